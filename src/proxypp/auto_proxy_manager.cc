@@ -5,190 +5,430 @@
 **   Description: 
 *******************************************************************************/
 #include "auto_proxy_manager.h"
-#include <regex>
+#include "proxypp/rule/rule_file_loader.h"
+#include <atomic>
+#include <chrono>
 #include <algorithm>
-#include <fstream>
 #include "nul/log.h"
-#include "util.h"
 
 namespace {
-  constexpr int SORT_RULES_THRESHOLD = 3;
-  const auto RULE_COMPARATOR = [](
-    const proxypp::AutoProxyRule &lhs, const proxypp::AutoProxyRule &rhs) {
-    return lhs.getMatchCount() > rhs.getMatchCount();
-  };
+  constexpr std::size_t DEFAULT_ROUTE_CACHE_CAPACITY = 4096;
 }
 
 namespace proxypp {
-  bool AutoProxyManager::addRule(const std::string &ruleStr) {
-    auto rule = parse(ruleStr);
-    if (rule) {
-      matchRules_.emplace_back(ruleStr, std::move(rule));
-      return true;
-    }
+  AutoProxyManager::AutoProxyManager() :
+    routeCache_(DEFAULT_ROUTE_CACHE_CAPACITY) {
+  }
 
-    rule = parseExceptionRule(ruleStr);
-    if (rule) {
-      exceptionRules_.emplace_back(ruleStr, std::move(rule));
-      return true;
+  AutoProxyManager::~AutoProxyManager() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cond_.notify_all();
+    if (compileThread_.joinable()) {
+      compileThread_.join();
     }
+  }
 
-    return false;
+  bool AutoProxyManager::addRule(const std::string &rule) {
+    RuleSnapshot::RegexMap regexes;
+    if (!RuleSnapshot::isValid(rule, &regexes)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    regexes_.insert(regexes.begin(), regexes.end());
+    if (++rules_[rule] == 1) {
+      recordChange(rule, 1);
+    }
+    recordForReload(rule, 1);
+    scheduleCompilation();
+    return true;
   }
 
   bool AutoProxyManager::removeRule(const std::string &rule) {
-    if (!removeRuleFrom(matchRules_, rule)) {
-      return removeRuleFrom(exceptionRules_, rule);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = rules_.find(rule);
+    if (it == rules_.end()) {
+      return false;
     }
-    return false;
+    if (--it->second == 0) {
+      rules_.erase(it);
+      recordChange(rule, -1);
+    }
+    recordForReload(rule, -1);
+    scheduleCompilation();
+    return true;
   }
 
   std::size_t AutoProxyManager::parseFileAsRules(const std::string &file) {
-    std::ifstream ruleFileStream(file, std::ios::binary);
-    if (!ruleFileStream.is_open()) {
-      LOG_W("proxy rule file not exists: %s", file.c_str());
-      return 0;
-    }
+    return parseFilesAsRules({file});
+  }
 
+  std::size_t AutoProxyManager::parseFilesAsRules(
+    const std::vector<std::string> &files) {
     std::size_t count = 0;
-    std::string line;
-    while (std::getline(ruleFileStream, line)) {
-      if (addRule(line)) {
-        ++count;
+    std::vector<std::string> textFiles;
+    for (auto &file : files) {
+      if (!CompiledRuleFile::isCompiledRuleFile(file)) {
+        textFiles.push_back(file);
+        continue;
+      }
+      auto compiledRules = CompiledRuleFile::load(file);
+      if (compiledRules) {
+        count += compiledRules->getRuleCount();
+        std::lock_guard<std::mutex> lock(mutex_);
+        compiledRules_ = std::move(compiledRules);
+        scheduleCompilation();
       }
     }
+
+    std::vector<std::string> rules;
+    RuleSnapshot::RegexMap regexes;
+    if (!textFiles.empty() &&
+        RuleFileLoader::load(textFiles, rules, 0, &regexes) > 0) {
+      count += rules.size();
+      std::lock_guard<std::mutex> lock(mutex_);
+      regexes_.insert(regexes.begin(), regexes.end());
+      for (auto &rule : rules) {
+        if (++rules_[rule] == 1) {
+          recordChange(rule, 1);
+        }
+        recordForReload(rule, 1);
+      }
+      scheduleCompilation();
+    }
     return count;
   }
 
+  void AutoProxyManager::reloadFile(const std::string &file) {
+    reloadFiles({file});
+  }
+
+  void AutoProxyManager::reloadFiles(const std::vector<std::string> &files) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pendingReloadFiles_ = files;
+    // the changes made before are replaced by the file
+    reloading_ = true;
+    reloadChanges_.clear();
+    ++resetCount_;
+    scheduleCompilation();
+  }
+
   void AutoProxyManager::clearAll() {
-    matchRules_.clear();
-    exceptionRules_.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    rules_.clear();
+    ruleChanges_.clear();
+    regexes_.clear();
+    rebuildAll_ = true;
+    compiledRules_.reset();
+    pendingReloadFiles_.clear();
+    reloading_ = false;
+    reloadChanges_.clear();
+    ++resetCount_;
+    scheduleCompilation();
+  }
+
+  void AutoProxyManager::waitUntilCompiled() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]{ return compiledVersion_ == version_; });
   }
 
   bool AutoProxyManager::matches(const std::string &host, uint16_t port) {
-    auto size = matchRules_.size();
-    auto &rules = matchRules_;
-    for (std::size_t i = 0; i < size; ++i) {
-      auto &rule = rules[i];
-      if (rule.matches(host, port)) {
-        if (i > SORT_RULES_THRESHOLD) {
-          ++matchCount_;
-          if (matchCount_ % SORT_RULES_THRESHOLD == 0) {
-            std::sort(rules.begin(), rules.end(), RULE_COMPARATOR);
-          }
-        }
+    return RouteAction::isUpstream(getAction(host, port));
+  }
 
-        for (auto &exceptRule : exceptionRules_) {
-          if (exceptRule.matches(host, port)) {
-            return false;
-          }
-        }
-        return true;
-      }
-    }
-    return false;
+  bool AutoProxyManager::matchesResolvedAddress(
+    const std::string &host, uint16_t port, const std::string &ip) {
+    return RouteAction::isUpstream(
+      getActionForResolvedAddress(host, port, ip));
   }
 
-  AutoProxyRule::MatchFun AutoProxyManager::parse(const std::string &rule) {
-    if (rule.empty()) {
-      return nullptr;
+  RouteAction::Id AutoProxyManager::getAction(
+    const std::string &host, uint16_t port) {
+    auto snapshot = std::atomic_load(&snapshot_);
+    if (!snapshot) {
+      return RouteAction::kDirect;
     }
 
-    auto size = rule.size();
-    auto ch = std::tolower(rule[0]);
-    if (size > 2 && ch == '/' && rule[size - 1] == '/') {
-      // it's a regex
-      return [r = std::regex(rule.substr(1, size - 1))] (
-        const std::string &rule, const std::string &host, uint16_t port) {
-        return std::regex_match(host, r);
-      };
+    // decisions are only valid for the snapshot they were made with
+    auto generation = snapshot->getVersion();
+    auto action = RouteAction::kDirect;
+    if (routeCache_.lookup(host, port, generation, action)) {
+      return action;
     }
 
-    if (ch != '|' && ch != '.' &&
-        (ch < '0' || ch > '9') && (ch < 'a' || ch > 'z')) {
-      return nullptr;
-    }
+    auto start = std::chrono::steady_clock::now();
+    IpPrefixTree::Address addr;
+    auto isAddress = snapshot->hasAddressRules() &&
+      IpPrefixTree::parseAddress(host, addr);
+    action = evaluate(*snapshot, host, port, isAddress ? &addr : nullptr);
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    routeCache_.store(host, port, generation, action, elapsed);
+    return action;
+  }
 
-    // matches against the entire rule
-    if (Util::strStartsWith(rule, "|https://", 0)) {
-      return [] (
-        const std::string &rule, const std::string &host, uint16_t port) {
-        return port == 443 && Util::strStartsWith(host, rule, 9);
-      };
+  RouteAction::Id AutoProxyManager::getActionForResolvedAddress(
+    const std::string &host, uint16_t port, const std::string &ip) {
+    auto snapshot = std::atomic_load(&snapshot_);
+    if (!snapshot) {
+      return RouteAction::kDirect;
     }
+    IpPrefixTree::Address addr;
+    auto isAddress = IpPrefixTree::parseAddress(ip, addr);
+    return evaluate(*snapshot, host, port, isAddress ? &addr : nullptr);
+  }
+
+  bool AutoProxyManager::hasAddressRules() const {
+    auto snapshot = std::atomic_load(&snapshot_);
+    return snapshot && snapshot->hasAddressRules();
+  }
 
-    if (Util::strStartsWith(rule, "|http://", 0)) {
-      return [] (
-        const std::string &rule, const std::string &host, uint16_t port) {
-        return port != 443 && Util::strStartsWith(host, rule, 8);
-      };
+  bool AutoProxyManager::setGeoIpDatabase(const std::string &file) {
+    auto db = GeoIpDatabase::load(file);
+    if (!db) {
+      return false;
     }
+    std::lock_guard<std::mutex> lock(mutex_);
+    geoIpDatabase_ = std::move(db);
+    scheduleCompilation();
+    return true;
+  }
 
-    // matches against domain
-    std::string ruleStartsWithDot;
-    if (Util::strStartsWith(rule, "||.", 0)) {
-      ruleStartsWithDot = rule.substr(2);
+  void AutoProxyManager::setRouteCacheCapacity(std::size_t capacity) {
+    routeCache_.setCapacity(capacity);
+  }
 
-    } else if (Util::strStartsWith(rule, "||", 0)) {
-      ruleStartsWithDot = "." + rule.substr(2);
+  const RouteCache::Stats &AutoProxyManager::getRouteCacheStats() const {
+    return routeCache_.getStats();
+  }
 
-    } else if (rule[0] != '.') {
-      ruleStartsWithDot = "." + rule;
+  const RuleBloomFilter::Stats &AutoProxyManager::getFilterStats() const {
+    return filterStats_;
+  }
 
+  RouteAction::Id AutoProxyManager::evaluate(
+    const RuleSnapshot &snapshot, const std::string &host, uint16_t port,
+    const IpPrefixTree::Address *addr) {
+    // most hosts match no rule, the filter turns them away without
+    // running the automaton, which is only needed for the exceptions
+    // then if an address rule or a regex matches
+    RuleAutomaton::Result result;
+    auto scanned = snapshot.mayMatchByName(host);
+    if (scanned) {
+      result = snapshot.scan(host, port);
+      if (!result.matched) {
+        ++filterStats_.falsePositives;
+      }
     } else {
-      ruleStartsWithDot = rule;
+      ++filterStats_.rejects;
     }
-    // treat the rule as having wildcards both at the start and the end
-    return [ruleStartsWithDot] (
-      const std::string &, const std::string &host, uint16_t port) {
-      return host.find(ruleStartsWithDot) != std::string::npos ||
-        (Util::strStartsWith(host, ruleStartsWithDot, 1));
-    };
-  }
 
-  AutoProxyRule::MatchFun AutoProxyManager::parseExceptionRule(
-    const std::string &rule) {
-    if (Util::strStartsWith(rule, "@@|https://", 0)) {
-      return [] (
-        const std::string &rule, const std::string &host, uint16_t port) {
-        return port == 443 && Util::strStartsWith(host, rule, 11);
-      };
+    if (addr && snapshot.hasAddressRules()) {
+      auto routeAction = RouteAction::kProxy;
+      auto action = snapshot.matchAddress(*addr, &routeAction);
+      if (action == IpPrefixTree::Action::kMatch) {
+        result.matched = true;
+        result.action = std::min(result.action, routeAction);
+      }
+      result.excepted =
+        result.excepted || action == IpPrefixTree::Action::kException;
     }
 
-    if (Util::strStartsWith(rule, "@@|http://", 0)) {
-      return [] (
-        const std::string &rule, const std::string &host, uint16_t port) {
-        return port != 443 && Util::strStartsWith(host, rule, 10);
-      };
+    auto &patterns = snapshot.getRegexPatterns();
+    if (!result.matched && !patterns.empty()) {
+      if (!regexSet_ || regexSetVersion_ != snapshot.getVersion()) {
+        regexSet_ = std::make_unique<RegexSet>();
+        for (auto &pattern : patterns) {
+          regexSet_->add(pattern);
+        }
+        regexSetVersion_ = snapshot.getVersion();
+      }
+      auto index = regexSet_->match(host);
+      if (index >= 0) {
+        result.matched = true;
+        result.action = snapshot.getRegexAction(index);
+      }
     }
 
-    if (Util::strStartsWith(rule, "@@||", 0)) {
-      std::string ruleStartsWithDot;
-      if (rule[0] != '.') {
-        ruleStartsWithDot = "." + rule.substr(4);
-      } else {
-        ruleStartsWithDot = rule;
+    if (!result.matched) {
+      if (!snapshot.matchesOtherRegexes(host, &result.action)) {
+        return RouteAction::kDirect;
+      }
+      if (snapshot.needsReordering()) {
+        requestReordering();
       }
+    }
+    if (!scanned) {
+      result.excepted = result.excepted || snapshot.scan(host, port).excepted;
+    }
+    return result.excepted ? RouteAction::kDirect : result.action;
+  }
+
+  void AutoProxyManager::requestReordering() {
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (lock.owns_lock() && !reorderRequested_) {
+      reorderRequested_ = true;
+      cond_.notify_all();
+    }
+  }
+
+  void AutoProxyManager::recordChange(const std::string &rule, int change) {
+    auto it = ruleChanges_.find(rule);
+    if (it == ruleChanges_.end()) {
+      ruleChanges_.emplace(rule, change);
+    } else if ((it->second += change) == 0) {
+      ruleChanges_.erase(it);
+    }
+  }
 
-      return [ruleStartsWithDot] (
-        const std::string &, const std::string &host, uint16_t port) {
-        return host.find(ruleStartsWithDot) != std::string::npos ||
-          (Util::strStartsWith(host, ruleStartsWithDot, 1));
-      };
+  void AutoProxyManager::recordForReload(const std::string &rule, int change) {
+    if (reloading_) {
+      reloadChanges_.emplace_back(rule, change);
     }
+  }
 
-    return nullptr;
+  void AutoProxyManager::scheduleCompilation() {
+    ++version_;
+    if (!compileThread_.joinable()) {
+      compileThread_ = std::thread(&AutoProxyManager::compileLoop, this);
+    }
+    cond_.notify_all();
   }
 
-  bool AutoProxyManager::removeRuleFrom(
-    std::vector<AutoProxyRule> &vec, const std::string &rule) {
-    auto it = vec.begin();
-    while (it != vec.end()) {
-      if (it->isRule(rule)) {
-        vec.erase(it);
-        return true;
+  void AutoProxyManager::compileLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cond_.wait(lock, [this]{
+        return stopped_ || compiledVersion_ != version_ || reorderRequested_;
+      });
+      if (stopped_) {
+        return;
+      }
+
+      if (reorderRequested_ && compiledVersion_ == version_) {
+        reorderRequested_ = false;
+        auto snapshot = std::atomic_load(&snapshot_);
+        lock.unlock();
+        if (snapshot && snapshot->reorderOtherRegexes()) {
+          LOG_D("reordered the regex rules by match count, version: %llu",
+                static_cast<unsigned long long>(snapshot->getVersion()));
+        }
+        lock.lock();
+        continue;
+      }
+      // the new snapshot counts the matches from scratch
+      reorderRequested_ = false;
+
+      if (!pendingReloadFiles_.empty()) {
+        std::vector<std::string> files;
+        std::swap(files, pendingReloadFiles_);
+        auto resetCount = resetCount_;
+        lock.unlock();
+        std::vector<std::string> fileRules;
+        RuleSnapshot::RegexMap regexes;
+        std::shared_ptr<const CompiledRuleFile> compiledRules;
+        std::size_t count = 0;
+        // the same as parseFilesAsRules(), the last compiled file wins
+        std::vector<std::string> textFiles;
+        for (auto &file : files) {
+          if (!CompiledRuleFile::isCompiledRuleFile(file)) {
+            textFiles.push_back(file);
+          } else if (auto rules = CompiledRuleFile::load(file)) {
+            count += rules->getRuleCount();
+            compiledRules = std::move(rules);
+          }
+        }
+        if (!textFiles.empty()) {
+          count += RuleFileLoader::load(textFiles, fileRules, 0, &regexes);
+        }
+        LOG_I("reloaded %zu proxy rules from %zu files", count, files.size());
+        decltype(rules_) newRules;
+        for (auto &rule : fileRules) {
+          ++newRules[rule];
+        }
+        lock.lock();
+
+        // a later reload or clearAll() wins, and the files it asked for are
+        // read before anything is compiled
+        if (resetCount != resetCount_) {
+          continue;
+        }
+
+        // the rules added or removed since reloadFile() was called were only
+        // applied to the rules the file replaces, and only the rules that
+        // differ from the ones loaded are compiled again
+        for (auto &change : reloadChanges_) {
+          if (change.second > 0) {
+            ++newRules[change.first];
+            continue;
+          }
+          auto it = newRules.find(change.first);
+          if (it != newRules.end() && --it->second == 0) {
+            newRules.erase(it);
+          }
+        }
+        reloading_ = false;
+        reloadChanges_.clear();
+        for (auto &entry : rules_) {
+          if (newRules.find(entry.first) == newRules.end()) {
+            recordChange(entry.first, -1);
+          }
+        }
+        for (auto &entry : newRules) {
+          if (rules_.find(entry.first) == rules_.end()) {
+            recordChange(entry.first, 1);
+          }
+        }
+        rules_ = std::move(newRules);
+        compiledRules_ = std::move(compiledRules);
+        regexes_.insert(regexes.begin(), regexes.end());
+      }
+
+      // changes made while compiling are picked up by the next round
+      auto version = version_;
+      std::vector<std::string> rules;
+      rules.reserve(rules_.size());
+      for (auto &entry : rules_) {
+        rules.push_back(entry.first);
       }
+      std::vector<std::string> addedRules;
+      std::vector<std::string> removedRules;
+      for (auto &entry : ruleChanges_) {
+        (entry.second > 0 ? addedRules : removedRules).push_back(entry.first);
+      }
+      ruleChanges_.clear();
+      auto rebuildAll = rebuildAll_;
+      rebuildAll_ = false;
+      auto regexes = std::move(regexes_);
+      regexes_.clear();
+      auto compiledRules = compiledRules_;
+      auto geoIpDatabase = geoIpDatabase_;
+      lock.unlock();
+
+      // small changes are layered over the automaton of the previous
+      // snapshot, which is only built anew once they add up
+      auto previous = std::atomic_load(&snapshot_);
+      auto changeCount = addedRules.size() + removedRules.size();
+      std::shared_ptr<const RuleSnapshot> snapshot;
+      if (previous && !rebuildAll && previous->canDerive(changeCount)) {
+        snapshot = std::make_shared<const RuleSnapshot>(
+          version, *previous, rules, addedRules, removedRules,
+          std::move(compiledRules), std::move(geoIpDatabase), regexes);
+      } else {
+        snapshot = std::make_shared<const RuleSnapshot>(
+          version, rules, std::move(compiledRules), std::move(geoIpDatabase),
+          regexes);
+      }
+      LOG_D("compiled %zu proxy rules, %zu changed, version: %llu",
+            snapshot->getRuleCount(), changeCount,
+            static_cast<unsigned long long>(version));
+      std::atomic_store(&snapshot_, std::move(snapshot));
+
+      lock.lock();
+      compiledVersion_ = version;
+      cond_.notify_all();
     }
-    return false;
   }
 } /* end of namespace: proxypp */
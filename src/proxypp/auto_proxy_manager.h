@@ -8,29 +8,129 @@
 #define AUTO_PROXY_MANAGER_H_
 #include <string>
 #include <vector>
-#include "auto_proxy_rule.h"
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include "proxypp/rule/rule_snapshot.h"
+#include "proxypp/rule/regex_set.h"
+#include "proxypp/rule/route_cache.h"
 
 namespace proxypp {
 
+  /**
+   * The rules are compiled into an immutable RuleSnapshot on a background
+   * thread whenever they change, including reloads of the rule file, the
+   * new snapshot is swapped in as a whole and matches() keeps using the
+   * previous one until then, so it never blocks on a reload or sees a
+   * partial rule set. matches() is meant for one loop thread, it only
+   * counts how often the slow regex rules match, they are reordered on
+   * the background thread as well. The regex rules are only tried for
+   * the hosts no other rule matches, see RuleSnapshot for the actions
+   */
   class AutoProxyManager final {
     public:
+      AutoProxyManager();
+      ~AutoProxyManager();
+
       bool addRule(const std::string &rule);
+      // rules loaded from a compiled rule file can't be removed one by one
       bool removeRule(const std::string &rule);
+      // the file is either a text file of rules, one per line, or a file
+      // compiled by rulec, which replaces any compiled rules loaded before
       std::size_t parseFileAsRules(const std::string &file);
+      // like parseFileAsRules() for each of the files, the text files are
+      // read all at once on a few threads
+      std::size_t parseFilesAsRules(const std::vector<std::string> &files);
+      // replaces all the rules with the ones in the file, the file is read
+      // on the background thread. rules added or removed after the call
+      // are applied on top of the ones in the file
+      void reloadFile(const std::string &file);
+      // like reloadFile(), the rules of all the files replace the rules
+      void reloadFiles(const std::vector<std::string> &files);
+      // hosts that are IP literals are also matched by the address rules,
+      // true if the host goes to some upstream, see getAction()
       bool matches(const std::string &host, uint16_t port);
+      // like matches(), with the address rules matched against the
+      // address the host resolved to, the decision is not cached
+      bool matchesResolvedAddress(
+        const std::string &host, uint16_t port, const std::string &ip);
+      // the lowest action of the rules that match, kDirect if none does
+      // or some exception rule does
+      RouteAction::Id getAction(const std::string &host, uint16_t port);
+      RouteAction::Id getActionForResolvedAddress(
+        const std::string &host, uint16_t port, const std::string &ip);
+      // rules like "10.0.0.0/8", or "geoip:CN" with a GeoIP database
+      bool hasAddressRules() const;
+
+      // the database the "geoip:" rules look up the countries in
+      bool setGeoIpDatabase(const std::string &file);
       void clearAll();
+      // blocks until the snapshot reflects all the changes made so far
+      void waitUntilCompiled();
 
-    private:
-      static AutoProxyRule::MatchFun parse(const std::string &rule);
-      static AutoProxyRule::MatchFun parseExceptionRule(const std::string &rule);
+      // decisions of matches() are cached per (host, port) until the rules
+      // change, 0 disables the cache
+      void setRouteCacheCapacity(std::size_t capacity);
+      const RouteCache::Stats &getRouteCacheStats() const;
+      // how well the bloom filter in front of the domain rules does
+      const RuleBloomFilter::Stats &getFilterStats() const;
 
-      static bool removeRuleFrom(
-        std::vector<AutoProxyRule> &vec, const std::string &rule);
+    private:
+      // addr is the address of the host for the address rules, if known
+      RouteAction::Id evaluate(
+        const RuleSnapshot &snapshot, const std::string &host, uint16_t port,
+        const IpPrefixTree::Address *addr);
+      // never blocks, the request is dropped if mutex_ is taken, it is
+      // made again on a later match
+      void requestReordering();
+      // the caller holds mutex_, change is 1 when the rule is added and
+      // -1 when it is removed
+      void recordChange(const std::string &rule, int change);
+      // the caller holds mutex_, keeps a change made while a reload is
+      // pending so that it is applied on top of the reloaded rules
+      void recordForReload(const std::string &rule, int change);
+      // the caller holds mutex_
+      void scheduleCompilation();
+      void compileLoop();
 
     private:
-      std::vector<AutoProxyRule> matchRules_;
-      std::vector<AutoProxyRule> exceptionRules_;
-      std::size_t matchCount_{0};
+      std::shared_ptr<const RuleSnapshot> snapshot_;
+      // used on the thread that calls matches()
+      RouteCache routeCache_;
+      RuleBloomFilter::Stats filterStats_;
+      std::unique_ptr<RegexSet> regexSet_;
+      // version of the snapshot regexSet_ was built from
+      uint64_t regexSetVersion_{0};
+
+      // guards everything below
+      std::mutex mutex_;
+      std::condition_variable cond_;
+      std::thread compileThread_;
+      // the rule strings, with the number of times each was added
+      std::unordered_map<std::string, std::size_t> rules_;
+      // the rules added to or removed from rules_ since the last snapshot
+      // was compiled, with the changes that cancel out left out
+      std::unordered_map<std::string, int> ruleChanges_;
+      // set by clearAll(), which drops the changes recorded before it
+      bool rebuildAll_{false};
+      // compiled to validate the rules added since the last snapshot was
+      // compiled, taken by the next one
+      RuleSnapshot::RegexMap regexes_;
+      std::shared_ptr<const CompiledRuleFile> compiledRules_;
+      std::shared_ptr<const GeoIpDatabase> geoIpDatabase_;
+      std::vector<std::string> pendingReloadFiles_;
+      // from reloadFile() until the rules of the file replace rules_
+      bool reloading_{false};
+      // the rules added (1) or removed (-1) in that time, in order
+      std::vector<std::pair<std::string, int>> reloadChanges_;
+      // bumped by reloadFile() and clearAll()
+      uint64_t resetCount_{0};
+      uint64_t version_{0};
+      uint64_t compiledVersion_{0};
+      bool reorderRequested_{false};
+      bool stopped_{false};
   };
 
 } /* end of namespace: proxypp */
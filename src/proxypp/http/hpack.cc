@@ -0,0 +1,433 @@
+/*******************************************************************************
+**          File: hpack.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 04:20 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/http/hpack.h"
+#include "nul/log.h"
+
+namespace {
+  struct HuffmanCode {
+    uint32_t code;
+    uint8_t length;
+  };
+
+  struct StaticEntry {
+    const char *name;
+    const char *value;
+  };
+
+  // RFC 7541 Appendix B, the last one is EOS
+  static const HuffmanCode HUFFMAN_CODES[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6},
+    {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6},
+    {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12},
+    {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7},
+    {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7},
+    {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7},
+    {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7},
+    {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19},
+    {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15}, {0x3, 5}, {0x23, 6},
+    {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5},
+    {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7},
+    {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11},
+    {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20},
+    {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22},
+    {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22},
+    {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24},
+    {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24},
+    {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22},
+    {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23},
+    {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21},
+    {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23},
+    {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20},
+    {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22},
+    {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27},
+    {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19},
+    {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27},
+    {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+    {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20},
+    {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22},
+    {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24},
+    {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26},
+    {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27},
+    {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27},
+    {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}
+  };
+
+  // RFC 7541 Appendix A
+  static const StaticEntry STATIC_TABLE[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+  };
+
+  static const auto STATIC_TABLE_SIZE =
+    sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+  static const auto EOS_SYMBOL = 256;
+  // RFC 7541 4.1
+  static const auto ENTRY_OVERHEAD = 32U;
+
+  // binary tree of the Huffman codes, leaves carry the symbols
+  struct HuffmanNode {
+    int16_t children[2]{-1, -1};
+    int16_t symbol{-1};
+  };
+
+  const std::vector<HuffmanNode> &getHuffmanTree() {
+    static const auto tree = []() {
+      std::vector<HuffmanNode> nodes(1);
+      for (int sym = 0; sym <= EOS_SYMBOL; ++sym) {
+        auto &hc = HUFFMAN_CODES[sym];
+        std::size_t node = 0;
+        for (int i = hc.length - 1; i >= 0; --i) {
+          auto bit = (hc.code >> i) & 1;
+          if (nodes[node].children[bit] == -1) {
+            nodes[node].children[bit] = static_cast<int16_t>(nodes.size());
+            nodes.emplace_back();
+          }
+          node = static_cast<std::size_t>(nodes[node].children[bit]);
+        }
+        nodes[node].symbol = static_cast<int16_t>(sym);
+      }
+      return nodes;
+    }();
+    return tree;
+  }
+}
+
+namespace proxypp {
+
+  HpackDecoder::HpackDecoder(std::size_t maxTableSize) :
+    maxTableSize_(maxTableSize), tableSizeLimit_(maxTableSize) {
+  }
+
+  void HpackDecoder::setMaxHeaderListSize(std::size_t maxHeaderListSize) {
+    maxHeaderListSize_ = maxHeaderListSize;
+  }
+
+  bool HpackDecoder::decode(
+    const char *buf, std::size_t len, HeaderList &headers) {
+    auto p = reinterpret_cast<const uint8_t *>(buf);
+    auto end = p + len;
+    std::size_t headerListSize = 0;
+    auto atBlockStart = true;
+
+    while (p < end) {
+      auto b = *p;
+      std::string name;
+      std::string value;
+
+      if (b & 0x80) {
+        // 6.1 indexed header field
+        uint64_t index;
+        if (!decodeInteger(p, end, 7, index) ||
+            !getIndexed(index, name, value)) {
+          return false;
+        }
+
+      } else if ((b & 0xe0) == 0x20) {
+        // 6.3 dynamic table size update, only allowed at the beginning
+        uint64_t size;
+        if (!atBlockStart || !decodeInteger(p, end, 5, size) ||
+            size > maxTableSize_) {
+          LOG_E("invalid hpack table size update");
+          return false;
+        }
+        tableSizeLimit_ = static_cast<std::size_t>(size);
+        evict(tableSizeLimit_);
+        continue;
+
+      } else {
+        // 6.2 literal header field, with incremental indexing (01),
+        // without indexing (0000) or never indexed (0001)
+        auto incremental = (b & 0xc0) == 0x40;
+        uint64_t index;
+        if (!decodeInteger(p, end, incremental ? 6 : 4, index)) {
+          return false;
+        }
+        if (index > 0) {
+          std::string ignored;
+          if (!getIndexed(index, name, ignored)) {
+            return false;
+          }
+        } else if (!decodeString(p, end, name)) {
+          return false;
+        }
+        if (!decodeString(p, end, value)) {
+          return false;
+        }
+        if (incremental) {
+          addEntry(name, value);
+        }
+      }
+
+      atBlockStart = false;
+      headerListSize += name.size() + value.size() + ENTRY_OVERHEAD;
+      if (headerListSize > maxHeaderListSize_) {
+        LOG_E("header list too large: %zu", headerListSize);
+        return false;
+      }
+      headers.emplace_back(std::move(name), std::move(value));
+    }
+    return true;
+  }
+
+  bool HpackDecoder::decodeInteger(
+    const uint8_t *&p, const uint8_t *end, int prefixBits, uint64_t &value) {
+    if (p >= end) {
+      return false;
+    }
+    uint64_t prefixMax = (1U << prefixBits) - 1;
+    value = *p++ & prefixMax;
+    if (value < prefixMax) {
+      return true;
+    }
+
+    for (int shift = 0; p < end; shift += 7) {
+      // values are bounded well below 2^62 so a malformed integer can't
+      // overflow
+      if (shift > 56) {
+        return false;
+      }
+      auto b = *p++;
+      value += static_cast<uint64_t>(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool HpackDecoder::decodeString(
+    const uint8_t *&p, const uint8_t *end, std::string &s) {
+    if (p >= end) {
+      return false;
+    }
+    auto huffman = (*p & 0x80) != 0;
+    uint64_t length;
+    if (!decodeInteger(p, end, 7, length) ||
+        length > static_cast<uint64_t>(end - p)) {
+      return false;
+    }
+
+    auto len = static_cast<std::size_t>(length);
+    if (huffman) {
+      if (!decodeHuffman(p, len, s)) {
+        return false;
+      }
+    } else {
+      s.assign(reinterpret_cast<const char *>(p), len);
+    }
+    p += len;
+    return true;
+  }
+
+  bool HpackDecoder::decodeHuffman(
+    const uint8_t *p, std::size_t len, std::string &out) {
+    auto &tree = getHuffmanTree();
+    out.clear();
+    out.reserve(len * 8 / 5);
+
+    std::size_t node = 0;
+    // bits consumed since the last symbol, all of them must be 1s if the
+    // input ends there (5.2)
+    auto depth = 0;
+    auto allOnes = true;
+    for (std::size_t i = 0; i < len; ++i) {
+      for (int shift = 7; shift >= 0; --shift) {
+        auto bit = (p[i] >> shift) & 1;
+        auto next = tree[node].children[bit];
+        if (next == -1) {
+          return false;
+        }
+        node = static_cast<std::size_t>(next);
+        ++depth;
+        allOnes = allOnes && bit == 1;
+
+        auto sym = tree[node].symbol;
+        if (sym != -1) {
+          if (sym == EOS_SYMBOL) {
+            return false;
+          }
+          out.push_back(static_cast<char>(sym));
+          node = 0;
+          depth = 0;
+          allOnes = true;
+        }
+      }
+    }
+    return depth < 8 && allOnes;
+  }
+
+  bool HpackDecoder::getIndexed(
+    uint64_t index, std::string &name, std::string &value) const {
+    if (index == 0) {
+      return false;
+    }
+    if (index <= STATIC_TABLE_SIZE) {
+      name = STATIC_TABLE[index - 1].name;
+      value = STATIC_TABLE[index - 1].value;
+      return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= dynamicTable_.size()) {
+      LOG_E("hpack index out of range");
+      return false;
+    }
+    name = dynamicTable_[index].first;
+    value = dynamicTable_[index].second;
+    return true;
+  }
+
+  void HpackDecoder::addEntry(
+    const std::string &name, const std::string &value) {
+    auto size = name.size() + value.size() + ENTRY_OVERHEAD;
+    if (size > tableSizeLimit_) {
+      // an entry larger than the table empties it (4.4)
+      evict(0);
+      return;
+    }
+    evict(tableSizeLimit_ - size);
+    dynamicTable_.emplace_front(name, value);
+    tableSize_ += size;
+  }
+
+  void HpackDecoder::evict(std::size_t maxSize) {
+    while (tableSize_ > maxSize && !dynamicTable_.empty()) {
+      auto &e = dynamicTable_.back();
+      tableSize_ -= e.first.size() + e.second.size() + ENTRY_OVERHEAD;
+      dynamicTable_.pop_back();
+    }
+  }
+
+  void HpackEncoder::encode(const HeaderList &headers, std::string &out) const {
+    for (auto &h : headers) {
+      std::size_t nameIndex = 0;
+      std::size_t fullIndex = 0;
+      for (std::size_t i = 0; i < STATIC_TABLE_SIZE; ++i) {
+        if (h.first == STATIC_TABLE[i].name) {
+          if (nameIndex == 0) {
+            nameIndex = i + 1;
+          }
+          if (h.second == STATIC_TABLE[i].value) {
+            fullIndex = i + 1;
+            break;
+          }
+        }
+      }
+
+      if (fullIndex > 0) {
+        encodeInteger(fullIndex, 7, 0x80, out);
+        continue;
+      }
+
+      // literal without indexing, strings are sent as is
+      encodeInteger(nameIndex, 4, 0x00, out);
+      if (nameIndex == 0) {
+        encodeInteger(h.first.size(), 7, 0x00, out);
+        out.append(h.first);
+      }
+      encodeInteger(h.second.size(), 7, 0x00, out);
+      out.append(h.second);
+    }
+  }
+
+  void HpackEncoder::encodeInteger(
+    uint64_t value, int prefixBits, uint8_t flags, std::string &out) {
+    uint64_t prefixMax = (1U << prefixBits) - 1;
+    if (value < prefixMax) {
+      out.push_back(static_cast<char>(flags | value));
+      return;
+    }
+    out.push_back(static_cast<char>(flags | prefixMax));
+    value -= prefixMax;
+    while (value >= 0x80) {
+      out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+  }
+
+} /* end of namspace: proxypp */
@@ -0,0 +1,58 @@
+/*******************************************************************************
+**          File: hpack.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 04:05 PM
+**   Description: HPACK (RFC 7541) header compression for HTTP/2, the
+**                encoder never indexes so it keeps no dynamic table
+*******************************************************************************/
+#ifndef PROXYPP_HPACK_H_
+#define PROXYPP_HPACK_H_
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+
+namespace proxypp {
+  using HeaderList = std::vector<std::pair<std::string, std::string>>;
+
+  class HpackDecoder final {
+    public:
+      // maxTableSize is SETTINGS_HEADER_TABLE_SIZE advertised to the peer
+      explicit HpackDecoder(std::size_t maxTableSize = 4096);
+
+      // decodes a complete header block, false means a COMPRESSION_ERROR,
+      // after which the decoder can't be used any more
+      bool decode(const char *buf, std::size_t len, HeaderList &headers);
+      void setMaxHeaderListSize(std::size_t maxHeaderListSize);
+
+      static bool decodeInteger(
+        const uint8_t *&p, const uint8_t *end, int prefixBits, uint64_t &value);
+      static bool decodeHuffman(
+        const uint8_t *p, std::size_t len, std::string &out);
+
+    private:
+      bool decodeString(const uint8_t *&p, const uint8_t *end, std::string &s);
+      bool getIndexed(
+        uint64_t index, std::string &name, std::string &value) const;
+      void addEntry(const std::string &name, const std::string &value);
+      void evict(std::size_t maxSize);
+
+    private:
+      std::size_t maxTableSize_;
+      std::size_t tableSizeLimit_;
+      std::size_t tableSize_{0};
+      std::size_t maxHeaderListSize_{64 * 1024U};
+      // the newest entry is at the front
+      std::deque<std::pair<std::string, std::string>> dynamicTable_;
+  };
+
+  class HpackEncoder final {
+    public:
+      void encode(const HeaderList &headers, std::string &out) const;
+
+      static void encodeInteger(
+        uint64_t value, int prefixBits, uint8_t flags, std::string &out);
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_HPACK_H_ */
@@ -0,0 +1,199 @@
+/*******************************************************************************
+**          File: http2_frame.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 05:02 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/http/http2_frame.h"
+#include "nul/log.h"
+
+#include <algorithm>
+
+namespace {
+  void appendUint32(std::string &out, uint32_t value) {
+    out.push_back(static_cast<char>((value >> 24) & 0xff));
+    out.push_back(static_cast<char>((value >> 16) & 0xff));
+    out.push_back(static_cast<char>((value >> 8) & 0xff));
+    out.push_back(static_cast<char>(value & 0xff));
+  }
+}
+
+namespace proxypp {
+  const std::string Http2::CONNECTION_PREFACE =
+    std::string{"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"};
+
+  void Http2FrameParser::feed(const char *buf, std::size_t len) {
+    // drop the consumed bytes once they make up most of the buffer
+    if (offset_ > 0 && offset_ >= buffer_.size() / 2) {
+      buffer_.erase(0, offset_);
+      offset_ = 0;
+    }
+    buffer_.append(buf, len);
+  }
+
+  Http2FrameParser::Result Http2FrameParser::next(Http2Frame &frame) {
+    auto available = buffer_.size() - offset_;
+    if (available < Http2::FRAME_HEADER_LENGTH) {
+      return Result::NEED_MORE_DATA;
+    }
+
+    auto p = reinterpret_cast<const uint8_t *>(buffer_.data() + offset_);
+    auto length = (static_cast<uint32_t>(p[0]) << 16) |
+      (static_cast<uint32_t>(p[1]) << 8) | p[2];
+    if (length > maxFrameSize_) {
+      LOG_E("frame too large: %u", length);
+      return Result::FRAME_SIZE_ERROR;
+    }
+    if (available < Http2::FRAME_HEADER_LENGTH + length) {
+      return Result::NEED_MORE_DATA;
+    }
+
+    frame.type = static_cast<Http2::FrameType>(p[3]);
+    frame.flags = p[4];
+    // the reserved bit is ignored
+    frame.streamId = Http2FrameBuilder::readUint32(
+      buffer_.data() + offset_ + 5) & 0x7fffffff;
+    frame.payload.assign(
+      buffer_, offset_ + Http2::FRAME_HEADER_LENGTH, length);
+    offset_ += Http2::FRAME_HEADER_LENGTH + length;
+
+    if (offset_ == buffer_.size()) {
+      buffer_.clear();
+      offset_ = 0;
+    }
+    return Result::FRAME;
+  }
+
+  void Http2FrameParser::setMaxFrameSize(uint32_t maxFrameSize) {
+    maxFrameSize_ = maxFrameSize;
+  }
+
+  std::size_t Http2FrameParser::getBufferedBytes() const {
+    return buffer_.size() - offset_;
+  }
+
+  bool Http2FrameParser::removePadding(Http2Frame &frame) {
+    std::size_t start = 0;
+    std::size_t padLength = 0;
+    if (frame.hasFlag(Http2::FLAG_PADDED)) {
+      if (frame.payload.empty()) {
+        return false;
+      }
+      padLength = static_cast<uint8_t>(frame.payload[0]);
+      start = 1;
+    }
+    if (frame.type == Http2::FrameType::HEADERS &&
+        frame.hasFlag(Http2::FLAG_PRIORITY)) {
+      // stream dependency and weight, priorities are not supported
+      start += 5;
+    }
+    if (start + padLength > frame.payload.size()) {
+      return false;
+    }
+    frame.payload = frame.payload.substr(
+      start, frame.payload.size() - start - padLength);
+    return true;
+  }
+
+  void Http2FrameBuilder::appendFrameHeader(
+    std::string &out, std::size_t length, Http2::FrameType type,
+    uint8_t flags, uint32_t streamId) {
+    out.push_back(static_cast<char>((length >> 16) & 0xff));
+    out.push_back(static_cast<char>((length >> 8) & 0xff));
+    out.push_back(static_cast<char>(length & 0xff));
+    out.push_back(static_cast<char>(type));
+    out.push_back(static_cast<char>(flags));
+    out.push_back(static_cast<char>((streamId >> 24) & 0x7f));
+    out.push_back(static_cast<char>((streamId >> 16) & 0xff));
+    out.push_back(static_cast<char>((streamId >> 8) & 0xff));
+    out.push_back(static_cast<char>(streamId & 0xff));
+  }
+
+  void Http2FrameBuilder::appendSettings(
+    std::string &out,
+    const std::vector<std::pair<Http2::Setting, uint32_t>> &settings) {
+    appendFrameHeader(
+      out, settings.size() * 6, Http2::FrameType::SETTINGS, 0, 0);
+    for (auto &s : settings) {
+      auto id = static_cast<uint16_t>(s.first);
+      out.push_back(static_cast<char>(id >> 8));
+      out.push_back(static_cast<char>(id & 0xff));
+      appendUint32(out, s.second);
+    }
+  }
+
+  void Http2FrameBuilder::appendSettingsAck(std::string &out) {
+    appendFrameHeader(
+      out, 0, Http2::FrameType::SETTINGS, Http2::FLAG_ACK, 0);
+  }
+
+  void Http2FrameBuilder::appendPingAck(
+    std::string &out, const std::string &opaque) {
+    appendFrameHeader(
+      out, opaque.size(), Http2::FrameType::PING, Http2::FLAG_ACK, 0);
+    out.append(opaque);
+  }
+
+  void Http2FrameBuilder::appendWindowUpdate(
+    std::string &out, uint32_t streamId, uint32_t increment) {
+    appendFrameHeader(out, 4, Http2::FrameType::WINDOW_UPDATE, 0, streamId);
+    appendUint32(out, increment & 0x7fffffff);
+  }
+
+  void Http2FrameBuilder::appendRstStream(
+    std::string &out, uint32_t streamId, Http2::ErrorCode errorCode) {
+    appendFrameHeader(out, 4, Http2::FrameType::RST_STREAM, 0, streamId);
+    appendUint32(out, static_cast<uint32_t>(errorCode));
+  }
+
+  void Http2FrameBuilder::appendGoaway(
+    std::string &out, uint32_t lastStreamId, Http2::ErrorCode errorCode) {
+    appendFrameHeader(out, 8, Http2::FrameType::GOAWAY, 0, 0);
+    appendUint32(out, lastStreamId & 0x7fffffff);
+    appendUint32(out, static_cast<uint32_t>(errorCode));
+  }
+
+  void Http2FrameBuilder::appendData(
+    std::string &out, uint32_t streamId, const char *buf, std::size_t len,
+    bool endStream) {
+    appendFrameHeader(
+      out, len, Http2::FrameType::DATA,
+      endStream ? Http2::FLAG_END_STREAM : 0, streamId);
+    out.append(buf, len);
+  }
+
+  void Http2FrameBuilder::appendHeaders(
+    std::string &out, uint32_t streamId, const std::string &headerBlock,
+    bool endStream, uint32_t maxFrameSize) {
+    std::size_t offset = 0;
+    auto type = Http2::FrameType::HEADERS;
+    do {
+      auto n = std::min<std::size_t>(
+        headerBlock.size() - offset, maxFrameSize);
+      uint8_t flags = 0;
+      if (type == Http2::FrameType::HEADERS && endStream) {
+        flags |= Http2::FLAG_END_STREAM;
+      }
+      if (offset + n == headerBlock.size()) {
+        flags |= Http2::FLAG_END_HEADERS;
+      }
+      appendFrameHeader(out, n, type, flags, streamId);
+      out.append(headerBlock, offset, n);
+      offset += n;
+      type = Http2::FrameType::CONTINUATION;
+    } while (offset < headerBlock.size());
+  }
+
+  uint32_t Http2FrameBuilder::readUint32(const char *p) {
+    auto u = reinterpret_cast<const uint8_t *>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) |
+      (static_cast<uint32_t>(u[1]) << 16) |
+      (static_cast<uint32_t>(u[2]) << 8) | u[3];
+  }
+
+  uint16_t Http2FrameBuilder::readUint16(const char *p) {
+    auto u = reinterpret_cast<const uint8_t *>(p);
+    return static_cast<uint16_t>((u[0] << 8) | u[1]);
+  }
+
+} /* end of namspace: proxypp */
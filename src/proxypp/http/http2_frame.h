@@ -0,0 +1,137 @@
+/*******************************************************************************
+**          File: http2_frame.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 04:48 PM
+**   Description: HTTP/2 (RFC 7540) constants, an incremental frame parser
+**                and serialization of the frames sent by the server
+*******************************************************************************/
+#ifndef PROXYPP_HTTP2_FRAME_H_
+#define PROXYPP_HTTP2_FRAME_H_
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace proxypp {
+  struct Http2 {
+    constexpr static auto FRAME_HEADER_LENGTH = 9U;
+    constexpr static auto DEFAULT_MAX_FRAME_SIZE = 16384U;
+    constexpr static auto MAX_MAX_FRAME_SIZE = 16777215U;
+    constexpr static auto DEFAULT_WINDOW_SIZE = 65535;
+    constexpr static auto MAX_WINDOW_SIZE = 2147483647;
+
+    static const std::string CONNECTION_PREFACE;
+
+    enum class FrameType {
+      DATA          = 0,
+      HEADERS       = 1,
+      PRIORITY      = 2,
+      RST_STREAM    = 3,
+      SETTINGS      = 4,
+      PUSH_PROMISE  = 5,
+      PING          = 6,
+      GOAWAY        = 7,
+      WINDOW_UPDATE = 8,
+      CONTINUATION  = 9
+    };
+
+    enum Flag {
+      FLAG_END_STREAM  = 0x1,
+      FLAG_ACK         = 0x1,
+      FLAG_END_HEADERS = 0x4,
+      FLAG_PADDED      = 0x8,
+      FLAG_PRIORITY    = 0x20
+    };
+
+    enum class ErrorCode {
+      NO_ERROR            = 0,
+      PROTOCOL_ERROR      = 1,
+      INTERNAL_ERROR      = 2,
+      FLOW_CONTROL_ERROR  = 3,
+      SETTINGS_TIMEOUT    = 4,
+      STREAM_CLOSED       = 5,
+      FRAME_SIZE_ERROR    = 6,
+      REFUSED_STREAM      = 7,
+      CANCEL              = 8,
+      COMPRESSION_ERROR   = 9,
+      CONNECT_ERROR       = 10,
+      ENHANCE_YOUR_CALM   = 11,
+      INADEQUATE_SECURITY = 12,
+      HTTP_1_1_REQUIRED   = 13
+    };
+
+    enum class Setting {
+      HEADER_TABLE_SIZE      = 1,
+      ENABLE_PUSH            = 2,
+      MAX_CONCURRENT_STREAMS = 3,
+      INITIAL_WINDOW_SIZE    = 4,
+      MAX_FRAME_SIZE         = 5,
+      MAX_HEADER_LIST_SIZE   = 6
+    };
+  };
+
+  struct Http2Frame {
+    Http2::FrameType type{Http2::FrameType::DATA};
+    uint8_t flags{0};
+    uint32_t streamId{0};
+    std::string payload;
+
+    bool hasFlag(Http2::Flag flag) const {
+      return (flags & flag) != 0;
+    }
+  };
+
+  class Http2FrameParser final {
+    public:
+      enum class Result {
+        FRAME,
+        NEED_MORE_DATA,
+        FRAME_SIZE_ERROR
+      };
+
+      void feed(const char *buf, std::size_t len);
+      // pops the next complete frame
+      Result next(Http2Frame &frame);
+      // SETTINGS_MAX_FRAME_SIZE advertised to the peer
+      void setMaxFrameSize(uint32_t maxFrameSize);
+      std::size_t getBufferedBytes() const;
+
+      // strips the padding (and the priority fields of HEADERS) off the
+      // payload of DATA and HEADERS frames, false if the padding is invalid
+      static bool removePadding(Http2Frame &frame);
+
+    private:
+      std::string buffer_;
+      std::size_t offset_{0};
+      uint32_t maxFrameSize_{Http2::DEFAULT_MAX_FRAME_SIZE};
+  };
+
+  class Http2FrameBuilder final {
+    public:
+      static void appendFrameHeader(
+        std::string &out, std::size_t length, Http2::FrameType type,
+        uint8_t flags, uint32_t streamId);
+      static void appendSettings(
+        std::string &out,
+        const std::vector<std::pair<Http2::Setting, uint32_t>> &settings);
+      static void appendSettingsAck(std::string &out);
+      static void appendPingAck(std::string &out, const std::string &opaque);
+      static void appendWindowUpdate(
+        std::string &out, uint32_t streamId, uint32_t increment);
+      static void appendRstStream(
+        std::string &out, uint32_t streamId, Http2::ErrorCode errorCode);
+      static void appendGoaway(
+        std::string &out, uint32_t lastStreamId, Http2::ErrorCode errorCode);
+      static void appendData(
+        std::string &out, uint32_t streamId, const char *buf, std::size_t len,
+        bool endStream);
+      // splits the header block into HEADERS and CONTINUATION frames
+      static void appendHeaders(
+        std::string &out, uint32_t streamId, const std::string &headerBlock,
+        bool endStream, uint32_t maxFrameSize);
+
+      static uint32_t readUint32(const char *p);
+      static uint16_t readUint16(const char *p);
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_HTTP2_FRAME_H_ */
@@ -0,0 +1,931 @@
+/*******************************************************************************
+**          File: http2_session.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 06:45 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/http/http2_session.h"
+#include "nul/log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+  static const uint32_t STREAM_WINDOW_SIZE = 256 * 1024U;
+  static const uint32_t CONNECTION_WINDOW_SIZE = 16 * 1024 * 1024U;
+  static const uint32_t MAX_HEADER_LIST_BYTES = 64 * 1024U;
+  static const std::size_t MAX_HEADER_BLOCK_BYTES = 64 * 1024U;
+  // response data held for a stream before reading from its upstream is
+  // paused
+  static const std::size_t MAX_STREAM_PENDING_BYTES = 64 * 1024U;
+  // DATA frames are held back while this much is queued for the client
+  static const std::size_t MAX_DOWNSTREAM_QUEUE_BYTES = 256 * 1024U;
+  static const std::size_t MAX_WRITE_CHUNK_BYTES = 8192U;
+
+  // host[:port] or [ipv6][:port]
+  bool parseAuthority(
+    const std::string &authority, uint16_t defaultPort,
+    std::string &host, uint16_t &port) {
+    std::string::size_type portPos = std::string::npos;
+    if (!authority.empty() && authority[0] == '[') {
+      auto end = authority.find(']');
+      if (end == std::string::npos) {
+        return false;
+      }
+      host = authority.substr(1, end - 1);
+      if (end + 1 < authority.size()) {
+        if (authority[end + 1] != ':') {
+          return false;
+        }
+        portPos = end + 2;
+      }
+    } else {
+      auto colon = authority.find(':');
+      host = authority.substr(0, colon);
+      if (colon != std::string::npos) {
+        portPos = colon + 1;
+      }
+    }
+
+    port = defaultPort;
+    if (portPos != std::string::npos) {
+      char *end = nullptr;
+      auto value = std::strtoul(authority.c_str() + portPos, &end, 10);
+      if (end == authority.c_str() + portPos || *end != '\0' ||
+          value > 65535) {
+        return false;
+      }
+      port = static_cast<uint16_t>(value);
+    }
+    return !host.empty() && port != 0;
+  }
+
+  // these are not allowed in HTTP/2 (RFC 7540 8.1.2.2), nor are they
+  // relayed to the HTTP/1.1 side
+  bool isConnectionSpecificHeader(const std::string &name) {
+    return name == "connection" || name == "keep-alive" ||
+      name == "proxy-connection" || name == "transfer-encoding" ||
+      name == "upgrade" || name == "te" || name == "http2-settings";
+  }
+}
+
+namespace proxypp {
+  Http2Session::Http2Session(
+    const std::shared_ptr<uvcpp::Tcp> &conn,
+    const std::shared_ptr<nul::BufferPool> &bufferPool) :
+    downstreamConn_(conn), bufferPool_(bufferPool) {
+    hpackDecoder_.setMaxHeaderListSize(MAX_HEADER_LIST_BYTES);
+  }
+
+  void Http2Session::setUpstreamServer(
+    UpstreamType type, const std::string &host, uint16_t port) {
+    defaultUpstream_ = UpstreamServer{type, host, port};
+  }
+
+  void Http2Session::setUpstreamServers(
+    const std::shared_ptr<const UpstreamServers> &upstreamServers) {
+    upstreamServers_ = upstreamServers;
+  }
+
+  void Http2Session::setAutoProxyManager(
+    const std::shared_ptr<AutoProxyManager> &proxyRuleManager) {
+    proxyRuleManager_ = proxyRuleManager;
+  }
+
+  void Http2Session::setMaxConcurrentStreams(uint32_t maxConcurrentStreams) {
+    maxConcurrentStreams_ = std::max<uint32_t>(1, maxConcurrentStreams);
+  }
+
+  void Http2Session::start() {
+    Http2FrameBuilder::appendSettings(output_, {
+      { Http2::Setting::MAX_CONCURRENT_STREAMS, maxConcurrentStreams_ },
+      { Http2::Setting::INITIAL_WINDOW_SIZE, STREAM_WINDOW_SIZE },
+      { Http2::Setting::MAX_HEADER_LIST_SIZE, MAX_HEADER_LIST_BYTES }
+    });
+    // the connection window only keeps a broken client in check, streams
+    // are throttled by their own windows
+    Http2FrameBuilder::appendWindowUpdate(
+      output_, 0, CONNECTION_WINDOW_SIZE - Http2::DEFAULT_WINDOW_SIZE);
+    recvWindow_ = CONNECTION_WINDOW_SIZE;
+    flushOutput();
+  }
+
+  void Http2Session::onDownstreamData(const char *buf, std::size_t len) {
+    if (closed_) {
+      return;
+    }
+
+    frameParser_.feed(buf, len);
+    Http2Frame frame;
+    while (!closed_) {
+      auto result = frameParser_.next(frame);
+      if (result == Http2FrameParser::Result::NEED_MORE_DATA) {
+        break;
+      }
+      if (result == Http2FrameParser::Result::FRAME_SIZE_ERROR) {
+        connectionError(Http2::ErrorCode::FRAME_SIZE_ERROR);
+        return;
+      }
+      handleFrame(frame);
+    }
+    flushOutput();
+  }
+
+  void Http2Session::onDownstreamDrained() {
+    if (!closed_ && !isDownstreamBusy()) {
+      flushStreams();
+      flushOutput();
+    }
+  }
+
+  void Http2Session::close() {
+    closed_ = true;
+    for (auto &it : streams_) {
+      if (it.second->upstream) {
+        it.second->upstream->close();
+      }
+    }
+    streams_.clear();
+  }
+
+  void Http2Session::handleFrame(Http2Frame &frame) {
+    // the client preface ends with SETTINGS
+    if (!settingsReceived_) {
+      if (frame.type != Http2::FrameType::SETTINGS ||
+          frame.hasFlag(Http2::FLAG_ACK)) {
+        connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+        return;
+      }
+      settingsReceived_ = true;
+    }
+
+    // nothing may come in between a header block and its CONTINUATIONs
+    if (headerStreamId_ != 0 &&
+        (frame.type != Http2::FrameType::CONTINUATION ||
+         frame.streamId != headerStreamId_)) {
+      connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+
+    switch (frame.type) {
+      case Http2::FrameType::DATA:
+        onData(frame);
+        break;
+
+      case Http2::FrameType::HEADERS:
+        onHeaders(frame);
+        break;
+
+      case Http2::FrameType::CONTINUATION: {
+        if (headerStreamId_ == 0) {
+          connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+          return;
+        }
+        headerBlock_.append(frame.payload);
+        if (headerBlock_.size() > MAX_HEADER_BLOCK_BYTES) {
+          connectionError(Http2::ErrorCode::ENHANCE_YOUR_CALM);
+          return;
+        }
+        if (frame.hasFlag(Http2::FLAG_END_HEADERS)) {
+          auto streamId = headerStreamId_;
+          headerStreamId_ = 0;
+          onHeaderBlock(streamId, headerEndStream_);
+        }
+        break;
+      }
+
+      case Http2::FrameType::PRIORITY:
+        // priorities are not supported
+        break;
+
+      case Http2::FrameType::RST_STREAM:
+        onRstStream(frame);
+        break;
+
+      case Http2::FrameType::SETTINGS:
+        onSettings(frame);
+        break;
+
+      case Http2::FrameType::PUSH_PROMISE:
+        // clients can't push
+        connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+        break;
+
+      case Http2::FrameType::PING:
+        if (frame.streamId != 0) {
+          connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+        } else if (frame.payload.size() != 8) {
+          connectionError(Http2::ErrorCode::FRAME_SIZE_ERROR);
+        } else if (!frame.hasFlag(Http2::FLAG_ACK)) {
+          Http2FrameBuilder::appendPingAck(output_, frame.payload);
+        }
+        break;
+
+      case Http2::FrameType::GOAWAY:
+        // no new streams will come, the connection is closed once the
+        // open ones are done, see flushOutput()
+        LOG_D("h2 client sent GOAWAY, %zu streams open", streams_.size());
+        goawayReceived_ = true;
+        break;
+
+      case Http2::FrameType::WINDOW_UPDATE:
+        onWindowUpdate(frame);
+        break;
+
+      default:
+        // unknown frame types must be ignored
+        break;
+    }
+  }
+
+  void Http2Session::onData(Http2Frame &frame) {
+    if (frame.streamId == 0) {
+      connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+
+    // padding counts towards flow control as well
+    auto frameLength = frame.payload.size();
+    recvWindow_ -= static_cast<int64_t>(frameLength);
+    if (recvWindow_ < 0) {
+      connectionError(Http2::ErrorCode::FLOW_CONTROL_ERROR);
+      return;
+    }
+    recvConsumed_ += frameLength;
+    if (recvConsumed_ >= CONNECTION_WINDOW_SIZE / 2) {
+      Http2FrameBuilder::appendWindowUpdate(
+        output_, 0, static_cast<uint32_t>(recvConsumed_));
+      recvWindow_ += static_cast<int64_t>(recvConsumed_);
+      recvConsumed_ = 0;
+    }
+
+    auto stream = findStream(frame.streamId);
+    if (!stream) {
+      if (frame.streamId > lastStreamId_) {
+        connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      } else {
+        Http2FrameBuilder::appendRstStream(
+          output_, frame.streamId, Http2::ErrorCode::STREAM_CLOSED);
+      }
+      return;
+    }
+    if (stream->requestEnded) {
+      resetStream(frame.streamId, Http2::ErrorCode::STREAM_CLOSED);
+      return;
+    }
+
+    stream->recvWindow -= static_cast<int64_t>(frameLength);
+    if (stream->recvWindow < 0) {
+      resetStream(frame.streamId, Http2::ErrorCode::FLOW_CONTROL_ERROR);
+      return;
+    }
+    if (!Http2FrameParser::removePadding(frame)) {
+      connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+
+    // padding never reaches the upstream, so it is credited back now
+    auto padding = frameLength - frame.payload.size();
+    if (padding > 0) {
+      stream->recvWindow += static_cast<int64_t>(padding);
+      Http2FrameBuilder::appendWindowUpdate(
+        output_, frame.streamId, static_cast<uint32_t>(padding));
+    }
+
+    if (!frame.payload.empty()) {
+      // the rest is credited back as the upstream takes it, which is
+      // what ties the client to the pace of the upstream
+      stream->uncreditedBytes += frame.payload.size();
+      if (stream->chunkedRequest) {
+        char sizeLine[24];
+        auto n = std::snprintf(
+          sizeLine, sizeof(sizeLine), "%zx\r\n", frame.payload.size());
+        stream->upstream->write(sizeLine, static_cast<std::size_t>(n));
+        stream->upstream->write(frame.payload.c_str(), frame.payload.size());
+        stream->upstream->write("\r\n", 2);
+      } else {
+        stream->upstream->write(frame.payload.c_str(), frame.payload.size());
+      }
+    }
+
+    if (frame.hasFlag(Http2::FLAG_END_STREAM)) {
+      endRequest(*stream);
+    }
+  }
+
+  void Http2Session::onHeaders(Http2Frame &frame) {
+    if (frame.streamId == 0) {
+      connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+    if (!Http2FrameParser::removePadding(frame)) {
+      connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+
+    headerBlock_ = std::move(frame.payload);
+    headerEndStream_ = frame.hasFlag(Http2::FLAG_END_STREAM);
+    if (frame.hasFlag(Http2::FLAG_END_HEADERS)) {
+      onHeaderBlock(frame.streamId, headerEndStream_);
+    } else {
+      headerStreamId_ = frame.streamId;
+    }
+  }
+
+  void Http2Session::onHeaderBlock(uint32_t streamId, bool endStream) {
+    // the block must be decoded even if the stream is refused, to keep
+    // the dynamic table in sync with the client
+    HeaderList headers;
+    if (!hpackDecoder_.decode(
+          headerBlock_.c_str(), headerBlock_.size(), headers)) {
+      connectionError(Http2::ErrorCode::COMPRESSION_ERROR);
+      return;
+    }
+    headerBlock_.clear();
+
+    auto stream = findStream(streamId);
+    if (stream) {
+      // trailers, which can't be relayed to HTTP/1.1, they only end the
+      // request
+      if (!endStream || stream->requestEnded) {
+        resetStream(streamId, Http2::ErrorCode::PROTOCOL_ERROR);
+      } else {
+        endRequest(*stream);
+      }
+      return;
+    }
+
+    if ((streamId & 1) == 0) {
+      connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+    if (streamId <= lastStreamId_) {
+      Http2FrameBuilder::appendRstStream(
+        output_, streamId, Http2::ErrorCode::STREAM_CLOSED);
+      return;
+    }
+    lastStreamId_ = streamId;
+
+    if (streams_.size() >= maxConcurrentStreams_) {
+      Http2FrameBuilder::appendRstStream(
+        output_, streamId, Http2::ErrorCode::REFUSED_STREAM);
+      return;
+    }
+    openStream(streamId, headers, endStream);
+  }
+
+  void Http2Session::openStream(
+    uint32_t streamId, const HeaderList &headers, bool endStream) {
+    std::string method;
+    std::string scheme;
+    std::string authority;
+    std::string path;
+    HeaderList fields;
+    for (auto &h : headers) {
+      if (h.first.empty() || h.first[0] != ':') {
+        fields.push_back(h);
+        continue;
+      }
+
+      // pseudo-headers must come first, and only the request ones are
+      // known (extended CONNECT with :protocol is not supported)
+      auto valid = fields.empty();
+      if (h.first == ":method") {
+        method = h.second;
+      } else if (h.first == ":scheme") {
+        scheme = h.second;
+      } else if (h.first == ":authority") {
+        authority = h.second;
+      } else if (h.first == ":path") {
+        path = h.second;
+      } else {
+        valid = false;
+      }
+      if (!valid) {
+        Http2FrameBuilder::appendRstStream(
+          output_, streamId, Http2::ErrorCode::PROTOCOL_ERROR);
+        return;
+      }
+    }
+
+    if (authority.empty()) {
+      for (auto &f : fields) {
+        if (f.first == "host") {
+          authority = f.second;
+          break;
+        }
+      }
+    }
+
+    auto isConnect = method == "CONNECT";
+    std::string addr;
+    uint16_t port = 0;
+    if (method.empty() ||
+        (isConnect ? !scheme.empty() || !path.empty() : path.empty()) ||
+        !parseAuthority(authority, isConnect ? 0 : 80, addr, port)) {
+      LOG_W("malformed h2 request on stream %u", streamId);
+      Http2FrameBuilder::appendRstStream(
+        output_, streamId, Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+
+    auto stream = std::make_unique<Stream>();
+    stream->id = streamId;
+    stream->isConnect = isConnect;
+    stream->isHead = method == "HEAD";
+    stream->requestEnded = endStream;
+    stream->recvWindow = STREAM_WINDOW_SIZE;
+    stream->sendWindow = peerInitialWindowSize_;
+    auto &s = *stream;
+    streams_[streamId] = std::move(stream);
+
+    if (!isConnect && scheme != "http") {
+      // requests for https URLs can only be made through CONNECT
+      sendStatus(s, 400, true);
+      return;
+    }
+
+    auto action = proxyRuleManager_ ?
+      proxyRuleManager_->getAction(addr, port) : RouteAction::kProxy;
+    if (action == RouteAction::kReject) {
+      sendStatus(s, 403, true);
+      return;
+    }
+    // kDirect for an upstream that is not configured
+    auto upstreamServer = findUpstreamServer(
+      defaultUpstream_, upstreamServers_.get(), action);
+    auto useUpstream = upstreamServer != nullptr;
+
+    s.upstream = std::make_shared<UpstreamConnector>(
+      downstreamConn_->getLoop(), bufferPool_);
+    if (upstreamServer) {
+      s.upstream->setUpstreamServer(
+        upstreamServer->type, upstreamServer->host, upstreamServer->port);
+    }
+    s.upstream->setConnectCallback([this, streamId](bool succeeded) {
+      this->onUpstreamConnected(streamId, succeeded);
+    });
+    s.upstream->setDataCallback(
+      [this, streamId](const char *buf, std::size_t len) {
+        this->onUpstreamData(streamId, buf, len);
+      });
+    s.upstream->setWriteCallback([this, streamId](std::size_t len) {
+      this->onUpstreamWritten(streamId, len);
+    });
+    s.upstream->setCloseCallback([this, streamId]() {
+      this->onUpstreamClosed(streamId);
+    });
+
+    if (!isConnect) {
+      // one HTTP/1.1 request per upstream connection, so the end of the
+      // response is always known
+      std::string request = method + " ";
+      if (useUpstream && upstreamServer->type == UpstreamType::kHTTP) {
+        request.append("http://").append(authority);
+      }
+      request.append(path).append(" HTTP/1.1\r\nHost: ")
+        .append(authority).append("\r\n");
+
+      std::string cookie;
+      auto hasContentLength = false;
+      for (auto &f : fields) {
+        if (f.first == "host" || isConnectionSpecificHeader(f.first)) {
+          continue;
+        }
+        // cookie may be split into several fields (8.1.2.5)
+        if (f.first == "cookie") {
+          if (!cookie.empty()) {
+            cookie.append("; ");
+          }
+          cookie.append(f.second);
+          continue;
+        }
+        if (f.first == "content-length") {
+          hasContentLength = true;
+        }
+        request.append(f.first).append(": ").append(f.second).append("\r\n");
+      }
+      if (!cookie.empty()) {
+        request.append("cookie: ").append(cookie).append("\r\n");
+      }
+      if (!endStream && !hasContentLength) {
+        request.append("Transfer-Encoding: chunked\r\n");
+        s.chunkedRequest = true;
+      }
+      request.append("Connection: close\r\n\r\n");
+
+      s.responseParser.reset(s.isHead);
+      s.responseParser.setBodyCallback(
+        [this, streamId](const char *buf, std::size_t len) {
+          auto stream = this->findStream(streamId);
+          if (!stream) {
+            return;
+          }
+          if (!stream->responseStarted) {
+            this->sendResponseHeaders(*stream, false);
+          }
+          this->sendData(*stream, buf, len);
+        });
+      s.upstream->write(request.c_str(), request.size());
+    }
+
+    LOG_D("h2 stream %u: %s %s, upstream: %d",
+          streamId, method.c_str(), authority.c_str(), useUpstream);
+    // the stream is removed if the connection fails right away
+    auto upstream = s.upstream;
+    upstream->connect(addr, port, useUpstream, isConnect);
+  }
+
+  void Http2Session::endRequest(Stream &stream) {
+    stream.requestEnded = true;
+    if (stream.chunkedRequest) {
+      stream.upstream->write("0\r\n\r\n", 5);
+    }
+  }
+
+  void Http2Session::onUpstreamConnected(uint32_t streamId, bool succeeded) {
+    auto stream = findStream(streamId);
+    if (!stream) {
+      return;
+    }
+
+    if (!succeeded) {
+      LOG_W("h2 stream %u failed to connect upstream", streamId);
+      sendStatus(*stream, 502, true);
+    } else if (stream->isConnect) {
+      sendStatus(*stream, 200, false);
+    }
+    flushOutput();
+  }
+
+  void Http2Session::onUpstreamData(
+    uint32_t streamId, const char *buf, std::size_t len) {
+    auto stream = findStream(streamId);
+    if (!stream) {
+      return;
+    }
+
+    if (stream->isConnect) {
+      sendData(*stream, buf, len);
+      flushOutput();
+      return;
+    }
+
+    auto &parser = stream->responseParser;
+    while (len > 0 && !parser.isComplete()) {
+      auto consumed = parser.parse(buf, len);
+      if (parser.getState() == HttpResponseParser::State::ERROR_OCCURRED) {
+        LOG_W("h2 stream %u got unrecognized response", streamId);
+        if (stream->responseStarted) {
+          resetStream(streamId, Http2::ErrorCode::INTERNAL_ERROR);
+        } else {
+          sendStatus(*stream, 502, true);
+        }
+        flushOutput();
+        return;
+      }
+      buf += consumed;
+      len -= consumed;
+
+      auto statusCode = parser.getStatusCode();
+      if (parser.isComplete() && statusCode >= 100 && statusCode < 200) {
+        // interim responses are dropped
+        parser.reset(stream->isHead);
+      }
+    }
+
+    if (parser.isHeaderComplete()) {
+      if (!stream->responseStarted) {
+        // no body has been sent yet, the response may have none at all
+        auto complete = parser.isComplete();
+        sendResponseHeaders(*stream, complete);
+        if (complete) {
+          flushOutput();
+          return;
+        }
+      }
+      if (parser.isComplete()) {
+        endResponse(*stream);
+      }
+    }
+    flushOutput();
+  }
+
+  void Http2Session::onUpstreamWritten(uint32_t streamId, std::size_t len) {
+    auto stream = findStream(streamId);
+    if (!stream || stream->requestEnded) {
+      return;
+    }
+
+    auto credit = std::min(len, stream->uncreditedBytes);
+    stream->uncreditedBytes -= credit;
+    stream->creditBatch += credit;
+    if (stream->creditBatch > 0 &&
+        (stream->creditBatch >= STREAM_WINDOW_SIZE / 4 ||
+         stream->upstream->getQueuedBytes() == 0)) {
+      Http2FrameBuilder::appendWindowUpdate(
+        output_, streamId, static_cast<uint32_t>(stream->creditBatch));
+      stream->recvWindow += static_cast<int64_t>(stream->creditBatch);
+      stream->creditBatch = 0;
+      flushOutput();
+    }
+  }
+
+  void Http2Session::onUpstreamClosed(uint32_t streamId) {
+    auto stream = findStream(streamId);
+    if (!stream) {
+      return;
+    }
+
+    if (stream->isConnect || stream->responseParser.getState() ==
+        HttpResponseParser::State::BODY_UNTIL_CLOSE) {
+      endResponse(*stream);
+    } else if (!stream->responseParser.isComplete()) {
+      LOG_W("h2 stream %u: upstream closed before the response is done",
+            streamId);
+      if (stream->responseStarted) {
+        resetStream(streamId, Http2::ErrorCode::INTERNAL_ERROR);
+      } else {
+        sendStatus(*stream, 502, true);
+      }
+    }
+    flushOutput();
+  }
+
+  void Http2Session::sendResponseHeaders(Stream &stream, bool endStream) {
+    auto &parser = stream.responseParser;
+    HeaderList headers{{ ":status", std::to_string(parser.getStatusCode()) }};
+    for (auto &f : parser.getHeaderFields()) {
+      if (!isConnectionSpecificHeader(f.first)) {
+        headers.push_back(std::move(f));
+      }
+    }
+    std::string headerBlock;
+    hpackEncoder_.encode(headers, headerBlock);
+    Http2FrameBuilder::appendHeaders(
+      output_, stream.id, headerBlock, endStream, peerMaxFrameSize_);
+    stream.responseStarted = true;
+    if (endStream) {
+      onResponseSent(stream);
+    }
+  }
+
+  void Http2Session::sendStatus(
+    Stream &stream, int statusCode, bool endStream) {
+    std::string headerBlock;
+    hpackEncoder_.encode(
+      {{ ":status", std::to_string(statusCode) }}, headerBlock);
+    Http2FrameBuilder::appendHeaders(
+      output_, stream.id, headerBlock, endStream, peerMaxFrameSize_);
+    stream.responseStarted = true;
+    if (endStream) {
+      onResponseSent(stream);
+    }
+  }
+
+  void Http2Session::sendData(
+    Stream &stream, const char *buf, std::size_t len) {
+    stream.pendingData.append(buf, len);
+    flushStream(stream);
+    if (!stream.upstreamReadPaused &&
+        stream.pendingData.size() >= MAX_STREAM_PENDING_BYTES) {
+      // the client doesn't take the data as fast as the upstream sends it
+      stream.upstreamReadPaused = true;
+      stream.upstream->readStop();
+    }
+  }
+
+  void Http2Session::endResponse(Stream &stream) {
+    if (!stream.responseEnded) {
+      stream.responseEnded = true;
+      flushStream(stream);
+    }
+  }
+
+  void Http2Session::flushStream(Stream &stream) {
+    while (!stream.pendingData.empty() && stream.sendWindow > 0 &&
+           sendWindow_ > 0 && !isDownstreamBusy()) {
+      auto n = std::min<std::size_t>({
+        stream.pendingData.size(),
+        static_cast<std::size_t>(stream.sendWindow),
+        static_cast<std::size_t>(sendWindow_),
+        peerMaxFrameSize_
+      });
+      auto endStream = stream.responseEnded && n == stream.pendingData.size();
+      Http2FrameBuilder::appendData(
+        output_, stream.id, stream.pendingData.c_str(), n, endStream);
+      stream.pendingData.erase(0, n);
+      stream.sendWindow -= static_cast<int64_t>(n);
+      sendWindow_ -= static_cast<int64_t>(n);
+      if (endStream) {
+        onResponseSent(stream);
+        return;
+      }
+    }
+
+    if (stream.pendingData.empty() && stream.responseEnded) {
+      Http2FrameBuilder::appendData(output_, stream.id, nullptr, 0, true);
+      onResponseSent(stream);
+      return;
+    }
+
+    if (stream.upstreamReadPaused &&
+        stream.pendingData.size() < MAX_STREAM_PENDING_BYTES / 2) {
+      stream.upstreamReadPaused = false;
+      stream.upstream->readStart();
+    }
+  }
+
+  void Http2Session::flushStreams() {
+    std::vector<uint32_t> streamIds;
+    for (auto &it : streams_) {
+      if (!it.second->pendingData.empty() || it.second->responseEnded) {
+        streamIds.push_back(it.first);
+      }
+    }
+    for (auto streamId : streamIds) {
+      auto stream = findStream(streamId);
+      if (stream) {
+        flushStream(*stream);
+      }
+    }
+  }
+
+  void Http2Session::onResponseSent(Stream &stream) {
+    // the request body is of no use any more
+    if (!stream.requestEnded) {
+      Http2FrameBuilder::appendRstStream(
+        output_, stream.id, Http2::ErrorCode::NO_ERROR);
+    }
+    removeStream(stream.id);
+  }
+
+  void Http2Session::onSettings(const Http2Frame &frame) {
+    if (frame.streamId != 0) {
+      connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+    if (frame.hasFlag(Http2::FLAG_ACK)) {
+      if (!frame.payload.empty()) {
+        connectionError(Http2::ErrorCode::FRAME_SIZE_ERROR);
+      }
+      return;
+    }
+    if (frame.payload.size() % 6 != 0) {
+      connectionError(Http2::ErrorCode::FRAME_SIZE_ERROR);
+      return;
+    }
+
+    for (std::size_t i = 0; i < frame.payload.size(); i += 6) {
+      auto id = static_cast<Http2::Setting>(
+        Http2FrameBuilder::readUint16(frame.payload.c_str() + i));
+      auto value = Http2FrameBuilder::readUint32(frame.payload.c_str() + i + 2);
+      switch (id) {
+        case Http2::Setting::INITIAL_WINDOW_SIZE: {
+          if (value > static_cast<uint32_t>(Http2::MAX_WINDOW_SIZE)) {
+            connectionError(Http2::ErrorCode::FLOW_CONTROL_ERROR);
+            return;
+          }
+          // applies to the open streams too (6.9.2)
+          auto delta = static_cast<int64_t>(value) - peerInitialWindowSize_;
+          for (auto &it : streams_) {
+            it.second->sendWindow += delta;
+          }
+          peerInitialWindowSize_ = value;
+          break;
+        }
+
+        case Http2::Setting::MAX_FRAME_SIZE:
+          if (value < Http2::DEFAULT_MAX_FRAME_SIZE ||
+              value > Http2::MAX_MAX_FRAME_SIZE) {
+            connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+            return;
+          }
+          peerMaxFrameSize_ = value;
+          break;
+
+        case Http2::Setting::ENABLE_PUSH:
+          if (value > 1) {
+            connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+            return;
+          }
+          break;
+
+        default:
+          // HEADER_TABLE_SIZE doesn't matter as the encoder never indexes
+          break;
+      }
+    }
+
+    Http2FrameBuilder::appendSettingsAck(output_);
+    flushStreams();
+  }
+
+  void Http2Session::onWindowUpdate(const Http2Frame &frame) {
+    if (frame.payload.size() != 4) {
+      connectionError(Http2::ErrorCode::FRAME_SIZE_ERROR);
+      return;
+    }
+
+    auto increment =
+      Http2FrameBuilder::readUint32(frame.payload.c_str()) & 0x7fffffff;
+    if (frame.streamId == 0) {
+      sendWindow_ += increment;
+      if (increment == 0 || sendWindow_ > Http2::MAX_WINDOW_SIZE) {
+        connectionError(increment == 0 ?
+          Http2::ErrorCode::PROTOCOL_ERROR :
+          Http2::ErrorCode::FLOW_CONTROL_ERROR);
+        return;
+      }
+      flushStreams();
+      return;
+    }
+
+    auto stream = findStream(frame.streamId);
+    if (!stream) {
+      return;
+    }
+    stream->sendWindow += increment;
+    if (increment == 0 || stream->sendWindow > Http2::MAX_WINDOW_SIZE) {
+      resetStream(frame.streamId, increment == 0 ?
+        Http2::ErrorCode::PROTOCOL_ERROR :
+        Http2::ErrorCode::FLOW_CONTROL_ERROR);
+      return;
+    }
+    flushStream(*stream);
+  }
+
+  void Http2Session::onRstStream(const Http2Frame &frame) {
+    if (frame.streamId == 0) {
+      connectionError(Http2::ErrorCode::PROTOCOL_ERROR);
+      return;
+    }
+    if (frame.payload.size() != 4) {
+      connectionError(Http2::ErrorCode::FRAME_SIZE_ERROR);
+      return;
+    }
+    LOG_D("h2 stream %u reset by client: %u", frame.streamId,
+          Http2FrameBuilder::readUint32(frame.payload.c_str()));
+    removeStream(frame.streamId);
+  }
+
+  void Http2Session::resetStream(
+    uint32_t streamId, Http2::ErrorCode errorCode) {
+    Http2FrameBuilder::appendRstStream(output_, streamId, errorCode);
+    removeStream(streamId);
+  }
+
+  void Http2Session::removeStream(uint32_t streamId) {
+    auto it = streams_.find(streamId);
+    if (it == streams_.end()) {
+      return;
+    }
+    if (it->second->upstream) {
+      it->second->upstream->close();
+    }
+    streams_.erase(it);
+  }
+
+  Http2Session::Stream *Http2Session::findStream(uint32_t streamId) {
+    auto it = streams_.find(streamId);
+    return it != streams_.end() ? it->second.get() : nullptr;
+  }
+
+  void Http2Session::connectionError(Http2::ErrorCode errorCode) {
+    LOG_E("h2 connection error: %d", static_cast<int>(errorCode));
+    Http2FrameBuilder::appendGoaway(output_, lastStreamId_, errorCode);
+    flushOutput();
+    if (!closed_) {
+      close();
+      downstreamConn_->close();
+    }
+  }
+
+  bool Http2Session::isDownstreamBusy() const {
+    auto queued = uv_stream_get_write_queue_size(
+      reinterpret_cast<uv_stream_t *>(downstreamConn_->get()));
+    return output_.size() + queued >= MAX_DOWNSTREAM_QUEUE_BYTES;
+  }
+
+  void Http2Session::flushOutput() {
+    if (closed_) {
+      return;
+    }
+
+    std::size_t offset = 0;
+    while (offset < output_.size()) {
+      auto n = std::min(output_.size() - offset, MAX_WRITE_CHUNK_BYTES);
+      downstreamConn_->writeAsync(
+        bufferPool_->assembleDataBuffer(output_.c_str() + offset, n));
+      offset += n;
+    }
+    output_.clear();
+
+    if (goawayReceived_ && streams_.empty()) {
+      close();
+      downstreamConn_->close();
+    }
+  }
+
+} /* end of namspace: proxypp */
@@ -0,0 +1,144 @@
+/*******************************************************************************
+**          File: http2_session.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 06:20 PM
+**   Description: h2c (prior knowledge) on a client connection of hpd, every
+**                CONNECT or plain request stream gets its own upstream
+**                connection, which is read only as fast as the client
+**                window allows, and the client is granted more window only
+**                as fast as the upstream takes the data
+*******************************************************************************/
+#ifndef PROXYPP_HTTP2_SESSION_H_
+#define PROXYPP_HTTP2_SESSION_H_
+#include "proxypp/upstream_type.h"
+#include "proxypp/upstream_connector.h"
+#include "proxypp/auto_proxy_manager.h"
+#include "proxypp/http/hpack.h"
+#include "proxypp/http/http2_frame.h"
+#include "proxypp/http/http_response_parser.h"
+#include "uvcpp.h"
+#include "nul/buffer_pool.hpp"
+
+#include <map>
+
+namespace proxypp {
+  /**
+   * The client connection is owned by HttpProxySession, which must call
+   * close() when it is closed, no upstream callback reaches this object
+   * after that
+   */
+  class Http2Session final {
+    public:
+      Http2Session(
+        const std::shared_ptr<uvcpp::Tcp> &conn,
+        const std::shared_ptr<nul::BufferPool> &bufferPool);
+
+      void setUpstreamServer(
+        UpstreamType type, const std::string &host, uint16_t port);
+      // the upstreams the rules name, see RouteAction
+      void setUpstreamServers(
+        const std::shared_ptr<const UpstreamServers> &upstreamServers);
+      void setAutoProxyManager(
+        const std::shared_ptr<AutoProxyManager> &proxyRuleManager);
+      void setMaxConcurrentStreams(uint32_t maxConcurrentStreams);
+
+      // sends the server connection preface
+      void start();
+      // data read from the client after the client connection preface
+      void onDownstreamData(const char *buf, std::size_t len);
+      // writes to the client completed, streams held back by a full send
+      // queue can go on
+      void onDownstreamDrained();
+      // closes the upstream connections of all the streams
+      void close();
+
+    private:
+      struct Stream {
+        uint32_t id{0};
+        bool isConnect{false};
+        bool isHead{false};
+        std::shared_ptr<UpstreamConnector> upstream;
+        HttpResponseParser responseParser;
+
+        // the request body is sent to the upstream with chunked encoding
+        bool chunkedRequest{false};
+        // END_STREAM received from the client
+        bool requestEnded{false};
+        // request DATA written to the upstream, not yet credited back
+        std::size_t uncreditedBytes{0};
+        std::size_t creditBatch{0};
+        int64_t recvWindow{0};
+
+        int64_t sendWindow{0};
+        // response data waiting for window
+        std::string pendingData;
+        bool responseStarted{false};
+        // END_STREAM is sent once pendingData is flushed
+        bool responseEnded{false};
+        bool upstreamReadPaused{false};
+      };
+
+      void handleFrame(Http2Frame &frame);
+      void onData(Http2Frame &frame);
+      void onHeaders(Http2Frame &frame);
+      void onHeaderBlock(uint32_t streamId, bool endStream);
+      void onSettings(const Http2Frame &frame);
+      void onWindowUpdate(const Http2Frame &frame);
+      void onRstStream(const Http2Frame &frame);
+
+      void openStream(
+        uint32_t streamId, const HeaderList &headers, bool endStream);
+      void endRequest(Stream &stream);
+      void onUpstreamConnected(uint32_t streamId, bool succeeded);
+      void onUpstreamData(uint32_t streamId, const char *buf, std::size_t len);
+      void onUpstreamWritten(uint32_t streamId, std::size_t len);
+      void onUpstreamClosed(uint32_t streamId);
+
+      void sendResponseHeaders(Stream &stream, bool endStream);
+      void sendStatus(Stream &stream, int statusCode, bool endStream);
+      void sendData(Stream &stream, const char *buf, std::size_t len);
+      void endResponse(Stream &stream);
+      void flushStream(Stream &stream);
+      void flushStreams();
+      // END_STREAM is sent, the stream is removed
+      void onResponseSent(Stream &stream);
+      void resetStream(uint32_t streamId, Http2::ErrorCode errorCode);
+      void removeStream(uint32_t streamId);
+      Stream *findStream(uint32_t streamId);
+      void connectionError(Http2::ErrorCode errorCode);
+      bool isDownstreamBusy() const;
+      void flushOutput();
+
+    private:
+      std::shared_ptr<uvcpp::Tcp> downstreamConn_;
+      std::shared_ptr<nul::BufferPool> bufferPool_;
+      UpstreamServer defaultUpstream_;
+      std::shared_ptr<const UpstreamServers> upstreamServers_;
+      std::shared_ptr<AutoProxyManager> proxyRuleManager_;
+      uint32_t maxConcurrentStreams_{100};
+
+      Http2FrameParser frameParser_;
+      HpackDecoder hpackDecoder_;
+      HpackEncoder hpackEncoder_;
+      // frames not yet handed to the client connection
+      std::string output_;
+
+      std::map<uint32_t, std::unique_ptr<Stream>> streams_;
+      uint32_t lastStreamId_{0};
+      // a header block split into CONTINUATION frames
+      uint32_t headerStreamId_{0};
+      bool headerEndStream_{false};
+      std::string headerBlock_;
+
+      bool settingsReceived_{false};
+      bool goawayReceived_{false};
+      bool closed_{false};
+      uint32_t peerMaxFrameSize_{Http2::DEFAULT_MAX_FRAME_SIZE};
+      int64_t peerInitialWindowSize_{Http2::DEFAULT_WINDOW_SIZE};
+      int64_t sendWindow_{Http2::DEFAULT_WINDOW_SIZE};
+      int64_t recvWindow_{Http2::DEFAULT_WINDOW_SIZE};
+      std::size_t recvConsumed_{0};
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_HTTP2_SESSION_H_ */
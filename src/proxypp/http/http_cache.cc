@@ -0,0 +1,709 @@
+/*******************************************************************************
+**          File: http_cache.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 11:48 AM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/http/http_cache.h"
+#include "nul/log.h"
+#include "nul/util.hpp"
+#include "proxypp/util.h"
+
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+  using su = nul::StringUtil;
+  using Clock = proxypp::HttpCache::Clock;
+
+  // bookkeeping overhead of an entry, roughly
+  static const auto ENTRY_OVERHEAD = 256U;
+  static const auto STATS_LOG_INTERVAL = 1000U;
+  static const auto MAX_HEURISTIC_FRESHNESS = std::chrono::hours(24);
+
+  std::map<std::string, std::string> parseCacheControl(
+    const std::string &value) {
+    std::map<std::string, std::string> directives;
+    su::split(value, ",", [&directives](auto index, const auto &part) {
+      auto directive = su::trim(part);
+      if (directive.empty()) {
+        return true;
+      }
+      auto eqIndex = directive.find('=');
+      auto name = su::trim(directive.substr(0, eqIndex));
+      su::tolower(name);
+      std::string arg;
+      if (eqIndex != std::string::npos) {
+        arg = su::trim(directive.substr(eqIndex + 1));
+        if (arg.size() >= 2 && arg.front() == '"' && arg.back() == '"') {
+          arg = arg.substr(1, arg.size() - 2);
+        }
+      }
+      directives[name] = arg;
+      return true;
+    });
+    return directives;
+  }
+
+  bool parseSeconds(const std::string &value, std::chrono::seconds &secs) {
+    char *end = nullptr;
+    auto n = std::strtoll(value.c_str(), &end, 10);
+    if (end == value.c_str() || n < 0) {
+      return false;
+    }
+    secs = std::chrono::seconds(n);
+    return true;
+  }
+
+  // days since 1970-01-01 of a date in the proleptic Gregorian calendar
+  int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    auto era = (y >= 0 ? y : y - 399) / 400;
+    auto yoe = static_cast<unsigned>(y - era * 400);
+    auto doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    auto doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+  }
+
+  // IMF-fixdate, RFC 850 date and asctime() date, see RFC 7231 7.1.1.1
+  bool parseHttpDate(const std::string &value, Clock::time_point &tp) {
+    static const char *MONTHS[] = {
+      "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+
+    char month[4] = {0};
+    int day = 0, year = 0, hour = 0, minute = 0, second = 0;
+    auto commaIndex = value.find(',');
+    auto s = value.c_str();
+    if (commaIndex != std::string::npos) {
+      s += commaIndex + 1;
+      // Sun, 06 Nov 1994 08:49:37 GMT
+      if (std::sscanf(s, " %d %3s %d %d:%d:%d",
+                      &day, month, &year, &hour, &minute, &second) != 6 &&
+          // Sunday, 06-Nov-94 08:49:37 GMT
+          std::sscanf(s, " %d-%3s-%d %d:%d:%d",
+                      &day, month, &year, &hour, &minute, &second) != 6) {
+        return false;
+      }
+      if (year < 100) {
+        year += year < 70 ? 2000 : 1900;
+      }
+
+    // Sun Nov  6 08:49:37 1994
+    } else if (std::sscanf(s, "%*s %3s %d %d:%d:%d %d",
+                           month, &day, &hour, &minute, &second, &year) != 6) {
+      return false;
+    }
+
+    unsigned mon = 0;
+    while (mon < 12 && std::strcmp(MONTHS[mon], month) != 0) {
+      ++mon;
+    }
+    if (mon == 12 || day < 1 || day > 31 ||
+        hour > 23 || minute > 59 || second > 60) {
+      return false;
+    }
+
+    auto days = daysFromCivil(year, mon + 1, static_cast<unsigned>(day));
+    tp = Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+        std::chrono::seconds(
+          days * 86400 + hour * 3600 + minute * 60 + second)));
+    return true;
+  }
+
+  // weak comparison, see RFC 7232 2.3.2
+  bool matchesEtag(const std::string &ifNoneMatch, const std::string &etag) {
+    if (etag.empty()) {
+      return false;
+    }
+    auto opaqueTag = etag.compare(0, 2, "W/") == 0 ? etag.substr(2) : etag;
+    auto matched = false;
+    su::split(ifNoneMatch, ",", [&](auto index, const auto &part) {
+      auto tag = su::trim(part);
+      if (tag.compare(0, 2, "W/") == 0) {
+        tag = tag.substr(2);
+      }
+      matched = tag == "*" || tag == opaqueTag;
+      return !matched;
+    });
+    return matched;
+  }
+
+  std::chrono::seconds secondsBetween(
+    Clock::time_point from, Clock::time_point to) {
+    if (to <= from) {
+      return std::chrono::seconds(0);
+    }
+    return std::chrono::duration_cast<std::chrono::seconds>(to - from);
+  }
+
+  // freshness lifetime of a response, see RFC 7234 4.2.1
+  std::chrono::seconds calcFreshnessLifetime(
+    const std::map<std::string, std::string> &cc,
+    const proxypp::HttpResponseParser &resp,
+    Clock::time_point date) {
+    std::chrono::seconds lifetime{0};
+
+    auto it = cc.find("s-maxage");
+    if (it != cc.end() && parseSeconds(it->second, lifetime)) {
+      return lifetime;
+    }
+    it = cc.find("max-age");
+    if (it != cc.end() && parseSeconds(it->second, lifetime)) {
+      return lifetime;
+    }
+
+    auto expires = resp.getHeader("expires");
+    if (!expires.empty()) {
+      Clock::time_point expiresTime;
+      // invalid Expires means the response has already expired
+      return parseHttpDate(expires, expiresTime) ?
+        secondsBetween(date, expiresTime) : std::chrono::seconds(0);
+    }
+
+    auto lastModified = resp.getHeader("last-modified");
+    Clock::time_point lastModifiedTime;
+    if (!lastModified.empty() &&
+        parseHttpDate(lastModified, lastModifiedTime)) {
+      // heuristic freshness, 10% of the time since last modification
+      return std::min(
+        std::chrono::duration_cast<std::chrono::seconds>(
+          MAX_HEURISTIC_FRESHNESS),
+        secondsBetween(lastModifiedTime, date) / 10);
+    }
+
+    return lifetime;
+  }
+
+  bool isCacheableStatus(int statusCode) {
+    switch (statusCode) {
+      case 200: case 203: case 300: case 301: case 404: case 410:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  bool strStartsWithIgnoreCase(const char *s, const char *prefix) {
+    for (; *prefix; ++s, ++prefix) {
+      if (std::tolower(*s) != *prefix) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // copies the response header without the Age lines and the terminating
+  // empty line, an up-to-date Age is added when the response is served
+  void appendHeaderWithoutAge(
+    const std::string &data, std::size_t headerLength, std::string &out) {
+    std::size_t lineStart = data.find("\r\n") + 2;
+    out.append(data, 0, lineStart);
+    while (lineStart < headerLength - 2) {
+      auto lineEnd = data.find("\r\n", lineStart) + 2;
+      if (!strStartsWithIgnoreCase(data.c_str() + lineStart, "age:")) {
+        out.append(data, lineStart, lineEnd - lineStart);
+      }
+      lineStart = lineEnd;
+    }
+  }
+
+  int64_t toEpochSeconds(Clock::time_point tp) {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+      tp.time_since_epoch()).count();
+  }
+
+  Clock::time_point fromEpochSeconds(int64_t secs) {
+    return Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+        std::chrono::seconds(secs)));
+  }
+}
+
+namespace proxypp {
+  double HttpCache::Stats::hitRatio() const {
+    return requests > 0 ? static_cast<double>(hits) / requests : 0;
+  }
+
+  double HttpCache::Stats::byteHitRatio() const {
+    return bytesServed > 0 ? static_cast<double>(bytesHit) / bytesServed : 0;
+  }
+
+  HttpCache::HttpCache(std::size_t capacity) :
+    capacity_(capacity), protectedCapacity_(capacity / 5 * 4) {
+  }
+
+  void HttpCache::setDiskCache(std::unique_ptr<HttpDiskCache> &&diskCache) {
+    diskCache_ = std::move(diskCache);
+  }
+
+  std::string HttpCache::makeKey(
+    const HttpHeaderParser &req, const std::string &host, uint16_t port) {
+    if (req.getMethod() != "GET" ||
+        req.hasHeader("authorization") ||
+        req.hasHeader("range") ||
+        req.hasHeader("transfer-encoding")) {
+      return "";
+    }
+
+    auto contentLength = req.getHeader("content-length");
+    if (!contentLength.empty() && contentLength != "0") {
+      return "";
+    }
+
+    auto cc = parseCacheControl(req.getHeader("cache-control"));
+    if (cc.find("no-store") != cc.end()) {
+      return "";
+    }
+
+    std::string key;
+    auto &url = req.getUrl();
+    if (Util::strStartsWith(url, "http://", 0)) {
+      key = url;
+    } else if (!url.empty() && url[0] == '/') {
+      key = "http://" + host;
+      if (port != 80) {
+        key.append(":").append(std::to_string(port));
+      }
+      key.append(url);
+    } else {
+      return "";
+    }
+
+    // Vary is only honoured for Accept-Encoding, so always key on it
+    key.append("\n").append(req.getHeader("accept-encoding"));
+    return key;
+  }
+
+  bool HttpCache::requiresRevalidation(const HttpHeaderParser &req) {
+    auto cc = parseCacheControl(req.getHeader("cache-control"));
+    if (cc.find("no-cache") != cc.end()) {
+      return true;
+    }
+    auto it = cc.find("max-age");
+    if (it != cc.end() && it->second == "0") {
+      return true;
+    }
+    return req.getHeader("pragma").find("no-cache") != std::string::npos;
+  }
+
+  std::shared_ptr<const HttpCache::Entry> HttpCache::lookup(
+    const std::string &key) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      return lookupDisk(key);
+    }
+    touch(it->second);
+    return it->second.entry;
+  }
+
+  std::shared_ptr<const HttpCache::Entry> HttpCache::lookupDisk(
+    const std::string &key) {
+    if (!diskCache_) {
+      return nullptr;
+    }
+    auto loc = diskCache_->find(key);
+    if (!loc) {
+      return nullptr;
+    }
+
+    auto entry = std::make_shared<Entry>();
+    entry->key = key;
+    appendHeaderWithoutAge(
+      diskCache_->readHeader(*loc), loc->headerLength, entry->data);
+    entry->headerEndPos = entry->data.size();
+    entry->data.append("\r\n");
+    entry->responseTime = fromEpochSeconds(loc->meta.responseTime);
+    entry->initialAge = std::chrono::seconds(loc->meta.initialAge);
+    entry->freshnessLifetime =
+      std::chrono::seconds(loc->meta.freshnessLifetime);
+    entry->etag = loc->meta.etag;
+    entry->lastModified = loc->meta.lastModified;
+    entry->mustRevalidate = loc->meta.mustRevalidate;
+    entry->bodyFd = diskCache_->getFd(loc->segment);
+    entry->bodyOffset = loc->dataOffset + loc->headerLength;
+    entry->bodyLength = loc->dataLength - loc->headerLength;
+    entry->pin = diskCache_->pin(loc->segment);
+    return entry;
+  }
+
+  bool HttpCache::isFresh(const Entry &entry) const {
+    auto age = entry.initialAge +
+      secondsBetween(entry.responseTime, Clock::now());
+    return age < entry.freshnessLifetime;
+  }
+
+  std::string HttpCache::buildResponse(const Entry &entry) const {
+    auto age = entry.initialAge +
+      secondsBetween(entry.responseTime, Clock::now());
+
+    std::string response;
+    response.reserve(entry.data.size() + 32);
+    response.append(entry.data, 0, entry.headerEndPos);
+    response.append("Age: ").append(std::to_string(age.count()));
+    response.append("\r\n");
+    response.append(entry.data, entry.headerEndPos, std::string::npos);
+    return response;
+  }
+
+  bool HttpCache::isNotModified(
+    const HttpHeaderParser &req, const Entry &entry) {
+    if (req.hasHeader("if-none-match")) {
+      return matchesEtag(req.getHeader("if-none-match"), entry.etag);
+    }
+    Clock::time_point since;
+    Clock::time_point lastModified;
+    return req.hasHeader("if-modified-since") &&
+      parseHttpDate(req.getHeader("if-modified-since"), since) &&
+      parseHttpDate(entry.lastModified, lastModified) &&
+      lastModified <= since;
+  }
+
+  std::string HttpCache::buildNotModifiedResponse(const Entry &entry) const {
+    static const char *HEADERS[] = {
+      "cache-control", "content-location", "date", "etag", "expires",
+      "last-modified", "vary"
+    };
+    auto age = entry.initialAge +
+      secondsBetween(entry.responseTime, Clock::now());
+
+    std::string response{"HTTP/1.1 304 Not Modified\r\n"};
+    // the header lines of the entry, after the status line
+    auto pos = entry.data.find("\r\n");
+    while (pos != std::string::npos && pos + 2 < entry.headerEndPos) {
+      auto lineStart = pos + 2;
+      pos = entry.data.find("\r\n", lineStart);
+      auto colonIndex = entry.data.find(':', lineStart);
+      if (pos == std::string::npos || colonIndex > pos) {
+        continue;
+      }
+      auto name = su::trim(
+        entry.data.substr(lineStart, colonIndex - lineStart));
+      su::tolower(name);
+      if (std::find_if(std::begin(HEADERS), std::end(HEADERS),
+                       [&name](const char *h) { return name == h; }) !=
+          std::end(HEADERS)) {
+        response.append(entry.data, lineStart, pos + 2 - lineStart);
+      }
+    }
+    response.append("Age: ").append(std::to_string(age.count()));
+    response.append("\r\n\r\n");
+    return response;
+  }
+
+  bool HttpCache::beginFetch(const std::string &key, FetchCallback &&callback) {
+    auto it = fetches_.find(key);
+    if (it == fetches_.end()) {
+      fetches_[key];
+      return true;
+    }
+    it->second.push_back(std::move(callback));
+    ++stats_.collapsed;
+    return false;
+  }
+
+  void HttpCache::endFetch(const std::string &key) {
+    auto it = fetches_.find(key);
+    if (it == fetches_.end()) {
+      return;
+    }
+    // the callbacks may start another fetch for the same key
+    auto callbacks = std::move(it->second);
+    fetches_.erase(it);
+    for (auto &callback : callbacks) {
+      callback();
+    }
+  }
+
+  bool HttpCache::isCacheable(const HttpResponseParser &resp) {
+    if (!resp.isHeaderComplete() ||
+        !isCacheableStatus(resp.getStatusCode()) ||
+        resp.getState() == HttpResponseParser::State::BODY_UNTIL_CLOSE) {
+      return false;
+    }
+
+    auto cc = parseCacheControl(resp.getHeader("cache-control"));
+    if (cc.find("no-store") != cc.end() || cc.find("private") != cc.end() ||
+        resp.getHeaders().count("set-cookie") > 0) {
+      return false;
+    }
+
+    auto vary = resp.getHeader("vary");
+    su::tolower(vary);
+    return vary.empty() ||
+      su::split(vary, ",", [](auto index, const auto &part) {
+        return su::trim(part) == "accept-encoding";
+      });
+  }
+
+  bool HttpCache::store(
+    const std::string &key,
+    std::string &&data,
+    const HttpResponseParser &resp,
+    Clock::time_point requestTime) {
+    if (!resp.isComplete() || data.size() > getMaxObjectSize() ||
+        resp.getHeaderLength() > data.size()) {
+      return false;
+    }
+
+    auto entry = makeEntry(key, resp, requestTime);
+    if (!entry) {
+      return false;
+    }
+
+    auto headerLength = resp.getHeaderLength();
+    entry->data.reserve(data.size());
+    appendHeaderWithoutAge(data, headerLength, entry->data);
+    entry->headerEndPos = entry->data.size();
+    entry->data.append(data, headerLength - 2, std::string::npos);
+
+    LOG_V("cached %zu bytes for %s, freshness: %llds", entry->data.size(),
+          key.substr(0, key.find('\n')).c_str(),
+          static_cast<long long>(entry->freshnessLifetime.count()));
+    insert(std::move(entry));
+    return true;
+  }
+
+  std::shared_ptr<HttpCache::Entry> HttpCache::makeEntry(
+    const std::string &key,
+    const HttpResponseParser &resp,
+    Clock::time_point requestTime) const {
+    if (!isCacheable(resp)) {
+      return nullptr;
+    }
+
+    auto cc = parseCacheControl(resp.getHeader("cache-control"));
+    auto entry = std::make_shared<Entry>();
+    entry->key = key;
+    entry->responseTime = Clock::now();
+    entry->etag = resp.getHeader("etag");
+    entry->lastModified = resp.getHeader("last-modified");
+    entry->mustRevalidate = cc.count("must-revalidate") > 0 ||
+      cc.count("proxy-revalidate") > 0 || cc.count("no-cache") > 0;
+
+    Clock::time_point date;
+    if (!parseHttpDate(resp.getHeader("date"), date)) {
+      date = entry->responseTime;
+    }
+    entry->freshnessLifetime = cc.count("no-cache") > 0 ?
+      std::chrono::seconds(0) : calcFreshnessLifetime(cc, resp, date);
+
+    if (entry->freshnessLifetime.count() == 0 &&
+        entry->etag.empty() && entry->lastModified.empty()) {
+      // can be neither served nor revalidated
+      return nullptr;
+    }
+
+    // initial age, see RFC 7234 4.2.3
+    std::chrono::seconds ageValue{0};
+    parseSeconds(resp.getHeader("age"), ageValue);
+    entry->initialAge = std::max(
+      secondsBetween(date, entry->responseTime),
+      ageValue + secondsBetween(requestTime, entry->responseTime));
+    return entry;
+  }
+
+  std::shared_ptr<const HttpCache::Entry> HttpCache::refresh(
+    const std::string &key, const HttpResponseParser &notModifiedResp) {
+    auto it = entries_.find(key);
+    auto current = it != entries_.end() ? it->second.entry : lookupDisk(key);
+    if (!current) {
+      return nullptr;
+    }
+
+    auto entry = std::make_shared<Entry>(*current);
+    entry->responseTime = Clock::now();
+    std::chrono::seconds ageValue{0};
+    parseSeconds(notModifiedResp.getHeader("age"), ageValue);
+    entry->initialAge = ageValue;
+
+    auto etag = notModifiedResp.getHeader("etag");
+    if (!etag.empty()) {
+      entry->etag = etag;
+    }
+    auto lastModified = notModifiedResp.getHeader("last-modified");
+    if (!lastModified.empty()) {
+      entry->lastModified = lastModified;
+    }
+
+    auto ccValue = notModifiedResp.getHeader("cache-control");
+    if (!ccValue.empty() || !notModifiedResp.getHeader("expires").empty()) {
+      auto cc = parseCacheControl(ccValue);
+      Clock::time_point date;
+      if (!parseHttpDate(notModifiedResp.getHeader("date"), date)) {
+        date = entry->responseTime;
+      }
+      entry->freshnessLifetime = cc.count("no-cache") > 0 ?
+        std::chrono::seconds(0) :
+        calcFreshnessLifetime(cc, notModifiedResp, date);
+    }
+
+    ++stats_.revalidated;
+    if (entry->bodyFd != -1) {
+      diskCache_->updateMeta(key, toMeta(*entry));
+      return entry;
+    }
+    erase(key);
+    std::shared_ptr<const Entry> result = entry;
+    insert(std::move(entry));
+    return result;
+  }
+
+  std::unique_ptr<HttpDiskCache::Reservation> HttpCache::reserveOnDisk(
+    const std::string &key,
+    const HttpResponseParser &resp,
+    Clock::time_point requestTime) {
+    // the size must be known up front, chunked responses stay in memory
+    auto contentLengthValue = resp.getHeader("content-length");
+    if (!diskCache_ || !resp.isHeaderComplete() ||
+        contentLengthValue.empty() ||
+        !resp.getHeader("transfer-encoding").empty()) {
+      return nullptr;
+    }
+    auto contentLength = std::strtoull(contentLengthValue.c_str(), nullptr, 10);
+    auto dataLength = resp.getHeaderLength() + contentLength;
+    if (dataLength <= getMaxObjectSize() ||
+        dataLength > diskCache_->getMaxObjectSize()) {
+      return nullptr;
+    }
+
+    auto entry = makeEntry(key, resp, requestTime);
+    if (!entry) {
+      return nullptr;
+    }
+    return diskCache_->reserve(
+      key, toMeta(*entry),
+      static_cast<uint32_t>(resp.getHeaderLength()), dataLength);
+  }
+
+  bool HttpCache::writeOnDisk(
+    HttpDiskCache::Reservation &reservation, const std::string &data) {
+    return diskCache_->write(reservation, data.data(), data.size());
+  }
+
+  bool HttpCache::commitOnDisk(HttpDiskCache::Reservation &reservation) {
+    if (!diskCache_->commit(reservation)) {
+      return false;
+    }
+    // the disk tier now holds the latest version
+    erase(reservation.key);
+    LOG_V("cached %llu bytes on disk for %s",
+          static_cast<unsigned long long>(reservation.written),
+          reservation.key.substr(0, reservation.key.find('\n')).c_str());
+    return true;
+  }
+
+  void HttpCache::recordServed(std::size_t bytes, bool fromCache) {
+    ++stats_.requests;
+    stats_.bytesServed += bytes;
+    if (fromCache) {
+      ++stats_.hits;
+      stats_.bytesHit += bytes;
+    }
+    if (stats_.requests % STATS_LOG_INTERVAL == 0) {
+      logStats();
+    }
+  }
+
+  std::size_t HttpCache::getMaxObjectSize() const {
+    return capacity_ / 8;
+  }
+
+  std::size_t HttpCache::getSize() const {
+    return size_;
+  }
+
+  const HttpCache::Stats &HttpCache::getStats() const {
+    return stats_;
+  }
+
+  void HttpCache::insert(std::shared_ptr<const Entry> &&entry) {
+    auto key = entry->key;
+    erase(key);
+
+    probation_.push_front(key);
+    size_ += sizeOf(*entry);
+    entries_[key] = Node{std::move(entry), Segment::kProbation,
+      probation_.begin()};
+    evict();
+  }
+
+  void HttpCache::erase(const std::string &key) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      return;
+    }
+    auto &node = it->second;
+    auto sz = sizeOf(*node.entry);
+    size_ -= sz;
+    if (node.segment == Segment::kProtected) {
+      protectedSize_ -= sz;
+      protected_.erase(node.it);
+    } else {
+      probation_.erase(node.it);
+    }
+    entries_.erase(it);
+  }
+
+  void HttpCache::touch(Node &node) {
+    if (node.segment == Segment::kProtected) {
+      protected_.splice(protected_.begin(), protected_, node.it);
+      return;
+    }
+
+    // promote on the second access, demote the coldest protected entries
+    // to the probation segment if it overflows
+    protected_.splice(protected_.begin(), probation_, node.it);
+    node.segment = Segment::kProtected;
+    protectedSize_ += sizeOf(*node.entry);
+
+    while (protectedSize_ > protectedCapacity_ && protected_.size() > 1) {
+      auto &victim = entries_[protected_.back()];
+      probation_.splice(probation_.begin(), protected_, victim.it);
+      victim.segment = Segment::kProbation;
+      protectedSize_ -= sizeOf(*victim.entry);
+    }
+  }
+
+  void HttpCache::evict() {
+    while (size_ > capacity_ && !entries_.empty()) {
+      auto &victim = !probation_.empty() ? probation_.back() : protected_.back();
+      LOG_V("evict cache entry: %s",
+            victim.substr(0, victim.find('\n')).c_str());
+      erase(std::string{victim});
+      ++stats_.evictions;
+    }
+  }
+
+  void HttpCache::logStats() const {
+    LOG_I("http cache: %zu entries, %zu bytes, %zu on disk, requests: %llu, "
+          "hit ratio: %.3f, byte hit ratio: %.3f, revalidated: %llu, "
+          "collapsed: %llu, evictions: %llu",
+          entries_.size(), size_,
+          diskCache_ ? diskCache_->getObjectCount() : 0,
+          static_cast<unsigned long long>(stats_.requests),
+          stats_.hitRatio(), stats_.byteHitRatio(),
+          static_cast<unsigned long long>(stats_.revalidated),
+          static_cast<unsigned long long>(stats_.collapsed),
+          static_cast<unsigned long long>(stats_.evictions));
+  }
+
+  std::size_t HttpCache::sizeOf(const Entry &entry) {
+    return entry.key.size() + entry.data.size() + ENTRY_OVERHEAD;
+  }
+
+  HttpDiskCache::Meta HttpCache::toMeta(const Entry &entry) {
+    HttpDiskCache::Meta meta;
+    meta.etag = entry.etag;
+    meta.lastModified = entry.lastModified;
+    meta.responseTime = toEpochSeconds(entry.responseTime);
+    meta.initialAge = entry.initialAge.count();
+    meta.freshnessLifetime = entry.freshnessLifetime.count();
+    meta.mustRevalidate = entry.mustRevalidate;
+    return meta;
+  }
+
+} /* end of namspace: proxypp */
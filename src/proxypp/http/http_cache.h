@@ -0,0 +1,163 @@
+/*******************************************************************************
+**          File: http_cache.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 11:05 AM
+**   Description: in-memory cache for responses to plain HTTP GET requests,
+**                entries are evicted with segmented LRU within a byte budget,
+**                objects too large for memory go to the optional disk tier
+*******************************************************************************/
+#ifndef PROXYPP_HTTP_CACHE_H_
+#define PROXYPP_HTTP_CACHE_H_
+#include "proxypp/http/http_header_parser.h"
+#include "proxypp/http/http_response_parser.h"
+#include "proxypp/http/http_disk_cache.h"
+
+#include <string>
+#include <list>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+
+namespace proxypp {
+  class HttpCache final {
+    public:
+      using Clock = std::chrono::system_clock;
+
+      struct Entry {
+        std::string key;
+        // the raw response, with the Age header removed
+        std::string data;
+        // offset of the empty line that terminates the header, Age is
+        // inserted here when the entry is served
+        std::size_t headerEndPos{0};
+        Clock::time_point responseTime;
+        std::chrono::seconds initialAge{0};
+        std::chrono::seconds freshnessLifetime{0};
+        std::string etag;
+        std::string lastModified;
+        bool mustRevalidate{false};
+        // set if the body lives in the disk tier, data then holds the
+        // header only and the body is read from bodyFd
+        int bodyFd{-1};
+        uint64_t bodyOffset{0};
+        uint64_t bodyLength{0};
+        std::shared_ptr<void> pin;
+      };
+
+      struct Stats {
+        uint64_t requests{0};
+        uint64_t hits{0};
+        uint64_t revalidated{0};
+        uint64_t collapsed{0};
+        uint64_t bytesServed{0};
+        uint64_t bytesHit{0};
+        uint64_t evictions{0};
+
+        double hitRatio() const;
+        double byteHitRatio() const;
+      };
+
+      using FetchCallback = std::function<void()>;
+
+      explicit HttpCache(std::size_t capacity);
+
+      void setDiskCache(std::unique_ptr<HttpDiskCache> &&diskCache);
+
+      // returns empty string if the request must not be served from cache
+      static std::string makeKey(
+        const HttpHeaderParser &req, const std::string &host, uint16_t port);
+      // the client asks for a response validated by the origin server
+      static bool requiresRevalidation(const HttpHeaderParser &req);
+
+      std::shared_ptr<const Entry> lookup(const std::string &key);
+      bool isFresh(const Entry &entry) const;
+      // the complete response with an up-to-date Age header
+      std::string buildResponse(const Entry &entry) const;
+      // the If-None-Match or, without it, the If-Modified-Since header of
+      // the request is satisfied by the entry, see RFC 7232 6
+      static bool isNotModified(
+        const HttpHeaderParser &req, const Entry &entry);
+      // a 304 response with the validators and the caching headers of the
+      // entry, see RFC 7232 4.1
+      std::string buildNotModifiedResponse(const Entry &entry) const;
+
+      // concurrent misses for the same key are collapsed into one fetch,
+      // returns false if a fetch is in flight, in which case callback is
+      // called after that fetch finishes (the entry may still be absent)
+      bool beginFetch(const std::string &key, FetchCallback &&callback);
+      void endFetch(const std::string &key);
+
+      // checks the status and header of the response, true if the
+      // response may be stored once it completes
+      static bool isCacheable(const HttpResponseParser &resp);
+
+      bool store(
+        const std::string &key,
+        std::string &&data,
+        const HttpResponseParser &resp,
+        Clock::time_point requestTime);
+      // merges the 304 response into the entry and makes it fresh again
+      std::shared_ptr<const Entry> refresh(
+        const std::string &key, const HttpResponseParser &notModifiedResp);
+
+      // responses with a Content-Length beyond the memory tier limit are
+      // written to the disk tier as they arrive, returns nullptr if the
+      // response is not meant for the disk tier
+      std::unique_ptr<HttpDiskCache::Reservation> reserveOnDisk(
+        const std::string &key,
+        const HttpResponseParser &resp,
+        Clock::time_point requestTime);
+      bool writeOnDisk(
+        HttpDiskCache::Reservation &reservation, const std::string &data);
+      bool commitOnDisk(HttpDiskCache::Reservation &reservation);
+
+      // bytes delivered to clients for cacheable requests, used to
+      // calculate byte hit ratio
+      void recordServed(std::size_t bytes, bool fromCache);
+
+      std::size_t getMaxObjectSize() const;
+      std::size_t getSize() const;
+      const Stats &getStats() const;
+
+    private:
+      enum class Segment { kProbation, kProtected };
+      struct Node {
+        std::shared_ptr<const Entry> entry;
+        Segment segment;
+        std::list<std::string>::iterator it;
+      };
+
+      std::shared_ptr<Entry> makeEntry(
+        const std::string &key,
+        const HttpResponseParser &resp,
+        Clock::time_point requestTime) const;
+      std::shared_ptr<const Entry> lookupDisk(const std::string &key);
+      void insert(std::shared_ptr<const Entry> &&entry);
+      void erase(const std::string &key);
+      void touch(Node &node);
+      void evict();
+      void logStats() const;
+
+      static std::size_t sizeOf(const Entry &entry);
+      static HttpDiskCache::Meta toMeta(const Entry &entry);
+
+    private:
+      std::size_t capacity_;
+      std::size_t protectedCapacity_;
+      std::size_t size_{0};
+      std::size_t protectedSize_{0};
+
+      // MRU at the front
+      std::list<std::string> probation_;
+      std::list<std::string> protected_;
+      std::unordered_map<std::string, Node> entries_;
+      std::unordered_map<std::string, std::vector<FetchCallback>> fetches_;
+
+      Stats stats_;
+      std::unique_ptr<HttpDiskCache> diskCache_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_HTTP_CACHE_H_ */
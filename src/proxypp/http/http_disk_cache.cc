@@ -0,0 +1,466 @@
+/*******************************************************************************
+**          File: http_disk_cache.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 02:47 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/http/http_disk_cache.h"
+#include "nul/log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+  static const uint32_t SEGMENT_MAGIC = 0x43445050;  // "PPDC"
+  static const uint32_t RECORD_MAGIC = 0x52445050;   // "PPDR"
+  static const uint32_t FORMAT_VERSION = 1;
+
+  static const uint32_t RECORD_PENDING = 1;
+  static const uint32_t RECORD_COMMITTED = 2;
+
+  static const uint32_t FLAG_MUST_REVALIDATE = 1;
+
+  // leaves room for the key and validators of the largest object
+  static const auto RECORD_SLACK = 8 * 1024U;
+
+  struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+    uint64_t segmentSize;
+    uint64_t reserved;
+  };
+
+  // followed by key, etag, last-modified and the raw response, records
+  // are 8-byte aligned, a record belongs to the segment only if the
+  // generations match, so stale records left by an earlier round of the
+  // segment terminate the scan
+  struct RecordHeader {
+    uint32_t magic;
+    uint32_t state;
+    uint64_t generation;
+    uint64_t recordLength;
+    uint64_t dataLength;
+    int64_t responseTime;
+    int64_t initialAge;
+    int64_t freshnessLifetime;
+    uint32_t keyLength;
+    uint32_t headerLength;
+    uint16_t etagLength;
+    uint16_t lastModifiedLength;
+    uint32_t flags;
+    uint64_t checksum;
+  };
+
+  uint64_t align8(uint64_t n) {
+    return (n + 7) & ~static_cast<uint64_t>(7);
+  }
+
+  uint64_t fnv1a(uint64_t hash, const void *data, std::size_t len) {
+    auto p = static_cast<const unsigned char *>(data);
+    for (std::size_t i = 0; i < len; ++i) {
+      hash ^= p[i];
+      hash *= 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  // the state field is excluded, it is flipped when the record is committed
+  uint64_t checksumOf(
+    RecordHeader header, const char *strings, std::size_t len) {
+    header.state = 0;
+    header.checksum = 0;
+    auto hash = fnv1a(0xcbf29ce484222325ULL, &header, sizeof(header));
+    return fnv1a(hash, strings, len);
+  }
+
+  bool writeAll(int fd, const char *buf, std::size_t len, uint64_t offset) {
+    while (len > 0) {
+      auto n = ::pwrite(fd, buf, len, static_cast<off_t>(offset));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG_E("pwrite failed: %s", std::strerror(errno));
+        return false;
+      }
+      buf += n;
+      len -= static_cast<std::size_t>(n);
+      offset += static_cast<uint64_t>(n);
+    }
+    return true;
+  }
+
+  bool preallocate(int fd, uint64_t size) {
+#ifdef __linux__
+    // reserve the blocks up front so writes to the segment don't fail
+    // with ENOSPC halfway through an object
+    auto err = ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+    if (err == 0) {
+      return true;
+    }
+    LOG_W("posix_fallocate failed: %s", std::strerror(err));
+#endif
+    return ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+  }
+}
+
+namespace proxypp {
+  HttpDiskCache::~HttpDiskCache() {
+    for (auto &segment : segments_) {
+      if (segment.addr) {
+        ::munmap(segment.addr, segmentSize_);
+      }
+      if (segment.fd != -1) {
+        ::close(segment.fd);
+      }
+    }
+  }
+
+  bool HttpDiskCache::open(
+    const std::string &dir, std::size_t capacity, std::size_t segmentSize) {
+    if (segmentSize <= sizeof(SegmentHeader) + sizeof(RecordHeader) +
+        RECORD_SLACK) {
+      LOG_E("segment size too small: %zu", segmentSize);
+      return false;
+    }
+    if (::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+      LOG_E("failed to create cache dir %s: %s",
+            dir.c_str(), std::strerror(errno));
+      return false;
+    }
+
+    dir_ = dir;
+    segmentSize_ = segmentSize;
+    auto segmentCount = std::max<std::size_t>(2, capacity / segmentSize);
+    segments_.resize(segmentCount);
+
+    for (uint32_t i = 0; i < segmentCount; ++i) {
+      auto path = dir + "/segment." + std::to_string(i);
+      if (!openSegment(i, path)) {
+        return false;
+      }
+    }
+
+    // rebuild the index from the oldest segment to the newest, so a key
+    // stored more than once resolves to its latest record
+    std::vector<uint32_t> order(segmentCount);
+    for (uint32_t i = 0; i < segmentCount; ++i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+      return segments_[a].generation < segments_[b].generation;
+    });
+    for (auto i : order) {
+      if (segments_[i].generation > 0) {
+        scanSegment(i);
+      }
+    }
+
+    auto newest = order.back();
+    if (segments_[newest].generation == 0) {
+      if (!recycleSegment(0)) {
+        return false;
+      }
+      newest = 0;
+    }
+    currentSegment_ = newest;
+    generation_ = segments_[newest].generation;
+
+    LOG_I("disk cache: %s, %zu segments of %zu bytes, %zu objects",
+          dir.c_str(), segmentCount, segmentSize, index_.size());
+    return true;
+  }
+
+  bool HttpDiskCache::openSegment(uint32_t index, const std::string &path) {
+    auto &segment = segments_[index];
+    segment.fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (segment.fd == -1) {
+      LOG_E("failed to open %s: %s", path.c_str(), std::strerror(errno));
+      return false;
+    }
+
+    struct stat st;
+    if (::fstat(segment.fd, &st) != 0) {
+      LOG_E("fstat failed: %s", std::strerror(errno));
+      return false;
+    }
+    auto valid = static_cast<uint64_t>(st.st_size) == segmentSize_;
+    if (!valid && !preallocate(segment.fd, segmentSize_)) {
+      LOG_E("failed to preallocate %s: %s",
+            path.c_str(), std::strerror(errno));
+      return false;
+    }
+
+    auto addr = ::mmap(nullptr, segmentSize_, PROT_READ, MAP_SHARED,
+                       segment.fd, 0);
+    if (addr == MAP_FAILED) {
+      LOG_E("mmap failed: %s", std::strerror(errno));
+      return false;
+    }
+    segment.addr = static_cast<char *>(addr);
+    segment.writeOffset = sizeof(SegmentHeader);
+
+    if (valid) {
+      SegmentHeader header;
+      std::memcpy(&header, segment.addr, sizeof(header));
+      if (header.magic == SEGMENT_MAGIC &&
+          header.version == FORMAT_VERSION &&
+          header.segmentSize == segmentSize_) {
+        segment.generation = header.generation;
+      }
+    }
+    return true;
+  }
+
+  void HttpDiskCache::scanSegment(uint32_t index) {
+    auto &segment = segments_[index];
+    auto offset = static_cast<uint64_t>(sizeof(SegmentHeader));
+
+    while (offset + sizeof(RecordHeader) <= segmentSize_) {
+      RecordHeader header;
+      std::memcpy(&header, segment.addr + offset, sizeof(header));
+      if (header.magic != RECORD_MAGIC ||
+          header.generation != segment.generation) {
+        break;
+      }
+
+      auto stringsLength = static_cast<uint64_t>(header.keyLength) +
+        header.etagLength + header.lastModifiedLength;
+      if (header.recordLength < sizeof(RecordHeader) ||
+          header.recordLength > segmentSize_ - offset ||
+          sizeof(RecordHeader) + stringsLength + header.dataLength >
+          header.recordLength ||
+          header.headerLength > header.dataLength) {
+        break;
+      }
+
+      auto strings = segment.addr + offset + sizeof(RecordHeader);
+      if (checksumOf(header, strings, stringsLength) != header.checksum) {
+        LOG_W("corrupted record in segment %u at %llu", index,
+              static_cast<unsigned long long>(offset));
+        break;
+      }
+
+      // uncommitted records belong to fetches that never finished, they
+      // are skipped but still occupy space
+      if (header.state == RECORD_COMMITTED) {
+        Location loc;
+        loc.segment = index;
+        loc.recordOffset = offset;
+        loc.dataOffset = offset + sizeof(RecordHeader) + stringsLength;
+        loc.dataLength = header.dataLength;
+        loc.headerLength = header.headerLength;
+        loc.meta.responseTime = header.responseTime;
+        loc.meta.initialAge = header.initialAge;
+        loc.meta.freshnessLifetime = header.freshnessLifetime;
+        loc.meta.mustRevalidate = (header.flags & FLAG_MUST_REVALIDATE) != 0;
+        auto p = strings + header.keyLength;
+        loc.meta.etag.assign(p, header.etagLength);
+        p += header.etagLength;
+        loc.meta.lastModified.assign(p, header.lastModifiedLength);
+        index_[std::string(strings, header.keyLength)] = std::move(loc);
+      }
+      offset += header.recordLength;
+    }
+
+    segment.writeOffset = offset;
+  }
+
+  bool HttpDiskCache::recycleSegment(uint32_t index) {
+    auto &segment = segments_[index];
+    for (auto it = index_.begin(); it != index_.end(); ) {
+      if (it->second.segment == index) {
+        it = index_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    SegmentHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = SEGMENT_MAGIC;
+    header.version = FORMAT_VERSION;
+    header.generation = ++generation_;
+    header.segmentSize = segmentSize_;
+    if (!writeAll(segment.fd, reinterpret_cast<const char *>(&header),
+                  sizeof(header), 0)) {
+      return false;
+    }
+    segment.generation = header.generation;
+    segment.writeOffset = sizeof(SegmentHeader);
+    return true;
+  }
+
+  std::size_t HttpDiskCache::getMaxObjectSize() const {
+    if (segments_.empty()) {
+      return 0;
+    }
+    return segmentSize_ - sizeof(SegmentHeader) - sizeof(RecordHeader) -
+      RECORD_SLACK;
+  }
+
+  std::unique_ptr<HttpDiskCache::Reservation> HttpDiskCache::reserve(
+    const std::string &key, const Meta &meta,
+    uint32_t headerLength, uint64_t dataLength) {
+    if (segments_.empty() || dataLength > getMaxObjectSize() ||
+        key.size() + meta.etag.size() + meta.lastModified.size() >
+        RECORD_SLACK || meta.etag.size() > UINT16_MAX ||
+        meta.lastModified.size() > UINT16_MAX) {
+      return nullptr;
+    }
+
+    auto recordLength = align8(sizeof(RecordHeader) + key.size() +
+      meta.etag.size() + meta.lastModified.size() + dataLength);
+    if (segments_[currentSegment_].writeOffset + recordLength >
+        segmentSize_) {
+      auto next = static_cast<uint32_t>(
+        (currentSegment_ + 1) % segments_.size());
+      if (segments_[next].pinCount > 0) {
+        LOG_V("segment %u is in use, skip caching %s", next,
+              key.substr(0, key.find('\n')).c_str());
+        return nullptr;
+      }
+      if (!recycleSegment(next)) {
+        return nullptr;
+      }
+      currentSegment_ = next;
+    }
+
+    auto &segment = segments_[currentSegment_];
+    auto reservation = std::make_unique<Reservation>();
+    reservation->key = key;
+    auto &loc = reservation->location;
+    loc.segment = currentSegment_;
+    loc.recordOffset = segment.writeOffset;
+    loc.dataOffset = segment.writeOffset + sizeof(RecordHeader) +
+      key.size() + meta.etag.size() + meta.lastModified.size();
+    loc.dataLength = dataLength;
+    loc.headerLength = headerLength;
+    loc.meta = meta;
+
+    // the pending record is written first, so the scan at startup can
+    // step over it even if the object is never completed
+    if (!writeRecordHeader(key, loc, RECORD_PENDING)) {
+      return nullptr;
+    }
+    segment.writeOffset += recordLength;
+    reservation->pin = pin(currentSegment_);
+    return reservation;
+  }
+
+  bool HttpDiskCache::write(
+    Reservation &reservation, const char *buf, std::size_t len) {
+    auto &loc = reservation.location;
+    if (reservation.written + len > loc.dataLength) {
+      return false;
+    }
+    if (!writeAll(segments_[loc.segment].fd, buf, len,
+                  loc.dataOffset + reservation.written)) {
+      return false;
+    }
+    reservation.written += len;
+    return true;
+  }
+
+  bool HttpDiskCache::commit(Reservation &reservation) {
+    auto &loc = reservation.location;
+    if (reservation.written != loc.dataLength) {
+      return false;
+    }
+    auto state = RECORD_COMMITTED;
+    if (!writeAll(segments_[loc.segment].fd,
+                  reinterpret_cast<const char *>(&state), sizeof(state),
+                  loc.recordOffset + offsetof(RecordHeader, state))) {
+      return false;
+    }
+    index_[reservation.key] = loc;
+    return true;
+  }
+
+  const HttpDiskCache::Location *HttpDiskCache::find(
+    const std::string &key) const {
+    auto it = index_.find(key);
+    return it != index_.end() ? &it->second : nullptr;
+  }
+
+  bool HttpDiskCache::updateMeta(const std::string &key, const Meta &meta) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      return false;
+    }
+    auto &loc = it->second;
+    auto persist = meta.etag.size() == loc.meta.etag.size() &&
+      meta.lastModified.size() == loc.meta.lastModified.size();
+    loc.meta = meta;
+    // the record can only be rewritten in place if the validators keep
+    // their lengths, otherwise the update lives in memory only
+    return !persist || writeRecordHeader(key, loc, RECORD_COMMITTED);
+  }
+
+  std::string HttpDiskCache::readHeader(const Location &location) const {
+    return std::string(segments_[location.segment].addr + location.dataOffset,
+                       location.headerLength);
+  }
+
+  int HttpDiskCache::getFd(uint32_t segment) const {
+    return segments_[segment].fd;
+  }
+
+  std::shared_ptr<void> HttpDiskCache::pin(uint32_t segment) {
+    ++segments_[segment].pinCount;
+    std::weak_ptr<bool> alive = alive_;
+    return std::shared_ptr<void>(this, [alive, segment](void *p) {
+      if (!alive.expired()) {
+        --static_cast<HttpDiskCache *>(p)->segments_[segment].pinCount;
+      }
+    });
+  }
+
+  std::size_t HttpDiskCache::getObjectCount() const {
+    return index_.size();
+  }
+
+  bool HttpDiskCache::writeRecordHeader(
+    const std::string &key, const Location &location, uint32_t state) {
+    auto &meta = location.meta;
+    auto stringsLength = key.size() + meta.etag.size() +
+      meta.lastModified.size();
+
+    RecordHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = RECORD_MAGIC;
+    header.state = state;
+    header.generation = segments_[location.segment].generation;
+    header.recordLength = align8(
+      sizeof(RecordHeader) + stringsLength + location.dataLength);
+    header.dataLength = location.dataLength;
+    header.responseTime = meta.responseTime;
+    header.initialAge = meta.initialAge;
+    header.freshnessLifetime = meta.freshnessLifetime;
+    header.keyLength = static_cast<uint32_t>(key.size());
+    header.headerLength = location.headerLength;
+    header.etagLength = static_cast<uint16_t>(meta.etag.size());
+    header.lastModifiedLength = static_cast<uint16_t>(meta.lastModified.size());
+    header.flags = meta.mustRevalidate ? FLAG_MUST_REVALIDATE : 0;
+
+    std::string buf;
+    buf.reserve(sizeof(header) + stringsLength);
+    buf.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    buf.append(key).append(meta.etag).append(meta.lastModified);
+    header.checksum = checksumOf(
+      header, buf.data() + sizeof(header), stringsLength);
+    std::memcpy(&buf[offsetof(RecordHeader, checksum)], &header.checksum,
+                sizeof(header.checksum));
+
+    return writeAll(segments_[location.segment].fd, buf.data(), buf.size(),
+                    location.recordOffset);
+  }
+
+} /* end of namspace: proxypp */
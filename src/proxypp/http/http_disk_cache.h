@@ -0,0 +1,104 @@
+/*******************************************************************************
+**          File: http_disk_cache.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 02:20 PM
+**   Description: disk tier of the HTTP cache for large objects, objects are
+**                appended to preallocated segment files which are recycled
+**                in FIFO order, the in-memory index is rebuilt by scanning
+**                the segment files at startup
+*******************************************************************************/
+#ifndef PROXYPP_HTTP_DISK_CACHE_H_
+#define PROXYPP_HTTP_DISK_CACHE_H_
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+namespace proxypp {
+  class HttpDiskCache final {
+    public:
+      struct Meta {
+        std::string etag;
+        std::string lastModified;
+        // seconds since epoch
+        int64_t responseTime{0};
+        int64_t initialAge{0};
+        int64_t freshnessLifetime{0};
+        bool mustRevalidate{false};
+      };
+
+      struct Location {
+        uint32_t segment{0};
+        uint64_t recordOffset{0};
+        // offset of the raw response in the segment file
+        uint64_t dataOffset{0};
+        uint64_t dataLength{0};
+        uint32_t headerLength{0};
+        Meta meta;
+      };
+
+      struct Reservation {
+        std::string key;
+        Location location;
+        uint64_t written{0};
+        // keeps the segment from being recycled before commit
+        std::shared_ptr<void> pin;
+      };
+
+      HttpDiskCache() = default;
+      HttpDiskCache(const HttpDiskCache &) = delete;
+      HttpDiskCache &operator=(const HttpDiskCache &) = delete;
+      ~HttpDiskCache();
+
+      bool open(
+        const std::string &dir, std::size_t capacity, std::size_t segmentSize);
+      std::size_t getMaxObjectSize() const;
+
+      // reserves space for a response of known size in the current segment,
+      // the record is invisible until commit() is called
+      std::unique_ptr<Reservation> reserve(
+        const std::string &key, const Meta &meta,
+        uint32_t headerLength, uint64_t dataLength);
+      bool write(Reservation &reservation, const char *buf, std::size_t len);
+      bool commit(Reservation &reservation);
+
+      const Location *find(const std::string &key) const;
+      bool updateMeta(const std::string &key, const Meta &meta);
+      // the response header, read from the mapped segment
+      std::string readHeader(const Location &location) const;
+      int getFd(uint32_t segment) const;
+      // segments are not recycled while pinned, the segment is unpinned
+      // when the returned object is released
+      std::shared_ptr<void> pin(uint32_t segment);
+
+      std::size_t getObjectCount() const;
+
+    private:
+      struct Segment {
+        int fd{-1};
+        char *addr{nullptr};
+        uint64_t generation{0};
+        uint64_t writeOffset{0};
+        int pinCount{0};
+      };
+
+      bool openSegment(uint32_t index, const std::string &path);
+      void scanSegment(uint32_t index);
+      bool recycleSegment(uint32_t index);
+      bool writeRecordHeader(
+        const std::string &key, const Location &location, uint32_t state);
+
+    private:
+      std::string dir_;
+      uint64_t segmentSize_{0};
+      std::vector<Segment> segments_;
+      uint32_t currentSegment_{0};
+      uint64_t generation_{0};
+      std::unordered_map<std::string, Location> index_;
+      // only its lifetime matters, a pin released after the cache is gone
+      // finds it expired
+      std::shared_ptr<bool> alive_{std::make_shared<bool>(true)};
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_HTTP_DISK_CACHE_H_ */
@@ -118,19 +118,31 @@ namespace proxypp {
     return "CONNECT" == method_;
   }
 
+  const std::string &HttpHeaderParser::getMethod() const {
+    return method_;
+  }
+
+  const std::string &HttpHeaderParser::getUrl() const {
+    return url_;
+  }
+
+  const std::string &HttpHeaderParser::getHttpVersion() const {
+    return httpVersion_;
+  }
+
+  std::string HttpHeaderParser::getHeader(const std::string &name) const {
+    auto it = headers_.find(name);
+    return it != headers_.end() ? it->second : std::string{};
+  }
+
+  bool HttpHeaderParser::hasHeader(const std::string &name) const {
+    return headers_.find(name) != headers_.end();
+  }
+
   std::string::size_type HttpHeaderParser::findHeaderEndPos(
     const std::string &data) {
-    auto size = data.size();
-    if (size < 4) {
-      return std::string::npos;
-    }
-
-    if ((data[size - 4] == '\r') &&
-        (data[size - 3] == '\n') &&
-        (data[size - 2] == '\r') &&
-        (data[size - 1] == '\n')) {
-      return size - 4;
-    }
+    // not the end of data even if it ends with a blank line, pipelined
+    // requests read together all end that way
     return data.find("\r\n\r\n");
   }
 
@@ -15,7 +15,15 @@ namespace proxypp {
       bool parse(const std::string &data, std::string::size_type headerEndPos);
       bool getAddrAndPort(std::string &addr, uint16_t &port) const;
       bool isConnectMethod() const;
+      const std::string &getMethod() const;
+      const std::string &getUrl() const;
+      const std::string &getHttpVersion() const;
+      // name must be in lower case, returns empty string if not found
+      std::string getHeader(const std::string &name) const;
+      bool hasHeader(const std::string &name) const;
 
+      // the end of the first header block in data, the requests pipelined
+      // after it may follow
       static std::string::size_type findHeaderEndPos(const std::string &data);
       static bool startsWithValidHttpMethod(const std::string &data);
     
@@ -8,24 +8,34 @@
 #include "proxypp/http/http_proxy_session.h"
 #include "proxypp/proxy_server.hpp"
 #include "proxypp/auto_proxy_manager.h"
+#include "proxypp/rule_file_watcher.h"
+#include "proxypp/http/http_cache.h"
 #include "proxypp/upstream_type.h"
-#include "nul/uri.hpp"
+#include "proxypp/upstream_connector.h"
+#include "nul/util.hpp"
 #include <cassert>
+#include <algorithm>
 #include <signal.h>
 
 namespace {
+  static const std::size_t DEFAULT_HTTP_CACHE_SIZE = 16 * 1024 * 1024U;
+  static const std::size_t MIN_DISK_CACHE_SEGMENT_SIZE = 16 * 1024 * 1024U;
+
   struct HttpProxyServerContext {
     proxypp::ProxyServer server;
-    proxypp::UpstreamType upstreamType{proxypp::UpstreamType::kUnknown};
-    std::string upstreamServerHost;
-    uint16_t upstreamServerPort;
+    proxypp::UpstreamServer upstream;
+    // the named upstreams, see proxypp::RouteAction
+    std::shared_ptr<const proxypp::UpstreamServers> upstreamServers{nullptr};
     bool proxyRuleMode;
+    bool optimisticConnect{false};
+    bool routeByResolvedAddress{false};
+    std::size_t maxPipelineDepth{8};
+    uint32_t maxConcurrentStreams{100};
     std::shared_ptr<proxypp::AutoProxyManager> autoProxyManager{nullptr};
+    std::shared_ptr<proxypp::HttpCache> httpCache{nullptr};
 
     std::shared_ptr<uvcpp::Loop> loop;
-    std::shared_ptr<uvcpp::FsEvent> proxyRuleFileChangeNotifier;
-
-    std::chrono::system_clock::time_point lastUpdateProxyRuleTs;
+    std::unique_ptr<proxypp::RuleFileWatcher> ruleFileWatcher;
   };
 }
 
@@ -51,8 +61,14 @@ namespace proxypp {
         auto sess =
           std::make_shared<HttpProxySession>(std::move(conn), bufferPool);
         sess->setUpstreamServer(
-          ctx->upstreamType, ctx->upstreamServerHost, ctx->upstreamServerPort);
+          ctx->upstream.type, ctx->upstream.host, ctx->upstream.port);
+        sess->setUpstreamServers(ctx->upstreamServers);
         sess->setAutoProxyManager(ctx->autoProxyManager);
+        sess->setOptimisticConnect(ctx->optimisticConnect);
+        sess->setRouteByResolvedAddress(ctx->routeByResolvedAddress);
+        sess->setHttpCache(ctx->httpCache);
+        sess->setMaxPipelineDepth(ctx->maxPipelineDepth);
+        sess->setMaxConcurrentStreams(ctx->maxConcurrentStreams);
         return sess;
       });
 
@@ -71,14 +87,8 @@ namespace proxypp {
     auto ctx = static_cast<HttpProxyServerContext *>(ctx_);
     ctx->server.shutdown();
 
-    if (ctx->proxyRuleFileChangeNotifier) {
-      auto work = uvcpp::Work::create(ctx->loop);
-      work->once<uvcpp::EvAfterWork>(
-        [ctx, _ = work](const auto &e, auto &work) {
-          ctx->proxyRuleFileChangeNotifier->stop();
-          ctx->proxyRuleFileChangeNotifier->close();
-        });
-      work->start();
+    if (ctx->ruleFileWatcher) {
+      ctx->ruleFileWatcher->stop();
     }
   }
 
@@ -102,79 +112,101 @@ namespace proxypp {
     }
 
     auto ctx = static_cast<HttpProxyServerContext *>(ctx_);
-    nul::URI uri;
-    if (!uri.parse(uriStr)) {
-      LOG_W("Invalid upstream server ignored: %s", uriStr.c_str());
+    if (!UpstreamConnector::parseUpstreamServer(uriStr, ctx->upstream)) {
       return;
     }
-    auto scheme = uri.getScheme();
-    if (scheme == "socks5") {
-      ctx->upstreamType = UpstreamType::kSOCKS5;
+    LOG_I("set upstream server: %s:%d",
+          ctx->upstream.host.c_str(), ctx->upstream.port);
+  }
 
-    } else if (scheme == "http" || scheme == "https") {
-      ctx->upstreamType = UpstreamType::kHTTP;
+  void HttpProxyServer::setUpstreamServers(const std::string &servers) {
+    if (ctx_) {
+      static_cast<HttpProxyServerContext *>(ctx_)->upstreamServers =
+        UpstreamConnector::parseUpstreamServers(servers);
+    }
+  }
 
-    } else {
-      LOG_W("Only 'socks5' or 'http' proxy server is support for upstream");
-      return;
+  void HttpProxyServer::setOptimisticConnect(bool optimisticConnect) {
+    if (ctx_) {
+      static_cast<HttpProxyServerContext *>(ctx_)->optimisticConnect =
+        optimisticConnect;
     }
+  }
 
-    ctx->upstreamServerHost = uri.getHost();
-    ctx->upstreamServerPort = uri.getPort();
+  void HttpProxyServer::setRouteByResolvedAddress(bool routeByResolvedAddress) {
+    if (ctx_) {
+      static_cast<HttpProxyServerContext *>(ctx_)->routeByResolvedAddress =
+        routeByResolvedAddress;
+    }
+  }
 
-    if (ctx->upstreamServerHost.empty()) {
-      LOG_W("Invalid upstream server ignored: %s", uriStr.c_str());
-      ctx->upstreamType = UpstreamType::kUnknown;
+  void HttpProxyServer::setHttpCacheSize(std::size_t bytes) {
+    if (!ctx_) {
       return;
     }
+    auto ctx = static_cast<HttpProxyServerContext *>(ctx_);
+    ctx->httpCache = bytes > 0 ? std::make_shared<HttpCache>(bytes) : nullptr;
+    if (bytes > 0) {
+      LOG_I("http cache enabled, capacity: %zu bytes", bytes);
+    }
+  }
 
-    if (ctx->upstreamServerPort == 0) {
-      LOG_W("Invalid upstream server port: %d", ctx->upstreamServerPort);
-      ctx->upstreamType = UpstreamType::kUnknown;
-      return;
+  bool HttpProxyServer::setHttpDiskCache(
+    const std::string &dir, std::size_t bytes) {
+    if (!ctx_) {
+      return false;
+    }
+    auto ctx = static_cast<HttpProxyServerContext *>(ctx_);
+    // a segment bounds the size of the largest object on disk
+    auto segmentSize = std::max(bytes / 16, MIN_DISK_CACHE_SEGMENT_SIZE);
+    auto diskCache = std::make_unique<HttpDiskCache>();
+    if (!diskCache->open(dir, bytes, segmentSize)) {
+      LOG_E("failed to open disk cache: %s", dir.c_str());
+      return false;
+    }
+    if (!ctx->httpCache) {
+      setHttpCacheSize(DEFAULT_HTTP_CACHE_SIZE);
     }
+    ctx->httpCache->setDiskCache(std::move(diskCache));
+    return true;
+  }
 
-    LOG_I("set upstream server: %s:%d",
-          ctx->upstreamServerHost.c_str(), ctx->upstreamServerPort);
+  void HttpProxyServer::setMaxPipelineDepth(std::size_t maxPipelineDepth) {
+    if (ctx_) {
+      static_cast<HttpProxyServerContext *>(ctx_)->maxPipelineDepth =
+        maxPipelineDepth;
+    }
+  }
+
+  void HttpProxyServer::setMaxConcurrentStreams(
+    uint32_t maxConcurrentStreams) {
+    if (ctx_) {
+      static_cast<HttpProxyServerContext *>(ctx_)->maxConcurrentStreams =
+        maxConcurrentStreams;
+    }
   }
 
   std::size_t HttpProxyServer::setAutoProxyRulesFile(
     const std::string &proxyRulesFile) {
+    if (proxyRulesFile.empty()) {
+      return 0;
+    }
+    return setAutoProxyRulesFiles({proxyRulesFile});
+  }
+
+  std::size_t HttpProxyServer::setAutoProxyRulesFiles(
+    const std::vector<std::string> &proxyRulesFiles) {
     assert(ctx_);
-    auto size = addAutoProxyRulesFile(proxyRulesFile);
 
     auto ctx = static_cast<HttpProxyServerContext *>(ctx_);
-    if (size > 0 && !ctx->proxyRuleFileChangeNotifier) {
-      LOG_I("will watch proxy rule file: %s", proxyRulesFile.c_str());
-
-      ctx->proxyRuleFileChangeNotifier = uvcpp::FsEvent::create(ctx->loop);
-      ctx->proxyRuleFileChangeNotifier->on<uvcpp::EvFsEvent>(
-        [this, ctx, proxyRulesFile](const auto &e, auto &fsEvent){
-          if (e.events == uvcpp::EvFsEvent::Event::kChange &&
-              e.path == proxyRulesFile) {
-
-            auto now = std::chrono::system_clock::now();
-            auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
-              now - ctx->lastUpdateProxyRuleTs).count();
-            if (elapsed < 2) {
-              return;
-            }
-
-            LOG_I("proxy rule file changed, will reload proxy rules from: %s",
-                  proxyRulesFile.c_str());
-
-            clearProxyRules();
-            auto updatedSize = addAutoProxyRulesFile(proxyRulesFile);
-            ctx->lastUpdateProxyRuleTs = std::chrono::system_clock::now();
-
-            LOG_I("rules updated: %zu", updatedSize);
-          }
-      });
-      ctx->proxyRuleFileChangeNotifier->start(
-        proxyRulesFile, uvcpp::FsEvent::Flag::kWatchEntry);
+    if (!ctx->autoProxyManager) {
+      ctx->autoProxyManager = std::make_shared<proxypp::AutoProxyManager>();
     }
-
-    return size;
+    if (!ctx->ruleFileWatcher) {
+      ctx->ruleFileWatcher = std::make_unique<RuleFileWatcher>(
+        ctx->loop, ctx->autoProxyManager);
+    }
+    return ctx->ruleFileWatcher->addFiles(proxyRulesFiles);
   }
 
   std::size_t HttpProxyServer::addAutoProxyRulesFile(
@@ -182,14 +214,28 @@ namespace proxypp {
     if (proxyRulesFile.empty()) {
       return 0;
     }
+    return addAutoProxyRulesFiles({proxyRulesFile});
+  }
+
+  std::size_t HttpProxyServer::addAutoProxyRulesFiles(
+    const std::vector<std::string> &proxyRulesFiles) {
+    assert(ctx_);
+
+    auto ctx = static_cast<HttpProxyServerContext *>(ctx_);
+    if (!ctx->autoProxyManager) {
+      ctx->autoProxyManager = std::make_shared<proxypp::AutoProxyManager>();
+    }
+    return ctx->autoProxyManager->parseFilesAsRules(proxyRulesFiles);
+  }
 
+  bool HttpProxyServer::setGeoIpDatabase(const std::string &file) {
     assert(ctx_);
 
     auto ctx = static_cast<HttpProxyServerContext *>(ctx_);
     if (!ctx->autoProxyManager) {
       ctx->autoProxyManager = std::make_shared<proxypp::AutoProxyManager>();
     }
-    return ctx->autoProxyManager->parseFileAsRules(proxyRulesFile);
+    return ctx->autoProxyManager->setGeoIpDatabase(file);
   }
 
   bool HttpProxyServer::addProxyRule(const std::string &rule) {
@@ -231,7 +277,31 @@ int main(int argc, char *argv[]) {
   p.add<std::string>(
     "upstream_server", 'u', "e.g. socks5://127.0.0.1:1080", false);
   p.add<std::string>(
-    "proxy_rules_file", 'r', "auto proxy rule file", false);
+    "upstream_servers", 'U',
+    "upstreams the rules name, e.g. us=socks5://127.0.0.1:1081,"
+    "eu=http://127.0.0.1:8081", false);
+  p.add<std::string>(
+    "proxy_rules_file", 'r',
+    "auto proxy rule files separated by commas, reloaded when changed",
+    false);
+  p.add("optimistic_connect", 'o',
+        "reply to CONNECT requests before the upstream is connected");
+  p.add("route_by_resolved_ip", 'a',
+        "match the address rules against the resolved IPs of tunnels");
+  p.add<std::string>(
+    "geoip_db", 'g', "GeoIP database for the geoip: rules", false);
+  p.add<std::size_t>(
+    "http_cache_size", 'c', "in-memory HTTP cache size in MB", false, 0);
+  p.add<std::string>(
+    "disk_cache_dir", 'd', "directory of the on-disk HTTP cache", false);
+  p.add<std::size_t>(
+    "disk_cache_size", 's', "on-disk HTTP cache size in MB", false, 1024);
+  p.add<std::size_t>(
+    "max_pipeline_depth", 'm', "max pipelined requests per connection",
+    false, 8, cmdline::range(1, 1024));
+  p.add<uint32_t>(
+    "max_concurrent_streams", 'n', "max concurrent streams per h2c connection",
+    false, 100, cmdline::range(1, 10000));
 
   p.parse_check(argc, argv);
 
@@ -241,10 +311,38 @@ int main(int argc, char *argv[]) {
     LOG_I("start server");
     d.setUpstreamServer(upstreamServer);
   }
+  // the names get their ids before the rules use them
+  auto upstreamServers = p.get<std::string>("upstream_servers");
+  if (!upstreamServers.empty()) {
+    d.setUpstreamServers(upstreamServers);
+  }
+
+  auto geoIpDb = p.get<std::string>("geoip_db");
+  if (!geoIpDb.empty()) {
+    d.setGeoIpDatabase(geoIpDb);
+  }
+
+  auto proxyRulesFiles = p.get<std::string>("proxy_rules_file");
+  if (!proxyRulesFiles.empty()) {
+    std::vector<std::string> files;
+    nul::StringUtil::split(
+      proxyRulesFiles, ",", [&files](auto index, const auto &part) {
+      files.push_back(part);
+      return true;
+    });
+    d.setAutoProxyRulesFiles(files);
+  }
+
+  d.setOptimisticConnect(p.exist("optimistic_connect"));
+  d.setRouteByResolvedAddress(p.exist("route_by_resolved_ip"));
+  d.setMaxPipelineDepth(p.get<std::size_t>("max_pipeline_depth"));
+  d.setMaxConcurrentStreams(p.get<uint32_t>("max_concurrent_streams"));
+  d.setHttpCacheSize(p.get<std::size_t>("http_cache_size") * 1024 * 1024);
 
-  auto proxyRulesFile = p.get<std::string>("proxy_rules_file");
-  if (!proxyRulesFile.empty()) {
-    d.setAutoProxyRulesFile(proxyRulesFile);
+  auto diskCacheDir = p.get<std::string>("disk_cache_dir");
+  if (!diskCacheDir.empty()) {
+    d.setHttpDiskCache(
+      diskCacheDir, p.get<std::size_t>("disk_cache_size") * 1024 * 1024);
   }
 
   signal(SIGPIPE, [](int){ /* ignore sigpipe */ });
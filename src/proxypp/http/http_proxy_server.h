@@ -8,6 +8,7 @@
 #define PROXYPP_HTTP_PROXY_SERVER_H_ 
 #include <string>
 #include <functional>
+#include <vector>
 
 namespace proxypp {
   class HttpProxyServer final {
@@ -31,9 +32,46 @@ namespace proxypp {
       // socks5://127.0.0.1:1080
       // http://127.0.0.1:8080
       void setUpstreamServer(const std::string &uriStr);
+      // the upstreams the rules name with "$action=NAME", as
+      // "NAME=URI,NAME2=URI2", the ones listed first win when rules of
+      // more than one of them match, see RouteAction. Call it before the
+      // rules are loaded
+      void setUpstreamServers(const std::string &servers);
 
+      // reply 200 to CONNECT requests right away and buffer the client's
+      // first flight until the upstream is connected, the client connection
+      // is reset if the upstream fails
+      void setOptimisticConnect(bool optimisticConnect);
+
+      // besides IP literals, match rules like "10.0.0.0/8" and "geoip:CN"
+      // against the addresses that the hosts of CONNECT requests resolve to
+      void setRouteByResolvedAddress(bool routeByResolvedAddress);
+
+      // cache responses to plain HTTP GET requests in memory, 0 disables it
+      void setHttpCacheSize(std::size_t bytes);
+      // keep objects too large for the in-memory cache in segment files
+      // under dir, the in-memory cache is enabled if it isn't yet
+      bool setHttpDiskCache(const std::string &dir, std::size_t bytes);
+
+      // max number of pipelined requests read from a client connection
+      // before their responses are sent back, 1 disables pipelining
+      void setMaxPipelineDepth(std::size_t maxPipelineDepth);
+
+      // max number of streams open at the same time on an h2c connection
+      void setMaxConcurrentStreams(uint32_t maxConcurrentStreams);
+
+      // a database compiled by "rulec -g", for the "geoip:" rules
+      bool setGeoIpDatabase(const std::string &file);
+
+      // the files are watched and reloaded when any of them changes, the
+      // rules added by the calls below are dropped when they are reloaded
       std::size_t setAutoProxyRulesFile(const std::string &proxyRulesFile);
+      std::size_t setAutoProxyRulesFiles(
+        const std::vector<std::string> &proxyRulesFiles);
       std::size_t addAutoProxyRulesFile(const std::string &proxyRulesFile);
+      // the text files are loaded at once, faster than one by one
+      std::size_t addAutoProxyRulesFiles(
+        const std::vector<std::string> &proxyRulesFiles);
       bool addProxyRule(const std::string &rule);
       bool removeProxyRule(const std::string &rule);
       void clearProxyRules();
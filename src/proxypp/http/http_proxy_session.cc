@@ -10,13 +10,21 @@
 #include "proxypp/http/http_header_parser.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 namespace {
   static const auto REPLY_BAD_REQUEST =
     std::string{"HTTP/1.1 400 Bad Request\r\nServer: hpd\r\n\r\n"};
   static const auto REPLY_BAD_GATEWAY =
     std::string{"HTTP/1.1 502 Bad Gateway\r\nServer: hpd\r\n\r\n"};
+  static const auto REPLY_FORBIDDEN =
+    std::string{"HTTP/1.1 403 Forbidden\r\nServer: hpd\r\n\r\n"};
   static const auto REPLY_PAYLOAD_TOO_LARGE =
     std::string{"HTTP/1.1 413 Payload Too Large\r\nServer: hpd\r\n\r\n"};
   static const auto REPLY_OK_FOR_CONNECT_REQUEST =
@@ -24,6 +32,11 @@ namespace {
   static const auto HTTP_HEADER_PROXY_CONNECTION =
     std::string{"Proxy-Connection"};
   static const auto MAX_PENDING_REQUEST_BYTES = 1024 * 1024U;
+  // client data buffered for an optimistically replied CONNECT request,
+  // reading from the client is paused once this is exceeded
+  static const auto MAX_OPTIMISTIC_CONNECT_BYTES = 64 * 1024U;
+  static const std::size_t MAX_WRITE_CHUNK_BYTES = 8192U;
+  static const std::size_t MAX_SENDFILE_BYTES = 1024 * 1024U;
 }
 
 namespace proxypp {
@@ -40,6 +53,8 @@ namespace proxypp {
       [this, _ = shared_from_this()](const auto &e, auto &client){
 
       ipIt_ = ipAddrs_.end();
+      // nothing to do when the upstream closes from now on
+      ++upstreamGeneration_;
       if (upstreamConn_) {
         upstreamConn_->close();
       } else if (socksClient_) {
@@ -49,14 +64,32 @@ namespace proxypp {
       if (dnsRequest_) {
         dnsRequest_->cancel();
       }
+
+      if (cacheFetcher_) {
+        this->finishRecording(false);
+      }
+      cachedBody_ = nullptr;
+
+      if (http2Session_) {
+        http2Session_->close();
+      }
     });
     downstreamConn_->on<uvcpp::EvBufferRecycled>([this](const auto &e, auto &conn) {
       bufferPool_->returnBuffer(std::forward<std::unique_ptr<nul::Buffer>>(
           const_cast<uvcpp::EvBufferRecycled &>(e).buffer));
+      if (cachedBody_) {
+        this->sendCachedBody();
+      } else if (http2Session_) {
+        http2Session_->onDownstreamDrained();
+      }
     });
     downstreamConn_->on<uvcpp::EvRead>(
       [this](const auto &e, auto &conn) {
-      if (upstreamConnected_) {
+      if (http2Session_) {
+        http2Session_->onDownstreamData(e.buf, e.nread);
+        return;
+      }
+      if (tunnel_ && upstreamConnected_) {
         if (upstreamConn_) {
           upstreamConn_->writeAsync(
             bufferPool_->assembleDataBuffer(e.buf, e.nread));
@@ -73,31 +106,88 @@ namespace proxypp {
       }
 
       requestData_.append(e.buf, e.nread);
+      this->processRequestData();
+    });
+
+    downstreamConn_->readStart();
+  }
+
+  void HttpProxySession::processRequestData() {
+    if (tunnel_) {
+      // waiting for the upstream of the tunnel
+      if (connectReplied_) {
+        if (requestData_.size() >= MAX_OPTIMISTIC_CONNECT_BYTES) {
+          LOG_D("buffered %zu bytes before upstream is ready, pause reading",
+                requestData_.size());
+          pauseDownstreamRead();
+        }
+
+      } else if (requestData_.size() > MAX_PENDING_REQUEST_BYTES) {
+        this->replyDownstream(REPLY_PAYLOAD_TOO_LARGE);
+        downstreamConn_->close();
+        LOG_E("pending request data too large, will close the connection");
+      } else {
+        LOG_W("accumulated %zu bytes of request data", requestData_.size());
+      }
+      return;
+    }
+
+    while (!requestData_.empty()) {
+      if (requestBodyRemaining_ > 0) {
+        auto n = static_cast<std::size_t>(std::min<uint64_t>(
+            requestBodyRemaining_, requestData_.size()));
+        auto &req = pendingRequests_.back();
+        req.data.append(requestData_, 0, n);
+        requestData_.erase(0, n);
+        requestBodyRemaining_ -= n;
+        req.complete = requestBodyRemaining_ == 0;
+        continue;
+      }
+
       if (hasReadHeader_) {
         if (requestData_.size() > MAX_PENDING_REQUEST_BYTES) {
           this->replyDownstream(REPLY_PAYLOAD_TOO_LARGE);
-          conn.close();
+          downstreamConn_->close();
           LOG_E("pending request data too large, will close the connection");
-        } else {
-          LOG_W("accumulated %zu bytes of request data", requestData_.size());
         }
-        return;
+        break;
+      }
+
+      // h2c with prior knowledge, which can only start a connection
+      if (currentRoute_.empty() && isPipelineIdle()) {
+        auto &preface = Http2::CONNECTION_PREFACE;
+        auto n = std::min(requestData_.size(), preface.size());
+        if (requestData_.compare(0, n, preface, 0, n) == 0) {
+          if (n == preface.size()) {
+            this->startHttp2();
+            return;
+          }
+          LOG_D("expecting more data for the HTTP/2 preface");
+          break;
+        }
+      }
+
+      if (pendingRequests_.size() + inflightRequests_.size() >=
+          maxPipelineDepth_) {
+        LOG_D("pipeline depth reached: %zu, pause reading", maxPipelineDepth_);
+        pauseDownstreamRead();
+        break;
       }
 
       auto pos = HttpHeaderParser::findHeaderEndPos(requestData_);
       if (pos == std::string::npos) {
-        if (!HttpHeaderParser::startsWithValidHttpMethod(requestData_)) {
+        if (!HttpHeaderParser::startsWithValidHttpMethod(requestData_) ||
+            requestData_.size() > MAX_PENDING_REQUEST_BYTES) {
           LOG_E("request does not starts with valid http method");
           this->replyDownstream(REPLY_BAD_REQUEST);
-          conn.close();
+          downstreamConn_->close();
           return;
         }
 
         LOG_D("expecting more data for the header: %zu", requestData_.size());
-        return;
+        break;
       }
 
-      hasReadHeader_ = true;
       HttpHeaderParser parser;
       std::string addr;
       uint16_t port;
@@ -105,44 +195,525 @@ namespace proxypp {
       if (!parser.parse(requestData_, pos) ||
           !parser.getAddrAndPort(addr, port)) {
         this->replyDownstream(REPLY_BAD_REQUEST);
-        conn.close();
+        downstreamConn_->close();
+        return;
+      }
+
+      // the connection can't be parsed any further after these requests,
+      // they end the pipeline and are handled once the requests before
+      // them are answered
+      if (parser.isConnectMethod() || parser.hasHeader("upgrade") ||
+          parser.hasHeader("transfer-encoding")) {
+        if (!isPipelineIdle()) {
+          break;
+        }
+        tunnel_ = true;
+        resetUpstream();
+        this->routeRequest(parser.isConnectMethod(), addr, port, pos);
         return;
       }
 
-      // not sure if we need the request data at this point,
-      // so save as a temp variable here
-      auto tempRequestData = std::move(requestData_);
-      if (!parser.isConnectMethod()) {
-        std::swap(requestData_, tempRequestData);
+      // a cached response can only be served if it won't overtake the
+      // responses to earlier requests
+      if (httpCache_ && isPipelineIdle()) {
+        cacheKey_ = HttpCache::makeKey(parser, addr, port);
+        if (!cacheKey_.empty()) {
+          hasReadHeader_ = true;
+          if (this->lookupCache(parser, addr, port, pos)) {
+            return;
+          }
+          hasReadHeader_ = false;
+          // conditional headers may have been added to the request
+          pos = HttpHeaderParser::findHeaderEndPos(requestData_);
+        }
       }
 
-      if (upstreamType_ != UpstreamType::kUnknown &&
-          (!proxyRuleManager_ || proxyRuleManager_->matches(addr, port))) {
+      this->enqueueRequest(parser, addr, port, pos);
+    }
 
-        if (upstreamType_ == UpstreamType::kSOCKS5) {
-          this->initiateSocksConnection(addr, port);
+    this->forwardRequests();
+  }
 
-        } else if (upstreamType_ == UpstreamType::kHTTP) {
-          // redirect all the request data to the remote HTTP proxy server
-          // regardless of whether it is a CONNECT request
-          if (!tempRequestData.empty()) {
-            std::swap(requestData_, tempRequestData);
-          }
-          this->connectUpstreamWithAddr(
-            upstreamServerHost_, upstreamServerPort_);
+  void HttpProxySession::startHttp2() {
+    LOG_D("h2c connection from: %s:%d",
+          downstreamConn_->getIP().c_str(), downstreamConn_->getPort());
+    http2Session_ = std::make_unique<Http2Session>(downstreamConn_, bufferPool_);
+    http2Session_->setUpstreamServer(
+      defaultUpstream_.type, defaultUpstream_.host, defaultUpstream_.port);
+    http2Session_->setUpstreamServers(upstreamServers_);
+    http2Session_->setAutoProxyManager(proxyRuleManager_);
+    http2Session_->setMaxConcurrentStreams(maxConcurrentStreams_);
+    http2Session_->start();
 
-        } else {
-          // DIRECT connect if no proxy server is available
-          // Should not reach here!
-          this->connectUpstreamWithAddr(addr, port);
+    auto data = requestData_.substr(Http2::CONNECTION_PREFACE.size());
+    requestData_.clear();
+    if (!data.empty()) {
+      http2Session_->onDownstreamData(data.c_str(), data.size());
+    }
+  }
+
+  void HttpProxySession::enqueueRequest(
+    const HttpHeaderParser &parser, const std::string &addr, uint16_t port,
+    std::string::size_type headerEndPos) {
+    PipelinedRequest req;
+    req.addr = addr;
+    req.port = port;
+    req.isHead = parser.getMethod() == "HEAD";
+    // the routing decision is made for every request, requests that end
+    // up on the same route share the upstream connection
+    req.action = getAction(addr, port);
+    auto upstream = findUpstreamServer(
+      defaultUpstream_, upstreamServers_.get(), req.action);
+    if (req.action == RouteAction::kReject) {
+      req.route = "reject";
+    } else if (upstream && upstream->type == UpstreamType::kHTTP) {
+      req.route = "upstream#" + std::to_string(req.action);
+    } else {
+      req.route = (upstream ?
+                   "upstream#" + std::to_string(req.action) + ":" :
+                   std::string{"direct:"}) +
+        addr + ":" + std::to_string(port);
+    }
+
+    req.data = requestData_.substr(0, headerEndPos + 4);
+    requestData_.erase(0, headerEndPos + 4);
+    auto pos = req.data.find(HTTP_HEADER_PROXY_CONNECTION);
+    if (pos != std::string::npos) {
+      req.data.replace(
+        pos, HTTP_HEADER_PROXY_CONNECTION.length(), "Connection");
+    }
+
+    requestBodyRemaining_ = std::strtoull(
+      parser.getHeader("content-length").c_str(), nullptr, 10);
+    req.complete = requestBodyRemaining_ == 0;
+    pendingRequests_.push_back(std::move(req));
+  }
+
+  void HttpProxySession::forwardRequests() {
+    while (!pendingRequests_.empty()) {
+      auto &req = pendingRequests_.front();
+      if (req.route != currentRoute_) {
+        // responses must go back in request order, so the upstream is
+        // switched only after it has answered everything sent to it
+        if (!inflightRequests_.empty()) {
+          return;
+        }
+        if (!currentRoute_.empty()) {
+          LOG_D("switch route: %s -> %s",
+                currentRoute_.c_str(), req.route.c_str());
+          resetUpstream();
+        }
+        if (req.action == RouteAction::kReject) {
+          this->rejectRequest(req.addr);
+          return;
+        }
+        currentRoute_ = req.route;
+        this->connectRoute(req.addr, req.port, req.action);
+        return;
+      }
+
+      // the rest is done in onUpstreamConnected()
+      if (!upstreamConnected_) {
+        return;
+      }
+
+      if (!req.data.empty()) {
+        writeUpstream(req.data);
+        req.data.clear();
+        req.started = true;
+      }
+      if (!req.complete) {
+        return;
+      }
+
+      if (cacheFetcher_ && inflightRequests_.empty()) {
+        requestTime_ = HttpCache::Clock::now();
+      }
+      inflightRequests_.push_back(req.isHead);
+      if (inflightRequests_.size() == 1) {
+        responseParser_.reset(req.isHead);
+      }
+      pendingRequests_.pop_front();
+    }
+  }
+
+  bool HttpProxySession::isPipelineIdle() const {
+    return pendingRequests_.empty() && inflightRequests_.empty() &&
+      !cachedBody_;
+  }
+
+  void HttpProxySession::pauseDownstreamRead() {
+    if (!downstreamReadPaused_) {
+      downstreamReadPaused_ = true;
+      downstreamConn_->readStop();
+    }
+  }
+
+  void HttpProxySession::resumeDownstreamRead() {
+    if (downstreamReadPaused_) {
+      downstreamReadPaused_ = false;
+      downstreamConn_->readStart();
+    }
+  }
+
+  void HttpProxySession::resetUpstream() {
+    ++upstreamGeneration_;
+    upstreamConnected_ = false;
+    ipAddrs_.clear();
+    ipIt_ = ipAddrs_.end();
+    // keep the old connection alive until it is closed, this may be
+    // called from one of its own callbacks
+    if (upstreamConn_) {
+      upstreamConn_->close();
+      retiredUpstreamConn_ = std::move(upstreamConn_);
+    }
+    if (socksClient_) {
+      socksClient_->close();
+      retiredSocksClient_ = std::move(socksClient_);
+    }
+  }
+
+  bool HttpProxySession::canReconnectUpstream() const {
+    return !tunnel_ && upstreamConnected_ && inflightRequests_.empty() &&
+      !cachedBody_ &&
+      (pendingRequests_.empty() || !pendingRequests_.front().started);
+  }
+
+  void HttpProxySession::onUpstreamClosed() {
+    if (canReconnectUpstream()) {
+      // an idle keep-alive connection was closed by the upstream, the
+      // client connection is kept and the next request reconnects
+      LOG_D("upstream closed idle connection: %s", currentRoute_.c_str());
+      resetUpstream();
+      currentRoute_.clear();
+      this->forwardRequests();
+      return;
+    }
+    this->closeDownstream();
+  }
+
+  void HttpProxySession::routeRequest(
+    bool isConnect, const std::string &addr, uint16_t port,
+    std::string::size_type headerEndPos) {
+    // the address rules may route the host the other way once it is
+    // resolved, the data of the tunnel is held until then
+    if (routeByResolvedAddress_ && proxyRuleManager_ &&
+        proxyRuleManager_->hasAddressRules() &&
+        !nul::NetUtil::isIPv4(addr) && !nul::NetUtil::isIPv6(addr)) {
+      this->resolveAndRouteRequest(isConnect, addr, port, headerEndPos);
+      return;
+    }
+
+    this->routeRequest(
+      isConnect, addr, port, headerEndPos, getAction(addr, port), {});
+  }
+
+  void HttpProxySession::resolveAndRouteRequest(
+    bool isConnect, const std::string &addr, uint16_t port,
+    std::string::size_type headerEndPos) {
+    dnsRequest_ = uvcpp::DNSRequest::create(downstreamConn_->getLoop());
+    dnsRequest_->once<uvcpp::EvDNSRequestFinish>(
+      // intentionally cycle-ref the HttpProxySession object to avoid
+      // deletion of it before this callback is fired
+      [this, _ = shared_from_this()](const auto &e, auto &req){
+        dnsRequest_ = nullptr;
+      });
+
+    // routed by the name, the upstream may still be able to resolve it
+    dnsRequest_->once<uvcpp::EvError>(
+      [this, isConnect, addr, port, headerEndPos](const auto &e, auto &r) {
+        if (downstreamConn_->isValid()) {
+          this->routeRequest(
+            isConnect, addr, port, headerEndPos, getAction(addr, port), {});
+        }
+      });
+
+    dnsRequest_->once<uvcpp::EvDNSResult>(
+      [this, isConnect, addr, port, headerEndPos](const auto &e, auto &req) {
+        if (!downstreamConn_->isValid()) {
+          return;
         }
+        if (e.dnsResults.empty()) {
+          this->routeRequest(
+            isConnect, addr, port, headerEndPos, getAction(addr, port), {});
+          return;
+        }
+
+        // the address connected to first decides
+        auto action = checkAction(
+          proxyRuleManager_->getActionForResolvedAddress(
+            addr, port, e.dnsResults.front()));
+        LOG_D("[%s] resolved to %s, routed %s", addr.c_str(),
+              e.dnsResults.front().c_str(),
+              RouteAction::getName(action).c_str());
+        this->routeRequest(
+          isConnect, addr, port, headerEndPos, action,
+          action == RouteAction::kDirect ?
+          e.dnsResults : uvcpp::EvDNSResult::DNSResultVector{});
+      });
+
+    dnsRequest_->resolve(addr);
+    LOG_D("Resolving address for routing: %s", addr.c_str());
+  }
+
+  void HttpProxySession::routeRequest(
+    bool isConnect, const std::string &addr, uint16_t port,
+    std::string::size_type headerEndPos, RouteAction::Id action,
+    uvcpp::EvDNSResult::DNSResultVector resolvedIps) {
+    if (action == RouteAction::kReject) {
+      this->rejectRequest(addr);
+      return;
+    }
+    this->selectUpstream(action);
+    auto useUpstream = RouteAction::isUpstream(action);
+
+    // the CONNECT request itself is only needed by an HTTP upstream
+    std::string connectRequestData;
+    if (isConnect) {
+      std::swap(connectRequestData, requestData_);
+    }
+
+    // the HTTP upstream answers the CONNECT request itself, so the reply
+    // can only be sent ahead of time for DIRECT and SOCKS connections
+    if (optimisticConnect_ && isConnect &&
+        !(useUpstream && upstreamType_ == UpstreamType::kHTTP)) {
+      this->replyDownstream(REPLY_OK_FOR_CONNECT_REQUEST);
+      connectReplied_ = true;
+      // keep whatever the client sent right after the CONNECT header,
+      // it will be flushed to the upstream once connected
+      requestData_ = connectRequestData.substr(headerEndPos + 4);
+    }
+
+    // redirect all the request data to the remote HTTP proxy server
+    // regardless of whether it is a CONNECT request
+    if (useUpstream && upstreamType_ == UpstreamType::kHTTP &&
+        !connectRequestData.empty()) {
+      std::swap(requestData_, connectRequestData);
+    }
+
+    if (!resolvedIps.empty()) {
+      this->connectUpstreamWithIps(std::move(resolvedIps), port);
+    } else {
+      this->connectRoute(addr, port, action);
+    }
+  }
+
+  RouteAction::Id HttpProxySession::getAction(
+    const std::string &addr, uint16_t port) {
+    // with no rules, everything goes to the default upstream if any
+    return checkAction(proxyRuleManager_ ?
+                       proxyRuleManager_->getAction(addr, port) :
+                       RouteAction::kProxy);
+  }
+
+  RouteAction::Id HttpProxySession::checkAction(RouteAction::Id action) const {
+    if (RouteAction::isUpstream(action) && !findUpstreamServer(
+        defaultUpstream_, upstreamServers_.get(), action)) {
+      return RouteAction::kDirect;
+    }
+    return action;
+  }
+
+  void HttpProxySession::selectUpstream(RouteAction::Id action) {
+    auto upstream = findUpstreamServer(
+      defaultUpstream_, upstreamServers_.get(), action);
+    upstreamType_ = upstream ? upstream->type : UpstreamType::kUnknown;
+    upstreamServerHost_ = upstream ? upstream->host : std::string{};
+    upstreamServerPort_ = upstream ? upstream->port : 0;
+  }
+
+  void HttpProxySession::rejectRequest(const std::string &addr) {
+    LOG_D("[%s] rejected by the rules", addr.c_str());
+    this->replyDownstream(REPLY_FORBIDDEN);
+    downstreamConn_->close();
+  }
+
+  void HttpProxySession::connectRoute(
+    const std::string &addr, uint16_t port, RouteAction::Id action) {
+    this->selectUpstream(action);
+    if (RouteAction::isUpstream(action)) {
+      if (upstreamType_ == UpstreamType::kSOCKS5) {
+        this->initiateSocksConnection(addr, port);
+
+      } else if (upstreamType_ == UpstreamType::kHTTP) {
+        this->connectUpstreamWithAddr(
+          upstreamServerHost_, upstreamServerPort_);
 
       } else {
+        // DIRECT connect if no proxy server is available
+        // Should not reach here!
         this->connectUpstreamWithAddr(addr, port);
       }
+
+    } else {
+      this->connectUpstreamWithAddr(addr, port);
+    }
+  }
+
+  bool HttpProxySession::lookupCache(
+    const HttpHeaderParser &parser, const std::string &addr,
+    uint16_t port, std::string::size_type headerEndPos) {
+    auto isConditional =
+      parser.hasHeader("if-none-match") ||
+      parser.hasHeader("if-modified-since");
+    auto entry = httpCache_->lookup(cacheKey_);
+    if (entry && !HttpCache::requiresRevalidation(parser) &&
+        httpCache_->isFresh(*entry)) {
+      // the request is finished once the response is written
+      cachedRequestHeaderEndPos_ = headerEndPos;
+      if (isConditional && HttpCache::isNotModified(parser, *entry)) {
+        LOG_D("cache hit, not modified: %s", addr.c_str());
+        auto response = httpCache_->buildNotModifiedResponse(*entry);
+        httpCache_->recordServed(response.size(), true);
+        writeDownstream(response.c_str(), response.size());
+        this->onCachedResponseSent();
+        return true;
+      }
+      LOG_D("cache hit: %s", addr.c_str());
+      this->replyFromCache(entry);
+      return true;
+    }
+
+    std::weak_ptr<HttpProxySession> weakSelf = shared_from_this();
+    auto isFetcher = httpCache_->beginFetch(cacheKey_, [weakSelf]() {
+        auto self = weakSelf.lock();
+        if (!self || !self->downstreamConn_->isValid()) {
+          return;
+        }
+        // the other fetch is done, handle the request again, which checks
+        // the cache first
+        self->hasReadHeader_ = false;
+        self->cacheKey_.clear();
+        self->processRequestData();
       });
+    if (!isFetcher) {
+      LOG_D("waiting for in-flight fetch: %s", addr.c_str());
+      return true;
+    }
 
-    downstreamConn_->readStart();
+    cacheFetcher_ = true;
+    if (entry && !isConditional &&
+        (!entry->etag.empty() || !entry->lastModified.empty())) {
+      // revalidate the stale entry instead of fetching the whole response
+      std::string conditionalHeaders;
+      if (!entry->etag.empty()) {
+        conditionalHeaders.append("If-None-Match: ")
+          .append(entry->etag).append("\r\n");
+      }
+      if (!entry->lastModified.empty()) {
+        conditionalHeaders.append("If-Modified-Since: ")
+          .append(entry->lastModified).append("\r\n");
+      }
+      requestData_.insert(headerEndPos + 2, conditionalHeaders);
+      staleEntry_ = entry;
+    }
+    return false;
+  }
+
+  void HttpProxySession::replyFromCache(
+    const std::shared_ptr<const HttpCache::Entry> &entry) {
+    auto response = httpCache_->buildResponse(*entry);
+    httpCache_->recordServed(response.size() + entry->bodyLength, true);
+    writeDownstream(response.c_str(), response.size());
+
+    if (entry->bodyFd != -1) {
+      cachedBody_ = entry;
+      cachedBodyOffset_ = entry->bodyOffset;
+      cachedBodyRemaining_ = entry->bodyLength;
+      sendCachedBody();
+    } else {
+      onCachedResponseSent();
+    }
+  }
+
+  void HttpProxySession::sendCachedBody() {
+    auto handle = downstreamConn_->get();
+    while (cachedBodyRemaining_ > 0) {
+      // the body must not overtake data queued by writeAsync(), this is
+      // called again when the queued buffers are recycled
+      if (uv_stream_get_write_queue_size(
+            reinterpret_cast<uv_stream_t *>(handle)) > 0) {
+        return;
+      }
+
+      auto n = static_cast<std::size_t>(
+        std::min<uint64_t>(cachedBodyRemaining_, MAX_SENDFILE_BYTES));
+#ifdef __linux__
+      uv_os_fd_t fd;
+      if (uv_fileno(reinterpret_cast<uv_handle_t *>(handle), &fd) == 0) {
+        // zero-copy from the page cache to the socket
+        auto offset = static_cast<off_t>(cachedBodyOffset_);
+        auto sent = ::sendfile(fd, cachedBody_->bodyFd, &offset, n);
+        if (sent > 0) {
+          cachedBodyOffset_ += static_cast<uint64_t>(sent);
+          cachedBodyRemaining_ -= static_cast<uint64_t>(sent);
+          continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+          continue;
+        }
+        if (sent == 0 || errno != EAGAIN) {
+          LOG_E("sendfile failed: %s", sent == 0 ? "EOF" : strerror(errno));
+          cachedBody_ = nullptr;
+          downstreamConn_->close();
+          return;
+        }
+      }
+#endif
+
+      // the socket buffer is full (or sendfile is not available), queue
+      // one chunk with writeAsync(), which gets us called again once the
+      // socket drains
+      char buf[MAX_WRITE_CHUNK_BYTES];
+      auto nread = ::pread(cachedBody_->bodyFd, buf,
+                           std::min(n, MAX_WRITE_CHUNK_BYTES),
+                           static_cast<off_t>(cachedBodyOffset_));
+      if (nread <= 0) {
+        LOG_E("failed to read cached body: %s",
+              nread == 0 ? "EOF" : strerror(errno));
+        cachedBody_ = nullptr;
+        downstreamConn_->close();
+        return;
+      }
+      downstreamConn_->writeAsync(bufferPool_->assembleDataBuffer(
+          buf, static_cast<std::size_t>(nread)));
+      cachedBodyOffset_ += static_cast<uint64_t>(nread);
+      cachedBodyRemaining_ -= static_cast<uint64_t>(nread);
+      return;
+    }
+
+    onCachedResponseSent();
+  }
+
+  void HttpProxySession::onCachedResponseSent() {
+    // releases the pin on the disk segment
+    cachedBody_ = nullptr;
+
+    if (cachedRequestHeaderEndPos_ == std::string::npos) {
+      // served after a 304, relay what the upstream sent in the meantime
+      if (!heldUpstreamData_.empty()) {
+        std::string data;
+        std::swap(data, heldUpstreamData_);
+        onUpstreamData(data.c_str(), data.size());
+      }
+      if (!tunnel_) {
+        this->processRequestData();
+      }
+    } else {
+      finishCachedRequest(cachedRequestHeaderEndPos_);
+    }
+  }
+
+  void HttpProxySession::finishCachedRequest(
+    std::string::size_type headerEndPos) {
+    // the request is fulfilled without touching the upstream, get ready
+    // for the next request on this connection
+    requestData_.erase(0, headerEndPos + 4);
+    hasReadHeader_ = false;
+    cacheKey_.clear();
+    if (!requestData_.empty()) {
+      processRequestData();
+    }
   }
 
   void HttpProxySession::initiateSocksConnection(
@@ -151,28 +722,32 @@ namespace proxypp {
       std::make_unique<SocksClient>(downstreamConn_->getLoop(), bufferPool_);
 
     if (!socksClient_->connect(upstreamServerHost_, upstreamServerPort_)) {
-      replyDownstream(REPLY_BAD_GATEWAY);
+      replyBadGateway();
       socksClient_->close();
 
     } else {
+      auto generation = upstreamGeneration_;
       // ref the session object until the SocksClient connection is closed
-      socksClient_->once<uvcpp::EvClose>([this, _ = shared_from_this()](
+      socksClient_->once<uvcpp::EvClose>(
+        [this, generation, _ = shared_from_this()](
           const auto &e, auto &conn){
-        downstreamConn_->close();
+        if (generation == upstreamGeneration_) {
+          this->onUpstreamClosed();
+        }
       });
 
       socksClient_->once<uvcpp::EvError>(
-        [this](const auto &e, auto &client) {
-          if (!upstreamConnected_) {
+        [this, generation](const auto &e, auto &client) {
+          if (generation == upstreamGeneration_ && !upstreamConnected_) {
             LOG_E("Failed to connect to SOCKS server: %s:%d",
                   client.getIP().c_str(), client.getPort());
-            this->replyDownstream(REPLY_BAD_GATEWAY);
+            this->replyBadGateway();
           }
         });
 
       socksClient_->once<EvSocksHandshake>([=](const auto &e, auto &conn){
         if (!e.succeeded) {
-          this->replyDownstream(REPLY_BAD_GATEWAY);
+          this->replyBadGateway();
           conn.close();
           return;
         }
@@ -182,8 +757,7 @@ namespace proxypp {
         this->onUpstreamConnected(conn);
 
         conn.template on<EvSocksRead>([this](const auto &e, auto &conn){
-          downstreamConn_->writeAsync(
-            bufferPool_->assembleDataBuffer(e.buf, e.nread));
+          this->onUpstreamData(e.buf, e.nread);
         });
       });
 
@@ -207,26 +781,21 @@ namespace proxypp {
 
     dnsRequest_->once<uvcpp::EvError>([this, addr](const auto &e, auto &r) {
       LOG_W("Failed to resolve address: %s", addr.c_str());
-      this->replyDownstream(REPLY_BAD_GATEWAY);
-      downstreamConn_->close();
+      this->replyBadGateway();
+      this->closeDownstream();
     });
 
     dnsRequest_->once<uvcpp::EvDNSResult>(
       [this, addr, port](const auto &e, auto &req) {
         if (e.dnsResults.empty()) {
           LOG_W("[%s] resolved to zero IPs", addr.c_str());
-          this->replyDownstream(REPLY_BAD_GATEWAY);
-          downstreamConn_->close();
+          this->replyBadGateway();
+          this->closeDownstream();
           return;
         }
 
-        ipAddrs_ = std::move(e.dnsResults);
-        ipIt_ = ipAddrs_.begin();
-        auto newIp = *ipIt_;
-        ++ipIt_;
-
         if (downstreamConn_->isValid()) {
-          this->connectUpstreamWithIp(newIp, port);
+          this->connectUpstreamWithIps(e.dnsResults, port);
         }
       });
 
@@ -234,39 +803,53 @@ namespace proxypp {
     LOG_D("Resolving address: %s", addr.c_str());
   }
 
+  void HttpProxySession::connectUpstreamWithIps(
+    uvcpp::EvDNSResult::DNSResultVector ips, uint16_t port) {
+    ipAddrs_ = std::move(ips);
+    ipIt_ = ipAddrs_.begin();
+    auto newIp = *ipIt_;
+    ++ipIt_;
+    this->connectUpstreamWithIp(newIp, port);
+  }
+
   void HttpProxySession::connectUpstreamWithIp(
     const std::string &ip, uint16_t port) {
     createUpstreamConnection(port);
     if (!upstreamConn_->connect(ip, port)) {
       // check if there're more IPs to try
       if (ipIt_ == ipAddrs_.end()) {
-        replyDownstream(REPLY_BAD_GATEWAY);
+        replyBadGateway();
       }
       upstreamConn_->close();
     }
   }
 
   void HttpProxySession::createUpstreamConnection(uint16_t port) {
+    auto generation = upstreamGeneration_;
     upstreamConn_ = uvcpp::Tcp::create(downstreamConn_->getLoop());
     upstreamConn_->once<uvcpp::EvError>(
-      [this](const auto &e, auto &client) {
-        if (!upstreamConnected_) {
+      [this, generation](const auto &e, auto &client) {
+        if (generation == upstreamGeneration_ && !upstreamConnected_) {
           LOG_E("Failed to connect to: %s:%d",
                 client.getIP().c_str(), client.getPort());
-          this->replyDownstream(REPLY_BAD_GATEWAY);
+          this->replyBadGateway();
         }
       });
     upstreamConn_->once<uvcpp::EvClose>(
       // intentionally cycle-ref the HttpProxySession object to avoid
       // deletion of it before this callback is fired
-      [this, port, _ = shared_from_this()](const auto &e, auto &client){
+      [this, port, generation, _ = shared_from_this()](
+        const auto &e, auto &client){
+      if (generation != upstreamGeneration_) {
+        return;
+      }
       if (!upstreamConnected_ && ipIt_ != ipAddrs_.end()) {
         auto newIp = *ipIt_;
         ++ipIt_;
         this->connectUpstreamWithIp(newIp, port);
 
       } else {
-        downstreamConn_->close();
+        this->onUpstreamClosed();
       }
     });
     upstreamConn_->once<uvcpp::EvConnect>(
@@ -280,8 +863,7 @@ namespace proxypp {
         });
 
         conn.template on<uvcpp::EvRead>([this](const auto &e, auto &conn){
-          downstreamConn_->writeAsync(
-            bufferPool_->assembleDataBuffer(e.buf, e.nread));
+          this->onUpstreamData(e.buf, e.nread);
         });
 
         upstreamConn_->readStart();
@@ -291,7 +873,20 @@ namespace proxypp {
   void HttpProxySession::onUpstreamConnected(uvcpp::Tcp &conn) {
     upstreamConnected_ = true;
 
-    if (!requestData_.empty()) {
+    if (!tunnel_) {
+      this->forwardRequests();
+
+    } else if (connectReplied_) {
+      // the client was told the tunnel is up, forward the buffered first
+      // flight verbatim
+      if (!requestData_.empty()) {
+        conn.writeAsync(bufferPool_->assembleDataBuffer(
+            requestData_.c_str(), requestData_.length()));
+        requestData_.clear();
+      }
+      resumeDownstreamRead();
+
+    } else if (!requestData_.empty()) {
       auto pos = requestData_.find(HTTP_HEADER_PROXY_CONNECTION);
       if (pos != std::string::npos) {
         requestData_ = requestData_.replace(
@@ -307,24 +902,262 @@ namespace proxypp {
     }
   }
 
+  void HttpProxySession::onUpstreamData(const char *buf, std::size_t len) {
+    while (len > 0 && !cachedBody_ && !tunnel_ &&
+           !inflightRequests_.empty()) {
+      auto consumed = relayResponse(buf, len);
+      buf += consumed;
+      len -= consumed;
+    }
+    if (len == 0) {
+      return;
+    }
+
+    if (cachedBody_) {
+      // a cached body is being sent after a 304
+      heldUpstreamData_.append(buf, len);
+    } else {
+      // tunnels, and responses that can't be framed
+      downstreamConn_->writeAsync(bufferPool_->assembleDataBuffer(buf, len));
+    }
+  }
+
+  std::size_t HttpProxySession::relayResponse(
+    const char *buf, std::size_t len) {
+    auto headerWasComplete = responseParser_.isHeaderComplete();
+    auto consumed = responseParser_.parse(buf, len);
+    if (responseParser_.getState() ==
+        HttpResponseParser::State::ERROR_OCCURRED) {
+      LOG_W("unrecognized response, relay the connection as is");
+      // relay whatever was held back, the rest goes through untouched
+      if (staleEntry_ && !responseData_.empty()) {
+        writeDownstream(responseData_.c_str(), responseData_.size());
+      }
+      if (cacheFetcher_) {
+        finishRecording(false);
+      }
+
+      // requests already read still go to the same upstream, those for
+      // other routes can't be answered in order any more
+      tunnel_ = true;
+      inflightRequests_.clear();
+      for (auto &req : pendingRequests_) {
+        if (req.route != currentRoute_) {
+          break;
+        }
+        writeUpstream(req.data);
+      }
+      pendingRequests_.clear();
+      if (!requestData_.empty()) {
+        writeUpstream(requestData_);
+        requestData_.clear();
+      }
+      return 0;
+    }
+
+    if (cacheFetcher_) {
+      recordResponse(buf, consumed, headerWasComplete);
+    } else {
+      writeDownstream(buf, consumed);
+    }
+
+    if (responseParser_.isComplete()) {
+      onResponseComplete();
+    }
+    return consumed;
+  }
+
+  void HttpProxySession::recordResponse(
+    const char *buf, std::size_t len, bool headerWasComplete) {
+    responseData_.append(buf, len);
+
+    if (staleEntry_) {
+      // hold the response back until we know whether it's a 304
+      if (!responseParser_.isHeaderComplete()) {
+        return;
+      }
+
+      if (responseParser_.getStatusCode() == 304) {
+        if (responseParser_.isComplete()) {
+          auto entry = httpCache_->refresh(cacheKey_, responseParser_);
+          LOG_D("revalidated cache entry, %zu bytes",
+                entry ? entry->data.size() : 0);
+          cachedRequestHeaderEndPos_ = std::string::npos;
+          this->replyFromCache(entry ? entry : staleEntry_);
+          finishRecording(false);
+        }
+        return;
+      }
+
+      // the resource has changed, relay the new response
+      writeDownstream(responseData_.c_str(), responseData_.size());
+      staleEntry_ = nullptr;
+
+    } else {
+      writeDownstream(buf, len);
+    }
+
+    if (!headerWasComplete && responseParser_.isHeaderComplete()) {
+      if (!HttpCache::isCacheable(responseParser_)) {
+        finishRecording(false);
+        return;
+      }
+      // large responses are streamed to the disk tier instead of being
+      // accumulated in memory
+      diskReservation_ =
+        httpCache_->reserveOnDisk(cacheKey_, responseParser_, requestTime_);
+    }
+
+    if (diskReservation_) {
+      if (!httpCache_->writeOnDisk(*diskReservation_, responseData_)) {
+        finishRecording(false);
+        return;
+      }
+      responseData_.clear();
+
+    } else if (responseData_.size() > httpCache_->getMaxObjectSize()) {
+      LOG_D("response too large to be cached: %s", cacheKey_.c_str());
+      finishRecording(false);
+      return;
+    }
+
+    if (responseParser_.isComplete()) {
+      finishRecording(true);
+    }
+  }
+
+  void HttpProxySession::onResponseComplete() {
+    auto statusCode = responseParser_.getStatusCode();
+    if (statusCode == 101) {
+      // not expected, Upgrade requests are tunnelled
+      tunnel_ = true;
+      return;
+    }
+    if (statusCode >= 100 && statusCode < 200) {
+      // interim response, the final one follows
+      responseParser_.reset(inflightRequests_.front());
+      return;
+    }
+
+    inflightRequests_.pop_front();
+    responseParser_.reset(
+      !inflightRequests_.empty() && inflightRequests_.front());
+
+    if (pendingRequests_.size() + inflightRequests_.size() <
+        maxPipelineDepth_) {
+      resumeDownstreamRead();
+    }
+    // parses requests held back by the pipeline depth, or those that
+    // wait for the pipeline to drain
+    this->processRequestData();
+  }
+
+  void HttpProxySession::finishRecording(bool store) {
+    if (store) {
+      if (diskReservation_) {
+        httpCache_->recordServed(diskReservation_->written, false);
+        httpCache_->commitOnDisk(*diskReservation_);
+      } else {
+        httpCache_->recordServed(responseData_.size(), false);
+        httpCache_->store(
+          cacheKey_, std::move(responseData_), responseParser_, requestTime_);
+      }
+    }
+
+    diskReservation_ = nullptr;
+    staleEntry_ = nullptr;
+    responseData_.clear();
+    if (cacheFetcher_) {
+      cacheFetcher_ = false;
+      // wake up sessions waiting for the same response
+      httpCache_->endFetch(cacheKey_);
+    }
+    cacheKey_.clear();
+  }
+
+  void HttpProxySession::writeUpstream(const std::string &data) {
+    if (upstreamConn_) {
+      upstreamConn_->writeAsync(
+        bufferPool_->assembleDataBuffer(data.c_str(), data.length()));
+    } else if (socksClient_) {
+      socksClient_->writeAsync(
+        bufferPool_->assembleDataBuffer(data.c_str(), data.length()));
+    }
+  }
+
+  void HttpProxySession::writeDownstream(const char *buf, std::size_t len) {
+    while (len > 0) {
+      auto n = std::min(len, MAX_WRITE_CHUNK_BYTES);
+      downstreamConn_->writeAsync(bufferPool_->assembleDataBuffer(buf, n));
+      buf += n;
+      len -= n;
+    }
+  }
+
   void HttpProxySession::replyDownstream(const std::string &message) {
     downstreamConn_->writeAsync(
       bufferPool_->assembleDataBuffer(message.c_str(), message.length()));
   }
 
+  void HttpProxySession::replyBadGateway() {
+    // the client has already got a 200 for its CONNECT request, the
+    // connection will be reset instead
+    if (!connectReplied_) {
+      replyDownstream(REPLY_BAD_GATEWAY);
+    }
+  }
+
+  void HttpProxySession::closeDownstream() {
+    if (connectReplied_ && !upstreamConnected_) {
+      // abort with RST so that the client doesn't take the failed tunnel
+      // for a connection closed by the target server
+      struct linger lingerOpt{1, 0};
+      downstreamConn_->setSockOption(
+        SO_LINGER, reinterpret_cast<void *>(&lingerOpt), sizeof(lingerOpt));
+    }
+    downstreamConn_->close();
+  }
+
   void HttpProxySession::close() {
     downstreamConn_->close();
   }
 
   void HttpProxySession::setUpstreamServer(
     UpstreamType upstreamType, const std::string &ip, uint16_t port) {
-    upstreamType_ = upstreamType;
-    upstreamServerHost_ = ip;
-    upstreamServerPort_ = port;
+    defaultUpstream_ = UpstreamServer{upstreamType, ip, port};
+    this->selectUpstream(RouteAction::kProxy);
+  }
+
+  void HttpProxySession::setUpstreamServers(
+    const std::shared_ptr<const UpstreamServers> &upstreamServers) {
+    upstreamServers_ = upstreamServers;
   }
 
   void HttpProxySession::setAutoProxyManager(
     const std::shared_ptr<AutoProxyManager> &proxyRuleManager) {
     proxyRuleManager_ = proxyRuleManager;
   }
+
+  void HttpProxySession::setOptimisticConnect(bool optimisticConnect) {
+    optimisticConnect_ = optimisticConnect;
+  }
+
+  void HttpProxySession::setRouteByResolvedAddress(
+    bool routeByResolvedAddress) {
+    routeByResolvedAddress_ = routeByResolvedAddress;
+  }
+
+  void HttpProxySession::setHttpCache(
+    const std::shared_ptr<HttpCache> &httpCache) {
+    httpCache_ = httpCache;
+  }
+
+  void HttpProxySession::setMaxPipelineDepth(std::size_t maxPipelineDepth) {
+    maxPipelineDepth_ = std::max<std::size_t>(1, maxPipelineDepth);
+  }
+
+  void HttpProxySession::setMaxConcurrentStreams(
+    uint32_t maxConcurrentStreams) {
+    maxConcurrentStreams_ = maxConcurrentStreams;
+  }
 } /* end of namspace: proxypp */
@@ -11,9 +11,15 @@
 #include "proxypp/upstream_type.h"
 #include "proxypp/auto_proxy_manager.h"
 #include "proxypp/socks/socks_client.h"
+#include "proxypp/http/http_header_parser.h"
+#include "proxypp/http/http_cache.h"
+#include "proxypp/http/http_response_parser.h"
+#include "proxypp/http/http2_session.h"
 #include "uvcpp.h"
 #include "nul/buffer_pool.hpp"
 
+#include <deque>
+
 namespace proxypp {
   /**
    * This class MUST be used with std::shared_ptr
@@ -30,13 +36,106 @@ namespace proxypp {
 
       void setUpstreamServer(
         UpstreamType type, const std::string &ip, uint16_t port);
+      // the upstreams the rules name, see RouteAction
+      void setUpstreamServers(
+        const std::shared_ptr<const UpstreamServers> &upstreamServers);
       void setAutoProxyManager(
         const std::shared_ptr<AutoProxyManager> &proxyRuleManager);
+      // reply 200 to CONNECT requests before the upstream is connected
+      void setOptimisticConnect(bool optimisticConnect);
+      // hosts of tunnels are resolved before they are routed, so that the
+      // address rules apply to them
+      void setRouteByResolvedAddress(bool routeByResolvedAddress);
+      void setHttpCache(const std::shared_ptr<HttpCache> &httpCache);
+      // number of requests read from the client but not yet answered,
+      // reading from the client is paused once this is reached
+      void setMaxPipelineDepth(std::size_t maxPipelineDepth);
+      // SETTINGS_MAX_CONCURRENT_STREAMS for h2c clients
+      void setMaxConcurrentStreams(uint32_t maxConcurrentStreams);
 
     private:
+      struct PipelinedRequest {
+        // head and body not yet written to the upstream
+        std::string data;
+        // requests on the same route share one upstream connection
+        std::string route;
+        std::string addr;
+        uint16_t port{0};
+        RouteAction::Id action{RouteAction::kDirect};
+        bool isHead{false};
+        // the whole body has been read from the client
+        bool complete{false};
+        // part of the request has been written to the upstream
+        bool started{false};
+      };
+
+      void processRequestData();
+      // the client sent the HTTP/2 connection preface
+      void startHttp2();
+      void enqueueRequest(
+        const HttpHeaderParser &parser, const std::string &addr,
+        uint16_t port, std::string::size_type headerEndPos);
+      void forwardRequests();
+      bool isPipelineIdle() const;
+      void pauseDownstreamRead();
+      void resumeDownstreamRead();
+      // closes the upstream without closing the client connection, so the
+      // next request can be routed elsewhere
+      void resetUpstream();
+      bool canReconnectUpstream() const;
+      void onUpstreamClosed();
+
+      // the action of the rules for the host, kDirect for an upstream
+      // that is not configured
+      RouteAction::Id getAction(const std::string &addr, uint16_t port);
+      RouteAction::Id checkAction(RouteAction::Id action) const;
+      // makes the upstream of action the one connectRoute() connects to
+      void selectUpstream(RouteAction::Id action);
+      // replies 403 and closes the client connection
+      void rejectRequest(const std::string &addr);
+
+      void routeRequest(
+        bool isConnect, const std::string &addr, uint16_t port,
+        std::string::size_type headerEndPos);
+      void resolveAndRouteRequest(
+        bool isConnect, const std::string &addr, uint16_t port,
+        std::string::size_type headerEndPos);
+      // resolvedIps are the addresses of a host routed DIRECT after it
+      // was resolved, they are connected to without resolving it again
+      void routeRequest(
+        bool isConnect, const std::string &addr, uint16_t port,
+        std::string::size_type headerEndPos, RouteAction::Id action,
+        uvcpp::EvDNSResult::DNSResultVector resolvedIps);
+      void connectRoute(
+        const std::string &addr, uint16_t port, RouteAction::Id action);
+
+      // returns true if the request is taken care of by the cache, i.e.
+      // served or waiting for another session to fetch the same URL
+      bool lookupCache(
+        const HttpHeaderParser &parser, const std::string &addr,
+        uint16_t port, std::string::size_type headerEndPos);
+      void replyFromCache(const std::shared_ptr<const HttpCache::Entry> &entry);
+      // streams the body of an entry kept in the disk tier
+      void sendCachedBody();
+      void onCachedResponseSent();
+      void finishCachedRequest(std::string::size_type headerEndPos);
+      void onUpstreamData(const char *buf, std::size_t len);
+      std::size_t relayResponse(const char *buf, std::size_t len);
+      void recordResponse(
+        const char *buf, std::size_t len, bool headerWasComplete);
+      void onResponseComplete();
+      void finishRecording(bool store);
+
+      void writeUpstream(const std::string &data);
+      void writeDownstream(const char *buf, std::size_t len);
       void replyDownstream(const std::string &message);
+      void replyBadGateway();
+      void closeDownstream();
       void connectUpstreamWithAddr(const std::string &host, uint16_t port);
       void connectUpstreamWithIp(const std::string &ip, uint16_t port);
+      // ips must not be empty, the rest are tried if the first one fails
+      void connectUpstreamWithIps(
+        uvcpp::EvDNSResult::DNSResultVector ips, uint16_t port);
       void createUpstreamConnection(uint16_t port);
 
       void onUpstreamConnected(uvcpp::Tcp &conn);
@@ -52,17 +151,64 @@ namespace proxypp {
       uvcpp::EvDNSResult::DNSResultVector ipAddrs_;
       decltype(ipAddrs_.begin()) ipIt_{ipAddrs_.end()};
       bool upstreamConnected_{false};
+      // a request is being served by the cache, requests after it are
+      // held back until it's done
       bool hasReadHeader_{false};
+      // the connection is relayed as is after CONNECT, Upgrade and
+      // requests whose framing is not understood
+      bool tunnel_{false};
+      bool optimisticConnect_{false};
+      bool routeByResolvedAddress_{false};
+      bool connectReplied_{false};
+      bool downstreamReadPaused_{false};
 
       std::shared_ptr<nul::BufferPool> bufferPool_;
 
+      // data read from the client but not yet parsed
       std::string requestData_;
+      std::deque<PipelinedRequest> pendingRequests_;
+      // isHead of the requests written to the upstream, in order
+      std::deque<bool> inflightRequests_;
+      uint64_t requestBodyRemaining_{0};
+      std::size_t maxPipelineDepth_{8};
+      std::string currentRoute_;
+      HttpResponseParser responseParser_;
+      // events from upstream connections that were reset are ignored
+      uint32_t upstreamGeneration_{0};
+      std::shared_ptr<uvcpp::Tcp> retiredUpstreamConn_;
+      std::unique_ptr<SocksClient> retiredSocksClient_;
+
+      // set once the connection speaks h2c, everything is handed to it
+      std::unique_ptr<Http2Session> http2Session_;
+      uint32_t maxConcurrentStreams_{100};
 
       std::unique_ptr<SocksClient> socksClient_;
+      UpstreamServer defaultUpstream_;
+      std::shared_ptr<const UpstreamServers> upstreamServers_;
+      // the upstream of the current route, see selectUpstream()
       UpstreamType upstreamType_{UpstreamType::kUnknown};
       std::string upstreamServerHost_;
       uint16_t upstreamServerPort_{0};
       std::shared_ptr<AutoProxyManager> proxyRuleManager_;
+
+      std::shared_ptr<HttpCache> httpCache_;
+      std::string cacheKey_;
+      bool cacheFetcher_{false};
+      // set when revalidating a stale entry with a conditional request
+      std::shared_ptr<const HttpCache::Entry> staleEntry_;
+      std::string responseData_;
+      HttpCache::Clock::time_point requestTime_;
+      std::unique_ptr<HttpDiskCache::Reservation> diskReservation_;
+
+      // set while the body of a disk tier entry is being sent
+      std::shared_ptr<const HttpCache::Entry> cachedBody_;
+      uint64_t cachedBodyOffset_{0};
+      uint64_t cachedBodyRemaining_{0};
+      // npos if the cached response answers a conditional request that
+      // went to the upstream
+      std::string::size_type cachedRequestHeaderEndPos_{0};
+      // upstream data that arrives while the body is being sent
+      std::string heldUpstreamData_;
   };
 } /* end of namspace: proxypp */
 
@@ -0,0 +1,294 @@
+/*******************************************************************************
+**          File: http_response_parser.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 10:40 AM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/http/http_response_parser.h"
+#include "nul/log.h"
+#include "nul/util.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+  static const auto MAX_HEADER_BYTES = 64 * 1024U;
+  static const auto MAX_CHUNK_LINE_BYTES = 1024U;
+}
+
+namespace proxypp {
+  using su = nul::StringUtil;
+
+  void HttpResponseParser::reset(bool isHeadRequest) {
+    state_ = State::HEADER;
+    isHeadRequest_ = isHeadRequest;
+    header_.clear();
+    chunkLine_.clear();
+    statusCode_ = 0;
+    headerLength_ = 0;
+    remainingBytes_ = 0;
+    headers_.clear();
+  }
+
+  std::size_t HttpResponseParser::parse(const char *buf, std::size_t len) {
+    std::size_t consumed = 0;
+
+    if (state_ == State::HEADER) {
+      // the header may be split across reads, only scan the newly added
+      // bytes (plus the 3 bytes before them) for the terminating CRLFCRLF
+      auto searchFrom = header_.size() < 3 ? 0 : header_.size() - 3;
+      header_.append(buf, len);
+
+      auto pos = header_.find("\r\n\r\n", searchFrom);
+      if (pos == std::string::npos) {
+        if (header_.size() > MAX_HEADER_BYTES) {
+          LOG_E("response header too large: %zu", header_.size());
+          state_ = State::ERROR_OCCURRED;
+          return 0;
+        }
+        return len;
+      }
+
+      headerLength_ = pos + 4;
+      consumed = len - (header_.size() - headerLength_);
+      header_.resize(headerLength_);
+
+      if (!parseHeader()) {
+        state_ = State::ERROR_OCCURRED;
+        return 0;
+      }
+    }
+
+    buf += consumed;
+    len -= consumed;
+
+    switch (state_) {
+      case State::BODY: {
+        auto n = std::min(len, remainingBytes_);
+        if (bodyCallback_ && n > 0) {
+          bodyCallback_(buf, n);
+        }
+        remainingBytes_ -= n;
+        consumed += n;
+        if (remainingBytes_ == 0) {
+          state_ = State::COMPLETE;
+        }
+        break;
+      }
+
+      case State::CHUNK_SIZE:
+      case State::CHUNK_DATA:
+      case State::CHUNK_DATA_END:
+      case State::CHUNK_TRAILER:
+        consumed += parseChunked(buf, len);
+        break;
+
+      case State::BODY_UNTIL_CLOSE:
+        if (bodyCallback_ && len > 0) {
+          bodyCallback_(buf, len);
+        }
+        consumed += len;
+        break;
+
+      default:
+        break;
+    }
+
+    return consumed;
+  }
+
+  bool HttpResponseParser::parseHeader() {
+    auto succeeded = su::split(
+      header_.substr(0, headerLength_ - 4), "\r\n",
+      [this](auto index, const auto &part) {
+      if (index == 0) {
+        // HTTP/1.1 200 OK, note that the reason phrase may contain spaces
+        if (part.compare(0, 5, "HTTP/") != 0) {
+          LOG_E("Invalid status line: %s", part.c_str());
+          return false;
+        }
+        auto sp = part.find(' ');
+        if (sp == std::string::npos || sp + 4 > part.size()) {
+          LOG_E("Invalid status line: %s", part.c_str());
+          return false;
+        }
+        statusCode_ = std::atoi(part.substr(sp + 1, 3).c_str());
+        return statusCode_ >= 100 && statusCode_ <= 999;
+      }
+
+      auto colonIndex = part.find(":");
+      if (colonIndex == std::string::npos) {
+        LOG_E("Invalid http header: %s", part.c_str());
+        return false;
+      }
+
+      auto key = su::trim(part.substr(0, colonIndex));
+      su::tolower(key);
+      auto value = su::trim(part.substr(colonIndex + 1));
+      auto it = headers_.find(key);
+      if (it == headers_.end()) {
+        headers_[key] = value;
+      } else {
+        // list-based fields such as Cache-Control can be repeated
+        it->second.append(", ").append(value);
+      }
+      return true;
+    });
+
+    if (!succeeded) {
+      return false;
+    }
+
+    if (isHeadRequest_ ||
+        (statusCode_ >= 100 && statusCode_ < 200) ||
+        statusCode_ == 204 || statusCode_ == 304) {
+      state_ = State::COMPLETE;
+      return true;
+    }
+
+    auto te = getHeader("transfer-encoding");
+    su::tolower(te);
+    if (te.find("chunked") != std::string::npos) {
+      state_ = State::CHUNK_SIZE;
+      return true;
+    }
+
+    auto contentLength = headers_.find("content-length");
+    if (contentLength != headers_.end()) {
+      char *end = nullptr;
+      auto length = std::strtoull(contentLength->second.c_str(), &end, 10);
+      if (end == contentLength->second.c_str() || *end != '\0') {
+        LOG_E("Invalid Content-Length: %s", contentLength->second.c_str());
+        return false;
+      }
+      remainingBytes_ = static_cast<std::size_t>(length);
+      state_ = remainingBytes_ > 0 ? State::BODY : State::COMPLETE;
+      return true;
+    }
+
+    state_ = State::BODY_UNTIL_CLOSE;
+    return true;
+  }
+
+  std::size_t HttpResponseParser::parseChunked(
+    const char *buf, std::size_t len) {
+    std::size_t i = 0;
+    while (i < len && state_ != State::COMPLETE &&
+           state_ != State::ERROR_OCCURRED) {
+      switch (state_) {
+        case State::CHUNK_SIZE:
+        case State::CHUNK_DATA_END:
+        case State::CHUNK_TRAILER: {
+          auto ch = buf[i++];
+          if (ch != '\n') {
+            chunkLine_.push_back(ch);
+            if (chunkLine_.size() > MAX_CHUNK_LINE_BYTES) {
+              LOG_E("chunk line too long");
+              state_ = State::ERROR_OCCURRED;
+            }
+            break;
+          }
+          if (!chunkLine_.empty() && chunkLine_.back() == '\r') {
+            chunkLine_.pop_back();
+          }
+
+          if (state_ == State::CHUNK_DATA_END) {
+            state_ = State::CHUNK_SIZE;
+
+          } else if (state_ == State::CHUNK_TRAILER) {
+            if (chunkLine_.empty()) {
+              state_ = State::COMPLETE;
+            }
+
+          } else {
+            // chunk-size [; chunk-ext]
+            char *end = nullptr;
+            remainingBytes_ = static_cast<std::size_t>(
+              std::strtoull(chunkLine_.c_str(), &end, 16));
+            if (end == chunkLine_.c_str()) {
+              LOG_E("Invalid chunk size: %s", chunkLine_.c_str());
+              state_ = State::ERROR_OCCURRED;
+            } else {
+              state_ = remainingBytes_ > 0 ?
+                State::CHUNK_DATA : State::CHUNK_TRAILER;
+            }
+          }
+          chunkLine_.clear();
+          break;
+        }
+
+        case State::CHUNK_DATA: {
+          auto n = std::min(len - i, remainingBytes_);
+          if (bodyCallback_ && n > 0) {
+            bodyCallback_(buf + i, n);
+          }
+          remainingBytes_ -= n;
+          i += n;
+          if (remainingBytes_ == 0) {
+            state_ = State::CHUNK_DATA_END;
+          }
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+    return i;
+  }
+
+  HttpResponseParser::State HttpResponseParser::getState() const {
+    return state_;
+  }
+
+  bool HttpResponseParser::isHeaderComplete() const {
+    return state_ != State::HEADER && state_ != State::ERROR_OCCURRED;
+  }
+
+  bool HttpResponseParser::isComplete() const {
+    return state_ == State::COMPLETE;
+  }
+
+  int HttpResponseParser::getStatusCode() const {
+    return statusCode_;
+  }
+
+  std::size_t HttpResponseParser::getHeaderLength() const {
+    return headerLength_;
+  }
+
+  const std::map<std::string, std::string> &
+  HttpResponseParser::getHeaders() const {
+    return headers_;
+  }
+
+  std::string HttpResponseParser::getHeader(const std::string &name) const {
+    auto it = headers_.find(name);
+    return it != headers_.end() ? it->second : std::string{};
+  }
+
+  std::vector<std::pair<std::string, std::string>>
+  HttpResponseParser::getHeaderFields() const {
+    std::vector<std::pair<std::string, std::string>> fields;
+    if (!isHeaderComplete()) {
+      return fields;
+    }
+    su::split(
+      header_.substr(0, headerLength_ - 4), "\r\n",
+      [&fields](auto index, const auto &part) {
+      auto colonIndex = part.find(":");
+      if (index > 0 && colonIndex != std::string::npos) {
+        auto key = su::trim(part.substr(0, colonIndex));
+        su::tolower(key);
+        fields.emplace_back(key, su::trim(part.substr(colonIndex + 1)));
+      }
+      return true;
+    });
+    return fields;
+  }
+
+  void HttpResponseParser::setBodyCallback(BodyCallback &&callback) {
+    bodyCallback_ = std::move(callback);
+  }
+
+} /* end of namspace: proxypp */
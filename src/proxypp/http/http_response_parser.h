@@ -0,0 +1,71 @@
+/*******************************************************************************
+**          File: http_response_parser.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 10:12 AM
+**   Description: incremental parser that finds the boundary of an HTTP
+**                response, i.e. the status line, headers and framing of
+**                the body
+*******************************************************************************/
+#ifndef PROXYPP_HTTP_RESPONSE_PARSER_H_
+#define PROXYPP_HTTP_RESPONSE_PARSER_H_
+#include <string>
+#include <map>
+#include <vector>
+#include <functional>
+
+namespace proxypp {
+  class HttpResponseParser final {
+    public:
+      using BodyCallback = std::function<void(const char *buf, std::size_t len)>;
+
+      enum class State {
+        HEADER,
+        BODY,
+        CHUNK_SIZE,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        CHUNK_TRAILER,
+        BODY_UNTIL_CLOSE,
+        COMPLETE,
+        ERROR_OCCURRED
+      };
+
+      // responses to HEAD requests never carry a body
+      void reset(bool isHeadRequest = false);
+
+      // returns number of bytes consumed, which is less than len only if
+      // the response completes in the middle of buf or an error occurs
+      std::size_t parse(const char *buf, std::size_t len);
+
+      State getState() const;
+      bool isHeaderComplete() const;
+      bool isComplete() const;
+      int getStatusCode() const;
+      std::size_t getHeaderLength() const;
+      const std::map<std::string, std::string> &getHeaders() const;
+      // name must be in lower case, returns empty string if not found
+      std::string getHeader(const std::string &name) const;
+      // fields in the order they appear, names in lower case, repeated
+      // fields such as Set-Cookie are kept apart
+      std::vector<std::pair<std::string, std::string>> getHeaderFields() const;
+      // receives the body as it is parsed, with the chunked framing removed
+      void setBodyCallback(BodyCallback &&callback);
+
+    private:
+      bool parseHeader();
+      std::size_t parseChunked(const char *buf, std::size_t len);
+
+    private:
+      State state_{State::HEADER};
+      bool isHeadRequest_{false};
+      std::string header_;
+      std::string chunkLine_;
+      int statusCode_{0};
+      std::size_t headerLength_{0};
+      std::size_t remainingBytes_{0};
+      std::map<std::string, std::string> headers_;
+      BodyCallback bodyCallback_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_HTTP_RESPONSE_PARSER_H_ */
@@ -0,0 +1,364 @@
+/*******************************************************************************
+**          File: compiled_rule_file.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 09:32 AM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/compiled_rule_file.h"
+#include "proxypp/rule/rule_snapshot.h"
+#include "nul/log.h"
+
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+  static const char MAGIC[8] = { 'P', 'P', 'R', 'U', 'L', 'E', 'S', '\0' };
+  static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+  static const std::size_t BYTE_CLASSES_SIZE = 256 * sizeof(uint16_t);
+  static const std::size_t BLOOM_FILTER_BLOCK_SIZE = 64;
+
+  struct FileHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t byteOrderMark;
+    uint32_t ruleCount;
+    uint32_t stateCount;
+    uint16_t classCount;
+    uint8_t emptyKeyOutputs;
+    uint8_t filterLengths;
+    uint32_t regexCount;
+    uint32_t addressRuleCount;
+    uint32_t filterBlockCount;
+    uint8_t filterMatchesAll;
+    uint8_t emptyKeyAction;
+    uint8_t reserved[2];
+    uint32_t wildcardRuleCount;
+    uint32_t actionNameCount;
+    uint32_t reserved2;
+    // offsets from the start of the file
+    uint64_t byteClassesOffset;
+    uint64_t transitionsOffset;
+    uint64_t outputsOffset;
+    // 0 if the automaton has no actions table
+    uint64_t actionsOffset;
+    uint64_t filterOffset;
+    // the string sections, every string is a uint32_t length followed
+    // by the bytes
+    uint64_t regexOffset;
+    uint64_t addressRulesOffset;
+    uint64_t wildcardRulesOffset;
+    // the names of the action ids of the tables, indexed by the ids
+    uint64_t actionNamesOffset;
+    uint64_t fileSize;
+  };
+  static_assert(sizeof(FileHeader) == 136, "unexpected padding in FileHeader");
+
+  // the columns of the actions table, see RuleAutomaton::Tables
+  static const std::size_t ACTION_COLUMNS = 3;
+
+  inline uint64_t alignUp(uint64_t n) {
+    return (n + 7) & ~static_cast<uint64_t>(7);
+  }
+
+  // written so that nothing read from the file can wrap the sum around
+  inline bool isOutOfBounds(uint64_t offset, uint64_t len, uint64_t size) {
+    return offset > size || len > size - offset;
+  }
+
+  uint64_t sizeOfStrings(const std::vector<std::string> &strs) {
+    uint64_t size = 0;
+    for (auto &s : strs) {
+      size += sizeof(uint32_t) + s.size();
+    }
+    return size;
+  }
+
+  void writeStrings(std::ostream &out, const std::vector<std::string> &strs) {
+    for (auto &s : strs) {
+      auto len = static_cast<uint32_t>(s.size());
+      out.write(reinterpret_cast<const char *>(&len), sizeof(len));
+      out.write(s.data(), s.size());
+    }
+  }
+
+  bool readStrings(
+    const char *base, std::size_t size, uint64_t offset, uint32_t count,
+    std::vector<std::string> &strs) {
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t len = 0;
+      if (isOutOfBounds(offset, sizeof(len), size)) {
+        return false;
+      }
+      std::memcpy(&len, base + offset, sizeof(len));
+      offset += sizeof(len);
+      if (isOutOfBounds(offset, len, size)) {
+        return false;
+      }
+      strs.emplace_back(base + offset, len);
+      offset += len;
+    }
+    return true;
+  }
+}
+
+namespace proxypp {
+  bool CompiledRuleFile::isCompiledRuleFile(const std::string &file) {
+    std::ifstream in(file, std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    return in.read(magic, sizeof(magic)) &&
+      std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+  }
+
+  bool CompiledRuleFile::write(
+    const std::string &file, const std::vector<std::string> &rules) {
+    auto keys = RuleSnapshot::collectKeys(rules);
+    RuleAutomaton automaton(keys);
+    auto tables = automaton.getTables();
+    RuleBloomFilter filter(keys);
+    auto filterTables = filter.getTables();
+    std::vector<std::string> actionNames;
+    for (std::size_t i = 0; i < RouteAction::getCount(); ++i) {
+      actionNames.push_back(
+        RouteAction::getName(static_cast<RouteAction::Id>(i)));
+    }
+
+    std::vector<std::string> regexRules;
+    std::vector<std::string> addressRules;
+    std::vector<std::string> wildcardRules;
+    std::string key;
+    auto keyType = RuleAutomaton::KeyType::kDomain;
+    for (auto &rule : rules) {
+      auto kind = RuleSnapshot::parse(rule, key, keyType);
+      if (kind == RuleSnapshot::RuleKind::kRegex) {
+        regexRules.push_back(rule);
+      } else if (RuleSnapshot::isAddressRule(kind)) {
+        addressRules.push_back(rule);
+      } else if (kind == RuleSnapshot::RuleKind::kWildcardMatch ||
+                 kind == RuleSnapshot::RuleKind::kWildcardException) {
+        wildcardRules.push_back(rule);
+      }
+    }
+
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.formatVersion = FORMAT_VERSION;
+    header.byteOrderMark = BYTE_ORDER_MARK;
+    header.ruleCount = static_cast<uint32_t>(rules.size());
+    header.stateCount = tables.stateCount;
+    header.classCount = tables.classCount;
+    header.emptyKeyOutputs = tables.emptyKeyOutputs;
+    header.emptyKeyAction = tables.emptyKeyAction;
+    header.regexCount = static_cast<uint32_t>(regexRules.size());
+    header.addressRuleCount = static_cast<uint32_t>(addressRules.size());
+    header.wildcardRuleCount = static_cast<uint32_t>(wildcardRules.size());
+    header.actionNameCount = static_cast<uint32_t>(actionNames.size());
+    header.filterLengths = filterTables.lengths;
+    header.filterBlockCount = filterTables.blockCount;
+    header.filterMatchesAll = filterTables.matchesAll ? 1 : 0;
+    header.byteClassesOffset = sizeof(FileHeader);
+    header.transitionsOffset =
+      alignUp(header.byteClassesOffset + BYTE_CLASSES_SIZE);
+    auto transitionsSize = static_cast<uint64_t>(tables.stateCount) *
+      tables.classCount * sizeof(uint32_t);
+    header.outputsOffset = header.transitionsOffset + transitionsSize;
+    auto actionsSize = tables.actions ?
+      static_cast<uint64_t>(tables.stateCount) * ACTION_COLUMNS : 0;
+    header.actionsOffset =
+      tables.actions ? header.outputsOffset + tables.stateCount : 0;
+    header.filterOffset =
+      alignUp(header.outputsOffset + tables.stateCount + actionsSize);
+    auto filterSize = static_cast<uint64_t>(filterTables.blockCount) *
+      BLOOM_FILTER_BLOCK_SIZE;
+    header.regexOffset = header.filterOffset + filterSize;
+    header.addressRulesOffset = header.regexOffset + sizeOfStrings(regexRules);
+    header.wildcardRulesOffset =
+      header.addressRulesOffset + sizeOfStrings(addressRules);
+    header.actionNamesOffset =
+      header.wildcardRulesOffset + sizeOfStrings(wildcardRules);
+    header.fileSize = header.actionNamesOffset + sizeOfStrings(actionNames);
+
+    auto tmpFile = file + ".tmp";
+    std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      LOG_E("failed to open: %s", tmpFile.c_str());
+      return false;
+    }
+
+    static const char PADDING[8] = { 0 };
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(
+      reinterpret_cast<const char *>(tables.byteClasses), BYTE_CLASSES_SIZE);
+    out.write(PADDING, header.transitionsOffset -
+              (header.byteClassesOffset + BYTE_CLASSES_SIZE));
+    out.write(
+      reinterpret_cast<const char *>(tables.transitions), transitionsSize);
+    out.write(
+      reinterpret_cast<const char *>(tables.outputs), tables.stateCount);
+    if (tables.actions) {
+      out.write(reinterpret_cast<const char *>(tables.actions), actionsSize);
+    }
+    out.write(PADDING, header.filterOffset -
+              (header.outputsOffset + tables.stateCount + actionsSize));
+    out.write(reinterpret_cast<const char *>(filterTables.words), filterSize);
+    writeStrings(out, regexRules);
+    writeStrings(out, addressRules);
+    writeStrings(out, wildcardRules);
+    writeStrings(out, actionNames);
+    out.close();
+
+    if (!out || std::rename(tmpFile.c_str(), file.c_str()) != 0) {
+      LOG_E("failed to write: %s", file.c_str());
+      std::remove(tmpFile.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  std::shared_ptr<const CompiledRuleFile> CompiledRuleFile::load(
+    const std::string &file) {
+    auto fd = ::open(file.c_str(), O_RDONLY);
+    if (fd == -1) {
+      LOG_W("failed to open compiled rule file: %s", file.c_str());
+      return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < sizeof(FileHeader)) {
+      LOG_W("invalid compiled rule file: %s", file.c_str());
+      ::close(fd);
+      return nullptr;
+    }
+
+    auto size = static_cast<std::size_t>(st.st_size);
+    auto addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      LOG_W("failed to mmap compiled rule file: %s", file.c_str());
+      return nullptr;
+    }
+
+    std::shared_ptr<CompiledRuleFile> ruleFile{new CompiledRuleFile()};
+    ruleFile->addr_ = addr;
+    ruleFile->size_ = size;
+
+    auto base = static_cast<const char *>(addr);
+    auto header = reinterpret_cast<const FileHeader *>(base);
+    auto transitionsSize = static_cast<uint64_t>(header->stateCount) *
+      header->classCount * sizeof(uint32_t);
+    auto filterSize = static_cast<uint64_t>(header->filterBlockCount) *
+      BLOOM_FILTER_BLOCK_SIZE;
+    auto actionsSize = static_cast<uint64_t>(header->stateCount) *
+      ACTION_COLUMNS;
+    if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        header->formatVersion != FORMAT_VERSION ||
+        header->byteOrderMark != BYTE_ORDER_MARK ||
+        header->fileSize != size ||
+        header->stateCount == 0 || header->classCount < 2 ||
+        header->byteClassesOffset % alignof(uint16_t) != 0 ||
+        isOutOfBounds(header->byteClassesOffset, BYTE_CLASSES_SIZE, size) ||
+        header->transitionsOffset % alignof(uint32_t) != 0 ||
+        isOutOfBounds(header->transitionsOffset, transitionsSize, size) ||
+        isOutOfBounds(header->outputsOffset, header->stateCount, size) ||
+        (header->actionsOffset != 0 &&
+         isOutOfBounds(header->actionsOffset, actionsSize, size)) ||
+        header->actionNameCount > RouteAction::kNone ||
+        header->filterOffset % alignof(uint64_t) != 0 ||
+        isOutOfBounds(header->filterOffset, filterSize, size) ||
+        isOutOfBounds(
+          header->filterOffset, filterSize, header->regexOffset)) {
+      LOG_W("invalid or incompatible compiled rule file: %s, format: %u",
+            file.c_str(), header->formatVersion);
+      return nullptr;
+    }
+
+    auto &tables = ruleFile->tables_;
+    tables.byteClasses = reinterpret_cast<const uint16_t *>(
+      base + header->byteClassesOffset);
+    tables.classCount = header->classCount;
+    tables.transitions = reinterpret_cast<const uint32_t *>(
+      base + header->transitionsOffset);
+    tables.outputs = reinterpret_cast<const uint8_t *>(
+      base + header->outputsOffset);
+    tables.actions = header->actionsOffset == 0 ? nullptr :
+      reinterpret_cast<const uint8_t *>(base + header->actionsOffset);
+    tables.stateCount = header->stateCount;
+    tables.emptyKeyOutputs = header->emptyKeyOutputs;
+    tables.emptyKeyAction = header->emptyKeyAction;
+    auto &filterTables = ruleFile->filterTables_;
+    filterTables.words = reinterpret_cast<const uint64_t *>(
+      base + header->filterOffset);
+    filterTables.blockCount = header->filterBlockCount;
+    filterTables.lengths = header->filterLengths;
+    filterTables.matchesAll = header->filterMatchesAll != 0;
+    for (int i = 0; i < 256; ++i) {
+      if (tables.byteClasses[i] >= tables.classCount) {
+        LOG_W("corrupted compiled rule file: %s", file.c_str());
+        return nullptr;
+      }
+    }
+    // a scan follows the transitions without checking them
+    auto transitionCount =
+      static_cast<uint64_t>(tables.stateCount) * tables.classCount;
+    for (uint64_t i = 0; i < transitionCount; ++i) {
+      if (tables.transitions[i] >= tables.stateCount) {
+        LOG_W("corrupted compiled rule file: %s", file.c_str());
+        return nullptr;
+      }
+    }
+
+    if (!readStrings(base, size, header->regexOffset, header->regexCount,
+                     ruleFile->regexRules_) ||
+        !readStrings(base, size, header->addressRulesOffset,
+                     header->addressRuleCount, ruleFile->addressRules_) ||
+        !readStrings(base, size, header->wildcardRulesOffset,
+                     header->wildcardRuleCount, ruleFile->wildcardRules_) ||
+        !readStrings(base, size, header->actionNamesOffset,
+                     header->actionNameCount, ruleFile->actionNames_)) {
+      LOG_W("corrupted compiled rule file: %s", file.c_str());
+      return nullptr;
+    }
+
+    ruleFile->ruleCount_ = header->ruleCount;
+    return ruleFile;
+  }
+
+  CompiledRuleFile::~CompiledRuleFile() {
+    if (addr_) {
+      ::munmap(addr_, size_);
+    }
+  }
+
+  const RuleAutomaton::Tables &CompiledRuleFile::getTables() const {
+    return tables_;
+  }
+
+  const RuleBloomFilter::Tables &CompiledRuleFile::getFilterTables() const {
+    return filterTables_;
+  }
+
+  const std::vector<std::string> &CompiledRuleFile::getRegexRules() const {
+    return regexRules_;
+  }
+
+  const std::vector<std::string> &CompiledRuleFile::getAddressRules() const {
+    return addressRules_;
+  }
+
+  const std::vector<std::string> &CompiledRuleFile::getWildcardRules() const {
+    return wildcardRules_;
+  }
+
+  const std::vector<std::string> &CompiledRuleFile::getActionNames() const {
+    return actionNames_;
+  }
+
+  std::size_t CompiledRuleFile::getRuleCount() const {
+    return ruleCount_;
+  }
+} /* end of namspace: proxypp */
@@ -0,0 +1,80 @@
+/*******************************************************************************
+**          File: compiled_rule_file.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 09:10 AM
+**   Description: rules compiled ahead of time into a binary file, which is
+**                mmap'ed and matched by name from the mapped pages
+*******************************************************************************/
+#ifndef PROXYPP_COMPILED_RULE_FILE_H_
+#define PROXYPP_COMPILED_RULE_FILE_H_
+#include "proxypp/rule/rule_automaton.h"
+#include "proxypp/rule/rule_bloom_filter.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace proxypp {
+  /**
+   * The file is a header followed by the tables of a RuleAutomaton and a
+   * RuleBloomFilter, the regex, address and wildcard rules and the names
+   * of the action ids in the tables, located by offsets from the start of
+   * the file, in the byte order of the machine that wrote it, which is
+   * checked on load. The ids are those of rulec, see RouteAction, the
+   * names are for the process that loads the file to map them to its own.
+   * The file is not trusted when it is loaded, every section is checked to
+   * lie within it and every transition to lead to a state of the table, so
+   * the transitions are read through once, the other tables are read in as
+   * they are used.
+   * Only the automaton and the filter are used from the mapping, the
+   * regex, address and wildcard rules are copied out of it on load and
+   * built by RuleSnapshot into the same heap structures as rules read from
+   * text, so a file of many such rules saves little over a text file
+   */
+  class CompiledRuleFile final {
+    public:
+      static const uint32_t FORMAT_VERSION = 5;
+
+      // true if the file starts with the magic of a compiled rule file
+      static bool isCompiledRuleFile(const std::string &file);
+      // rules must be valid, see RuleSnapshot::isValid(), the file is
+      // written next to the target and renamed over it, so a running
+      // process that has the old file mapped is not affected
+      static bool write(
+        const std::string &file, const std::vector<std::string> &rules);
+      static std::shared_ptr<const CompiledRuleFile> load(
+        const std::string &file);
+
+      ~CompiledRuleFile();
+
+      const RuleAutomaton::Tables &getTables() const;
+      const RuleBloomFilter::Tables &getFilterTables() const;
+      // the rules as they are written, the patterns are compiled on load
+      const std::vector<std::string> &getRegexRules() const;
+      // the rules as they are written, the tree is built on load
+      const std::vector<std::string> &getAddressRules() const;
+      // the rules as they are written, the automaton has their keys
+      const std::vector<std::string> &getWildcardRules() const;
+      // indexed by the action ids in the tables
+      const std::vector<std::string> &getActionNames() const;
+      std::size_t getRuleCount() const;
+
+    private:
+      CompiledRuleFile() = default;
+      CompiledRuleFile(const CompiledRuleFile &) = delete;
+      CompiledRuleFile &operator=(const CompiledRuleFile &) = delete;
+
+    private:
+      void *addr_{nullptr};
+      std::size_t size_{0};
+      RuleAutomaton::Tables tables_;
+      RuleBloomFilter::Tables filterTables_;
+      std::vector<std::string> regexRules_;
+      std::vector<std::string> addressRules_;
+      std::vector<std::string> wildcardRules_;
+      std::vector<std::string> actionNames_;
+      std::size_t ruleCount_{0};
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_COMPILED_RULE_FILE_H_ */
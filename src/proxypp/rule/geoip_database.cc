@@ -0,0 +1,339 @@
+/*******************************************************************************
+**          File: geoip_database.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 02:40 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/geoip_database.h"
+#include "nul/log.h"
+
+#include <fstream>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+  using Address = proxypp::IpPrefixTree::Address;
+
+  static const char MAGIC[8] = { 'P', 'P', 'G', 'E', 'O', 'I', 'P', '\0' };
+  static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+  static const uint64_t IPV4_MAPPED_LO = 0xffffULL << 32;
+  // a start and a country
+  static const uint64_t IPV4_ENTRY_SIZE = sizeof(uint32_t) + sizeof(uint16_t);
+  static const uint64_t IPV6_ENTRY_SIZE =
+    sizeof(uint64_t) * 2 + sizeof(uint16_t);
+
+  struct FileHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t byteOrderMark;
+    uint32_t ipv4Count;
+    uint32_t ipv6Count;
+    // offsets from the start of the file, the countries of a family
+    // follow the starts of it
+    uint64_t ipv4Offset;
+    uint64_t ipv6Offset;
+    uint64_t fileSize;
+  };
+  static_assert(sizeof(FileHeader) == 48, "unexpected padding in FileHeader");
+
+  struct Range {
+    Address start;
+    Address end;
+    uint16_t country;
+  };
+
+  inline uint64_t alignUp(uint64_t n) {
+    return (n + 7) & ~static_cast<uint64_t>(7);
+  }
+
+  // written so that nothing read from the file can wrap the sum around
+  inline bool isOutOfBounds(uint64_t offset, uint64_t len, uint64_t size) {
+    return offset > size || len > size - offset;
+  }
+
+  inline bool isLess(const Address &a, const Address &b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+  }
+
+  inline bool isIPv4Mapped(const Address &addr) {
+    return addr.hi == 0 && (addr.lo >> 32) == 0xffff;
+  }
+
+  // false if addr is the last address
+  inline bool increment(Address &addr) {
+    if (++addr.lo == 0) {
+      return ++addr.hi != 0;
+    }
+    return true;
+  }
+
+  std::string unquote(const std::string &field) {
+    auto start = field.find_first_not_of(" \t\"");
+    auto end = field.find_last_not_of(" \t\"\r");
+    return start == std::string::npos ?
+      std::string{} : field.substr(start, end - start + 1);
+  }
+
+  // sorted ranges to the starts of the ranges and the gaps between them,
+  // neighbours of the same country are merged
+  void flatten(
+    const std::vector<Range> &ranges,
+    std::vector<Address> &starts,
+    std::vector<uint16_t> &countries,
+    std::size_t &overlaps) {
+    auto append = [&starts, &countries](const Address &start, uint16_t c) {
+      if (countries.empty() || countries.back() != c) {
+        starts.push_back(start);
+        countries.push_back(c);
+      }
+    };
+
+    Address next{0, 0};
+    auto exhausted = false;
+    for (auto &range : ranges) {
+      if (exhausted || isLess(range.start, next)) {
+        ++overlaps;
+        continue;
+      }
+      if (isLess(next, range.start)) {
+        append(next, 0);
+      }
+      append(range.start, range.country);
+      next = range.end;
+      exhausted = !increment(next);
+    }
+    if (!exhausted) {
+      append(next, 0);
+    }
+  }
+}
+
+namespace proxypp {
+  uint16_t GeoIpDatabase::toCountryCode(const std::string &country) {
+    if (country.size() != 2 ||
+        !std::isalpha(static_cast<unsigned char>(country[0])) ||
+        !std::isalpha(static_cast<unsigned char>(country[1]))) {
+      return 0;
+    }
+    return static_cast<uint16_t>(
+      (std::toupper(static_cast<unsigned char>(country[0])) << 8) |
+      std::toupper(static_cast<unsigned char>(country[1])));
+  }
+
+  bool GeoIpDatabase::compileCsv(
+    const std::string &csvFile, const std::string &file) {
+    std::ifstream in(csvFile, std::ios::binary);
+    if (!in.is_open()) {
+      LOG_E("failed to open: %s", csvFile.c_str());
+      return false;
+    }
+
+    std::vector<Range> ipv4Ranges;
+    std::vector<Range> ipv6Ranges;
+    std::size_t invalidLines = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+      auto comma1 = line.find(',');
+      auto comma2 = comma1 == std::string::npos ?
+        comma1 : line.find(',', comma1 + 1);
+      if (comma2 == std::string::npos) {
+        ++invalidLines;
+        continue;
+      }
+      auto comma3 = line.find(',', comma2 + 1);
+
+      Range range;
+      auto startIp = unquote(line.substr(0, comma1));
+      auto endIp = unquote(line.substr(comma1 + 1, comma2 - comma1 - 1));
+      range.country = toCountryCode(unquote(line.substr(
+            comma2 + 1, comma3 == std::string::npos ?
+            std::string::npos : comma3 - comma2 - 1)));
+      if (range.country == 0 ||
+          !IpPrefixTree::parseAddress(startIp, range.start) ||
+          !IpPrefixTree::parseAddress(endIp, range.end) ||
+          isIPv4Mapped(range.start) != isIPv4Mapped(range.end) ||
+          isLess(range.end, range.start)) {
+        ++invalidLines;
+        continue;
+      }
+      (isIPv4Mapped(range.start) ? ipv4Ranges : ipv6Ranges).push_back(range);
+    }
+    if (invalidLines > 0) {
+      LOG_W("ignored %zu invalid lines in: %s", invalidLines, csvFile.c_str());
+    }
+
+    auto byStart = [](const Range &a, const Range &b) {
+      return isLess(a.start, b.start);
+    };
+    std::sort(ipv4Ranges.begin(), ipv4Ranges.end(), byStart);
+    std::sort(ipv6Ranges.begin(), ipv6Ranges.end(), byStart);
+
+    // IPv4 ranges are flattened within ::ffff:0:0/96, then cut down to
+    // the IPv4 addresses
+    std::vector<Address> ipv4Starts;
+    std::vector<uint16_t> ipv4Countries;
+    std::vector<Address> ipv6Starts;
+    std::vector<uint16_t> ipv6Countries;
+    std::size_t overlaps = 0;
+    for (auto &range : ipv4Ranges) {
+      range.start.lo -= IPV4_MAPPED_LO;
+      range.end.lo -= IPV4_MAPPED_LO;
+    }
+    flatten(ipv4Ranges, ipv4Starts, ipv4Countries, overlaps);
+    if (!ipv4Starts.empty() && ipv4Starts.back().lo > 0xffffffffULL) {
+      ipv4Starts.pop_back();
+      ipv4Countries.pop_back();
+    }
+    flatten(ipv6Ranges, ipv6Starts, ipv6Countries, overlaps);
+    if (overlaps > 0) {
+      LOG_W("ignored %zu overlapping ranges in: %s",
+            overlaps, csvFile.c_str());
+    }
+
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.formatVersion = FORMAT_VERSION;
+    header.byteOrderMark = BYTE_ORDER_MARK;
+    header.ipv4Count = static_cast<uint32_t>(ipv4Starts.size());
+    header.ipv6Count = static_cast<uint32_t>(ipv6Starts.size());
+    header.ipv4Offset = sizeof(FileHeader);
+    auto ipv4End = header.ipv4Offset + header.ipv4Count * IPV4_ENTRY_SIZE;
+    header.ipv6Offset = alignUp(ipv4End);
+    auto ipv6End = header.ipv6Offset + header.ipv6Count * IPV6_ENTRY_SIZE;
+    header.fileSize = alignUp(ipv6End);
+
+    auto tmpFile = file + ".tmp";
+    std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      LOG_E("failed to open: %s", tmpFile.c_str());
+      return false;
+    }
+
+    static const char PADDING[8] = { 0 };
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (auto &start : ipv4Starts) {
+      auto ip = static_cast<uint32_t>(start.lo);
+      out.write(reinterpret_cast<const char *>(&ip), sizeof(ip));
+    }
+    out.write(reinterpret_cast<const char *>(ipv4Countries.data()),
+              ipv4Countries.size() * sizeof(uint16_t));
+    out.write(PADDING, header.ipv6Offset - ipv4End);
+    for (auto &start : ipv6Starts) {
+      out.write(reinterpret_cast<const char *>(&start.hi), sizeof(start.hi));
+      out.write(reinterpret_cast<const char *>(&start.lo), sizeof(start.lo));
+    }
+    out.write(reinterpret_cast<const char *>(ipv6Countries.data()),
+              ipv6Countries.size() * sizeof(uint16_t));
+    out.write(PADDING, header.fileSize - ipv6End);
+    out.close();
+
+    if (!out || std::rename(tmpFile.c_str(), file.c_str()) != 0) {
+      LOG_E("failed to write: %s", file.c_str());
+      std::remove(tmpFile.c_str());
+      return false;
+    }
+    LOG_I("compiled %zu IPv4 and %zu IPv6 ranges into: %s",
+          ipv4Starts.size(), ipv6Starts.size(), file.c_str());
+    return true;
+  }
+
+  std::shared_ptr<const GeoIpDatabase> GeoIpDatabase::load(
+    const std::string &file) {
+    auto fd = ::open(file.c_str(), O_RDONLY);
+    if (fd == -1) {
+      LOG_W("failed to open GeoIP database: %s", file.c_str());
+      return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < sizeof(FileHeader)) {
+      LOG_W("invalid GeoIP database: %s", file.c_str());
+      ::close(fd);
+      return nullptr;
+    }
+
+    auto size = static_cast<std::size_t>(st.st_size);
+    auto addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      LOG_W("failed to mmap GeoIP database: %s", file.c_str());
+      return nullptr;
+    }
+
+    std::shared_ptr<GeoIpDatabase> db{new GeoIpDatabase()};
+    db->addr_ = addr;
+    db->size_ = size;
+
+    auto base = static_cast<const char *>(addr);
+    auto header = reinterpret_cast<const FileHeader *>(base);
+    if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        header->formatVersion != FORMAT_VERSION ||
+        header->byteOrderMark != BYTE_ORDER_MARK ||
+        header->fileSize != size ||
+        header->ipv4Offset % alignof(uint32_t) != 0 ||
+        isOutOfBounds(
+          header->ipv4Offset, header->ipv4Count * IPV4_ENTRY_SIZE, size) ||
+        header->ipv6Offset % alignof(uint64_t) != 0 ||
+        isOutOfBounds(
+          header->ipv6Offset, header->ipv6Count * IPV6_ENTRY_SIZE, size)) {
+      LOG_W("invalid or incompatible GeoIP database: %s, format: %u",
+            file.c_str(), header->formatVersion);
+      return nullptr;
+    }
+
+    db->ipv4Count_ = header->ipv4Count;
+    db->ipv4Starts_ =
+      reinterpret_cast<const uint32_t *>(base + header->ipv4Offset);
+    db->ipv4Countries_ = reinterpret_cast<const uint16_t *>(
+      base + header->ipv4Offset + header->ipv4Count * sizeof(uint32_t));
+    db->ipv6Count_ = header->ipv6Count;
+    db->ipv6Starts_ =
+      reinterpret_cast<const uint64_t *>(base + header->ipv6Offset);
+    db->ipv6Countries_ = reinterpret_cast<const uint16_t *>(
+      base + header->ipv6Offset + header->ipv6Count * sizeof(uint64_t) * 2);
+    LOG_I("loaded GeoIP database: %s, %u IPv4 and %u IPv6 ranges",
+          file.c_str(), header->ipv4Count, header->ipv6Count);
+    return db;
+  }
+
+  GeoIpDatabase::~GeoIpDatabase() {
+    if (addr_) {
+      ::munmap(addr_, size_);
+    }
+  }
+
+  uint16_t GeoIpDatabase::lookup(const IpPrefixTree::Address &addr) const {
+    if (isIPv4Mapped(addr)) {
+      auto ip = static_cast<uint32_t>(addr.lo);
+      auto end = ipv4Starts_ + ipv4Count_;
+      auto it = std::upper_bound(ipv4Starts_, end, ip);
+      return it == ipv4Starts_ ? 0 : ipv4Countries_[it - ipv4Starts_ - 1];
+    }
+
+    // the last range that starts at or before addr
+    uint32_t lo = 0;
+    uint32_t hi = ipv6Count_;
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      Address start{ipv6Starts_[mid * 2], ipv6Starts_[mid * 2 + 1]};
+      if (isLess(addr, start)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo == 0 ? 0 : ipv6Countries_[lo - 1];
+  }
+
+  std::size_t GeoIpDatabase::getRangeCount() const {
+    return ipv4Count_ + ipv6Count_;
+  }
+} /* end of namspace: proxypp */
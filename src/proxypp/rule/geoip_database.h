@@ -0,0 +1,63 @@
+/*******************************************************************************
+**          File: geoip_database.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 02:15 PM
+**   Description: IP range to country database, mmap'ed and binary searched
+*******************************************************************************/
+#ifndef PROXYPP_GEOIP_DATABASE_H_
+#define PROXYPP_GEOIP_DATABASE_H_
+#include "proxypp/rule/ip_prefix_tree.h"
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+namespace proxypp {
+  /**
+   * The file holds the starts of the IPv4 ranges and of the IPv6 ranges,
+   * sorted, each followed by the countries of the ranges, a range ends
+   * where the next one starts. It is built by rulec from a CSV file of
+   * "start_ip,end_ip,country_code" lines, the format most free databases
+   * are published in. lookup() reads the mapped pages only, so it is safe
+   * to call from any thread without locking and never allocates
+   */
+  class GeoIpDatabase final {
+    public:
+      static const uint32_t FORMAT_VERSION = 1;
+
+      // "CN" -> 0x434e, case insensitive, 0 if it is not two letters
+      static uint16_t toCountryCode(const std::string &country);
+
+      // the database is written next to the target and renamed over it
+      static bool compileCsv(
+        const std::string &csvFile, const std::string &file);
+      static std::shared_ptr<const GeoIpDatabase> load(
+        const std::string &file);
+
+      ~GeoIpDatabase();
+
+      // the country code of the address, 0 if it is not in the database
+      uint16_t lookup(const IpPrefixTree::Address &addr) const;
+
+      std::size_t getRangeCount() const;
+
+    private:
+      GeoIpDatabase() = default;
+      GeoIpDatabase(const GeoIpDatabase &) = delete;
+      GeoIpDatabase &operator=(const GeoIpDatabase &) = delete;
+
+    private:
+      void *addr_{nullptr};
+      std::size_t size_{0};
+
+      const uint32_t *ipv4Starts_{nullptr};
+      const uint16_t *ipv4Countries_{nullptr};
+      uint32_t ipv4Count_{0};
+      // hi and lo of every start
+      const uint64_t *ipv6Starts_{nullptr};
+      const uint16_t *ipv6Countries_{nullptr};
+      uint32_t ipv6Count_{0};
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_GEOIP_DATABASE_H_ */
@@ -0,0 +1,297 @@
+/*******************************************************************************
+**          File: ip_prefix_tree.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 11:48 AM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/ip_prefix_tree.h"
+
+#include <cstdlib>
+#include <algorithm>
+#include <arpa/inet.h>
+
+namespace {
+  using Address = proxypp::IpPrefixTree::Address;
+
+  static const uint32_t NO_NODE = 0;
+  static const uint8_t MAX_PREFIX_LEN = 128;
+  static const uint8_t IPV4_MAPPED_PREFIX_LEN = 96;
+  static const uint64_t IPV4_MAPPED_LO = 0xffffULL << 32;
+  static const uint32_t BUCKET_COUNT = 1 << 16;
+
+  inline uint64_t loadBigEndian(const uint8_t *p) {
+    uint64_t n = 0;
+    for (int i = 0; i < 8; ++i) {
+      n = (n << 8) | p[i];
+    }
+    return n;
+  }
+
+  inline Address mask(const Address &addr, uint8_t len) {
+    Address masked;
+    masked.hi = len >= 64 ? addr.hi : len == 0 ? 0 :
+      addr.hi & (~0ULL << (64 - len));
+    masked.lo = len >= 128 ? addr.lo : len <= 64 ? 0 :
+      addr.lo & (~0ULL << (128 - len));
+    return masked;
+  }
+
+  inline int bitAt(const Address &addr, uint8_t pos) {
+    return pos < 64 ?
+      static_cast<int>((addr.hi >> (63 - pos)) & 1) :
+      static_cast<int>((addr.lo >> (127 - pos)) & 1);
+  }
+
+  inline bool isLess(const Address &a, const Address &b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+  }
+
+  inline Address lastAddress(const Address &prefix, uint8_t len) {
+    auto masked = mask(Address{~0ULL, ~0ULL}, len);
+    return Address{prefix.hi | ~masked.hi, prefix.lo | ~masked.lo};
+  }
+
+  inline bool isIPv4Mapped(const Address &addr) {
+    return addr.hi == 0 && (addr.lo >> 32) == 0xffff;
+  }
+
+  inline uint8_t commonPrefixLen(const Address &a, const Address &b) {
+    auto diff = a.hi ^ b.hi;
+    if (diff != 0) {
+      return static_cast<uint8_t>(__builtin_clzll(diff));
+    }
+    diff = a.lo ^ b.lo;
+    if (diff != 0) {
+      return static_cast<uint8_t>(64 + __builtin_clzll(diff));
+    }
+    return MAX_PREFIX_LEN;
+  }
+}
+
+namespace proxypp {
+  bool IpPrefixTree::parseAddress(const std::string &ip, Address &addr) {
+    uint8_t bytes[16];
+    if (inet_pton(AF_INET6, ip.c_str(), bytes) != 1) {
+      uint8_t v4[4];
+      if (inet_pton(AF_INET, ip.c_str(), v4) != 1) {
+        return false;
+      }
+      for (int i = 0; i < 10; ++i) {
+        bytes[i] = 0;
+      }
+      bytes[10] = 0xff;
+      bytes[11] = 0xff;
+      for (int i = 0; i < 4; ++i) {
+        bytes[12 + i] = v4[i];
+      }
+    }
+    addr.hi = loadBigEndian(bytes);
+    addr.lo = loadBigEndian(bytes + 8);
+    return true;
+  }
+
+  bool IpPrefixTree::parsePrefix(
+    const std::string &cidr, Address &prefix, uint8_t &prefixLen) {
+    auto slash = cidr.find('/');
+    if (slash == std::string::npos || slash + 1 == cidr.size() ||
+        cidr.size() - slash > 4) {
+      return false;
+    }
+    for (auto i = slash + 1; i < cidr.size(); ++i) {
+      if (cidr[i] < '0' || cidr[i] > '9') {
+        return false;
+      }
+    }
+
+    auto ip = cidr.substr(0, slash);
+    auto len = std::atoi(cidr.c_str() + slash + 1);
+    auto isIPv4 = ip.find(':') == std::string::npos;
+    if (len > (isIPv4 ? 32 : 128) || !parseAddress(ip, prefix)) {
+      return false;
+    }
+
+    prefixLen = static_cast<uint8_t>(
+      isIPv4 ? IPV4_MAPPED_PREFIX_LEN + len : len);
+    prefix = mask(prefix, prefixLen);
+    return true;
+  }
+
+  IpPrefixTree::IpPrefixTree() {
+    newNode(Address{0, 0}, 0, Action::kNone, RouteAction::kNone);
+  }
+
+  void IpPrefixTree::insert(
+    const Address &addr, uint8_t prefixLen, Action action,
+    RouteAction::Id routeAction) {
+    auto prefix = mask(addr, prefixLen);
+    // the prefix of the current node is always a prefix of the new one
+    uint32_t current = 0;
+    while (true) {
+      if (nodes_[current].prefixLen == prefixLen) {
+        auto &node = nodes_[current];
+        if (node.action == Action::kNone) {
+          ++size_;
+          node.action = action;
+          node.routeAction = routeAction;
+        } else if (node.action == Action::kMatch) {
+          node.routeAction = action == Action::kMatch ?
+            std::min(node.routeAction, routeAction) : routeAction;
+          node.action = action;
+        }
+        return;
+      }
+
+      auto branch = bitAt(prefix, nodes_[current].prefixLen);
+      auto child = nodes_[current].children[branch];
+      if (child == NO_NODE) {
+        auto leaf = newNode(prefix, prefixLen, action, routeAction);
+        nodes_[current].children[branch] = leaf;
+        ++size_;
+        return;
+      }
+
+      auto childLen = nodes_[child].prefixLen;
+      auto common = commonPrefixLen(prefix, nodes_[child].prefix);
+      if (common >= childLen && prefixLen >= childLen) {
+        current = child;
+        continue;
+      }
+
+      // the new prefix goes between the current node and the child,
+      // either as the parent of the child or as the sibling of it
+      auto splitLen = std::min(common, prefixLen);
+      auto split = splitLen == prefixLen ?
+        newNode(prefix, prefixLen, action, routeAction) :
+        newNode(mask(prefix, splitLen), splitLen, Action::kNone,
+                RouteAction::kNone);
+      nodes_[split].children[bitAt(nodes_[child].prefix, splitLen)] = child;
+      if (splitLen != prefixLen) {
+        auto leaf = newNode(prefix, prefixLen, action, routeAction);
+        nodes_[split].children[bitAt(prefix, splitLen)] = leaf;
+      }
+      nodes_[current].children[branch] = split;
+      ++size_;
+      return;
+    }
+  }
+
+  void IpPrefixTree::build() {
+    rangeStarts_.clear();
+    rangeActions_.clear();
+    rangeRouteActions_.clear();
+    appendRanges(0, Action::kNone, RouteAction::kNone);
+    buildIndex(ipv4Index_, Address{0, IPV4_MAPPED_LO}, true);
+    buildIndex(ipv6Index_, Address{0, 0}, false);
+    std::vector<Node>().swap(nodes_);
+  }
+
+  IpPrefixTree::Action IpPrefixTree::lookup(
+    const Address &addr, RouteAction::Id *routeAction) const {
+    if (rangeStarts_.empty()) {
+      if (routeAction) {
+        *routeAction = RouteAction::kNone;
+      }
+      return Action::kNone;
+    }
+    uint32_t bucket;
+    const uint32_t *index;
+    if (isIPv4Mapped(addr)) {
+      bucket = static_cast<uint32_t>(addr.lo >> 16) & 0xffff;
+      index = ipv4Index_.data();
+    } else {
+      bucket = static_cast<uint32_t>(addr.hi >> 48);
+      index = ipv6Index_.data();
+    }
+
+    // the range at index[bucket] starts at or before addr, the one after
+    // index[bucket + 1] starts after the end of the bucket
+    auto first = rangeStarts_.begin() + index[bucket];
+    auto last = rangeStarts_.begin() + index[bucket + 1] + 1;
+    auto it = std::upper_bound(first, last, addr, isLess);
+    auto range = it - rangeStarts_.begin() - 1;
+    if (routeAction) {
+      *routeAction = rangeRouteActions_[range];
+    }
+    return rangeActions_[range];
+  }
+
+  std::size_t IpPrefixTree::size() const {
+    return size_;
+  }
+
+  void IpPrefixTree::appendRanges(
+    uint32_t current, Action inherited, RouteAction::Id inheritedRoute) {
+    auto &node = nodes_[current];
+    auto action = inherited;
+    auto routeAction = inheritedRoute;
+    if (node.action != Action::kNone) {
+      action = node.action;
+      routeAction = node.action == Action::kMatch ?
+        node.routeAction : RouteAction::kNone;
+    }
+    appendRange(node.prefix, action, routeAction);
+    for (auto child : node.children) {
+      if (child == NO_NODE) {
+        continue;
+      }
+      appendRanges(child, action, routeAction);
+      // back to this node after the child, if the child ends where this
+      // node does, the parent overwrites the range right away
+      auto end = lastAddress(nodes_[child].prefix, nodes_[child].prefixLen);
+      if (end.lo != ~0ULL) {
+        appendRange(Address{end.hi, end.lo + 1}, action, routeAction);
+      } else if (end.hi != ~0ULL) {
+        appendRange(Address{end.hi + 1, 0}, action, routeAction);
+      }
+    }
+  }
+
+  void IpPrefixTree::appendRange(
+    const Address &start, Action action, RouteAction::Id routeAction) {
+    if (!rangeStarts_.empty() && rangeStarts_.back().hi == start.hi &&
+        rangeStarts_.back().lo == start.lo) {
+      rangeStarts_.pop_back();
+      rangeActions_.pop_back();
+      rangeRouteActions_.pop_back();
+    }
+    if (rangeActions_.empty() || rangeActions_.back() != action ||
+        rangeRouteActions_.back() != routeAction) {
+      rangeStarts_.push_back(start);
+      rangeActions_.push_back(action);
+      rangeRouteActions_.push_back(routeAction);
+    }
+  }
+
+  void IpPrefixTree::buildIndex(
+    std::vector<uint32_t> &index, const Address &first, bool ipv4) {
+    index.resize(BUCKET_COUNT + 1);
+    for (uint32_t bucket = 0; bucket <= BUCKET_COUNT; ++bucket) {
+      Address start = first;
+      if (bucket == BUCKET_COUNT) {
+        start = ipv4 ?
+          Address{0, IPV4_MAPPED_LO | 0xffffffffULL} : Address{~0ULL, ~0ULL};
+      } else if (ipv4) {
+        start.lo |= static_cast<uint64_t>(bucket) << 16;
+      } else {
+        start.hi = static_cast<uint64_t>(bucket) << 48;
+      }
+      auto it = std::upper_bound(
+        rangeStarts_.begin(), rangeStarts_.end(), start, isLess);
+      index[bucket] = static_cast<uint32_t>(it - rangeStarts_.begin() - 1);
+    }
+  }
+
+  uint32_t IpPrefixTree::newNode(
+    const Address &prefix, uint8_t prefixLen, Action action,
+    RouteAction::Id routeAction) {
+    Node node;
+    node.prefix = prefix;
+    node.prefixLen = prefixLen;
+    node.action = action;
+    node.routeAction = routeAction;
+    node.children[0] = NO_NODE;
+    node.children[1] = NO_NODE;
+    nodes_.push_back(node);
+    return static_cast<uint32_t>(nodes_.size() - 1);
+  }
+} /* end of namspace: proxypp */
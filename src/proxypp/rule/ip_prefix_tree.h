@@ -0,0 +1,102 @@
+/*******************************************************************************
+**          File: ip_prefix_tree.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 11:20 AM
+**   Description: IPv4 and IPv6 prefixes with longest prefix match lookup
+*******************************************************************************/
+#ifndef PROXYPP_IP_PREFIX_TREE_H_
+#define PROXYPP_IP_PREFIX_TREE_H_
+#include "proxypp/rule/route_action.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace proxypp {
+  /**
+   * IPv4 addresses are stored as IPv4-mapped IPv6 addresses (::ffff:0:0/96)
+   * so both families live in one tree. The prefixes are inserted into a
+   * path compressed radix tree, which build() then flattens into sorted,
+   * disjoint address ranges with the action of the longest prefix pushed
+   * down to each of them. lookup() indexes the ranges by the first 16 bits
+   * of the address (of the IPv4 address for the mapped ones) and searches
+   * the few ranges under them, so it touches a handful of cache lines
+   * however many prefixes there are, where walking the tree would miss the
+   * cache at every level. Immutable after build(), which is how RuleSnapshot
+   * uses it
+   */
+  class IpPrefixTree final {
+    public:
+      enum class Action : uint8_t {
+        kNone,
+        kMatch,
+        kException
+      };
+
+      // 128 bits, most significant first
+      struct Address {
+        uint64_t hi;
+        uint64_t lo;
+      };
+
+      static bool parseAddress(const std::string &ip, Address &addr);
+      // "10.0.0.0/8", "2001:db8::/32", the bits after the prefix are cleared
+      static bool parsePrefix(
+        const std::string &cidr, Address &prefix, uint8_t &prefixLen);
+
+      IpPrefixTree();
+
+      // an exception wins over a match of the same prefix, and of two
+      // matches, the lower routeAction
+      void insert(
+        const Address &prefix, uint8_t prefixLen, Action action,
+        RouteAction::Id routeAction = RouteAction::kProxy);
+      // called once after the last insert(), the tree is dropped
+      void build();
+      // the action of the longest prefix that contains the address, and
+      // for kMatch, its routeAction if it is asked for
+      Action lookup(
+        const Address &addr, RouteAction::Id *routeAction = nullptr) const;
+
+      // number of prefixes inserted
+      std::size_t size() const;
+
+    private:
+      struct Node {
+        Address prefix;
+        uint8_t prefixLen;
+        Action action;
+        RouteAction::Id routeAction;
+        // indices into nodes_, 0 for none as the root is never a child
+        uint32_t children[2];
+      };
+
+      uint32_t newNode(
+        const Address &prefix, uint8_t prefixLen, Action action,
+        RouteAction::Id routeAction);
+      // appends the ranges of the node and its subtree in address order
+      void appendRanges(
+        uint32_t node, Action inherited, RouteAction::Id inheritedRoute);
+      void appendRange(
+        const Address &start, Action action, RouteAction::Id routeAction);
+      // index[i] is the last range that starts at or before bucket i
+      void buildIndex(
+        std::vector<uint32_t> &index, const Address &first, bool ipv4);
+
+    private:
+      std::vector<Node> nodes_;
+      std::size_t size_{0};
+
+      // starts of the ranges, sorted, the first one is ::
+      std::vector<Address> rangeStarts_;
+      std::vector<Action> rangeActions_;
+      std::vector<RouteAction::Id> rangeRouteActions_;
+      // 65536 buckets and one past the last, for ::ffff:0:0/96 by the
+      // first 16 bits of the IPv4 address, and for the rest by the first
+      // 16 bits of the address
+      std::vector<uint32_t> ipv4Index_;
+      std::vector<uint32_t> ipv6Index_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_IP_PREFIX_TREE_H_ */
@@ -0,0 +1,198 @@
+/*******************************************************************************
+**          File: layered_rule_automaton.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 09:40 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/layered_rule_automaton.h"
+
+#include <algorithm>
+
+namespace {
+  // the layers may grow to this many keys plus an eighth of the base
+  // automaton before it is built anew
+  static const std::size_t MIN_LAYERED_KEYS = 1024;
+}
+
+namespace proxypp {
+  LayeredRuleAutomaton::Base::Base(
+    const std::vector<RuleAutomaton::Key> &keys) :
+    automaton(keys), filter(keys), keyCount(keys.size()) {
+    for (auto &key : keys) {
+      auto encoded = encode(key);
+      if (keyCounts[encoded]++ == 0) {
+        keyActions[encoded.erase(1, 1)].push_back(key.action);
+      }
+    }
+  }
+
+  LayeredRuleAutomaton::LayeredRuleAutomaton(
+    const std::vector<RuleAutomaton::Key> &keys) :
+    base_(std::make_shared<const Base>(keys)),
+    addedAutomaton_({}), addedFilter_({}), removedAutomaton_({}) {
+  }
+
+  LayeredRuleAutomaton::LayeredRuleAutomaton(
+    const LayeredRuleAutomaton &previous,
+    const std::vector<RuleAutomaton::Key> &addedKeys,
+    const std::vector<RuleAutomaton::Key> &removedKeys) :
+    base_(previous.base_), deltas_(previous.deltas_),
+    addedAutomaton_({}), addedFilter_({}), removedAutomaton_({}) {
+    auto apply = [this](const RuleAutomaton::Key &key, int32_t change) {
+      auto encoded = encode(key);
+      auto it = deltas_.find(encoded);
+      if (it == deltas_.end()) {
+        deltas_.emplace(std::move(encoded), change);
+      } else if ((it->second += change) == 0) {
+        deltas_.erase(it);
+      }
+    };
+    for (auto &key : addedKeys) {
+      apply(key, 1);
+    }
+    for (auto &key : removedKeys) {
+      apply(key, -1);
+    }
+
+    std::vector<RuleAutomaton::Key> added;
+    std::vector<RuleAutomaton::Key> removed;
+    for (auto &entry : deltas_) {
+      auto it = base_->keyCounts.find(entry.first);
+      auto baseCount = it == base_->keyCounts.end() ?
+        0 : static_cast<int32_t>(it->second);
+      if (baseCount == 0 && entry.second > 0) {
+        added.push_back(decode(entry.first));
+      } else if (baseCount > 0 && baseCount + entry.second <= 0) {
+        removed.push_back(decode(entry.first));
+      }
+    }
+
+    addedAutomaton_ = RuleAutomaton(added);
+    addedFilter_ = RuleBloomFilter(added);
+    addedKeyCount_ = added.size();
+    removedAutomaton_ = RuleAutomaton(removed);
+    removedKeyCount_ = removed.size();
+  }
+
+  bool LayeredRuleAutomaton::mayMatch(const std::string &host) const {
+    return base_->filter.mayMatch(host) ||
+      (addedKeyCount_ > 0 && addedFilter_.mayMatch(host));
+  }
+
+  RuleAutomaton::Result LayeredRuleAutomaton::scan(
+    const std::string &host, uint16_t port) const {
+    auto result = base_->automaton.scan(host, port);
+    if (removedKeyCount_ > 0) {
+      // only the hosts some removed key matches can have a different
+      // result, which is rare enough to look up the keys one by one
+      auto removedResult = removedAutomaton_.scan(host, port);
+      if ((removedResult.matched && result.matched) ||
+          (removedResult.excepted && result.excepted)) {
+        // a stale wildcard flag only costs RuleSnapshot some lookups
+        auto wildcard = result.wildcard;
+        result = scanBaseKeys(host, port);
+        result.wildcard = wildcard;
+      }
+    }
+    if (addedKeyCount_ > 0) {
+      auto addedResult = addedAutomaton_.scan(host, port);
+      result.matched = result.matched || addedResult.matched;
+      result.excepted = result.excepted || addedResult.excepted;
+      result.wildcard = result.wildcard || addedResult.wildcard;
+      result.action = std::min(result.action, addedResult.action);
+    }
+    return result;
+  }
+
+  bool LayeredRuleAutomaton::canLayer(std::size_t changeCount) const {
+    return deltas_.size() + changeCount <=
+      MIN_LAYERED_KEYS + base_->keyCount / 8;
+  }
+
+  std::size_t LayeredRuleAutomaton::getLayeredKeyCount() const {
+    return deltas_.size();
+  }
+
+  std::size_t LayeredRuleAutomaton::getStateCount() const {
+    return base_->automaton.getStateCount() +
+      addedAutomaton_.getStateCount() + removedAutomaton_.getStateCount();
+  }
+
+  std::string LayeredRuleAutomaton::encode(const RuleAutomaton::Key &key) {
+    std::string encoded;
+    encoded.reserve(key.key.size() + 2);
+    encoded.push_back(static_cast<char>(
+        static_cast<int>(key.type) * 2 + (key.exception ? 1 : 0)));
+    encoded.push_back(static_cast<char>(key.action));
+    encoded.append(key.key);
+    return encoded;
+  }
+
+  RuleAutomaton::Key LayeredRuleAutomaton::decode(const std::string &encoded) {
+    RuleAutomaton::Key key;
+    key.key = encoded.substr(2);
+    key.type = static_cast<RuleAutomaton::KeyType>(encoded[0] / 2);
+    key.exception = encoded[0] % 2 != 0;
+    key.action = static_cast<RouteAction::Id>(encoded[1]);
+    return key;
+  }
+
+  RuleAutomaton::Result LayeredRuleAutomaton::scanBaseKeys(
+    const std::string &host, uint16_t port) const {
+    RuleAutomaton::Result result;
+    std::string encoded;
+    auto lookup = [&](RuleAutomaton::KeyType type, std::size_t pos,
+                      std::size_t len) {
+      for (auto exception : {false, true}) {
+        encoded.assign(1, static_cast<char>(
+            static_cast<int>(type) * 2 + (exception ? 1 : 0)));
+        encoded.append(host, pos, len);
+        auto it = base_->keyActions.find(encoded);
+        if (it == base_->keyActions.end()) {
+          continue;
+        }
+        for (auto action : it->second) {
+          encoded.insert(1, 1, static_cast<char>(action));
+          if (isLiveBaseKey(encoded)) {
+            if (exception) {
+              result.excepted = true;
+            } else {
+              result.matched = true;
+              result.action = std::min(result.action, action);
+            }
+          }
+          encoded.erase(1, 1);
+        }
+      }
+    };
+
+    // the same keys the automaton would find, see RuleAutomaton::scan()
+    if (host.find('.') != std::string::npos) {
+      lookup(RuleAutomaton::KeyType::kDomain, 0, 0);
+    }
+    for (std::size_t pos = 0; pos < host.size(); ++pos) {
+      if (pos > 0 && host[pos - 1] != '.') {
+        continue;
+      }
+      for (auto len = host.size() - pos; len > 0; --len) {
+        lookup(RuleAutomaton::KeyType::kDomain, pos, len);
+      }
+    }
+    auto portType = port == 443 ?
+      RuleAutomaton::KeyType::kHttps : RuleAutomaton::KeyType::kHttp;
+    for (auto len = host.size(); len > 0; --len) {
+      lookup(portType, 0, len);
+    }
+    return result;
+  }
+
+  bool LayeredRuleAutomaton::isLiveBaseKey(const std::string &encoded) const {
+    auto it = base_->keyCounts.find(encoded);
+    if (it == base_->keyCounts.end()) {
+      return false;
+    }
+    auto delta = deltas_.find(encoded);
+    return delta == deltas_.end() ||
+      static_cast<int32_t>(it->second) + delta->second > 0;
+  }
+} /* end of namspace: proxypp */
@@ -0,0 +1,90 @@
+/*******************************************************************************
+**          File: layered_rule_automaton.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 09:14 PM
+**   Description: the automaton rules of a snapshot, with small changes to
+**                them layered over the automaton of the previous snapshot
+*******************************************************************************/
+#ifndef PROXYPP_LAYERED_RULE_AUTOMATON_H_
+#define PROXYPP_LAYERED_RULE_AUTOMATON_H_
+#include "proxypp/rule/rule_automaton.h"
+#include "proxypp/rule/rule_bloom_filter.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+
+namespace proxypp {
+  /**
+   * Building the automaton of a large rule set takes a while, so a
+   * snapshot derived from another shares its base automaton and only
+   * builds the keys added since into an automaton of their own. The keys
+   * removed since go into a third one, when it matches a host, the host
+   * is looked up in the remaining keys of the base one substring at a
+   * time instead. Immutable once built
+   */
+  class LayeredRuleAutomaton final {
+    public:
+      // builds the base automaton from all the keys
+      explicit LayeredRuleAutomaton(
+        const std::vector<RuleAutomaton::Key> &keys);
+      // shares the base automaton of previous, the removed keys must be
+      // ones previous has
+      LayeredRuleAutomaton(
+        const LayeredRuleAutomaton &previous,
+        const std::vector<RuleAutomaton::Key> &addedKeys,
+        const std::vector<RuleAutomaton::Key> &removedKeys);
+
+      // false if no match rule matches the host
+      bool mayMatch(const std::string &host) const;
+      RuleAutomaton::Result scan(const std::string &host, uint16_t port) const;
+
+      // false once the layers grow too large compared with the base
+      // automaton for changeCount more keys, it is time to build anew
+      bool canLayer(std::size_t changeCount) const;
+      // the keys that differ from the base automaton
+      std::size_t getLayeredKeyCount() const;
+      std::size_t getStateCount() const;
+
+    private:
+      // "<type and exception><action><key>" -> the number of rules with
+      // the key
+      using KeyCounts = std::unordered_map<std::string, uint32_t>;
+
+      struct Base {
+        explicit Base(const std::vector<RuleAutomaton::Key> &keys);
+
+        RuleAutomaton automaton;
+        RuleBloomFilter filter;
+        KeyCounts keyCounts;
+        // "<type and exception><key>" -> the actions it has in keyCounts
+        std::unordered_map<std::string, std::vector<RouteAction::Id>>
+          keyActions;
+        std::size_t keyCount;
+      };
+
+      static std::string encode(const RuleAutomaton::Key &key);
+      static RuleAutomaton::Key decode(const std::string &encoded);
+      // the keys of the base automaton minus the removed ones
+      RuleAutomaton::Result scanBaseKeys(
+        const std::string &host, uint16_t port) const;
+      bool isLiveBaseKey(const std::string &encoded) const;
+
+    private:
+      std::shared_ptr<const Base> base_;
+      // the number of rules of each key minus the number in base_, for
+      // the keys where they differ
+      std::unordered_map<std::string, int32_t> deltas_;
+      // keys not in base_
+      RuleAutomaton addedAutomaton_;
+      RuleBloomFilter addedFilter_;
+      std::size_t addedKeyCount_{0};
+      // keys of base_ no rule has any more
+      RuleAutomaton removedAutomaton_;
+      std::size_t removedKeyCount_{0};
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_LAYERED_RULE_AUTOMATON_H_ */
@@ -0,0 +1,596 @@
+/*******************************************************************************
+**          File: regex_set.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 09:55 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/regex_set.h"
+
+#include <algorithm>
+#include <memory>
+
+namespace {
+  // bounded repeats are expanded, keep the NFA small
+  static const int MAX_REPEAT = 64;
+  static const int MAX_NESTING_DEPTH = 32;
+  static const int32_t UNKNOWN_TRANSITION = -1;
+  // bookkeeping of a DFA state besides its NFA states and transitions
+  static const std::size_t DFA_STATE_OVERHEAD_BYTES = 64;
+}
+
+namespace proxypp {
+  struct RegexSet::Node {
+    enum class Type {
+      kChars,
+      kConcat,
+      kAlternate,
+      kRepeat
+    };
+
+    explicit Node(Type type) : type(type) { }
+
+    Type type;
+    CharSet chars;
+    std::vector<std::unique_ptr<Node>> children;
+    int min{0};
+    // -1 for no upper bound
+    int max{0};
+  };
+
+  class RegexSet::Parser {
+    public:
+      explicit Parser(const std::string &pattern) : p_(pattern) { }
+
+      // nullptr if the pattern is not supported
+      std::unique_ptr<Node> parse() {
+        auto node = parseAlternate(0);
+        if (!ok_ || pos_ != p_.size()) {
+          return nullptr;
+        }
+        return node;
+      }
+
+    private:
+      bool atEnd() const {
+        return pos_ >= p_.size();
+      }
+
+      std::unique_ptr<Node> parseAlternate(int depth) {
+        if (depth > MAX_NESTING_DEPTH) {
+          ok_ = false;
+          return nullptr;
+        }
+        auto node = std::make_unique<Node>(Node::Type::kAlternate);
+        node->children.push_back(parseConcat(depth));
+        while (ok_ && !atEnd() && p_[pos_] == '|') {
+          ++pos_;
+          node->children.push_back(parseConcat(depth));
+        }
+        if (node->children.size() == 1) {
+          return std::move(node->children[0]);
+        }
+        return node;
+      }
+
+      std::unique_ptr<Node> parseConcat(int depth) {
+        auto node = std::make_unique<Node>(Node::Type::kConcat);
+        // the input is matched entirely, so the anchors at the ends of
+        // the top level branches mean nothing
+        if (depth == 0 && !atEnd() && p_[pos_] == '^') {
+          ++pos_;
+        }
+        while (ok_ && !atEnd() && p_[pos_] != '|' && p_[pos_] != ')') {
+          if (depth == 0 && p_[pos_] == '$' &&
+              (pos_ + 1 == p_.size() || p_[pos_ + 1] == '|')) {
+            ++pos_;
+            break;
+          }
+          node->children.push_back(parseRepeat(depth));
+        }
+        return node;
+      }
+
+      std::unique_ptr<Node> parseRepeat(int depth) {
+        auto atom = parseAtom(depth);
+        if (!ok_ || atEnd()) {
+          return atom;
+        }
+
+        int min = 0;
+        int max = 0;
+        auto ch = p_[pos_];
+        if (ch == '*') {
+          max = -1;
+        } else if (ch == '+') {
+          min = 1;
+          max = -1;
+        } else if (ch == '?') {
+          max = 1;
+        } else if (ch != '{') {
+          return atom;
+        }
+        if (ch != '{') {
+          ++pos_;
+        } else if (!parseBounds(min, max)) {
+          ok_ = false;
+          return nullptr;
+        }
+        // non-greedy matches the same inputs
+        if (!atEnd() && p_[pos_] == '?') {
+          ++pos_;
+        }
+        if (!atEnd() && (p_[pos_] == '*' || p_[pos_] == '+' ||
+                         p_[pos_] == '?' || p_[pos_] == '{')) {
+          ok_ = false;
+          return nullptr;
+        }
+
+        auto node = std::make_unique<Node>(Node::Type::kRepeat);
+        node->min = min;
+        node->max = max;
+        node->children.push_back(std::move(atom));
+        return node;
+      }
+
+      // {n}, {n,} or {n,m}, pos_ is left after the '}'
+      bool parseBounds(int &min, int &max) {
+        ++pos_;
+        if (!parseNumber(min)) {
+          return false;
+        }
+        max = min;
+        if (!atEnd() && p_[pos_] == ',') {
+          ++pos_;
+          max = -1;
+          if (!atEnd() && p_[pos_] != '}' && !parseNumber(max)) {
+            return false;
+          }
+        }
+        if (atEnd() || p_[pos_] != '}' || (max != -1 && max < min)) {
+          return false;
+        }
+        ++pos_;
+        return true;
+      }
+
+      bool parseNumber(int &n) {
+        auto start = pos_;
+        n = 0;
+        while (!atEnd() && p_[pos_] >= '0' && p_[pos_] <= '9') {
+          n = n * 10 + (p_[pos_] - '0');
+          if (n > MAX_REPEAT) {
+            return false;
+          }
+          ++pos_;
+        }
+        return pos_ > start;
+      }
+
+      std::unique_ptr<Node> parseAtom(int depth) {
+        auto ch = p_[pos_];
+        if (ch == '(') {
+          ++pos_;
+          if (!atEnd() && p_[pos_] == '?') {
+            // only non-capturing groups, no lookarounds
+            if (pos_ + 1 >= p_.size() || p_[pos_ + 1] != ':') {
+              ok_ = false;
+              return nullptr;
+            }
+            pos_ += 2;
+          }
+          auto node = parseAlternate(depth + 1);
+          if (!ok_ || atEnd() || p_[pos_] != ')') {
+            ok_ = false;
+            return nullptr;
+          }
+          ++pos_;
+          return node;
+        }
+
+        auto node = std::make_unique<Node>(Node::Type::kChars);
+        if (ch == '[') {
+          ok_ = parseClass(node->chars);
+        } else if (ch == '\\') {
+          ++pos_;
+          ok_ = parseEscape(node->chars);
+        } else if (ch == '.') {
+          node->chars.set();
+          node->chars.reset('\n');
+          node->chars.reset('\r');
+          ++pos_;
+        } else if (ch == '^' || ch == '$' || ch == '*' || ch == '+' ||
+                   ch == '?' || ch == '{' || ch == '}' || ch == ']' ||
+                   ch == ')') {
+          ok_ = false;
+        } else {
+          node->chars.set(static_cast<uint8_t>(ch));
+          ++pos_;
+        }
+        if (!ok_) {
+          return nullptr;
+        }
+        return node;
+      }
+
+      // pos_ is at the char after the backslash
+      bool parseEscape(CharSet &chars) {
+        if (atEnd()) {
+          return false;
+        }
+        auto ch = p_[pos_++];
+        switch (ch) {
+          case 'd': addDigits(chars); return true;
+          case 'w': addWordChars(chars); return true;
+          case 's': addSpaces(chars); return true;
+          case 'D': { CharSet s; addDigits(s); chars |= ~s; return true; }
+          case 'W': { CharSet s; addWordChars(s); chars |= ~s; return true; }
+          case 'S': { CharSet s; addSpaces(s); chars |= ~s; return true; }
+          case 'n': chars.set('\n'); return true;
+          case 'r': chars.set('\r'); return true;
+          case 't': chars.set('\t'); return true;
+          case 'f': chars.set('\f'); return true;
+          case 'v': chars.set('\v'); return true;
+          default:
+            // \b, \B, backreferences, \x, \u, \c and the like
+            if ((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') ||
+                (ch >= 'A' && ch <= 'Z')) {
+              return false;
+            }
+            chars.set(static_cast<uint8_t>(ch));
+            return true;
+        }
+      }
+
+      bool parseClass(CharSet &chars) {
+        ++pos_;
+        auto negated = !atEnd() && p_[pos_] == '^';
+        if (negated) {
+          ++pos_;
+        }
+        // "[]" and "[^]" mean different things in different dialects
+        if (atEnd() || p_[pos_] == ']') {
+          return false;
+        }
+
+        while (!atEnd() && p_[pos_] != ']') {
+          int lo = 0;
+          if (!parseClassChar(chars, lo)) {
+            return false;
+          }
+          if (pos_ + 1 >= p_.size() || p_[pos_] != '-' ||
+              p_[pos_ + 1] == ']') {
+            continue;
+          }
+          // a range can't start with \d and the like
+          if (lo < 0) {
+            return false;
+          }
+          ++pos_;
+          int hi = 0;
+          if (!parseClassChar(chars, hi) || hi < lo) {
+            return false;
+          }
+          for (auto c = lo; c <= hi; ++c) {
+            chars.set(c);
+          }
+        }
+        if (atEnd()) {
+          return false;
+        }
+        ++pos_;
+        if (negated) {
+          chars.flip();
+        }
+        return true;
+      }
+
+      // a single char is returned in c and is not added to chars, c is -1
+      // for escapes like \d, which can't be ends of ranges
+      bool parseClassChar(CharSet &chars, int &c) {
+        auto ch = p_[pos_];
+        if (ch == '[') {
+          // [:alpha:] and the like
+          return false;
+        }
+        if (ch != '\\') {
+          ++pos_;
+          c = static_cast<uint8_t>(ch);
+          chars.set(c);
+          return true;
+        }
+
+        ++pos_;
+        if (atEnd() || p_[pos_] == 'b') {
+          return false;
+        }
+        CharSet escaped;
+        if (!parseEscape(escaped)) {
+          return false;
+        }
+        chars |= escaped;
+        c = escaped.count() == 1 ? firstChar(escaped) : -1;
+        return true;
+      }
+
+      static int firstChar(const CharSet &chars) {
+        for (int c = 0; c < 256; ++c) {
+          if (chars.test(c)) {
+            return c;
+          }
+        }
+        return -1;
+      }
+
+      static void addDigits(CharSet &chars) {
+        for (auto c = '0'; c <= '9'; ++c) {
+          chars.set(c);
+        }
+      }
+
+      static void addWordChars(CharSet &chars) {
+        addDigits(chars);
+        for (auto c = 'a'; c <= 'z'; ++c) {
+          chars.set(c);
+          chars.set(c - 'a' + 'A');
+        }
+        chars.set('_');
+      }
+
+      static void addSpaces(CharSet &chars) {
+        for (auto c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+          chars.set(c);
+        }
+      }
+
+    private:
+      const std::string &p_;
+      std::size_t pos_{0};
+      bool ok_{true};
+  };
+
+  RegexSet::RegexSet(std::size_t maxCacheBytes) :
+    maxCacheBytes_(maxCacheBytes) {
+    nfaStart_ = newNfaState();
+  }
+
+  bool RegexSet::isSupported(const std::string &pattern) {
+    return Parser{pattern}.parse() != nullptr;
+  }
+
+  bool RegexSet::add(const std::string &pattern) {
+    auto node = Parser{pattern}.parse();
+    if (!node) {
+      return false;
+    }
+
+    auto start = newNfaState();
+    nfaStates_[nfaStart_].epsilons.push_back(start);
+    auto end = compile(*node, start);
+    nfaStates_[end].match = static_cast<int32_t>(patternCount_++);
+    prepared_ = false;
+    return true;
+  }
+
+  int RegexSet::match(const std::string &input) {
+    if (patternCount_ == 0) {
+      return -1;
+    }
+    if (!prepared_) {
+      prepare();
+    }
+
+    if (dfaStart_ < 0) {
+      StateSet seeds{nfaStart_};
+      StateSet nfaStates;
+      closure(seeds, nfaStates);
+      dfaStart_ = static_cast<int32_t>(addDfaState(std::move(nfaStates)));
+    }
+
+    auto classCount = classBytes_.size();
+    auto state = static_cast<uint32_t>(dfaStart_);
+    for (auto ch : input) {
+      auto cls = byteClasses_[static_cast<uint8_t>(ch)];
+      auto next = transitions_[state * classCount + cls];
+      if (next == UNKNOWN_TRANSITION) {
+        next = static_cast<int32_t>(computeTransition(state, cls));
+      }
+      state = static_cast<uint32_t>(next);
+      if (dfaStates_[state].nfaStates->empty()) {
+        return -1;
+      }
+    }
+    return dfaStates_[state].match;
+  }
+
+  std::size_t RegexSet::size() const {
+    return patternCount_;
+  }
+
+  std::size_t RegexSet::getCachedStateCount() const {
+    return dfaStates_.size();
+  }
+
+  uint64_t RegexSet::getCacheResetCount() const {
+    return cacheResetCount_;
+  }
+
+  uint32_t RegexSet::newNfaState() {
+    nfaStates_.emplace_back();
+    return static_cast<uint32_t>(nfaStates_.size() - 1);
+  }
+
+  uint32_t RegexSet::compile(const Node &node, uint32_t start) {
+    switch (node.type) {
+      case Node::Type::kChars: {
+        auto end = newNfaState();
+        charSets_.push_back(node.chars);
+        nfaStates_[start].charSet = static_cast<int32_t>(charSets_.size() - 1);
+        nfaStates_[start].next = end;
+        return end;
+      }
+
+      case Node::Type::kConcat: {
+        auto cur = start;
+        for (auto &child : node.children) {
+          cur = compile(*child, cur);
+        }
+        return cur;
+      }
+
+      case Node::Type::kAlternate: {
+        auto end = newNfaState();
+        for (auto &child : node.children) {
+          auto branch = newNfaState();
+          nfaStates_[start].epsilons.push_back(branch);
+          auto branchEnd = compile(*child, branch);
+          nfaStates_[branchEnd].epsilons.push_back(end);
+        }
+        return end;
+      }
+
+      case Node::Type::kRepeat: {
+        auto &child = *node.children[0];
+        auto cur = start;
+        for (int i = 0; i < node.min; ++i) {
+          // every copy starts from a fresh state, a state leads out with
+          // at most one char set
+          auto next = newNfaState();
+          nfaStates_[cur].epsilons.push_back(next);
+          cur = compile(child, next);
+        }
+
+        auto end = newNfaState();
+        if (node.max < 0) {
+          auto loop = newNfaState();
+          nfaStates_[cur].epsilons.push_back(loop);
+          nfaStates_[loop].epsilons.push_back(end);
+          auto body = newNfaState();
+          nfaStates_[loop].epsilons.push_back(body);
+          auto bodyEnd = compile(child, body);
+          nfaStates_[bodyEnd].epsilons.push_back(loop);
+          return end;
+        }
+
+        for (int i = node.min; i < node.max; ++i) {
+          nfaStates_[cur].epsilons.push_back(end);
+          auto next = newNfaState();
+          nfaStates_[cur].epsilons.push_back(next);
+          cur = compile(child, next);
+        }
+        nfaStates_[cur].epsilons.push_back(end);
+        return end;
+      }
+    }
+    return start;
+  }
+
+  void RegexSet::prepare() {
+    computeByteClasses();
+    resetCache();
+    prepared_ = true;
+  }
+
+  void RegexSet::computeByteClasses() {
+    // bytes that no char set tells apart share a class, refined set by set
+    byteClasses_.fill(0);
+    uint16_t classCount = 1;
+    for (auto &chars : charSets_) {
+      std::map<std::pair<uint16_t, bool>, uint16_t> refined;
+      uint16_t newCount = 0;
+      for (int c = 0; c < 256; ++c) {
+        auto key = std::make_pair(byteClasses_[c], chars.test(c));
+        auto it = refined.find(key);
+        if (it == refined.end()) {
+          it = refined.emplace(key, newCount++).first;
+        }
+        byteClasses_[c] = it->second;
+      }
+      classCount = newCount;
+    }
+
+    classBytes_.assign(classCount, 0);
+    for (int c = 255; c >= 0; --c) {
+      classBytes_[byteClasses_[c]] = static_cast<uint8_t>(c);
+    }
+  }
+
+  void RegexSet::resetCache() {
+    if (!dfaStates_.empty()) {
+      ++cacheResetCount_;
+    }
+    dfaStateIds_.clear();
+    dfaStates_.clear();
+    transitions_.clear();
+    dfaStart_ = -1;
+    cacheBytes_ = 0;
+  }
+
+  uint32_t RegexSet::addDfaState(StateSet &&nfaStates) {
+    auto it = dfaStateIds_.find(nfaStates);
+    if (it != dfaStateIds_.end()) {
+      return it->second;
+    }
+
+    auto id = static_cast<uint32_t>(dfaStates_.size());
+    int32_t match = -1;
+    for (auto s : nfaStates) {
+      auto m = nfaStates_[s].match;
+      if (m >= 0 && (match < 0 || m < match)) {
+        match = m;
+      }
+    }
+    cacheBytes_ += nfaStates.size() * sizeof(uint32_t) +
+      classBytes_.size() * sizeof(int32_t) + DFA_STATE_OVERHEAD_BYTES;
+    it = dfaStateIds_.emplace(std::move(nfaStates), id).first;
+    dfaStates_.push_back(DfaState{&it->first, match});
+    transitions_.resize(
+      transitions_.size() + classBytes_.size(), UNKNOWN_TRANSITION);
+    return id;
+  }
+
+  void RegexSet::closure(StateSet &seeds, StateSet &out) const {
+    std::vector<bool> visited(nfaStates_.size(), false);
+    out.clear();
+    while (!seeds.empty()) {
+      auto s = seeds.back();
+      seeds.pop_back();
+      if (visited[s]) {
+        continue;
+      }
+      visited[s] = true;
+      auto &state = nfaStates_[s];
+      // only the states that consume a byte or end a pattern tell DFA
+      // states apart
+      if (state.charSet >= 0 || state.match >= 0) {
+        out.push_back(s);
+      }
+      seeds.insert(seeds.end(), state.epsilons.begin(), state.epsilons.end());
+    }
+    std::sort(out.begin(), out.end());
+  }
+
+  uint32_t RegexSet::computeTransition(uint32_t state, uint16_t cls) {
+    auto byte = classBytes_[cls];
+    StateSet seeds;
+    for (auto s : *dfaStates_[state].nfaStates) {
+      auto &nfaState = nfaStates_[s];
+      if (nfaState.charSet >= 0 && charSets_[nfaState.charSet].test(byte)) {
+        seeds.push_back(nfaState.next);
+      }
+    }
+    StateSet nfaStates;
+    closure(seeds, nfaStates);
+
+    if (cacheBytes_ >= maxCacheBytes_) {
+      // the source state goes away with the cache, the caller moves on
+      // to the returned state and doesn't need it anymore
+      resetCache();
+      return addDfaState(std::move(nfaStates));
+    }
+
+    auto next = addDfaState(std::move(nfaStates));
+    transitions_[state * classBytes_.size() + cls] =
+      static_cast<int32_t>(next);
+    return next;
+  }
+} /* end of namspace: proxypp */
@@ -0,0 +1,103 @@
+/*******************************************************************************
+**          File: regex_set.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 09:30 PM
+**   Description: many regular expressions matched in one pass by a DFA that
+**                is built lazily from their combined NFA
+*******************************************************************************/
+#ifndef PROXYPP_REGEX_SET_H_
+#define PROXYPP_REGEX_SET_H_
+#include <string>
+#include <vector>
+#include <array>
+#include <bitset>
+#include <map>
+#include <cstdint>
+
+namespace proxypp {
+  /**
+   * Supports the subset of ECMAScript regex that a DFA can do: literals,
+   * escapes, '.', classes, groups, alternation and quantifiers, with '^'
+   * and '$' only at the ends of the top level branches, patterns must
+   * match the entire input like std::regex_match. DFA states are built as
+   * the inputs need them, the cache of them is dropped when it grows over
+   * maxCacheBytes. Not thread safe, match() updates the cache
+   */
+  class RegexSet final {
+    public:
+      explicit RegexSet(std::size_t maxCacheBytes = 2 * 1024 * 1024);
+
+      // false if the pattern uses what the DFA can't do (backreferences,
+      // lookarounds, anchors in the middle, etc.) or it is not valid
+      static bool isSupported(const std::string &pattern);
+
+      // the index of the pattern is the number of patterns added before it
+      bool add(const std::string &pattern);
+      // the index of the first pattern that matches the entire input, -1
+      // if none does
+      int match(const std::string &input);
+
+      std::size_t size() const;
+      std::size_t getCachedStateCount() const;
+      uint64_t getCacheResetCount() const;
+
+    private:
+      using CharSet = std::bitset<256>;
+      using StateSet = std::vector<uint32_t>;
+
+      // the parsed pattern, and the parser of it
+      struct Node;
+      class Parser;
+
+      struct NfaState {
+        // index into charSets_, -1 if no byte leads out of this state
+        int32_t charSet{-1};
+        uint32_t next{0};
+        std::vector<uint32_t> epsilons;
+        // index of the pattern that ends in this state, -1 if none
+        int32_t match{-1};
+      };
+
+      struct DfaState {
+        // points to the key in dfaStateIds_
+        const StateSet *nfaStates;
+        int32_t match;
+      };
+
+      uint32_t newNfaState();
+      // builds the NFA of the node from the start state, returns the end
+      uint32_t compile(const Node &node, uint32_t start);
+
+      void prepare();
+      void computeByteClasses();
+      void resetCache();
+      uint32_t addDfaState(StateSet &&nfaStates);
+      void closure(StateSet &seeds, StateSet &out) const;
+      uint32_t computeTransition(uint32_t state, uint16_t cls);
+
+    private:
+      std::size_t maxCacheBytes_;
+      std::size_t patternCount_{0};
+
+      std::vector<NfaState> nfaStates_;
+      std::vector<CharSet> charSets_;
+      // start of the NFA, with an epsilon to the start of every pattern
+      uint32_t nfaStart_{0};
+
+      // computed on the first match() after patterns are added
+      bool prepared_{false};
+      std::array<uint16_t, 256> byteClasses_;
+      // a byte of each class
+      std::vector<uint8_t> classBytes_;
+
+      std::map<StateSet, uint32_t> dfaStateIds_;
+      std::vector<DfaState> dfaStates_;
+      // classBytes_.size() transitions per DFA state, row by row
+      std::vector<int32_t> transitions_;
+      int32_t dfaStart_{-1};
+      std::size_t cacheBytes_{0};
+      uint64_t cacheResetCount_{0};
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_REGEX_SET_H_ */
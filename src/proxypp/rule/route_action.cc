@@ -0,0 +1,63 @@
+/*******************************************************************************
+**          File: route_action.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-22 Thu 09:28 AM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/route_action.h"
+#include "nul/log.h"
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+namespace {
+  std::mutex &getMutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  // indexed by the ids
+  std::vector<std::string> &getNames() {
+    static std::vector<std::string> names{"reject", "direct", "proxy"};
+    return names;
+  }
+}
+
+namespace proxypp {
+  const RouteAction::Id RouteAction::kReject;
+  const RouteAction::Id RouteAction::kDirect;
+  const RouteAction::Id RouteAction::kProxy;
+  const RouteAction::Id RouteAction::kNone;
+
+  RouteAction::Id RouteAction::getId(const std::string &name) {
+    std::lock_guard<std::mutex> lock(getMutex());
+    auto &names = getNames();
+    auto it = std::find(names.begin(), names.end(), name);
+    if (it != names.end()) {
+      return static_cast<Id>(it - names.begin());
+    }
+    if (names.size() == kNone) {
+      LOG_W("too many upstreams, rules of %s go to the default upstream",
+            name.c_str());
+      return kProxy;
+    }
+    names.push_back(name);
+    return static_cast<Id>(names.size() - 1);
+  }
+
+  std::string RouteAction::getName(Id id) {
+    std::lock_guard<std::mutex> lock(getMutex());
+    auto &names = getNames();
+    return id < names.size() ? names[id] : std::string{};
+  }
+
+  std::size_t RouteAction::getCount() {
+    std::lock_guard<std::mutex> lock(getMutex());
+    return getNames().size();
+  }
+
+  bool RouteAction::isUpstream(Id id) {
+    return id >= kProxy && id != kNone;
+  }
+} /* end of namspace: proxypp */
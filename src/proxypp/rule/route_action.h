@@ -0,0 +1,47 @@
+/*******************************************************************************
+**          File: route_action.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-22 Thu 09:15 AM
+**   Description: the compact ids of what is done with a connection, for
+**                the rules to name an action or an upstream
+*******************************************************************************/
+#ifndef PROXYPP_ROUTE_ACTION_H_
+#define PROXYPP_ROUTE_ACTION_H_
+#include <string>
+#include <cstdint>
+
+namespace proxypp {
+  /**
+   * An id is also the priority of the action, when rules of more than one
+   * action match a host, the action of the lowest id wins: reject, then
+   * direct, then the default upstream, then the named upstreams in the
+   * order they were first named, which is the order of --upstream_servers
+   * as they are named before the rules are loaded. The ids are the same
+   * for the whole process, a compiled rule file keeps the names
+   */
+  class RouteAction final {
+    public:
+      using Id = uint8_t;
+
+      static const Id kReject = 0;
+      static const Id kDirect = 1;
+      // the upstream given by --upstream_server, what the rules with no
+      // action name
+      static const Id kProxy = 2;
+      // no rule matched
+      static const Id kNone = 255;
+
+      // "reject", "direct" and "proxy" are the ones above, any other name
+      // is an upstream, which gets the next id the first time it is seen,
+      // kProxy once the ids run out. Thread safe
+      static Id getId(const std::string &name);
+      // empty for an id not given yet
+      static std::string getName(Id id);
+      // the ids given so far, the built-in ones included
+      static std::size_t getCount();
+      // kProxy or a named upstream
+      static bool isUpstream(Id id);
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_ROUTE_ACTION_H_ */
@@ -0,0 +1,100 @@
+/*******************************************************************************
+**          File: route_cache.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 10:52 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/route_cache.h"
+
+namespace proxypp {
+  double RouteCache::Stats::hitRatio() const {
+    auto lookups = hits + misses;
+    return lookups == 0 ? 0 : static_cast<double>(hits) / lookups;
+  }
+
+  uint64_t RouteCache::Stats::avgMissNanos() const {
+    return misses == 0 ? 0 : missNanos / misses;
+  }
+
+  RouteCache::RouteCache(std::size_t capacity) : capacity_(capacity) {
+  }
+
+  bool RouteCache::lookup(
+    const std::string &host,
+    uint16_t port,
+    uint64_t generation,
+    RouteAction::Id &action) {
+    if (generation != generation_) {
+      clear();
+      generation_ = generation;
+    }
+
+    if (!decisions_.empty()) {
+      auto it = decisions_.find(makeKey(host, port));
+      if (it != decisions_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.it);
+        action = it->second.action;
+        ++stats_.hits;
+        return true;
+      }
+    }
+    ++stats_.misses;
+    return false;
+  }
+
+  void RouteCache::store(
+    const std::string &host,
+    uint16_t port,
+    uint64_t generation,
+    RouteAction::Id action,
+    uint64_t evalNanos) {
+    stats_.missNanos += evalNanos;
+    // the rules changed while evaluating
+    if (generation != generation_ || capacity_ == 0) {
+      return;
+    }
+
+    auto key = makeKey(host, port);
+    auto it = decisions_.find(key);
+    if (it != decisions_.end()) {
+      it->second.action = action;
+      lru_.splice(lru_.begin(), lru_, it->second.it);
+      return;
+    }
+
+    if (decisions_.size() >= capacity_) {
+      decisions_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    lru_.push_front(key);
+    decisions_.emplace(std::move(key), Node{action, lru_.begin()});
+  }
+
+  void RouteCache::setCapacity(std::size_t capacity) {
+    capacity_ = capacity;
+    while (decisions_.size() > capacity_) {
+      decisions_.erase(lru_.back());
+      lru_.pop_back();
+    }
+  }
+
+  std::size_t RouteCache::getSize() const {
+    return decisions_.size();
+  }
+
+  const RouteCache::Stats &RouteCache::getStats() const {
+    return stats_;
+  }
+
+  std::string RouteCache::makeKey(const std::string &host, uint16_t port) {
+    auto key = host;
+    key.push_back(':');
+    key.append(std::to_string(port));
+    return key;
+  }
+
+  void RouteCache::clear() {
+    lru_.clear();
+    decisions_.clear();
+  }
+} /* end of namspace: proxypp */
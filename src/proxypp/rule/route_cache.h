@@ -0,0 +1,74 @@
+/*******************************************************************************
+**          File: route_cache.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 10:40 PM
+**   Description: LRU cache of the routing decisions of (host, port), all of
+**                them are dropped when the rules change
+*******************************************************************************/
+#ifndef PROXYPP_ROUTE_CACHE_H_
+#define PROXYPP_ROUTE_CACHE_H_
+#include "proxypp/rule/route_action.h"
+
+#include <string>
+#include <list>
+#include <cstdint>
+#include <unordered_map>
+
+namespace proxypp {
+  /**
+   * Not thread safe, each loop thread keeps its own
+   */
+  class RouteCache final {
+    public:
+      struct Stats {
+        uint64_t hits{0};
+        uint64_t misses{0};
+        // time spent evaluating the rules for the misses
+        uint64_t missNanos{0};
+
+        double hitRatio() const;
+        uint64_t avgMissNanos() const;
+      };
+
+      explicit RouteCache(std::size_t capacity);
+
+      // generation is bumped by the owner of the rules whenever they
+      // change, a lookup with a generation other than the one of the
+      // cached decisions drops them all
+      bool lookup(
+        const std::string &host,
+        uint16_t port,
+        uint64_t generation,
+        RouteAction::Id &action);
+      void store(
+        const std::string &host,
+        uint16_t port,
+        uint64_t generation,
+        RouteAction::Id action,
+        uint64_t evalNanos);
+
+      // 0 disables the cache
+      void setCapacity(std::size_t capacity);
+      std::size_t getSize() const;
+      const Stats &getStats() const;
+
+    private:
+      struct Node {
+        RouteAction::Id action;
+        std::list<std::string>::iterator it;
+      };
+
+      static std::string makeKey(const std::string &host, uint16_t port);
+      void clear();
+
+    private:
+      std::size_t capacity_;
+      uint64_t generation_{0};
+      // most recently used first
+      std::list<std::string> lru_;
+      std::unordered_map<std::string, Node> decisions_;
+      Stats stats_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_ROUTE_CACHE_H_ */
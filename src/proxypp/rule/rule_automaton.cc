@@ -0,0 +1,244 @@
+/*******************************************************************************
+**          File: rule_automaton.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 08:52 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/rule_automaton.h"
+
+#include <deque>
+#include <algorithm>
+
+namespace {
+  static const uint32_t START_STATE = 0;
+  static const uint32_t NO_STATE = static_cast<uint32_t>(-1);
+
+  inline uint8_t outputBit(
+    proxypp::RuleAutomaton::KeyType type, bool exception) {
+    return 1 << (static_cast<int>(type) + (exception ? 4 : 0));
+  }
+
+  inline bool isAnchored(proxypp::RuleAutomaton::KeyType type) {
+    return type == proxypp::RuleAutomaton::KeyType::kHttps ||
+      type == proxypp::RuleAutomaton::KeyType::kHttp;
+  }
+
+  // kDomain, kHttps and kHttp, the types that have a column in actions
+  static const std::size_t ACTION_COLUMNS = 3;
+
+  inline bool hasActionColumn(const proxypp::RuleAutomaton::Key &key) {
+    return !key.exception &&
+      key.type != proxypp::RuleAutomaton::KeyType::kWildcard;
+  }
+}
+
+namespace proxypp {
+  RuleAutomaton::RuleAutomaton(const std::vector<Key> &keys) {
+    byteClasses_.fill(0);
+    byteClasses_[static_cast<uint8_t>('.')] = classCount_++;
+    for (auto &key : keys) {
+      for (auto ch : key.key) {
+        auto &cls = byteClasses_[static_cast<uint8_t>(ch)];
+        if (cls == 0) {
+          cls = classCount_++;
+        }
+      }
+    }
+    // the anchor
+    ++classCount_;
+
+    transitions_.assign(classCount_, NO_STATE);
+    outputs_.assign(1, 0);
+    for (auto &key : keys) {
+      if (hasActionColumn(key) && key.action != RouteAction::kProxy) {
+        actions_.assign(ACTION_COLUMNS, RouteAction::kNone);
+        break;
+      }
+    }
+    for (auto &key : keys) {
+      addKey(key);
+    }
+    buildFailureTransitions();
+  }
+
+  void RuleAutomaton::addKey(const Key &key) {
+    auto bit = outputBit(key.type, key.exception);
+    if (key.key.empty()) {
+      // an anchored empty key never matches, wildcard rules always have
+      // a key
+      if (key.type == KeyType::kDomain) {
+        emptyKeyOutputs_ |= bit;
+        if (!key.exception) {
+          emptyKeyAction_ = std::min(emptyKeyAction_, key.action);
+        }
+      }
+      return;
+    }
+
+    std::vector<uint16_t> classes;
+    classes.reserve(key.key.size() + 2);
+    if (isAnchored(key.type)) {
+      classes.push_back(classCount_ - 1);
+    }
+    classes.push_back(byteClasses_[static_cast<uint8_t>('.')]);
+    for (auto ch : key.key) {
+      classes.push_back(byteClasses_[static_cast<uint8_t>(ch)]);
+    }
+
+    auto state = START_STATE;
+    for (auto cls : classes) {
+      auto &next = transitions_[state * classCount_ + cls];
+      if (next == NO_STATE) {
+        next = static_cast<uint32_t>(outputs_.size());
+        outputs_.push_back(0);
+        if (!actions_.empty()) {
+          actions_.resize(actions_.size() + ACTION_COLUMNS, RouteAction::kNone);
+        }
+        transitions_.resize(transitions_.size() + classCount_, NO_STATE);
+      }
+      // transitions_ may have been reallocated
+      state = transitions_[state * classCount_ + cls];
+    }
+    outputs_[state] |= bit;
+    if (!actions_.empty() && hasActionColumn(key)) {
+      auto &action = actions_[
+        state * ACTION_COLUMNS + static_cast<std::size_t>(key.type)];
+      action = std::min(action, key.action);
+    }
+  }
+
+  void RuleAutomaton::buildFailureTransitions() {
+    std::vector<uint32_t> failures(outputs_.size(), START_STATE);
+    std::deque<uint32_t> queue;
+    for (uint16_t cls = 0; cls < classCount_; ++cls) {
+      auto &next = transitions_[cls];
+      if (next == NO_STATE) {
+        next = START_STATE;
+      } else {
+        queue.push_back(next);
+      }
+    }
+
+    // breadth first, so the row of the failure state is always complete
+    // by the time it is copied from
+    while (!queue.empty()) {
+      auto state = queue.front();
+      queue.pop_front();
+      auto failure = failures[state];
+      outputs_[state] |= outputs_[failure];
+      if (!actions_.empty()) {
+        for (std::size_t i = 0; i < ACTION_COLUMNS; ++i) {
+          auto &action = actions_[state * ACTION_COLUMNS + i];
+          action = std::min(action, actions_[failure * ACTION_COLUMNS + i]);
+        }
+      }
+
+      auto row = state * classCount_;
+      auto failureRow = failure * classCount_;
+      for (uint16_t cls = 0; cls < classCount_; ++cls) {
+        auto &next = transitions_[row + cls];
+        if (next == NO_STATE) {
+          next = transitions_[failureRow + cls];
+        } else {
+          failures[next] = transitions_[failureRow + cls];
+          queue.push_back(next);
+        }
+      }
+    }
+  }
+
+  RuleAutomaton::Result RuleAutomaton::scan(
+    const std::string &host, uint16_t port) const {
+    return scan(getTables(), host, port);
+  }
+
+  RuleAutomaton::Result RuleAutomaton::scan(
+    const Tables &tables, const std::string &host, uint16_t port) {
+    uint8_t outputs = 0;
+    if (tables.emptyKeyOutputs != 0 &&
+        host.find('.') != std::string::npos) {
+      outputs |= tables.emptyKeyOutputs;
+    }
+
+    auto classCount = tables.classCount;
+    auto transitions = tables.transitions;
+    auto byteClasses = tables.byteClasses;
+    // the host is scanned as <anchor>.<host>
+    auto state = transitions[START_STATE * classCount + classCount - 1];
+    outputs |= tables.outputs[state];
+    state = transitions[
+      state * classCount + byteClasses[static_cast<uint8_t>('.')]];
+    outputs |= tables.outputs[state];
+    for (auto ch : host) {
+      state = transitions[
+        state * classCount + byteClasses[static_cast<uint8_t>(ch)]];
+      outputs |= tables.outputs[state];
+    }
+
+    auto portType = port == 443 ? KeyType::kHttps : KeyType::kHttp;
+    auto matchMask = outputBit(KeyType::kDomain, false) |
+      outputBit(portType, false);
+    auto exceptionMask = outputBit(KeyType::kDomain, true) |
+      outputBit(portType, true);
+    auto wildcardMask = outputBit(KeyType::kWildcard, false) |
+      outputBit(KeyType::kWildcard, true);
+
+    Result result;
+    result.matched = (outputs & matchMask) != 0;
+    result.excepted = (outputs & exceptionMask) != 0;
+    result.wildcard = (outputs & wildcardMask) != 0;
+    if (result.matched) {
+      result.action = tables.actions ?
+        scanAction(tables, host, port) : RouteAction::kProxy;
+    }
+    return result;
+  }
+
+  RouteAction::Id RuleAutomaton::scanAction(
+    const Tables &tables, const std::string &host, uint16_t port) {
+    auto action = RouteAction::kNone;
+    if ((tables.emptyKeyOutputs & outputBit(KeyType::kDomain, false)) != 0 &&
+        host.find('.') != std::string::npos) {
+      action = tables.emptyKeyAction;
+    }
+
+    auto portColumn = static_cast<std::size_t>(
+      port == 443 ? KeyType::kHttps : KeyType::kHttp);
+    auto visit = [&tables, &action, portColumn](uint32_t state) {
+      auto row = tables.actions + state * ACTION_COLUMNS;
+      action = std::min(action, std::min(row[0], row[portColumn]));
+    };
+
+    auto classCount = tables.classCount;
+    auto transitions = tables.transitions;
+    auto byteClasses = tables.byteClasses;
+    auto state = transitions[START_STATE * classCount + classCount - 1];
+    visit(state);
+    state = transitions[
+      state * classCount + byteClasses[static_cast<uint8_t>('.')]];
+    visit(state);
+    for (auto ch : host) {
+      state = transitions[
+        state * classCount + byteClasses[static_cast<uint8_t>(ch)]];
+      visit(state);
+    }
+    return action;
+  }
+
+  RuleAutomaton::Tables RuleAutomaton::getTables() const {
+    Tables tables;
+    tables.byteClasses = byteClasses_.data();
+    tables.classCount = classCount_;
+    tables.transitions = transitions_.data();
+    tables.outputs = outputs_.data();
+    tables.actions = actions_.empty() ? nullptr : actions_.data();
+    tables.stateCount = static_cast<uint32_t>(outputs_.size());
+    tables.emptyKeyOutputs = emptyKeyOutputs_;
+    tables.emptyKeyAction = emptyKeyAction_;
+    return tables;
+  }
+
+  std::size_t RuleAutomaton::getStateCount() const {
+    return outputs_.size();
+  }
+} /* end of namspace: proxypp */
@@ -0,0 +1,112 @@
+/*******************************************************************************
+**          File: rule_automaton.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 08:35 PM
+**   Description: Aho-Corasick automaton over the domain rules and their
+**                exceptions, one pass over a host answers all of them
+*******************************************************************************/
+#ifndef PROXYPP_RULE_AUTOMATON_H_
+#define PROXYPP_RULE_AUTOMATON_H_
+#include "proxypp/rule/route_action.h"
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+
+namespace proxypp {
+  /**
+   * A domain rule of "google.com" is the substring ".google.com" of the
+   * host with a dot prepended, so it also matches "google.com.hk", the
+   * |http:// and |https:// rules are the same substring anchored at the
+   * start of the host. The automaton is immutable once built, it is built
+   * on a background thread and shared with the loop thread. The action of
+   * the match rules is kept per state only if some rule has an action
+   * other than kProxy, it is looked up in a second pass over the hosts
+   * that match, so the hosts that don't cost no more than before
+   */
+  class RuleAutomaton final {
+    public:
+      enum class KeyType {
+        // the key starts at any label of the host, any port
+        kDomain,
+        // the host starts with the key, port 443 only (|https://)
+        kHttps,
+        // the host starts with the key, any port but 443 (|http://)
+        kHttp,
+        // like kDomain, a rule with wildcards may match where the key
+        // is found, see WildcardRule
+        kWildcard
+      };
+
+      struct Key {
+        std::string key;
+        KeyType type;
+        bool exception;
+        // of the match rules, exceptions have none
+        RouteAction::Id action{RouteAction::kProxy};
+      };
+
+      struct Result {
+        // some match rule matches the host
+        bool matched{false};
+        // the lowest action of the match rules that match, kNone if
+        // there is none
+        RouteAction::Id action{RouteAction::kNone};
+        // some exception rule matches the host
+        bool excepted{false};
+        // some wildcard rule may match the host
+        bool wildcard{false};
+      };
+
+      // the flat tables the automaton runs on, they are owned by a
+      // RuleAutomaton or mapped from a compiled rule file
+      struct Tables {
+        // 256 entries
+        const uint16_t *byteClasses;
+        uint16_t classCount;
+        // stateCount rows of classCount
+        const uint32_t *transitions;
+        const uint8_t *outputs;
+        // stateCount rows of the lowest actions of the kDomain, kHttps
+        // and kHttp match rules, null if they are all kProxy
+        const uint8_t *actions;
+        uint32_t stateCount;
+        uint8_t emptyKeyOutputs;
+        RouteAction::Id emptyKeyAction;
+      };
+
+      explicit RuleAutomaton(const std::vector<Key> &keys);
+
+      Result scan(const std::string &host, uint16_t port) const;
+      static Result scan(
+        const Tables &tables, const std::string &host, uint16_t port);
+      Tables getTables() const;
+      std::size_t getStateCount() const;
+
+    private:
+      void addKey(const Key &key);
+      void buildFailureTransitions();
+      // the second pass of scan() over a host that matched
+      static RouteAction::Id scanAction(
+        const Tables &tables, const std::string &host, uint16_t port);
+
+    private:
+      // byte -> column of the transition table, bytes that appear in no
+      // key share column 0, the last column is the start-of-host anchor
+      std::array<uint16_t, 256> byteClasses_;
+      uint16_t classCount_{1};
+      // classCount_ transitions per state, row by row
+      std::vector<uint32_t> transitions_;
+      // the rules that end in each state, including those that end in
+      // the states on its failure chain
+      std::vector<uint8_t> outputs_;
+      // like outputs_, see Tables::actions, empty if there are none
+      std::vector<uint8_t> actions_;
+      // rules with empty keys, they match any host that contains a dot
+      uint8_t emptyKeyOutputs_{0};
+      RouteAction::Id emptyKeyAction_{RouteAction::kNone};
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_RULE_AUTOMATON_H_ */
@@ -0,0 +1,169 @@
+/*******************************************************************************
+**          File: rule_bloom_filter.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 05:32 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/rule_bloom_filter.h"
+
+namespace {
+  static const uint32_t BITS_PER_ITEM = 12;
+  static const uint32_t BITS_PER_BLOCK = 512;
+  static const uint32_t WORDS_PER_BLOCK = BITS_PER_BLOCK / 64;
+  static const int HASH_COUNT = 6;
+  // stands for the start of the host, like the anchor of the automaton
+  static const char ANCHOR = '\x01';
+
+  static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+
+  // FNV-1a, so the hashes of all the prefixes of an item come in one pass
+  inline uint64_t hashByte(uint64_t h, char ch) {
+    return (h ^ static_cast<uint8_t>(ch)) * 0x100000001b3ULL;
+  }
+
+  // the finalizer of splitmix64, to spread the bits
+  inline uint64_t finalize(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+  }
+
+  inline const uint64_t *blockOf(
+    const uint64_t *words, uint32_t blockCount, uint64_t h) {
+    auto block = static_cast<uint32_t>(((h >> 32) * blockCount) >> 32);
+    return words + static_cast<std::size_t>(block) * WORDS_PER_BLOCK;
+  }
+
+  inline uint32_t bitOf(uint64_t h, int i) {
+    auto h1 = static_cast<uint32_t>(h);
+    auto h2 = static_cast<uint32_t>(h >> 41) | 1;
+    return (h1 + i * h2) % BITS_PER_BLOCK;
+  }
+
+  inline bool contains(
+    const proxypp::RuleBloomFilter::Tables &tables, uint64_t h) {
+    auto block = blockOf(tables.words, tables.blockCount, h);
+    for (int i = 0; i < HASH_COUNT; ++i) {
+      auto bit = bitOf(h, i);
+      if ((block[bit / 64] & (1ULL << (bit % 64))) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // the prefixes of the item of the lengths that some items have
+  inline bool containsPrefix(
+    const proxypp::RuleBloomFilter::Tables &tables,
+    const char *item, std::size_t len) {
+    auto h = FNV_OFFSET_BASIS;
+    for (std::size_t i = 0; i < len; ++i) {
+      h = hashByte(h, item[i]);
+      if ((tables.lengths & (1 << i)) != 0 && contains(tables, finalize(h))) {
+        return true;
+      }
+    }
+    return false;
+  }
+}
+
+namespace proxypp {
+  double RuleBloomFilter::Stats::falsePositiveRate() const {
+    auto negatives = rejects + falsePositives;
+    return negatives == 0 ? 0 : static_cast<double>(falsePositives) / negatives;
+  }
+
+  RuleBloomFilter::RuleBloomFilter(
+    const std::vector<RuleAutomaton::Key> &keys) {
+    std::size_t itemCount = 0;
+    for (auto &key : keys) {
+      if (!key.exception) {
+        ++itemCount;
+      }
+    }
+    blockCount_ = static_cast<uint32_t>(
+      (itemCount * BITS_PER_ITEM + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
+    words_.assign(static_cast<std::size_t>(blockCount_) * WORDS_PER_BLOCK, 0);
+
+    std::string item;
+    for (auto &key : keys) {
+      if (key.exception) {
+        continue;
+      }
+      if (key.key.empty()) {
+        // an anchored empty key never matches
+        matchesAll_ = matchesAll_ || key.type == RuleAutomaton::KeyType::kDomain;
+        continue;
+      }
+
+      item.clear();
+      if (key.type == RuleAutomaton::KeyType::kHttps ||
+          key.type == RuleAutomaton::KeyType::kHttp) {
+        item.push_back(ANCHOR);
+      }
+      item.push_back('.');
+      item.append(key.key, 0, MAX_ITEM_LEN - item.size());
+      add(item.data(), item.size());
+    }
+  }
+
+  bool RuleBloomFilter::mayMatch(const std::string &host) const {
+    return mayMatch(getTables(), host);
+  }
+
+  bool RuleBloomFilter::mayMatch(
+    const Tables &tables, const std::string &host) {
+    if (tables.matchesAll) {
+      return true;
+    }
+    if (tables.blockCount == 0) {
+      return false;
+    }
+
+    // the anchored rules at the start of the host
+    char item[MAX_ITEM_LEN];
+    item[0] = ANCHOR;
+    item[1] = '.';
+    auto len = host.copy(item + 2, MAX_ITEM_LEN - 2);
+    if (containsPrefix(tables, item, len + 2)) {
+      return true;
+    }
+
+    // the domain rules at every label, the host is taken as ".<host>"
+    item[0] = '.';
+    for (std::size_t pos = 0; pos < host.size(); ++pos) {
+      if (pos > 0 && host[pos - 1] != '.') {
+        continue;
+      }
+      len = host.copy(item + 1, MAX_ITEM_LEN - 1, pos);
+      if (containsPrefix(tables, item, len + 1)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  RuleBloomFilter::Tables RuleBloomFilter::getTables() const {
+    Tables tables;
+    tables.words = words_.data();
+    tables.blockCount = blockCount_;
+    tables.lengths = lengths_;
+    tables.matchesAll = matchesAll_;
+    return tables;
+  }
+
+  void RuleBloomFilter::add(const char *item, std::size_t len) {
+    lengths_ |= 1 << (len - 1);
+    auto h = FNV_OFFSET_BASIS;
+    for (std::size_t i = 0; i < len; ++i) {
+      h = hashByte(h, item[i]);
+    }
+    h = finalize(h);
+    auto block = const_cast<uint64_t *>(
+      blockOf(words_.data(), blockCount_, h));
+    for (int i = 0; i < HASH_COUNT; ++i) {
+      auto bit = bitOf(h, i);
+      block[bit / 64] |= 1ULL << (bit % 64);
+    }
+  }
+} /* end of namspace: proxypp */
@@ -0,0 +1,71 @@
+/*******************************************************************************
+**          File: rule_bloom_filter.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 05:10 PM
+**   Description: blocked bloom filter over the domain rules, it rejects the
+**                hosts that no domain rule can match before the automaton
+**                is run
+*******************************************************************************/
+#ifndef PROXYPP_RULE_BLOOM_FILTER_H_
+#define PROXYPP_RULE_BLOOM_FILTER_H_
+#include "proxypp/rule/rule_automaton.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace proxypp {
+  /**
+   * A domain rule matches where a label of the host starts, so the first
+   * MAX_ITEM_LEN bytes of ".<rule>" are added to the filter, and at every
+   * label of the host, the bytes from the dot on are looked up for each
+   * length that some item has, anchored rules the same at the start of
+   * the host only, the keys of wildcard rules like domain rules. Every
+   * item sets its bits in one 64 byte block, so a lookup reads one cache
+   * line, and the filter is small enough to stay in the cache where the
+   * automaton of a large rule set does not. Exceptions are left out,
+   * they only matter once a rule matches
+   */
+  class RuleBloomFilter final {
+    public:
+      static const std::size_t MAX_ITEM_LEN = 8;
+
+      struct Stats {
+        // hosts the filter rejected
+        uint64_t rejects{0};
+        // hosts the filter passed but no domain rule matched
+        uint64_t falsePositives{0};
+
+        // out of the hosts no domain rule matches, the ones passed
+        double falsePositiveRate() const;
+      };
+
+      struct Tables {
+        // blockCount blocks of 8 words
+        const uint64_t *words;
+        uint32_t blockCount;
+        // bit n is set if some item is n + 1 bytes long
+        uint8_t lengths;
+        // a rule with an empty key matches every host with a dot
+        bool matchesAll;
+      };
+
+      explicit RuleBloomFilter(const std::vector<RuleAutomaton::Key> &keys);
+
+      // false if no domain rule matches the host, true if some may
+      bool mayMatch(const std::string &host) const;
+      static bool mayMatch(const Tables &tables, const std::string &host);
+      Tables getTables() const;
+
+    private:
+      void add(const char *item, std::size_t len);
+
+    private:
+      std::vector<uint64_t> words_;
+      uint32_t blockCount_{0};
+      uint8_t lengths_{0};
+      bool matchesAll_{false};
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_RULE_BLOOM_FILTER_H_ */
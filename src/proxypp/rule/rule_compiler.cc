@@ -0,0 +1,49 @@
+/*******************************************************************************
+**          File: rule_compiler.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-20 Tue 10:05 AM
+**   Description: rulec, compiles a text rule file into a file that hpd can
+**                mmap, see CompiledRuleFile, or a CSV file of IP ranges
+**                into a GeoIP database
+*******************************************************************************/
+#include "proxypp/rule/compiled_rule_file.h"
+#include "proxypp/rule/rule_file_loader.h"
+#include "proxypp/rule/geoip_database.h"
+#include "proxypp/cli/cmdline.h"
+#include "nul/log.h"
+
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  cmdline::parser p;
+
+  p.add<std::string>("input", 'i', "text rule file, one rule per line", true);
+  p.add<std::string>("output", 'o', "compiled rule file", true);
+  p.add("geoip", 'g',
+        "the input is a CSV file of start_ip,end_ip,country_code lines, "
+        "compile it into a GeoIP database");
+
+  p.parse_check(argc, argv);
+
+  auto input = p.get<std::string>("input");
+  if (p.exist("geoip")) {
+    return proxypp::GeoIpDatabase::compileCsv(
+      input, p.get<std::string>("output")) ? 0 : 1;
+  }
+
+  if (::access(input.c_str(), R_OK) != 0) {
+    LOG_E("failed to open: %s", input.c_str());
+    return 1;
+  }
+
+  std::vector<std::string> rules;
+  proxypp::RuleFileLoader::load({input}, rules);
+
+  auto output = p.get<std::string>("output");
+  if (!proxypp::CompiledRuleFile::write(output, rules)) {
+    return 1;
+  }
+  LOG_I("compiled %zu rules into: %s, format: %u",
+        rules.size(), output.c_str(), proxypp::CompiledRuleFile::FORMAT_VERSION);
+  return 0;
+}
@@ -0,0 +1,220 @@
+/*******************************************************************************
+**          File: rule_file_loader.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-21 Wed 10:20 AM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/rule_file_loader.h"
+#include "proxypp/rule/rule_snapshot.h"
+#include "proxypp/util.h"
+#include "nul/log.h"
+
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+  static const std::size_t CHUNK_SIZE = 256 * 1024;
+  static const std::string SECTION_PREFIX = "[action:";
+
+  struct MappedFile {
+    void *addr;
+    std::size_t size;
+  };
+
+  struct Chunk {
+    const char *begin;
+    const char *end;
+    // the sections of a file start over with no action
+    bool firstOfFile;
+    std::vector<std::string> rules;
+    // the index into rules each "[action: NAME]" line is at, with NAME
+    std::vector<std::pair<std::size_t, std::string>> sections;
+    proxypp::RuleSnapshot::RegexMap regexes;
+  };
+
+  bool mapFile(const std::string &file, MappedFile &mapped) {
+    auto fd = ::open(file.c_str(), O_RDONLY);
+    if (fd == -1) {
+      LOG_W("proxy rule file not exists: %s", file.c_str());
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+
+    mapped.size = static_cast<std::size_t>(st.st_size);
+    mapped.addr = ::mmap(nullptr, mapped.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped.addr == MAP_FAILED) {
+      LOG_W("failed to mmap proxy rule file: %s", file.c_str());
+      return false;
+    }
+    ::madvise(mapped.addr, mapped.size, MADV_SEQUENTIAL);
+    return true;
+  }
+
+  // a list like gfwlist is the base64 of the rules, it is taken for one
+  // only if it decodes to text, a plain rule file has a '.' or a '|' in
+  // the first few bytes and is turned away right there
+  bool decodeBase64List(
+    const char *data, std::size_t size, std::string &decoded) {
+    if (!proxypp::Util::base64Decode(data, size, decoded) ||
+        decoded.empty()) {
+      return false;
+    }
+    for (auto ch : decoded) {
+      auto c = static_cast<unsigned char>(ch);
+      if (c < 0x20 && c != '\t' && c != '\r' && c != '\n') {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // "[action: NAME]", the rules after it up to the next one are of the
+  // action NAME, see RouteAction, an empty NAME ends the section
+  bool parseSection(const std::string &line, std::string &name) {
+    if (line.size() <= SECTION_PREFIX.size() ||
+        line.compare(0, SECTION_PREFIX.size(), SECTION_PREFIX) != 0) {
+      return false;
+    }
+    auto end = line.find_last_not_of(" \t\r");
+    if (line[end] != ']') {
+      return false;
+    }
+    auto begin = line.find_first_not_of(" \t", SECTION_PREFIX.size());
+    name = line.substr(begin, end - begin);
+    name.erase(name.find_last_not_of(" \t") + 1);
+    return true;
+  }
+
+  // lines are split at '\n' only, like std::getline()
+  void parseChunk(Chunk &chunk) {
+    auto p = chunk.begin;
+    std::string name;
+    while (p < chunk.end) {
+      auto eol = static_cast<const char *>(
+        std::memchr(p, '\n', chunk.end - p));
+      auto lineEnd = eol ? eol : chunk.end;
+      std::string line(p, lineEnd);
+      if (parseSection(line, name)) {
+        chunk.sections.emplace_back(chunk.rules.size(), name);
+      } else if (proxypp::RuleSnapshot::isValid(line, &chunk.regexes)) {
+        chunk.rules.push_back(std::move(line));
+      }
+      p = lineEnd + 1;
+    }
+  }
+}
+
+namespace proxypp {
+  std::size_t RuleFileLoader::load(
+    const std::vector<std::string> &files,
+    std::vector<std::string> &rules,
+    std::size_t threadCount,
+    RuleSnapshot::RegexMap *regexes) {
+    std::vector<MappedFile> mappedFiles;
+    // reserved so the strings the chunks point into never move
+    std::vector<std::string> decodedFiles;
+    decodedFiles.reserve(files.size());
+    std::vector<Chunk> chunks;
+    std::string decoded;
+    for (auto &file : files) {
+      MappedFile mapped;
+      if (!mapFile(file, mapped)) {
+        continue;
+      }
+      mappedFiles.push_back(mapped);
+
+      auto data = static_cast<const char *>(mapped.addr);
+      auto end = data + mapped.size;
+      if (decodeBase64List(data, mapped.size, decoded)) {
+        decodedFiles.push_back(std::move(decoded));
+        data = decodedFiles.back().data();
+        end = data + decodedFiles.back().size();
+      }
+      auto firstOfFile = true;
+      for (auto begin = data; begin < end; ) {
+        auto chunkEnd = begin + std::min<std::size_t>(CHUNK_SIZE, end - begin);
+        if (chunkEnd < end) {
+          auto eol = static_cast<const char *>(
+            std::memchr(chunkEnd, '\n', end - chunkEnd));
+          chunkEnd = eol ? eol + 1 : end;
+        }
+        chunks.push_back(Chunk{begin, chunkEnd, firstOfFile, {}, {}, {}});
+        firstOfFile = false;
+        begin = chunkEnd;
+      }
+    }
+
+    if (threadCount == 0) {
+      threadCount = std::max(1U, std::thread::hardware_concurrency());
+    }
+    threadCount = std::min(threadCount, chunks.size());
+    if (threadCount <= 1) {
+      for (auto &chunk : chunks) {
+        parseChunk(chunk);
+      }
+
+    } else {
+      std::atomic<std::size_t> nextChunk{0};
+      auto work = [&chunks, &nextChunk]() {
+        std::size_t index;
+        while ((index = nextChunk.fetch_add(1)) < chunks.size()) {
+          parseChunk(chunks[index]);
+        }
+      };
+      std::vector<std::thread> workers;
+      for (std::size_t i = 1; i < threadCount; ++i) {
+        workers.emplace_back(work);
+      }
+      work();
+      for (auto &worker : workers) {
+        worker.join();
+      }
+    }
+
+    std::size_t count = 0;
+    for (auto &chunk : chunks) {
+      count += chunk.rules.size();
+    }
+    rules.reserve(rules.size() + count);
+    // a section may go on over the chunks after the one it starts in
+    std::string action;
+    for (auto &chunk : chunks) {
+      if (chunk.firstOfFile) {
+        action.clear();
+      }
+      auto section = chunk.sections.begin();
+      for (std::size_t i = 0; i < chunk.rules.size(); ++i) {
+        for (; section != chunk.sections.end() && section->first == i;
+             ++section) {
+          action = section->second;
+        }
+        rules.push_back(action.empty() ? std::move(chunk.rules[i]) :
+          RuleSnapshot::withAction(chunk.rules[i], action));
+      }
+      if (!chunk.sections.empty()) {
+        action = chunk.sections.back().second;
+      }
+      if (regexes) {
+        for (auto &entry : chunk.regexes) {
+          regexes->insert(std::move(entry));
+        }
+      }
+    }
+
+    for (auto &mapped : mappedFiles) {
+      ::munmap(mapped.addr, mapped.size);
+    }
+    return count;
+  }
+} /* end of namspace: proxypp */
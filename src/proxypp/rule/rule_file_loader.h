@@ -0,0 +1,43 @@
+/*******************************************************************************
+**          File: rule_file_loader.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-21 Wed 10:05 AM
+**   Description: reads text rule files, validating the lines of them on a
+**                few threads at once
+*******************************************************************************/
+#ifndef PROXYPP_RULE_FILE_LOADER_H_
+#define PROXYPP_RULE_FILE_LOADER_H_
+#include <string>
+#include <vector>
+#include "proxypp/rule/rule_snapshot.h"
+
+namespace proxypp {
+  /**
+   * The files are mapped and cut into chunks at line boundaries, every
+   * worker takes the next chunk until there are none left, the regex
+   * rules are compiled by RuleSnapshot::isValid() on the workers as well,
+   * and can be handed to the RuleSnapshot so it doesn't compile them again.
+   * The rules of each chunk are kept apart and joined in the order of the
+   * chunks, so the result is the same as reading the files line by line.
+   * A file of base64, as gfwlist is published, is decoded first.
+   *
+   * A line "[action: NAME]" gives the rules after it in the same file the
+   * option "action=NAME", unless they name an action themselves, up to
+   * the next such line, see RuleSnapshot::getAction()
+   */
+  class RuleFileLoader final {
+    public:
+      // appends the valid rules of the files to rules, in the order of
+      // the files and of the lines in them, files that can't be read are
+      // skipped, returns the number of rules appended. threadCount of 0
+      // is one thread per core. the std::regex objects compiled to
+      // validate the rules are added to regexes if it is set
+      static std::size_t load(
+        const std::vector<std::string> &files,
+        std::vector<std::string> &rules,
+        std::size_t threadCount = 0,
+        RuleSnapshot::RegexMap *regexes = nullptr);
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_RULE_FILE_LOADER_H_ */
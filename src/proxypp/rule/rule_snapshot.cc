@@ -0,0 +1,586 @@
+/*******************************************************************************
+**          File: rule_snapshot.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 11:34 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/rule_snapshot.h"
+#include "proxypp/rule/regex_set.h"
+#include "proxypp/rule/wildcard_rule.h"
+#include "proxypp/util.h"
+#include "nul/log.h"
+
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <functional>
+
+namespace {
+  // a regex rule has to match this many times more than twice as often
+  // as the one before it to have them reordered, so the order doesn't
+  // flip back and forth between rules that match about as often
+  static const uint64_t REORDER_MIN_HITS = 32;
+
+  // "$third-party,action=reject", the last '$' of the rule if nothing
+  // after it is a '/', which a regex rule ends with
+  std::string::size_type findOptions(const std::string &rule) {
+    auto pos = rule.rfind('$');
+    if (pos == std::string::npos || pos == 0 ||
+        rule.find('/', pos) != std::string::npos) {
+      return std::string::npos;
+    }
+    return pos;
+  }
+
+  // where the name of the "action=NAME" option of the rule starts, the
+  // option is the first or follows a ','
+  std::string::size_type findActionName(const std::string &rule) {
+    static const std::string ACTION_OPTION = "action=";
+    auto options = findOptions(rule);
+    if (options == std::string::npos) {
+      return std::string::npos;
+    }
+    auto pos = rule.find(ACTION_OPTION, options + 1);
+    while (pos != std::string::npos &&
+           rule[pos - 1] != '$' && rule[pos - 1] != ',') {
+      pos = rule.find(ACTION_OPTION, pos + 1);
+    }
+    return pos == std::string::npos ? pos : pos + ACTION_OPTION.size();
+  }
+
+  // drops what of an Adblock Plus pattern can't be matched against the
+  // host, a trailing '*' as the keys match a prefix of what follows
+  // anyway, a trailing '|' or '/' ends the host just as '^' does. true
+  // if the pattern has wildcards left
+  bool normalizePattern(std::string &key) {
+    while (!key.empty() && key.back() == '*') {
+      key.pop_back();
+    }
+    if (!key.empty() && (key.back() == '|' || key.back() == '/')) {
+      key.back() = '^';
+    }
+    return proxypp::WildcardRule::isWildcard(key);
+  }
+}
+
+namespace proxypp {
+  RuleSnapshot::RuleKind RuleSnapshot::parse(
+    const std::string &rule,
+    std::string &key,
+    RuleAutomaton::KeyType &keyType) {
+    if (rule.empty()) {
+      return RuleKind::kInvalid;
+    }
+    auto options = findOptions(rule);
+    if (options != std::string::npos) {
+      return parse(rule.substr(0, options), key, keyType);
+    }
+
+    auto size = rule.size();
+    auto ch = std::tolower(rule[0]);
+    if (size > 2 && ch == '/' && rule[size - 1] == '/') {
+      // it's a regex
+      key = rule.substr(1, size - 2);
+      return RuleKind::kRegex;
+    }
+
+    if (Util::strStartsWith(rule, "geoip:", 0) ||
+        Util::strStartsWith(rule, "@@geoip:", 0)) {
+      auto isException = rule[0] == '@';
+      auto code = GeoIpDatabase::toCountryCode(
+        rule.substr(isException ? 8 : 6));
+      if (code == 0) {
+        return RuleKind::kInvalid;
+      }
+      key = {static_cast<char>(code >> 8), static_cast<char>(code & 0xff)};
+      return isException ? RuleKind::kGeoIpException : RuleKind::kGeoIpMatch;
+    }
+
+    // an address block, which would never match as a domain rule
+    if (rule.find('/') != std::string::npos) {
+      auto isException = Util::strStartsWith(rule, "@@", 0);
+      auto cidr = isException ? rule.substr(2) : rule;
+      IpPrefixTree::Address prefix;
+      uint8_t prefixLen = 0;
+      if (IpPrefixTree::parsePrefix(cidr, prefix, prefixLen)) {
+        key = std::move(cidr);
+        return isException ?
+          RuleKind::kAddressException : RuleKind::kAddressMatch;
+      }
+    }
+
+    if (ch == '|' || ch == '.' || ch == '*' ||
+        (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z')) {
+      // matches against the entire rule
+      if (Util::strStartsWith(rule, "|https://", 0)) {
+        key = rule.substr(9);
+        keyType = RuleAutomaton::KeyType::kHttps;
+
+      } else if (Util::strStartsWith(rule, "|http://", 0)) {
+        key = rule.substr(8);
+        keyType = RuleAutomaton::KeyType::kHttp;
+
+      // matches against domain, the rule is treated as having wildcards
+      // both at the start and the end, but it must start at a label
+      } else if (Util::strStartsWith(rule, "||.", 0)) {
+        key = rule.substr(3);
+        keyType = RuleAutomaton::KeyType::kDomain;
+
+      } else if (Util::strStartsWith(rule, "||", 0)) {
+        key = rule.substr(2);
+        keyType = RuleAutomaton::KeyType::kDomain;
+
+      } else {
+        key = rule[0] != '.' ? rule : rule.substr(1);
+        keyType = RuleAutomaton::KeyType::kDomain;
+      }
+      return normalizePattern(key) ?
+        RuleKind::kWildcardMatch : RuleKind::kMatch;
+    }
+
+    if (Util::strStartsWith(rule, "@@|https://", 0)) {
+      key = rule.substr(11);
+      keyType = RuleAutomaton::KeyType::kHttps;
+
+    } else if (Util::strStartsWith(rule, "@@|http://", 0)) {
+      key = rule.substr(10);
+      keyType = RuleAutomaton::KeyType::kHttp;
+
+    } else if (Util::strStartsWith(rule, "@@||", 0)) {
+      key = rule.substr(4);
+      keyType = RuleAutomaton::KeyType::kDomain;
+
+    } else {
+      return RuleKind::kInvalid;
+    }
+    return normalizePattern(key) ?
+      RuleKind::kWildcardException : RuleKind::kException;
+  }
+
+  RouteAction::Id RuleSnapshot::getAction(const std::string &rule) {
+    auto pos = findActionName(rule);
+    if (pos == std::string::npos) {
+      return RouteAction::kProxy;
+    }
+    return RouteAction::getId(rule.substr(pos, rule.find(',', pos) - pos));
+  }
+
+  std::string RuleSnapshot::withAction(
+    const std::string &rule, const std::string &name) {
+    if (findActionName(rule) != std::string::npos) {
+      return rule;
+    }
+    auto separator = findOptions(rule) == std::string::npos ? "$" : ",";
+    return rule + separator + "action=" + name;
+  }
+
+  bool RuleSnapshot::isValid(const std::string &rule, RegexMap *regexes) {
+    std::string key;
+    auto keyType = RuleAutomaton::KeyType::kDomain;
+    auto kind = parse(rule, key, keyType);
+    if (kind != RuleKind::kRegex) {
+      return kind != RuleKind::kInvalid;
+    }
+    if (RegexSet::isSupported(key)) {
+      return true;
+    }
+    if (regexes && regexes->find(key) != regexes->end()) {
+      return true;
+    }
+    try {
+      auto regex = std::make_shared<const std::regex>(key);
+      if (regexes) {
+        regexes->emplace(key, std::move(regex));
+      }
+    } catch (const std::regex_error &e) {
+      LOG_W("invalid regex rule: %s, %s", rule.c_str(), e.what());
+      return false;
+    }
+    return true;
+  }
+
+  bool RuleSnapshot::isAddressRule(RuleKind kind) {
+    return kind == RuleKind::kAddressMatch ||
+      kind == RuleKind::kAddressException ||
+      kind == RuleKind::kGeoIpMatch ||
+      kind == RuleKind::kGeoIpException;
+  }
+
+  RuleSnapshot::RuleSnapshot(
+    uint64_t version,
+    const std::vector<std::string> &rules,
+    std::shared_ptr<const CompiledRuleFile> compiledRules,
+    std::shared_ptr<const GeoIpDatabase> geoIpDatabase,
+    const RegexMap &regexes) :
+    version_(version), ruleCount_(rules.size()),
+    automaton_(collectKeys(rules)), compiledRules_(std::move(compiledRules)),
+    geoIpDatabase_(std::move(geoIpDatabase)) {
+    compileOtherRules(rules, nullptr, regexes);
+  }
+
+  RuleSnapshot::RuleSnapshot(
+    uint64_t version,
+    const RuleSnapshot &previous,
+    const std::vector<std::string> &rules,
+    const std::vector<std::string> &addedRules,
+    const std::vector<std::string> &removedRules,
+    std::shared_ptr<const CompiledRuleFile> compiledRules,
+    std::shared_ptr<const GeoIpDatabase> geoIpDatabase,
+    const RegexMap &regexes) :
+    version_(version), ruleCount_(rules.size()),
+    automaton_(
+      previous.automaton_, collectKeys(addedRules), collectKeys(removedRules)),
+    compiledRules_(std::move(compiledRules)),
+    geoIpDatabase_(std::move(geoIpDatabase)) {
+    compileOtherRules(rules, &previous, regexes);
+  }
+
+  void RuleSnapshot::compileOtherRules(
+    const std::vector<std::string> &rules, const RuleSnapshot *previous,
+    const RegexMap &regexes) {
+    std::vector<std::string> regexRules;
+    std::vector<std::string> addressRules;
+    std::string key;
+    auto keyType = RuleAutomaton::KeyType::kDomain;
+    for (auto &rule : rules) {
+      auto kind = parse(rule, key, keyType);
+      if (kind == RuleKind::kRegex) {
+        regexRules.push_back(rule);
+      } else if (isAddressRule(kind)) {
+        addressRules.push_back(rule);
+      } else if (kind == RuleKind::kWildcardMatch ||
+                 kind == RuleKind::kWildcardException) {
+        addWildcardRule(kind, key, keyType, getAction(rule));
+      }
+    }
+    compiledActions_.fill(RouteAction::kProxy);
+    if (compiledRules_) {
+      ruleCount_ += compiledRules_->getRuleCount();
+      auto &actionNames = compiledRules_->getActionNames();
+      for (std::size_t i = 0; i < actionNames.size(); ++i) {
+        compiledActions_[i] = RouteAction::getId(actionNames[i]);
+      }
+      for (auto &rule : compiledRules_->getWildcardRules()) {
+        auto kind = parse(rule, key, keyType);
+        addWildcardRule(kind, key, keyType, getAction(rule));
+      }
+      auto &compiledRegexRules = compiledRules_->getRegexRules();
+      regexRules.insert(
+        regexRules.end(), compiledRegexRules.begin(), compiledRegexRules.end());
+      auto &compiledAddressRules = compiledRules_->getAddressRules();
+      addressRules.insert(
+        addressRules.end(),
+        compiledAddressRules.begin(), compiledAddressRules.end());
+    }
+
+    IpPrefixTree::Address prefix;
+    uint8_t prefixLen = 0;
+    for (auto &rule : addressRules) {
+      auto kind = parse(rule, key, keyType);
+      auto action = getAction(rule);
+      if (kind == RuleKind::kGeoIpMatch) {
+        geoIpMatches_.emplace_back(GeoIpDatabase::toCountryCode(key), action);
+      } else if (kind == RuleKind::kGeoIpException) {
+        geoIpExceptions_.push_back(GeoIpDatabase::toCountryCode(key));
+      } else if (IpPrefixTree::parsePrefix(key, prefix, prefixLen)) {
+        addressRules_.insert(
+          prefix, prefixLen, kind == RuleKind::kAddressException ?
+          IpPrefixTree::Action::kException : IpPrefixTree::Action::kMatch,
+          action);
+      }
+    }
+    addressRules_.build();
+    // the lowest action first, so the first country that matches is it
+    std::stable_sort(
+      geoIpMatches_.begin(), geoIpMatches_.end(),
+      [](const std::pair<uint16_t, RouteAction::Id> &a,
+         const std::pair<uint16_t, RouteAction::Id> &b) {
+        return a.second < b.second;
+      });
+
+    // compiling a std::regex takes long, the ones compiled already to
+    // validate the rules or for previous are taken as they are
+    RegexMap previousRegexes;
+    if (previous) {
+      for (std::size_t i = 0; i < previous->otherRegexes_.size(); ++i) {
+        previousRegexes.emplace(
+          previous->otherRegexPatterns_[i], previous->otherRegexes_[i]);
+      }
+    }
+
+    // RegexSet reports the first pattern that matches, so the patterns
+    // are sorted by their actions for it to be the one of the lowest
+    std::vector<std::pair<RouteAction::Id, std::string>> patterns;
+    for (auto &rule : regexRules) {
+      parse(rule, key, keyType);
+      auto action = getAction(rule);
+      if (RegexSet::isSupported(key)) {
+        patterns.emplace_back(action, key);
+        continue;
+      }
+      auto it = regexes.find(key);
+      if (it != regexes.end()) {
+        otherRegexes_.push_back(it->second);
+      } else if ((it = previousRegexes.find(key)) != previousRegexes.end()) {
+        otherRegexes_.push_back(it->second);
+      } else {
+        otherRegexes_.push_back(std::make_shared<const std::regex>(key));
+      }
+      otherRegexPatterns_.push_back(key);
+      otherRegexActions_.push_back(action);
+    }
+    std::stable_sort(
+      patterns.begin(), patterns.end(),
+      [](const std::pair<RouteAction::Id, std::string> &a,
+         const std::pair<RouteAction::Id, std::string> &b) {
+        return a.first < b.first;
+      });
+    for (auto &p : patterns) {
+      regexActions_.push_back(p.first);
+      regexPatterns_.push_back(std::move(p.second));
+    }
+
+    std::unordered_map<std::string, uint64_t> previousHits;
+    if (previous) {
+      for (std::size_t i = 0; i < previous->otherRegexes_.size(); ++i) {
+        previousHits[previous->otherRegexPatterns_[i]] =
+          previous->otherRegexHits_[i].load(std::memory_order_relaxed);
+      }
+    }
+    auto count = otherRegexes_.size();
+    std::vector<uint64_t> hits(count);
+    otherRegexHits_.reset(new std::atomic<uint64_t>[count]);
+    for (std::size_t i = 0; i < count; ++i) {
+      auto it = previousHits.find(otherRegexPatterns_[i]);
+      hits[i] = it == previousHits.end() ? 0 : it->second;
+      otherRegexHits_[i].store(hits[i], std::memory_order_relaxed);
+    }
+    auto order = std::make_shared<std::vector<uint32_t>>(count);
+    std::iota(order->begin(), order->end(), 0);
+    std::stable_sort(order->begin(), order->end(), compareOtherRegexes(hits));
+    otherRegexOrder_ = std::move(order);
+  }
+
+  std::function<bool(uint32_t, uint32_t)> RuleSnapshot::compareOtherRegexes(
+    const std::vector<uint64_t> &hits) const {
+    return [this, &hits](uint32_t a, uint32_t b) {
+      if (otherRegexActions_[a] != otherRegexActions_[b]) {
+        return otherRegexActions_[a] < otherRegexActions_[b];
+      }
+      return hits[a] > hits[b];
+    };
+  }
+
+  void RuleSnapshot::addWildcardRule(
+    RuleKind kind, const std::string &pattern, RuleAutomaton::KeyType type,
+    RouteAction::Id action) {
+    auto exception = kind == RuleKind::kWildcardException;
+    std::string indexKey;
+    if (WildcardRule::getIndexKey(pattern, indexKey)) {
+      maxWildcardKeyLen_ = std::max(maxWildcardKeyLen_, indexKey.size());
+      wildcardRules_[indexKey].emplace_back(pattern, type, exception, action);
+    } else {
+      unindexedWildcardRules_.emplace_back(pattern, type, exception, action);
+      hasUnindexedWildcardMatches_ =
+        hasUnindexedWildcardMatches_ || !exception;
+    }
+  }
+
+  bool RuleSnapshot::canDerive(std::size_t changeCount) const {
+    return automaton_.canLayer(changeCount);
+  }
+
+  uint64_t RuleSnapshot::getVersion() const {
+    return version_;
+  }
+
+  std::size_t RuleSnapshot::getRuleCount() const {
+    return ruleCount_;
+  }
+
+  bool RuleSnapshot::mayMatchByName(const std::string &host) const {
+    return hasUnindexedWildcardMatches_ || automaton_.mayMatch(host) ||
+      (compiledRules_ && RuleBloomFilter::mayMatch(
+          compiledRules_->getFilterTables(), host));
+  }
+
+  RuleAutomaton::Result RuleSnapshot::scan(
+    const std::string &host, uint16_t port) const {
+    auto result = automaton_.scan(host, port);
+    if (compiledRules_) {
+      auto compiledResult =
+        RuleAutomaton::scan(compiledRules_->getTables(), host, port);
+      if (compiledResult.matched) {
+        // the ids of the file are its own, see CompiledRuleFile
+        result.action = std::min(
+          result.action, compiledActions_[compiledResult.action]);
+      }
+      result.matched = result.matched || compiledResult.matched;
+      result.excepted = result.excepted || compiledResult.excepted;
+      result.wildcard = result.wildcard || compiledResult.wildcard;
+    }
+    if (result.wildcard || !unindexedWildcardRules_.empty()) {
+      matchWildcardRules(host, port, result);
+    }
+    return result;
+  }
+
+  void RuleSnapshot::matchWildcardRules(
+    const std::string &host, uint16_t port,
+    RuleAutomaton::Result &result) const {
+    auto check = [&](const WildcardRule &rule) {
+      if (rule.isException()) {
+        result.excepted = result.excepted || rule.matches(host, port);
+      } else if (rule.getAction() < result.action && rule.matches(host, port)) {
+        result.matched = true;
+        result.action = rule.getAction();
+      }
+    };
+    for (auto &rule : unindexedWildcardRules_) {
+      check(rule);
+    }
+    if (!result.wildcard) {
+      return;
+    }
+
+    // the automaton found some key, but not which, so the keys are
+    // looked up at every label the way it would have found them
+    std::string key;
+    for (std::size_t pos = 0; pos < host.size(); ++pos) {
+      if (pos > 0 && host[pos - 1] != '.') {
+        continue;
+      }
+      auto maxLen = std::min(maxWildcardKeyLen_, host.size() - pos);
+      for (std::size_t len = 1; len <= maxLen; ++len) {
+        key.assign(host, pos, len);
+        auto it = wildcardRules_.find(key);
+        if (it != wildcardRules_.end()) {
+          for (auto &rule : it->second) {
+            check(rule);
+          }
+        }
+      }
+    }
+  }
+
+  const std::vector<std::string> &RuleSnapshot::getRegexPatterns() const {
+    return regexPatterns_;
+  }
+
+  RouteAction::Id RuleSnapshot::getRegexAction(std::size_t index) const {
+    return regexActions_[index];
+  }
+
+  bool RuleSnapshot::matchesOtherRegexes(
+    const std::string &host, RouteAction::Id *action) const {
+    if (otherRegexes_.empty()) {
+      return false;
+    }
+
+    auto order = std::atomic_load(&otherRegexOrder_);
+    for (std::size_t i = 0; i < order->size(); ++i) {
+      auto index = (*order)[i];
+      if (!std::regex_match(host, *otherRegexes_[index])) {
+        continue;
+      }
+
+      auto hits = otherRegexHits_[index].fetch_add(
+        1, std::memory_order_relaxed) + 1;
+      // the rules of a lower action are always tried first
+      auto before = i > 0 ? (*order)[i - 1] : index;
+      if (i > 0 && otherRegexActions_[before] == otherRegexActions_[index] &&
+          hits > REORDER_MIN_HITS + 2 *
+          otherRegexHits_[before].load(std::memory_order_relaxed)) {
+        reorderNeeded_.store(true, std::memory_order_relaxed);
+      }
+      if (action) {
+        *action = otherRegexActions_[index];
+      }
+      return true;
+    }
+    return false;
+  }
+
+  bool RuleSnapshot::needsReordering() const {
+    return reorderNeeded_.load(std::memory_order_relaxed);
+  }
+
+  bool RuleSnapshot::reorderOtherRegexes() const {
+    reorderNeeded_.store(false, std::memory_order_relaxed);
+    auto current = std::atomic_load(&otherRegexOrder_);
+    std::vector<uint64_t> hits(otherRegexes_.size());
+    for (std::size_t i = 0; i < hits.size(); ++i) {
+      hits[i] = otherRegexHits_[i].load(std::memory_order_relaxed);
+    }
+
+    auto order = std::make_shared<std::vector<uint32_t>>(*current);
+    std::stable_sort(order->begin(), order->end(), compareOtherRegexes(hits));
+    if (*order == *current) {
+      return false;
+    }
+    std::atomic_store(
+      &otherRegexOrder_,
+      std::shared_ptr<const std::vector<uint32_t>>(std::move(order)));
+    return true;
+  }
+
+  bool RuleSnapshot::hasAddressRules() const {
+    return addressRules_.size() > 0 || (geoIpDatabase_ &&
+      (!geoIpMatches_.empty() || !geoIpExceptions_.empty()));
+  }
+
+  IpPrefixTree::Action RuleSnapshot::matchAddress(
+    const IpPrefixTree::Address &addr, RouteAction::Id *routeAction) const {
+    auto action = addressRules_.lookup(addr, routeAction);
+    if (action != IpPrefixTree::Action::kNone || !geoIpDatabase_ ||
+        (geoIpMatches_.empty() && geoIpExceptions_.empty())) {
+      return action;
+    }
+
+    auto country = geoIpDatabase_->lookup(addr);
+    if (country == 0) {
+      return action;
+    }
+    for (auto c : geoIpExceptions_) {
+      if (c == country) {
+        return IpPrefixTree::Action::kException;
+      }
+    }
+    for (auto &c : geoIpMatches_) {
+      if (c.first == country) {
+        if (routeAction) {
+          *routeAction = c.second;
+        }
+        return IpPrefixTree::Action::kMatch;
+      }
+    }
+    return action;
+  }
+
+  std::vector<RuleAutomaton::Key> RuleSnapshot::collectKeys(
+    const std::vector<std::string> &rules) {
+    std::vector<RuleAutomaton::Key> keys;
+    keys.reserve(rules.size());
+    for (auto &rule : rules) {
+      RuleAutomaton::Key key;
+      auto kind = parse(rule, key.key, key.type);
+      if (kind == RuleKind::kMatch || kind == RuleKind::kException) {
+        key.exception = kind == RuleKind::kException;
+        if (!key.exception) {
+          key.action = getAction(rule);
+        }
+        keys.push_back(std::move(key));
+
+      } else if (kind == RuleKind::kWildcardMatch ||
+                 kind == RuleKind::kWildcardException) {
+        auto pattern = std::move(key.key);
+        if (WildcardRule::getIndexKey(pattern, key.key)) {
+          key.type = RuleAutomaton::KeyType::kWildcard;
+          key.exception = kind == RuleKind::kWildcardException;
+          keys.push_back(std::move(key));
+        }
+      }
+    }
+    return keys;
+  }
+} /* end of namspace: proxypp */
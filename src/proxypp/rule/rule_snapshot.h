@@ -0,0 +1,202 @@
+/*******************************************************************************
+**          File: rule_snapshot.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 11:20 PM
+**   Description: an immutable, compiled set of auto proxy rules, published
+**                as a whole so readers never see a half-built rule set
+*******************************************************************************/
+#ifndef PROXYPP_RULE_SNAPSHOT_H_
+#define PROXYPP_RULE_SNAPSHOT_H_
+#include "proxypp/rule/rule_automaton.h"
+#include "proxypp/rule/layered_rule_automaton.h"
+#include "proxypp/rule/compiled_rule_file.h"
+#include "proxypp/rule/ip_prefix_tree.h"
+#include "proxypp/rule/geoip_database.h"
+#include "proxypp/rule/wildcard_rule.h"
+#include "proxypp/rule/route_action.h"
+
+#include <string>
+#include <vector>
+#include <array>
+#include <functional>
+#include <memory>
+#include <regex>
+#include <atomic>
+#include <unordered_map>
+
+namespace proxypp {
+  /**
+   * Safe to be shared by any number of threads. The regex rules that
+   * RegexSet can do are kept as patterns, the DFA built from them caches
+   * states as it matches, so every reader builds its own. The ones it
+   * can't do are tried one by one, the order they are tried in is the
+   * only thing that changes after construction, it is swapped in as a
+   * whole by reorderOtherRegexes()
+   *
+   * A match rule may name the RouteAction of the hosts it matches with a
+   * "$action=NAME" option, "$action=reject", "$action=direct" or the name
+   * of an upstream. Of the rules that match, the lowest action wins
+   */
+  class RuleSnapshot final {
+    public:
+      // the std::regex objects of the regex rules RegexSet can't do, by
+      // pattern, compiled once and shared by the snapshots
+      using RegexMap =
+        std::unordered_map<std::string, std::shared_ptr<const std::regex>>;
+
+      enum class RuleKind {
+        kInvalid,
+        kRegex,
+        kMatch,
+        kException,
+        // "10.0.0.0/8", "2001:db8::/32"
+        kAddressMatch,
+        // "@@10.0.0.0/8"
+        kAddressException,
+        // "geoip:CN"
+        kGeoIpMatch,
+        // "@@geoip:CN"
+        kGeoIpException,
+        // "||*.google.com", "google.*^", see WildcardRule
+        kWildcardMatch,
+        // "@@||*.google.cn^"
+        kWildcardException
+      };
+
+      // for kMatch and kException, key and keyType locate the rule in
+      // the automaton, for the wildcard rules, key is the pattern and
+      // keyType is where it has to match, for kRegex, key is the pattern,
+      // for the address rules, key is the CIDR, for the GeoIP rules, the
+      // country code
+      static RuleKind parse(
+        const std::string &rule,
+        std::string &key,
+        RuleAutomaton::KeyType &keyType);
+      // the action named by the "$action=NAME" option of the rule, kProxy
+      // if it names none
+      static RouteAction::Id getAction(const std::string &rule);
+      // the rule with an "action=NAME" option of name, the rule itself if
+      // it names an action already
+      static std::string withAction(
+        const std::string &rule, const std::string &name);
+      // the rule parses, and its pattern compiles if it is a regex, the
+      // std::regex compiled for that is added to regexes if it is set
+      static bool isValid(const std::string &rule, RegexMap *regexes = nullptr);
+      // the kinds matched against IP addresses rather than host names
+      static bool isAddressRule(RuleKind kind);
+
+      // the keys of the automaton rules, in the order they appear
+      static std::vector<RuleAutomaton::Key> collectKeys(
+        const std::vector<std::string> &rules);
+
+      // rules are assumed valid, the compiled rules, if any, are matched
+      // in addition to them, the GeoIP rules need geoIpDatabase. the
+      // regexes found in regexes are taken rather than compiled again
+      RuleSnapshot(
+        uint64_t version,
+        const std::vector<std::string> &rules,
+        std::shared_ptr<const CompiledRuleFile> compiledRules = nullptr,
+        std::shared_ptr<const GeoIpDatabase> geoIpDatabase = nullptr,
+        const RegexMap &regexes = {});
+      // rules are all the rules, previous had them but for addedRules and
+      // had removedRules as well, the automaton and the regexes of
+      // previous are shared and the counts of the regex rules that are
+      // still there are kept
+      RuleSnapshot(
+        uint64_t version,
+        const RuleSnapshot &previous,
+        const std::vector<std::string> &rules,
+        const std::vector<std::string> &addedRules,
+        const std::vector<std::string> &removedRules,
+        std::shared_ptr<const CompiledRuleFile> compiledRules = nullptr,
+        std::shared_ptr<const GeoIpDatabase> geoIpDatabase = nullptr,
+        const RegexMap &regexes = {});
+
+      // false if changeCount more changed rules had better be compiled
+      // into a new snapshot from scratch than derived from this one
+      bool canDerive(std::size_t changeCount) const;
+
+      uint64_t getVersion() const;
+      std::size_t getRuleCount() const;
+
+      // false if scan() would find no match rule for the host, it is
+      // much cheaper than scan() and right for most hosts
+      bool mayMatchByName(const std::string &host) const;
+      RuleAutomaton::Result scan(const std::string &host, uint16_t port) const;
+      // patterns for RegexSet, sorted by their actions
+      const std::vector<std::string> &getRegexPatterns() const;
+      // the action of the pattern at index of getRegexPatterns()
+      RouteAction::Id getRegexAction(std::size_t index) const;
+      // the regex rules RegexSet can't do, the ones of the lowest action
+      // first and of them, the ones that matched most often once they are
+      // reordered, action is set to the action of the one that matched
+      bool matchesOtherRegexes(
+        const std::string &host, RouteAction::Id *action = nullptr) const;
+      // true once some regex rule matched much more often than the one
+      // tried before it, until they are reordered
+      bool needsReordering() const;
+      // sorts the regex rules RegexSet can't do by their match counts,
+      // meant for a thread other than the ones matching, false if they
+      // are in order already
+      bool reorderOtherRegexes() const;
+
+      bool hasAddressRules() const;
+      // the address rule of the longest prefix that contains the address,
+      // or if there is none, the GeoIP rule of the country of it,
+      // routeAction is set to the action of the rule for kMatch
+      IpPrefixTree::Action matchAddress(
+        const IpPrefixTree::Address &addr,
+        RouteAction::Id *routeAction = nullptr) const;
+
+    private:
+      // the rules other than the automaton ones, the match counts and the
+      // regexes of the regex rules are taken from previous if there is one
+      void compileOtherRules(
+        const std::vector<std::string> &rules, const RuleSnapshot *previous,
+        const RegexMap &regexes);
+      void addWildcardRule(
+        RuleKind kind, const std::string &pattern,
+        RuleAutomaton::KeyType type, RouteAction::Id action);
+      // by action, then by the match counts in hits
+      std::function<bool(uint32_t, uint32_t)> compareOtherRegexes(
+        const std::vector<uint64_t> &hits) const;
+      // sets matched, action and excepted of result for the wildcard
+      // rules that match, the indexed ones are looked up only if
+      // result.wildcard
+      void matchWildcardRules(
+        const std::string &host, uint16_t port,
+        RuleAutomaton::Result &result) const;
+
+    private:
+      uint64_t version_;
+      std::size_t ruleCount_;
+      LayeredRuleAutomaton automaton_;
+      std::shared_ptr<const CompiledRuleFile> compiledRules_;
+      // the ids of this process for the action ids of compiledRules_
+      std::array<RouteAction::Id, 256> compiledActions_;
+      // the wildcard rules by the keys of kWildcard they are found by
+      std::unordered_map<std::string, std::vector<WildcardRule>>
+        wildcardRules_;
+      std::size_t maxWildcardKeyLen_{0};
+      // the rules with no such key, they are checked for every host
+      std::vector<WildcardRule> unindexedWildcardRules_;
+      bool hasUnindexedWildcardMatches_{false};
+      std::vector<std::string> regexPatterns_;
+      std::vector<RouteAction::Id> regexActions_;
+      std::vector<std::string> otherRegexPatterns_;
+      std::vector<RouteAction::Id> otherRegexActions_;
+      std::vector<std::shared_ptr<const std::regex>> otherRegexes_;
+      // match counts of otherRegexes_, bumped by the matching threads
+      std::unique_ptr<std::atomic<uint64_t>[]> otherRegexHits_;
+      // indices into otherRegexes_, in the order they are tried
+      mutable std::shared_ptr<const std::vector<uint32_t>> otherRegexOrder_;
+      mutable std::atomic<bool> reorderNeeded_{false};
+      IpPrefixTree addressRules_;
+      std::shared_ptr<const GeoIpDatabase> geoIpDatabase_;
+      // country codes, the matches with their actions, lowest first
+      std::vector<std::pair<uint16_t, RouteAction::Id>> geoIpMatches_;
+      std::vector<uint16_t> geoIpExceptions_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_RULE_SNAPSHOT_H_ */
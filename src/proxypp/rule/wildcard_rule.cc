@@ -0,0 +1,109 @@
+/*******************************************************************************
+**          File: wildcard_rule.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-21 Wed 03:32 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule/wildcard_rule.h"
+
+namespace {
+  inline bool isSeparator(char ch) {
+    auto c = static_cast<unsigned char>(ch);
+    return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+             (c >= '0' && c <= '9') || c >= 0x80 ||
+             c == '_' || c == '-' || c == '.' || c == '%');
+  }
+}
+
+namespace proxypp {
+  WildcardRule::WildcardRule(
+    const std::string &pattern,
+    RuleAutomaton::KeyType type,
+    bool exception,
+    RouteAction::Id action) :
+    pattern_(pattern), type_(type), exception_(exception), action_(action) {
+  }
+
+  bool WildcardRule::isWildcard(const std::string &pattern) {
+    return pattern.find_first_of("*^") != std::string::npos;
+  }
+
+  bool WildcardRule::getIndexKey(
+    const std::string &pattern, std::string &key) {
+    key.clear();
+    std::size_t start = 0;
+    while (true) {
+      auto end = pattern.find_first_of("*^", start);
+      if (end == std::string::npos) {
+        end = pattern.size();
+      }
+      if (start == 0) {
+        // the pattern itself starts at a label, or the start of the host
+        if (end > key.size()) {
+          key = pattern.substr(0, end);
+        }
+      } else {
+        // any other part, from its first dot on, follows a real dot
+        auto dot = pattern.find('.', start);
+        if (dot < end && end - dot - 1 > key.size()) {
+          key = pattern.substr(dot + 1, end - dot - 1);
+        }
+      }
+      if (end == pattern.size()) {
+        break;
+      }
+      start = end + 1;
+    }
+    return !key.empty();
+  }
+
+  bool WildcardRule::matches(const std::string &host, uint16_t port) const {
+    if (type_ == RuleAutomaton::KeyType::kHttps ||
+        type_ == RuleAutomaton::KeyType::kHttp) {
+      return (port == 443) == (type_ == RuleAutomaton::KeyType::kHttps) &&
+        matchesAt(host, 0);
+    }
+    for (std::size_t pos = 0; pos < host.size(); ++pos) {
+      if ((pos == 0 || host[pos - 1] == '.') && matchesAt(host, pos)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool WildcardRule::isException() const {
+    return exception_;
+  }
+
+  RouteAction::Id WildcardRule::getAction() const {
+    return action_;
+  }
+
+  bool WildcardRule::matchesAt(const std::string &host, std::size_t pos) const {
+    // the usual backtracking to the last '*', which is enough as a later
+    // '*' can match whatever an earlier one would have
+    auto p = std::size_t{0};
+    auto h = pos;
+    auto star = std::string::npos;
+    auto starHost = h;
+    while (p < pattern_.size()) {
+      auto ch = pattern_[p];
+      if (ch == '*') {
+        star = p++;
+        starHost = h;
+      } else if (h < host.size() &&
+                 (ch == '^' ? isSeparator(host[h]) : ch == host[h])) {
+        ++p;
+        ++h;
+      } else if (ch == '^' && h == host.size()) {
+        ++p;
+      } else if (star != std::string::npos && starHost < host.size()) {
+        p = star + 1;
+        h = ++starHost;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+} /* end of namspace: proxypp */
@@ -0,0 +1,57 @@
+/*******************************************************************************
+**          File: wildcard_rule.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-21 Wed 03:10 PM
+**   Description: an Adblock Plus pattern with '*' and '^' matched against
+**                the host
+*******************************************************************************/
+#ifndef PROXYPP_WILDCARD_RULE_H_
+#define PROXYPP_WILDCARD_RULE_H_
+#include "proxypp/rule/rule_automaton.h"
+
+#include <string>
+#include <cstdint>
+
+namespace proxypp {
+  /**
+   * '*' matches any run of bytes and '^' a separator, any byte but a
+   * letter, a digit or one of "_-.%", or the end of the host. A pattern
+   * of kDomain starts where a label of the host starts, one of kHttps or
+   * kHttp at the start of the host, and it needs only match the start of
+   * what follows, like the keys of RuleAutomaton. The rules are not
+   * matched one by one for every host, a part of the pattern that every
+   * host it matches has at the start of a label is kept in the automaton
+   * as a key of kWildcard, the rule is only checked when that is found
+   */
+  class WildcardRule final {
+    public:
+      WildcardRule(
+        const std::string &pattern,
+        RuleAutomaton::KeyType type,
+        bool exception,
+        RouteAction::Id action = RouteAction::kProxy);
+
+      // true if the pattern has '*' or '^'
+      static bool isWildcard(const std::string &pattern);
+      // the longest key of kWildcard the rule can be found by, false if
+      // no part of the pattern has to start at a label, the start of the
+      // host is one for the anchored patterns as well
+      static bool getIndexKey(const std::string &pattern, std::string &key);
+
+      bool matches(const std::string &host, uint16_t port) const;
+      bool isException() const;
+      RouteAction::Id getAction() const;
+
+    private:
+      // the pattern matches the start of the host from pos on
+      bool matchesAt(const std::string &host, std::size_t pos) const;
+
+    private:
+      std::string pattern_;
+      RuleAutomaton::KeyType type_;
+      bool exception_;
+      RouteAction::Id action_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_WILDCARD_RULE_H_ */
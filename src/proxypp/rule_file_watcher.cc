@@ -0,0 +1,86 @@
+/*******************************************************************************
+**          File: rule_file_watcher.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 11:40 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/rule_file_watcher.h"
+#include "proxypp/auto_proxy_manager.h"
+#include <algorithm>
+
+namespace proxypp {
+
+  RuleFileWatcher::RuleFileWatcher(
+    const std::shared_ptr<uvcpp::Loop> &loop,
+    const std::shared_ptr<AutoProxyManager> &manager) :
+    loop_(loop), manager_(manager) {
+  }
+
+  std::size_t RuleFileWatcher::addFiles(
+    const std::vector<std::string> &files) {
+    auto size = manager_->parseFilesAsRules(files);
+    if (size > 0) {
+      // don't route the first connections with no rules
+      manager_->waitUntilCompiled();
+    }
+    LOG_I("loaded %zu proxy rules from %zu files", size, files.size());
+
+    for (auto &file : files) {
+      if (std::find(files_.begin(), files_.end(), file) == files_.end()) {
+        files_.push_back(file);
+        watch(file);
+      }
+    }
+    return size;
+  }
+
+  void RuleFileWatcher::stop() {
+    if (fsEvents_.empty()) {
+      return;
+    }
+    auto fsEvents = fsEvents_;
+    auto work = uvcpp::Work::create(loop_);
+    work->once<uvcpp::EvAfterWork>(
+      [fsEvents, _ = work](const auto &e, auto &work) {
+        for (auto &fsEvent : fsEvents) {
+          fsEvent->stop();
+          fsEvent->close();
+        }
+      });
+    work->start();
+  }
+
+  void RuleFileWatcher::watch(const std::string &file) {
+    LOG_I("will watch proxy rule file: %s", file.c_str());
+    auto fsEvent = uvcpp::FsEvent::create(loop_);
+    fsEvent->on<uvcpp::EvFsEvent>([this, file](const auto &e, auto &fsEvent){
+      if (e.events == uvcpp::EvFsEvent::Event::kChange && e.path == file) {
+        onFileChanged(file);
+      }
+    });
+    fsEvent->start(file, uvcpp::FsEvent::Flag::kWatchEntry);
+    fsEvents_.push_back(std::move(fsEvent));
+  }
+
+  void RuleFileWatcher::onFileChanged(const std::string &file) {
+    // editors write a file more than once when saving it
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastReloadTs_ < std::chrono::seconds(2)) {
+      return;
+    }
+    lastReloadTs_ = now;
+
+    LOG_I("proxy rule file changed, will reload proxy rules from: %s",
+          file.c_str());
+    // the files replace all the rules, so all of them are read again
+    manager_->reloadFiles(files_);
+
+    auto &stats = manager_->getRouteCacheStats();
+    LOG_I("route cache hit ratio: %.3f, avg rule evaluation: %lluns",
+          stats.hitRatio(),
+          static_cast<unsigned long long>(stats.avgMissNanos()));
+    LOG_I("rule filter false positive rate: %.3f",
+          manager_->getFilterStats().falsePositiveRate());
+  }
+
+} /* end of namspace: proxypp */
@@ -0,0 +1,49 @@
+/*******************************************************************************
+**          File: rule_file_watcher.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 11:40 PM
+**   Description: reloads the proxy rule files when they change
+*******************************************************************************/
+#ifndef PROXYPP_RULE_FILE_WATCHER_H_
+#define PROXYPP_RULE_FILE_WATCHER_H_
+#include "uvcpp.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace proxypp {
+  class AutoProxyManager;
+
+  /**
+   * loads the rule files for hpd and spd and watches them on the loop,
+   * a change to any of the files reloads all of them on the background
+   * thread of AutoProxyManager, the previous rules stay in effect until
+   * the new ones are ready
+   */
+  class RuleFileWatcher final {
+    public:
+      RuleFileWatcher(const std::shared_ptr<uvcpp::Loop> &loop,
+                      const std::shared_ptr<AutoProxyManager> &manager);
+
+      // loads the rules of the files and waits until they are compiled,
+      // so that the first connections are routed by them. the files
+      // of all the calls are watched, returns the number of rules loaded
+      std::size_t addFiles(const std::vector<std::string> &files);
+      // the watchers are closed on the loop, call it from any thread
+      void stop();
+
+    private:
+      void watch(const std::string &file);
+      void onFileChanged(const std::string &file);
+
+    private:
+      std::shared_ptr<uvcpp::Loop> loop_;
+      std::shared_ptr<AutoProxyManager> manager_;
+      std::vector<std::string> files_;
+      std::vector<std::shared_ptr<uvcpp::FsEvent>> fsEvents_;
+      std::chrono::steady_clock::time_point lastReloadTs_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_RULE_FILE_WATCHER_H_ */
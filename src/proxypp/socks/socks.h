@@ -6,6 +6,8 @@
 *******************************************************************************/
 #ifndef PROXYPP_SOCKS_H_
 #define PROXYPP_SOCKS_H_
+#include <cstdint>
+#include <string>
 
 namespace proxypp {
   struct Socks {
@@ -31,6 +33,27 @@ namespace proxypp {
       IPV6        = 4
     };
   };
+
+  struct Socks4 {
+    constexpr static auto VERSION = 4;
+
+    // only CONNECT and BIND of Socks::RequestType
+    enum class ReplyCode {
+      GRANTED  = 90,
+      REJECTED = 91
+    };
+  };
+
+  // what a SOCKS5 or SOCKS4/4a client asked for, SOCKS4a host names are
+  // DOMAIN_NAME
+  struct SocksRequest {
+    Socks::RequestType cmd{Socks::RequestType::CONNECT};
+    Socks::AddressType atyp{Socks::AddressType::UNKNOWN};
+    // 4 or 16 bytes for IP addresses
+    std::string addr;
+    // in network byte order
+    uint16_t port{0};
+  };
 } /* end of namspace: proxypp */
 
 #endif /* end of include guard: PROXYPP_SOCKS_H_ */
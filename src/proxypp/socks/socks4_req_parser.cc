@@ -0,0 +1,121 @@
+/*******************************************************************************
+**          File: socks4_req_parser.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 11:20 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/socks/socks4_req_parser.h"
+#include "nul/log.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace proxypp {
+
+  constexpr std::size_t Socks4ReqParser::kMaxStringLength;
+  constexpr std::size_t Socks4ReqParser::kHeaderLength;
+
+  std::size_t Socks4ReqParser::parse(const char *buf, std::size_t len) {
+    std::size_t consumed = 0;
+    if (state_ != State::PARSING_REQUEST) {
+      LOG_E("Invalid state: %d", static_cast<int>(state_));
+      state_ = State::ERROR_OCCURRED;
+      return consumed;
+    }
+
+    if (headerLen_ < kHeaderLength) {
+      auto n = std::min(kHeaderLength - headerLen_, len);
+      memcpy(header_ + headerLen_, buf, n);
+      headerLen_ += n;
+      consumed += n;
+      if (headerLen_ < kHeaderLength || !parseHeader()) {
+        return consumed;
+      }
+    }
+
+    if (!userIdComplete_) {
+      consumed += parseString(
+        buf + consumed, len - consumed, userId_, userIdComplete_);
+      if (!userIdComplete_) {
+        return consumed;
+      }
+      if (!isSocks4a_) {
+        state_ = State::REQUEST_COMPLETE;
+        return consumed;
+      }
+    }
+
+    auto hostNameComplete = false;
+    consumed += parseString(
+      buf + consumed, len - consumed, request_.addr, hostNameComplete);
+    if (hostNameComplete) {
+      if (request_.addr.empty()) {
+        LOG_E("empty SOCKS4a host name");
+        state_ = State::ERROR_OCCURRED;
+      } else {
+        state_ = State::REQUEST_COMPLETE;
+      }
+    }
+    return consumed;
+  }
+
+  bool Socks4ReqParser::parseHeader() {
+    auto version = header_[0];
+    auto cmd = header_[1];
+    if (version != Socks4::VERSION) {
+      LOG_E("Invalid SOCKS4 version: %d", version);
+      state_ = State::ERROR_OCCURRED;
+      return false;
+    }
+    if (cmd != static_cast<int>(Socks::RequestType::CONNECT) &&
+        cmd != static_cast<int>(Socks::RequestType::BIND)) {
+      LOG_E("unsupported SOCKS4 command: %d", cmd);
+      state_ = State::ERROR_OCCURRED;
+      return false;
+    }
+
+    request_.cmd = static_cast<Socks::RequestType>(cmd);
+    memcpy(&request_.port, header_ + 2, 2);
+    // 0.0.0.x means the host name follows the USERID
+    isSocks4a_ = header_[4] == 0 && header_[5] == 0 && header_[6] == 0 &&
+      header_[7] != 0;
+    if (isSocks4a_) {
+      request_.atyp = Socks::AddressType::DOMAIN_NAME;
+    } else {
+      request_.atyp = Socks::AddressType::IPV4;
+      request_.addr.assign(header_ + 4, 4);
+    }
+    return true;
+  }
+
+  std::size_t Socks4ReqParser::parseString(
+    const char *buf, std::size_t len, std::string &field, bool &complete) {
+    auto end = static_cast<const char *>(memchr(buf, '\0', len));
+    auto n = end ? static_cast<std::size_t>(end - buf) : len;
+    if (field.size() + n > kMaxStringLength) {
+      LOG_E("SOCKS4 request too long");
+      state_ = State::ERROR_OCCURRED;
+      return len;
+    }
+    field.append(buf, n);
+    if (!end) {
+      return len;
+    }
+    complete = true;
+    // the NUL
+    return n + 1;
+  }
+
+  Socks4ReqParser::State Socks4ReqParser::getState() const {
+    return state_;
+  }
+
+  const SocksRequest &Socks4ReqParser::getRequest() const {
+    return request_;
+  }
+
+  std::string Socks4ReqParser::getUserId() const {
+    return userId_;
+  }
+
+} /* end of namspace: proxypp */
@@ -0,0 +1,55 @@
+/*******************************************************************************
+**          File: socks4_req_parser.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 11:20 PM
+**   Description: the class that parses SOCKS4 and SOCKS4a requests
+*******************************************************************************/
+#ifndef PROXYPP_SOCKS4_REQ_PARSER_H_
+#define PROXYPP_SOCKS4_REQ_PARSER_H_
+#include <string>
+#include "proxypp/socks/socks.h"
+
+namespace proxypp {
+  /**
+   * VN CD DSTPORT DSTIP USERID NUL, followed by HOSTNAME NUL for SOCKS4a,
+   * whose DSTIP is 0.0.0.x with a non-zero x
+   */
+  class Socks4ReqParser {
+    public:
+      enum class State {
+        PARSING_REQUEST     = 0,
+        REQUEST_COMPLETE    = 1,
+        ERROR_OCCURRED      = 2,
+      };
+
+      // returns the number of bytes consumed, which is less than len only
+      // if the request completes in the middle of buf or an error occurs.
+      // an incomplete request is kept until the rest arrives
+      std::size_t parse(const char *buf, std::size_t len);
+      State getState() const;
+      const SocksRequest &getRequest() const;
+      std::string getUserId() const;
+
+    private:
+      bool parseHeader();
+      // appends to field up to the NUL, returns the bytes consumed
+      std::size_t parseString(
+        const char *buf, std::size_t len, std::string &field, bool &complete);
+
+    private:
+      // USERID and HOSTNAME may not be longer
+      static constexpr std::size_t kMaxStringLength = 255;
+      static constexpr std::size_t kHeaderLength = 8;
+
+      State state_{State::PARSING_REQUEST};
+      char header_[kHeaderLength];
+      std::size_t headerLen_{0};
+      bool isSocks4a_{false};
+      bool userIdComplete_{false};
+
+      SocksRequest request_;
+      std::string userId_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_SOCKS4_REQ_PARSER_H_ */
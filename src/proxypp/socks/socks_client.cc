@@ -151,6 +151,18 @@ namespace proxypp {
     }
   }
 
+  void SocksClient::readStart() {
+    if (conn_) {
+      conn_->readStart();
+    }
+  }
+
+  void SocksClient::readStop() {
+    if (conn_) {
+      conn_->readStop();
+    }
+  }
+
   void SocksClient::close() {
     if (conn_) {
       conn_->close();
@@ -46,6 +46,9 @@ namespace proxypp {
       }
 
       void writeAsync(std::unique_ptr<nul::Buffer> &&buffer);
+      // pause/resume EvSocksRead after the handshake, for backpressure
+      void readStart();
+      void readStop();
       void close();
       void setUsername(const std::string &username);
       void setPassword(const std::string &password);
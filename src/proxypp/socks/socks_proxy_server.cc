@@ -7,6 +7,11 @@
 #include "proxypp/socks/socks_proxy_server.h"
 #include "proxypp/socks/socks_proxy_session.h"
 #include "proxypp/proxy_server.hpp"
+#include "proxypp/auto_proxy_manager.h"
+#include "proxypp/rule_file_watcher.h"
+#include "proxypp/upstream_connector.h"
+#include "nul/util.hpp"
+#include <cassert>
 #include <signal.h>
 
 namespace {
@@ -14,11 +19,25 @@ namespace {
     proxypp::ProxyServer server;
     std::string username;
     std::string password;
+    bool optimisticConnect{false};
+    proxypp::UpstreamServer upstream;
+    std::shared_ptr<const proxypp::UpstreamServers> upstreamServers{nullptr};
+    std::shared_ptr<proxypp::AutoProxyManager> autoProxyManager{nullptr};
+
+    std::shared_ptr<uvcpp::Loop> loop;
+    std::unique_ptr<proxypp::RuleFileWatcher> ruleFileWatcher;
   };
 }
 
 namespace proxypp {
   SocksProxyServer::SocksProxyServer() : ctx_(new SocksProxyServerContext{}) {
+    // the rule files are watched on it before the server starts
+    auto loop = std::make_shared<uvcpp::Loop>();
+    if (!loop->init()) {
+      LOG_E("Failed to start event loop");
+      abort();
+    }
+    reinterpret_cast<SocksProxyServerContext *>(ctx_)->loop = loop;
   }
 
   SocksProxyServer::~SocksProxyServer() {
@@ -26,12 +45,6 @@ namespace proxypp {
   }
 
   bool SocksProxyServer::start(const std::string &addr, uint16_t port, int backlog) {
-    auto loop = std::make_shared<uvcpp::Loop>();
-    if (!loop->init()) {
-      LOG_E("Failed to start event loop");
-      return false;
-    }
-
     auto ctx = reinterpret_cast<SocksProxyServerContext *>(ctx_);
     ctx->server.setSessionCreator([ctx](
         const std::shared_ptr<uvcpp::Tcp> &conn,
@@ -39,20 +52,30 @@ namespace proxypp {
       auto sess = std::make_shared<SocksProxySession>(std::move(conn), bufferPool);
       sess->setUsername(ctx->username);
       sess->setPassword(ctx->password);
+      sess->setOptimisticConnect(ctx->optimisticConnect);
+      sess->setUpstreamServer(
+        ctx->upstream.type, ctx->upstream.host, ctx->upstream.port);
+      sess->setUpstreamServers(ctx->upstreamServers);
+      sess->setAutoProxyManager(ctx->autoProxyManager);
       return sess;
     });
 
-    if (!ctx->server.start(loop, addr, port, backlog)) {
+    if (!ctx->server.start(ctx->loop, addr, port, backlog)) {
       LOG_E("Failed to start SocksProxyServerContext");
       return false;
     }
-    loop->run();
+    ctx->loop->run();
     return true;
   }
 
   void SocksProxyServer::shutdown() {
-    if (ctx_) {
-      reinterpret_cast<SocksProxyServerContext *>(ctx_)->server.shutdown();
+    if (!ctx_) {
+      return;
+    }
+    auto ctx = reinterpret_cast<SocksProxyServerContext *>(ctx_);
+    ctx->server.shutdown();
+    if (ctx->ruleFileWatcher) {
+      ctx->ruleFileWatcher->stop();
     }
   }
 
@@ -81,6 +104,62 @@ namespace proxypp {
       reinterpret_cast<SocksProxyServerContext *>(ctx_)->password = password;
     }
   }
+
+  void SocksProxyServer::setOptimisticConnect(bool optimisticConnect) {
+    if (ctx_) {
+      reinterpret_cast<SocksProxyServerContext *>(ctx_)->optimisticConnect =
+        optimisticConnect;
+    }
+  }
+
+  void SocksProxyServer::setUpstreamServer(const std::string &uriStr) {
+    if (!ctx_) {
+      return;
+    }
+    auto ctx = reinterpret_cast<SocksProxyServerContext *>(ctx_);
+    if (UpstreamConnector::parseUpstreamServer(uriStr, ctx->upstream)) {
+      LOG_I("set upstream server: %s:%d",
+            ctx->upstream.host.c_str(), ctx->upstream.port);
+    }
+  }
+
+  void SocksProxyServer::setUpstreamServers(const std::string &servers) {
+    if (ctx_) {
+      reinterpret_cast<SocksProxyServerContext *>(ctx_)->upstreamServers =
+        UpstreamConnector::parseUpstreamServers(servers);
+    }
+  }
+
+  bool SocksProxyServer::setGeoIpDatabase(const std::string &file) {
+    assert(ctx_);
+    auto ctx = reinterpret_cast<SocksProxyServerContext *>(ctx_);
+    if (!ctx->autoProxyManager) {
+      ctx->autoProxyManager = std::make_shared<AutoProxyManager>();
+    }
+    return ctx->autoProxyManager->setGeoIpDatabase(file);
+  }
+
+  std::size_t SocksProxyServer::setAutoProxyRulesFile(
+    const std::string &proxyRulesFile) {
+    if (proxyRulesFile.empty()) {
+      return 0;
+    }
+    return setAutoProxyRulesFiles({proxyRulesFile});
+  }
+
+  std::size_t SocksProxyServer::setAutoProxyRulesFiles(
+    const std::vector<std::string> &proxyRulesFiles) {
+    assert(ctx_);
+    auto ctx = reinterpret_cast<SocksProxyServerContext *>(ctx_);
+    if (!ctx->autoProxyManager) {
+      ctx->autoProxyManager = std::make_shared<AutoProxyManager>();
+    }
+    if (!ctx->ruleFileWatcher) {
+      ctx->ruleFileWatcher = std::make_unique<RuleFileWatcher>(
+        ctx->loop, ctx->autoProxyManager);
+    }
+    return ctx->ruleFileWatcher->addFiles(proxyRulesFiles);
+  }
   
 } /* end of namspace: proxypp */
 
@@ -97,12 +176,54 @@ int main(int argc, char *argv[]) {
   p.add<int>("backlog", 'b', "backlog for the server", false, 200, cmdline::range(1, 65535));
   p.add<std::string>("username", 'U', "username", false);
   p.add<std::string>("password", 'P', "password", false);
+  p.add("optimistic_connect", 'o',
+        "reply to CONNECT requests before the upstream is connected");
+  p.add<std::string>(
+    "upstream_server", 'u',
+    "e.g. socks5://127.0.0.1:1080. UDP can't go through upstreams, "
+    "datagrams that should are dropped, and UDP ASSOCIATE is refused "
+    "if there are no rules", false);
+  p.add<std::string>(
+    "upstream_servers", 0,
+    "upstreams the rules name, e.g. us=socks5://127.0.0.1:1081,"
+    "eu=http://127.0.0.1:8081", false);
+  p.add<std::string>(
+    "proxy_rules_file", 'r',
+    "auto proxy rule files separated by commas, reloaded when changed",
+    false);
+  p.add<std::string>(
+    "geoip_db", 'g', "GeoIP database for the geoip: rules", false);
 
   p.parse_check(argc, argv);
 
   proxypp::SocksProxyServer s{};
   s.setUsername(p.get<std::string>("username"));
   s.setPassword(p.get<std::string>("password"));
+  s.setOptimisticConnect(p.exist("optimistic_connect"));
+
+  auto upstreamServer = p.get<std::string>("upstream_server");
+  if (!upstreamServer.empty()) {
+    s.setUpstreamServer(upstreamServer);
+  }
+  // the names get their ids before the rules use them
+  auto upstreamServers = p.get<std::string>("upstream_servers");
+  if (!upstreamServers.empty()) {
+    s.setUpstreamServers(upstreamServers);
+  }
+  auto geoIpDb = p.get<std::string>("geoip_db");
+  if (!geoIpDb.empty()) {
+    s.setGeoIpDatabase(geoIpDb);
+  }
+  auto proxyRulesFiles = p.get<std::string>("proxy_rules_file");
+  if (!proxyRulesFiles.empty()) {
+    std::vector<std::string> files;
+    nul::StringUtil::split(
+      proxyRulesFiles, ",", [&files](auto index, const auto &part) {
+      files.push_back(part);
+      return true;
+    });
+    s.setAutoProxyRulesFiles(files);
+  }
 
   signal(SIGPIPE, [](int){ /* ignore sigpipe */ });
 
@@ -8,6 +8,8 @@
 #define PROXYPP_SOCKS_PROXY_SERVER_H_
 #include <string>
 #include <functional>
+#include <cstddef>
+#include <vector>
 
 namespace proxypp {
   class SocksProxyServer final {
@@ -29,6 +31,20 @@ namespace proxypp {
       void setEventCallback(EventCallback &&callback);
       void setUsername(const std::string &username);
       void setPassword(const std::string &password);
+
+      // reply success with a zero BND.ADDR right away and buffer what the
+      // client sends until the upstream is connected, the client
+      // connection is reset if the upstream fails
+      void setOptimisticConnect(bool optimisticConnect);
+
+      // the same as the ones of HttpProxyServer, requests are connected
+      // through the upstream the rules pick, directly if none
+      void setUpstreamServer(const std::string &uriStr);
+      void setUpstreamServers(const std::string &servers);
+      bool setGeoIpDatabase(const std::string &file);
+      std::size_t setAutoProxyRulesFile(const std::string &proxyRulesFile);
+      std::size_t setAutoProxyRulesFiles(
+        const std::vector<std::string> &proxyRulesFiles);
     
     private:
       void *ctx_{nullptr};
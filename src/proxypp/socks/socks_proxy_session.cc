@@ -9,17 +9,64 @@
 
 #include <algorithm>
 #include <cstring>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 namespace {
   #define SOCKS_ERROR_REPLY(replyField) "\5" replyField "\0\1\0\0\0\0\0\0"
   #define SOCKS_ERROR_REPLY_LENGTH 10
+  // the address the upstream connected from is not known, 0.0.0.0:0
+  #define SOCKS_UPSTREAM_REPLY SOCKS_ERROR_REPLY("\0")
+  #define SOCKS4_REPLY_LENGTH 8
+  // client data buffered before the upstream is connected, reading is
+  // paused beyond it
+  static const auto MAX_PENDING_BYTES = 64 * 1024U;
+  // UDP ASSOCIATE, a NAT entry is dropped after idling for this long
+  static const auto UDP_IDLE_TIMEOUT_MS = 120 * 1000U;
+  static const auto UDP_IDLE_CHECK_INTERVAL_MS = 30 * 1000U;
+  // BIND, the listener is closed if nobody connects to it in time
+  static const auto BIND_TIMEOUT_MS = 120 * 1000U;
+
+  // IPv4-mapped IPv6 addresses are returned as IPv4
+  std::string getIp(const sockaddr *addr) {
+    char ip[INET6_ADDRSTRLEN];
+    if (addr->sa_family == AF_INET) {
+      auto addr4 = reinterpret_cast<const sockaddr_in *>(addr);
+      if (inet_ntop(AF_INET, &addr4->sin_addr, ip, sizeof(ip))) {
+        return ip;
+      }
+    } else if (addr->sa_family == AF_INET6) {
+      auto addr6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+      if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+        if (inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], ip, sizeof(ip))) {
+          return ip;
+        }
+      } else if (inet_ntop(AF_INET6, &addr6->sin6_addr, ip, sizeof(ip))) {
+        return ip;
+      }
+    }
+    return {};
+  }
+
+  // the local or the remote address of the connection
+  bool getTcpAddress(uvcpp::Tcp &conn, bool peer, sockaddr_storage &addr) {
+    uv_os_fd_t fd;
+    socklen_t addrLen = sizeof(addr);
+    if (uv_fileno(reinterpret_cast<uv_handle_t *>(conn.get()), &fd) != 0) {
+      return false;
+    }
+    auto sockAddr = reinterpret_cast<sockaddr *>(&addr);
+    return (peer ? getpeername(fd, sockAddr, &addrLen) :
+            getsockname(fd, sockAddr, &addrLen)) == 0;
+  }
 }
 
 namespace proxypp {
   SocksProxySession::SocksProxySession(
     const std::shared_ptr<uvcpp::Tcp> &conn,
     const std::shared_ptr<nul::BufferPool> &bufferPool) :
-    downstreamConn_(std::move(conn)), bufferPool_(bufferPool) {
+    downstreamConn_(std::move(conn)), bufferPool_(bufferPool),
+    bindTimeoutMs_(BIND_TIMEOUT_MS) {
   }
 
   void SocksProxySession::start() {
@@ -32,9 +79,15 @@ namespace proxypp {
       if (upstreamConn_) {
         upstreamConn_->close();
       }
+      if (connector_) {
+        connector_->close();
+        connector_ = nullptr;
+      }
       if (dnsRequest_) {
         dnsRequest_->cancel();
       }
+      this->closeUdpRelay();
+      this->closeBindListener();
     });
     downstreamConn_->on<uvcpp::EvBufferRecycled>([this](const auto &e, auto &conn) {
       bufferPool_->returnBuffer(std::forward<std::unique_ptr<nul::Buffer>>(
@@ -42,77 +95,251 @@ namespace proxypp {
     });
     downstreamConn_->on<uvcpp::EvRead>(
       [this](const auto &e, auto &conn) {
+      if (connector_) {
+        // buffered until connected
+        connector_->write(e.buf, e.nread);
+        if (!upstreamConnected_ &&
+            connector_->getQueuedBytes() >= MAX_PENDING_BYTES) {
+          conn.readStop();
+          downstreamReadPaused_ = true;
+        }
+        return;
+      }
       if (upstreamConnected_) {
         auto buffer = bufferPool_->assembleDataBuffer(e.buf, e.nread);
         upstreamConn_->writeAsync(std::move(buffer));
         return;
       }
+      if (udpRelay_) {
+        // the connection only keeps the UDP association alive
+        return;
+      }
 
-      auto state = socks_.getState();
-      if (state == SocksReqParser::State::ERROR_OCCURRED) {
-        // do nothing, shouldn't reach here
+      if (this->isRequestComplete()) {
+        // sent by the client before the upstream is connected
+        pendingData_.append(e.buf, e.nread);
+        if (pendingData_.size() >= MAX_PENDING_BYTES) {
+          conn.readStop();
+          downstreamReadPaused_ = true;
+        }
+        return;
+      }
 
-      } else {
-        auto reply = socks_.parse(e.buf, e.nread);
-        if (reply != SocksReqParser::ReplyField::SUCCEEDED) {
-          this->replySocksError();
-          conn.close();
-          return;
+      if (!protocolSniffed_ && e.nread > 0) {
+        protocolSniffed_ = true;
+        // a SOCKS4 request starts with 4 and a SOCKS5 greeting with 5, so
+        // the first byte tells them apart without waiting for more
+        if (e.buf[0] == Socks4::VERSION) {
+          socks4_ = std::make_unique<Socks4ReqParser>();
         }
+      }
+      if (socks4_) {
+        this->handleSocks4Request(e.buf, e.nread);
+      } else {
+        this->handleSocksMessages(e.buf, e.nread);
+      }
+    });
 
-        if (state == SocksReqParser::State::METHOD_IDENTIFICATION)  {
-          auto shouldUseUsernamePasswordAuth =
-            !username_.empty() || !password_.empty();
+    if (!username_.empty() || !password_.empty()) {
+      socks_.setRequireAuthMethod(Socks::Method::USERNAME_PASSWORD);
+    }
 
-          auto buffer = bufferPool_->requestBuffer(2);
-          buffer->assign(shouldUseUsernamePasswordAuth ?  "\5\2" : "\5\0", 2);
-          conn.writeAsync(std::move(buffer));
+    downstreamConn_->readStart();
+  }
 
-        } else if (state == SocksReqParser::State::USERNAME_PASSWORD_AUTH)  {
-          auto isCorrect = username_ == socks_.getParsedUsername() &&
-            password_ == socks_.getParsedPassword();
+  void SocksProxySession::handleSocksMessages(const char *buf, std::size_t len) {
+    while (len > 0) {
+      auto state = socks_.getState();
+      auto consumed = socks_.parse(buf, len);
+      buf += consumed;
+      len -= consumed;
 
-          auto buffer = bufferPool_->requestBuffer(2);
-          buffer->assign(isCorrect ? "\1\0" : "\1\1", 2);
-          conn.writeAsync(std::move(buffer));
+      auto newState = socks_.getState();
+      if (newState == SocksReqParser::State::ERROR_OCCURRED) {
+        this->replySocksError(socks_.getErrorReply());
+        downstreamConn_->close();
+        return;
+      }
+      if (newState == state) {
+        // the message is incomplete, the parser keeps what it has
+        return;
+      }
 
-          if (!isCorrect) {
-            LOG_E("username/password don't match");
-            conn.close();
+      if (state == SocksReqParser::State::METHOD_IDENTIFICATION)  {
+        auto shouldUseUsernamePasswordAuth =
+          !username_.empty() || !password_.empty();
 
-          } else {
-            socks_.setState(SocksReqParser::State::PARSING_REQUEST);
-          }
+        auto buffer = bufferPool_->requestBuffer(2);
+        buffer->assign(shouldUseUsernamePasswordAuth ?  "\5\2" : "\5\0", 2);
+        downstreamConn_->writeAsync(std::move(buffer));
+
+      } else if (state == SocksReqParser::State::USERNAME_PASSWORD_AUTH)  {
+        auto isCorrect = username_ == socks_.getParsedUsername() &&
+          password_ == socks_.getParsedPassword();
 
-        } else if (state == SocksReqParser::State::PARSING_REQUEST)  {
-          this->connectUpstream();
+        auto buffer = bufferPool_->requestBuffer(2);
+        buffer->assign(isCorrect ? "\1\0" : "\1\1", 2);
+        downstreamConn_->writeAsync(std::move(buffer));
 
+        if (!isCorrect) {
+          LOG_E("username/password don't match");
+          downstreamConn_->close();
+          return;
+        }
+
+      } else if (state == SocksReqParser::State::PARSING_REQUEST)  {
+        if (socks_.getCommand() == Socks::RequestType::UDP_ASSOCIATE) {
+          this->startUdpRelay();
+          return;
+        }
+        if (socks_.getCommand() == Socks::RequestType::BIND) {
+          // what the client sends before the second reply is kept for
+          // the incoming connection
+          pendingData_.assign(buf, len);
+          this->startBind();
+          return;
         }
+        // whatever follows the request is payload for the target
+        pendingData_.assign(buf, len);
+        this->routeRequest();
+        return;
       }
-    });
+    }
+  }
+
+  void SocksProxySession::handleSocks4Request(const char *buf, std::size_t len) {
+    auto consumed = socks4_->parse(buf, len);
+    auto state = socks4_->getState();
+    if (state == Socks4ReqParser::State::ERROR_OCCURRED) {
+      this->replySocksError();
+      downstreamConn_->close();
+      return;
+    }
+    if (state != Socks4ReqParser::State::REQUEST_COMPLETE) {
+      return;
+    }
 
     if (!username_.empty() || !password_.empty()) {
-      socks_.setRequireAuthMethod(Socks::Method::USERNAME_PASSWORD);
+      // the USERID of SOCKS4 is no credential
+      LOG_E("SOCKS4 rejected, username/password is required");
+      this->replySocksError();
+      downstreamConn_->close();
+      return;
     }
 
-    downstreamConn_->readStart();
+    pendingData_.assign(buf + consumed, len - consumed);
+    if (getRequest().cmd == Socks::RequestType::BIND) {
+      this->startBind();
+    } else {
+      this->routeRequest();
+    }
+  }
+
+  const SocksRequest &SocksProxySession::getRequest() const {
+    return socks4_ ? socks4_->getRequest() : socks_.getRequest();
+  }
+
+  bool SocksProxySession::isRequestComplete() const {
+    if (socks4_) {
+      return socks4_->getState() == Socks4ReqParser::State::REQUEST_COMPLETE;
+    }
+    return socks_.getState() == SocksReqParser::State::NEGOTIATION_COMPLETE;
+  }
+
+  std::string SocksProxySession::getTargetAddress() const {
+    auto atyp = getRequest().atyp;
+    if (atyp == Socks::AddressType::DOMAIN_NAME) {
+      return getRequest().addr;
+    }
+    char ip[INET6_ADDRSTRLEN];
+    auto family = atyp == Socks::AddressType::IPV4 ? AF_INET : AF_INET6;
+    if (!inet_ntop(family, getRequest().addr.data(), ip, sizeof(ip))) {
+      return {};
+    }
+    return ip;
+  }
+
+  void SocksProxySession::routeRequest() {
+    // with no rules, everything goes to the default upstream if any
+    auto addr = getTargetAddress();
+    auto port = ntohs(getRequest().port);
+    auto action = proxyRuleManager_ ?
+      proxyRuleManager_->getAction(addr, port) : RouteAction::kProxy;
+    if (action == RouteAction::kReject) {
+      LOG_D("[%s] rejected by the rules", addr.c_str());
+      this->replySocksError(SocksReqParser::ReplyField::CONNECTION_NOT_ALLOWED);
+      downstreamConn_->close();
+      return;
+    }
+
+    if (optimisticConnect_) {
+      // nearly no client looks at BND.ADDR, so succeed with 0.0.0.0:0
+      // and let the client send its first bytes while connecting
+      this->replySocksSuccess(nullptr);
+      successReplied_ = true;
+    }
+
+    auto upstream = findUpstreamServer(
+      defaultUpstream_, upstreamServers_.get(), action);
+    if (upstream) {
+      this->connectThroughUpstream(*upstream, addr, port);
+    } else {
+      this->connectUpstream();
+    }
+  }
+
+  void SocksProxySession::connectThroughUpstream(
+    const UpstreamServer &upstream, const std::string &addr, uint16_t port) {
+    connector_ = std::make_shared<UpstreamConnector>(
+      downstreamConn_->getLoop(), bufferPool_);
+    connector_->setUpstreamServer(upstream.type, upstream.host, upstream.port);
+    connector_->setConnectCallback([this, addr, upstream](bool succeeded) {
+      if (!succeeded) {
+        LOG_E("Failed to connect to %s through %s:%d", addr.c_str(),
+              upstream.host.c_str(), upstream.port);
+        this->replySocksError(SocksReqParser::ReplyField::HOST_UNREACHABLE);
+        this->closeDownstream();
+        return;
+      }
+      upstreamConnected_ = true;
+      if (!successReplied_) {
+        this->replySocksSuccess(nullptr);
+      }
+      this->resumeDownstreamRead();
+    });
+    connector_->setDataCallback([this](const char *buf, std::size_t len) {
+      downstreamConn_->writeAsync(bufferPool_->assembleDataBuffer(buf, len));
+    });
+    connector_->setCloseCallback([this]() {
+      this->closeDownstream();
+    });
+    if (!pendingData_.empty()) {
+      connector_->write(pendingData_.data(), pendingData_.size());
+      std::string().swap(pendingData_);
+    }
+
+    // the upstream resolves the name, so the rules of the upstream and
+    // not the local DNS decide where it goes
+    LOG_D("[%s:%d] through upstream %s:%d", addr.c_str(), port,
+          upstream.host.c_str(), upstream.port);
+    connector_->connect(addr, port, true, true);
   }
 
   void SocksProxySession::connectUpstream() {
-    auto atyp = socks_.getAddressType();
+    auto atyp = getRequest().atyp;
     if (atyp == Socks::AddressType::IPV4) {
       uvcpp::SockAddr4 addr4;
-      memcpy(&addr4.sin_addr, socks_.getAddress().data(), 4);
+      memcpy(&addr4.sin_addr, getRequest().addr.data(), 4);
       addr4.sin_family = AF_INET;
-      addr4.sin_port = socks_.getPort();
+      addr4.sin_port = getRequest().port;
 
       connectUpstream(reinterpret_cast<uvcpp::SockAddr *>(&addr4));
 
     } else if (atyp == Socks::AddressType::IPV6) {
       uvcpp::SockAddr6 addr6;
-      memcpy(&addr6.sin6_addr, socks_.getAddress().data(), 16);
+      memcpy(&addr6.sin6_addr, getRequest().addr.data(), 16);
       addr6.sin6_family = AF_INET6;
-      addr6.sin6_port = socks_.getPort();
+      addr6.sin6_port = getRequest().port;
 
       connectUpstream(reinterpret_cast<uvcpp::SockAddr *>(&addr6));
 
@@ -126,17 +353,17 @@ namespace proxypp {
       });
 
       dnsRequest_->once<uvcpp::EvError>([this](const auto &e, auto &r) {
-        LOG_W("Failed to resolve address: %s", socks_.getAddress().c_str());
+        LOG_W("Failed to resolve address: %s", getRequest().addr.c_str());
         this->replySocksError();
-        downstreamConn_->close();
+        this->closeDownstream();
       });
 
       dnsRequest_->once<uvcpp::EvDNSResult>(
         [this](const auto &e, auto &req) {
         if (e.dnsResults.empty()) {
-          LOG_W("[%s] resolved to zero IPs", socks_.getAddress().c_str());
+          LOG_W("[%s] resolved to zero IPs", getRequest().addr.c_str());
           this->replySocksError();
-          downstreamConn_->close();
+          this->closeDownstream();
           return;
         }
 
@@ -150,8 +377,8 @@ namespace proxypp {
         }
       });
 
-      dnsRequest_->resolve(socks_.getAddress());
-      LOG_D("Resolving address: %s", socks_.getAddress().c_str());
+      dnsRequest_->resolve(getRequest().addr);
+      LOG_D("Resolving address: %s", getRequest().addr.c_str());
     }
   }
 
@@ -165,7 +392,7 @@ namespace proxypp {
 
   void SocksProxySession::connectUpstream(const std::string &ip) {
     createUpstreamConnection();
-    if (!upstreamConn_->connect(ip, ntohs(socks_.getPort()))) {
+    if (!upstreamConn_->connect(ip, ntohs(getRequest().port))) {
       upstreamConn_->close();
       // check if there're more IPs to try
       if (ipIt_ == ipAddrs_.end()) {
@@ -194,68 +421,416 @@ namespace proxypp {
         this->connectUpstream(newIp);
 
       } else {
-        downstreamConn_->close();
+        this->closeDownstream();
       }
     });
     upstreamConn_->once<uvcpp::EvConnect>(
       [this](const auto &e, auto &client) {
         upstreamConnected_ = true;
         LOG_V("Connected to: %s:%d", client.getIP().c_str(), client.getPort());
-
-        auto sockAddr = upstreamConn_->getSockAddr();
-        //auto atyp = Socks::AddressType::UNKNOWN;
-        auto bufLen = 4 + 2;  // first 4 bytes + length of port
-        if (sockAddr->sa_family == AF_INET) {
-          //atyp = Socks::AddressType::IPV4;
-          bufLen += 4;
-        } else {
-          //atyp = Socks::AddressType::IPV6;
-          bufLen += 16;
+        if (!successReplied_) {
+          this->replySocksSuccess(upstreamConn_->getSockAddr());
         }
+        this->startForwarding();
+      });
+  }
 
-        auto buffer = bufferPool_->requestBuffer(bufLen);
-        auto data = buffer->getData();
-        data[0] = '\5';
-        data[1] = '\0';
-        data[2] = '\0';
-
-        if (sockAddr->sa_family == AF_INET) {
-          data[3] = '\1';
-          auto sockAddr4 = reinterpret_cast<const uvcpp::SockAddr4 *>(sockAddr);
-          memcpy(data + 4, &sockAddr4->sin_addr, 4);
-          memcpy(data + 8, &sockAddr4->sin_port, 2);
-        } else {
-          data[3] = '\4';
-          auto sockAddr6 = reinterpret_cast<const uvcpp::SockAddr6 *>(sockAddr);
-          memcpy(data + 4, &sockAddr6->sin6_addr, 16);
-          memcpy(data + 20, &sockAddr6->sin6_port, 2);
-        }
-        buffer->setLength(bufLen);
-        downstreamConn_->writeAsync(std::move(buffer));
+  void SocksProxySession::startForwarding() {
+    upstreamConn_->on<uvcpp::EvBufferRecycled>([this](const auto &e, auto &conn) {
+      bufferPool_->returnBuffer(std::forward<std::unique_ptr<nul::Buffer>>(
+          const_cast<uvcpp::EvBufferRecycled &>(e).buffer));
+    });
+    upstreamConn_->on<uvcpp::EvRead>([this](const auto &e, auto &client){
+      auto buffer = bufferPool_->assembleDataBuffer(e.buf, e.nread);
+      downstreamConn_->writeAsync(std::move(buffer));
+    });
 
-        upstreamConn_->on<uvcpp::EvBufferRecycled>([this](const auto &e, auto &conn) {
-          bufferPool_->returnBuffer(std::forward<std::unique_ptr<nul::Buffer>>(
-              const_cast<uvcpp::EvBufferRecycled &>(e).buffer));
-        });
-        upstreamConn_->on<uvcpp::EvRead>([this](const auto &e, auto &client){
-          auto buffer = bufferPool_->assembleDataBuffer(e.buf, e.nread);
-          downstreamConn_->writeAsync(std::move(buffer));
-        });
+    upstreamConn_->readStart();
 
-        upstreamConn_->readStart();
-      });
+    if (!pendingData_.empty()) {
+      upstreamConn_->writeAsync(bufferPool_->assembleDataBuffer(
+          pendingData_.data(), pendingData_.size()));
+      std::string().swap(pendingData_);
+    }
+    this->resumeDownstreamRead();
+  }
+
+  void SocksProxySession::resumeDownstreamRead() {
+    if (downstreamReadPaused_) {
+      downstreamReadPaused_ = false;
+      downstreamConn_->readStart();
+    }
+  }
+
+  void SocksProxySession::replySocksSuccess(const sockaddr *bndAddr) {
+    if (socks4_) {
+      // VN CD DSTPORT DSTIP, zeros for an unknown or IPv6 address
+      auto buffer = bufferPool_->requestBuffer(SOCKS4_REPLY_LENGTH);
+      buffer->assign("\0\0\0\0\0\0\0\0", SOCKS4_REPLY_LENGTH);
+      auto data = buffer->getData();
+      data[1] = static_cast<char>(Socks4::ReplyCode::GRANTED);
+      if (bndAddr && bndAddr->sa_family == AF_INET) {
+        auto sockAddr4 = reinterpret_cast<const uvcpp::SockAddr4 *>(bndAddr);
+        memcpy(data + 2, &sockAddr4->sin_port, 2);
+        memcpy(data + 4, &sockAddr4->sin_addr, 4);
+      }
+      downstreamConn_->writeAsync(std::move(buffer));
+      return;
+    }
+
+    if (!bndAddr) {
+      auto buffer = bufferPool_->requestBuffer(SOCKS_ERROR_REPLY_LENGTH);
+      buffer->assign(SOCKS_UPSTREAM_REPLY, SOCKS_ERROR_REPLY_LENGTH);
+      downstreamConn_->writeAsync(std::move(buffer));
+      return;
+    }
+
+    auto bufLen = 4 + 2;  // first 4 bytes + length of port
+    if (bndAddr->sa_family == AF_INET) {
+      bufLen += 4;
+    } else {
+      bufLen += 16;
+    }
+
+    auto buffer = bufferPool_->requestBuffer(bufLen);
+    auto data = buffer->getData();
+    data[0] = '\5';
+    data[1] = '\0';
+    data[2] = '\0';
+
+    if (bndAddr->sa_family == AF_INET) {
+      data[3] = '\1';
+      auto sockAddr4 = reinterpret_cast<const uvcpp::SockAddr4 *>(bndAddr);
+      memcpy(data + 4, &sockAddr4->sin_addr, 4);
+      memcpy(data + 8, &sockAddr4->sin_port, 2);
+    } else {
+      data[3] = '\4';
+      auto sockAddr6 = reinterpret_cast<const uvcpp::SockAddr6 *>(bndAddr);
+      memcpy(data + 4, &sockAddr6->sin6_addr, 16);
+      memcpy(data + 20, &sockAddr6->sin6_port, 2);
+    }
+    buffer->setLength(bufLen);
+    downstreamConn_->writeAsync(std::move(buffer));
+  }
+
+  void SocksProxySession::startUdpRelay() {
+    // with an upstream and no rules, every datagram would be dropped
+    if (!proxyRuleManager_ &&
+        findUpstreamServer(defaultUpstream_, upstreamServers_.get(),
+                           RouteAction::kProxy)) {
+      LOG_D("UDP ASSOCIATE not allowed, everything goes to the upstream");
+      this->replySocksError(SocksReqParser::ReplyField::CONNECTION_NOT_ALLOWED);
+      downstreamConn_->close();
+      return;
+    }
+
+    sockaddr_storage localAddr;
+    sockaddr_storage peerAddr;
+    if (!getTcpAddress(*downstreamConn_, false, localAddr) ||
+        !getTcpAddress(*downstreamConn_, true, peerAddr)) {
+      LOG_E("Failed to get the addresses of the UDP ASSOCIATE connection");
+      this->replySocksError();
+      downstreamConn_->close();
+      return;
+    }
+
+    // the client sends to the IP it reached us at
+    udpRelay_ = std::make_unique<SocksUdpRelay>();
+    if (!udpRelay_->open(getIp(reinterpret_cast<sockaddr *>(&localAddr)))) {
+      udpRelay_ = nullptr;
+      this->replySocksError();
+      downstreamConn_->close();
+      return;
+    }
+    udpRelay_->setClientIp(getIp(reinterpret_cast<sockaddr *>(&peerAddr)));
+    udpRelay_->setAllowCallback([this](const std::string &addr, uint16_t port) {
+      auto action = proxyRuleManager_ ?
+        proxyRuleManager_->getAction(addr, port) : RouteAction::kProxy;
+      // the upstreams only take TCP, what should go through them is
+      // dropped rather than sent directly
+      return action != RouteAction::kReject &&
+        !findUpstreamServer(defaultUpstream_, upstreamServers_.get(), action);
+    });
+    udpRelay_->setResolveCallback(
+      [this](const std::string &host,
+             SocksUdpRelay::ResolvedCallback &&callback) {
+      this->resolveForUdpRelay(host, std::move(callback));
+    });
+    udpRelay_->setSocketCallback([this](int fd, bool opened) {
+      if (opened) {
+        this->startUdpPoll(fd);
+      } else {
+        this->stopUdpPoll(fd);
+      }
+    });
+    this->startUdpPoll(udpRelay_->getFd());
+
+    this->startTimer(UDP_IDLE_CHECK_INTERVAL_MS, UDP_IDLE_CHECK_INTERVAL_MS);
+
+    sockaddr_storage bndAddr;
+    udpRelay_->getBoundAddress(bndAddr);
+    LOG_D("UDP ASSOCIATE relayed at port %d",
+          ntohs(reinterpret_cast<sockaddr_in *>(&bndAddr)->sin_port));
+    this->replySocksSuccess(reinterpret_cast<sockaddr *>(&bndAddr));
   }
 
-  void SocksProxySession::replySocksError() {
+  void SocksProxySession::resolveForUdpRelay(
+    const std::string &host, SocksUdpRelay::ResolvedCallback &&callback) {
+    auto req = uvcpp::DNSRequest::create(downstreamConn_->getLoop());
+    auto done = std::make_shared<SocksUdpRelay::ResolvedCallback>(
+      std::move(callback));
+    req->once<uvcpp::EvDNSResult>([done](const auto &e, auto &r) {
+      (*done)(e.dnsResults.empty() ? std::string{} : e.dnsResults.front());
+    });
+    req->once<uvcpp::EvError>([done, host](const auto &e, auto &r) {
+      LOG_W("Failed to resolve address: %s", host.c_str());
+      (*done)(std::string{});
+    });
+    req->once<uvcpp::EvDNSRequestFinish>(
+      // intentionally cycle-ref the SocksProxySession object to avoid
+      // deletion of it before this callback is fired
+      [this, _ = shared_from_this()](const auto &e, auto &r) {
+      udpDnsRequests_.erase(
+        std::remove_if(
+          udpDnsRequests_.begin(), udpDnsRequests_.end(),
+          [&r](const auto &req) { return req.get() == &r; }),
+        udpDnsRequests_.end());
+    });
+    udpDnsRequests_.push_back(req);
+    req->resolve(host);
+  }
+
+  void SocksProxySession::startUdpPoll(int fd) {
+    auto loop = uv_handle_get_loop(
+      reinterpret_cast<uv_handle_t *>(downstreamConn_->get()));
+    auto poll = new uv_poll_t;
+    uv_poll_init_socket(loop, poll, fd);
+    poll->data = this;
+    uv_poll_start(poll, UV_READABLE, [](uv_poll_t *h, int status, int) {
+      auto self = static_cast<SocksProxySession *>(h->data);
+      uv_os_fd_t fd;
+      if (self && status == 0 &&
+          uv_fileno(reinterpret_cast<uv_handle_t *>(h), &fd) == 0) {
+        self->udpRelay_->onReadable(fd);
+      }
+    });
+    udpPolls_[fd] = poll;
+  }
+
+  void SocksProxySession::stopUdpPoll(int fd) {
+    auto it = udpPolls_.find(fd);
+    if (it == udpPolls_.end()) {
+      return;
+    }
+    auto poll = it->second;
+    udpPolls_.erase(it);
+    // must happen before the socket is closed
+    uv_poll_stop(poll);
+    poll->data = nullptr;
+    uv_close(reinterpret_cast<uv_handle_t *>(poll), [](uv_handle_t *h) {
+      delete reinterpret_cast<uv_poll_t *>(h);
+    });
+  }
+
+  void SocksProxySession::closeUdpRelay() {
+    while (!udpPolls_.empty()) {
+      this->stopUdpPoll(udpPolls_.begin()->first);
+    }
+    this->closeTimer();
+    auto dnsRequests = std::move(udpDnsRequests_);
+    for (auto &req : dnsRequests) {
+      req->cancel();
+    }
+    if (udpRelay_) {
+      udpRelay_->close();
+      udpRelay_ = nullptr;
+    }
+  }
+
+  void SocksProxySession::replySocksError(SocksReqParser::ReplyField reply) {
+    if (successReplied_) {
+      // too late for an error, closeDownstream() resets the connection
+      return;
+    }
+    if (socks4_) {
+      // SOCKS4 has one code for all failures
+      auto buffer = bufferPool_->requestBuffer(SOCKS4_REPLY_LENGTH);
+      buffer->assign("\0\0\0\0\0\0\0\0", SOCKS4_REPLY_LENGTH);
+      buffer->getData()[1] = static_cast<char>(Socks4::ReplyCode::REJECTED);
+      downstreamConn_->writeAsync(std::move(buffer));
+      return;
+    }
     auto buffer = bufferPool_->requestBuffer(SOCKS_ERROR_REPLY_LENGTH);
     buffer->assign(SOCKS_ERROR_REPLY("\1"), SOCKS_ERROR_REPLY_LENGTH);
+    buffer->getData()[1] = static_cast<char>(reply);
     downstreamConn_->writeAsync(std::move(buffer));
   }
 
+  void SocksProxySession::startBind() {
+    auto addr = getTargetAddress();
+    auto port = ntohs(getRequest().port);
+    auto action = proxyRuleManager_ ?
+      proxyRuleManager_->getAction(addr, port) : RouteAction::kProxy;
+    // the upstreams can't listen for us, what should go through them
+    // is not allowed to connect directly either
+    if (action == RouteAction::kReject ||
+        findUpstreamServer(defaultUpstream_, upstreamServers_.get(), action)) {
+      LOG_D("[%s] BIND not allowed", addr.c_str());
+      this->replySocksError(SocksReqParser::ReplyField::CONNECTION_NOT_ALLOWED);
+      downstreamConn_->close();
+      return;
+    }
+
+    // listen on the IP the client reached us at, as the client tells the
+    // other side to connect to it
+    sockaddr_storage localAddr;
+    std::string ip;
+    if (getTcpAddress(*downstreamConn_, false, localAddr)) {
+      ip = getIp(reinterpret_cast<sockaddr *>(&localAddr));
+    }
+    if (ip.empty()) {
+      this->replySocksError();
+      downstreamConn_->close();
+      return;
+    }
+
+    bindListener_ = uvcpp::Tcp::create(
+      downstreamConn_->getLoop(),
+      ip.find(':') == std::string::npos ?
+      uvcpp::Tcp::Domain::INET : uvcpp::Tcp::Domain::INET6);
+    bindListener_->on<uvcpp::EvError>([this, ip](const auto &e, auto &s) {
+      LOG_E("BIND failed to listen on %s", ip.c_str());
+      this->replySocksError();
+      downstreamConn_->close();
+    });
+    bindListener_->on<uvcpp::EvAccept<uvcpp::Tcp>>([this](const auto &e, auto &s) {
+      this->onBindAccepted(
+        std::move(const_cast<uvcpp::EvAccept<uvcpp::Tcp> &>(e).client));
+    });
+
+    sockaddr_storage listenAddr;
+    if (!bindListener_->bind(ip, 0) || !bindListener_->listen(1) ||
+        !getTcpAddress(*bindListener_, false, listenAddr)) {
+      LOG_E("BIND failed to listen on %s", ip.c_str());
+      this->replySocksError();
+      downstreamConn_->close();
+      return;
+    }
+
+    LOG_D("BIND listening on %s:%d for %s", ip.c_str(),
+          ntohs(reinterpret_cast<sockaddr_in *>(&listenAddr)->sin_port),
+          addr.c_str());
+    this->replySocksSuccess(reinterpret_cast<sockaddr *>(&listenAddr));
+    this->startTimer(bindTimeoutMs_, 0);
+  }
+
+  void SocksProxySession::onBindAccepted(std::shared_ptr<uvcpp::Tcp> conn) {
+    sockaddr_storage peerAddr;
+    if (!getTcpAddress(*conn, true, peerAddr)) {
+      conn->close();
+      return;
+    }
+
+    // DST.ADDR of a BIND request is the host expected to connect, others
+    // are turned away. 0.0.0.0 or a name doesn't restrict it
+    auto peerIp = getIp(reinterpret_cast<sockaddr *>(&peerAddr));
+    auto expectedIp = getTargetAddress();
+    if (getRequest().atyp != Socks::AddressType::DOMAIN_NAME &&
+        expectedIp != "0.0.0.0" && expectedIp != "::" &&
+        peerIp != expectedIp) {
+      LOG_W("BIND expected %s, refused %s", expectedIp.c_str(), peerIp.c_str());
+      conn->close();
+      return;
+    }
+
+    this->closeBindListener();
+
+    upstreamConn_ = std::move(conn);
+    upstreamConn_->once<uvcpp::EvClose>(
+      // intentionally cycle-ref the SocksProxySession object to avoid
+      // deletion of it before this callback is fired
+      [this, _ = shared_from_this()](const auto &e, auto &client){
+      this->closeDownstream();
+    });
+    upstreamConnected_ = true;
+    LOG_V("BIND accepted: %s", peerIp.c_str());
+
+    this->replySocksSuccess(reinterpret_cast<sockaddr *>(&peerAddr));
+    this->startForwarding();
+  }
+
+  void SocksProxySession::closeBindListener() {
+    this->closeTimer();
+    if (bindListener_) {
+      bindListener_->close();
+      bindListener_ = nullptr;
+    }
+  }
+
+  void SocksProxySession::startTimer(uint64_t timeoutMs, uint64_t repeatMs) {
+    if (!timer_) {
+      timer_ = new uv_timer_t;
+      uv_timer_init(
+        uv_handle_get_loop(
+          reinterpret_cast<uv_handle_t *>(downstreamConn_->get())),
+        timer_);
+      timer_->data = this;
+    }
+    uv_timer_start(timer_, [](uv_timer_t *h) {
+      auto self = static_cast<SocksProxySession *>(h->data);
+      if (self) {
+        self->onTimer();
+      }
+    }, timeoutMs, repeatMs);
+  }
+
+  void SocksProxySession::onTimer() {
+    if (udpRelay_) {
+      udpRelay_->expireIdleEntries(
+        std::chrono::milliseconds(UDP_IDLE_TIMEOUT_MS));
+
+    } else if (bindListener_) {
+      LOG_D("BIND timed out");
+      this->replySocksError(SocksReqParser::ReplyField::TTL_EXPIRED);
+      this->closeBindListener();
+      downstreamConn_->close();
+    }
+  }
+
+  void SocksProxySession::closeTimer() {
+    if (timer_) {
+      uv_timer_stop(timer_);
+      timer_->data = nullptr;
+      uv_close(reinterpret_cast<uv_handle_t *>(timer_), [](uv_handle_t *h) {
+        delete reinterpret_cast<uv_timer_t *>(h);
+      });
+      timer_ = nullptr;
+    }
+  }
+
+  void SocksProxySession::closeDownstream() {
+    if (successReplied_ && !upstreamConnected_) {
+      // abort with RST so that the client doesn't take the failed connect
+      // for a connection closed by the target
+      struct linger lingerOpt{1, 0};
+      downstreamConn_->setSockOption(
+        SO_LINGER, reinterpret_cast<void *>(&lingerOpt), sizeof(lingerOpt));
+    }
+    downstreamConn_->close();
+  }
+
   void SocksProxySession::close() {
     downstreamConn_->close();
   }
 
+  void SocksProxySession::setOptimisticConnect(bool optimisticConnect) {
+    optimisticConnect_ = optimisticConnect;
+  }
+
+  void SocksProxySession::setBindTimeout(uint64_t timeoutMs) {
+    bindTimeoutMs_ = timeoutMs;
+  }
+
   void SocksProxySession::setUsername(const std::string &username) {
     username_ = username;
   }
@@ -263,4 +838,19 @@ namespace proxypp {
   void SocksProxySession::setPassword(const std::string &password) {
     password_ = password;
   }
+
+  void SocksProxySession::setUpstreamServer(
+    UpstreamType type, const std::string &host, uint16_t port) {
+    defaultUpstream_ = UpstreamServer{type, host, port};
+  }
+
+  void SocksProxySession::setUpstreamServers(
+    const std::shared_ptr<const UpstreamServers> &upstreamServers) {
+    upstreamServers_ = upstreamServers;
+  }
+
+  void SocksProxySession::setAutoProxyManager(
+    const std::shared_ptr<AutoProxyManager> &proxyRuleManager) {
+    proxyRuleManager_ = proxyRuleManager;
+  }
 } /* end of namspace: proxypp */
@@ -8,8 +8,13 @@
 #ifndef PROXYPP_SOCKS_PROXY_SESSION_H_
 #define PROXYPP_SOCKS_PROXY_SESSION_H_
 #include "proxypp/proxy_session.h"
+#include "proxypp/upstream_type.h"
+#include "proxypp/upstream_connector.h"
+#include "proxypp/auto_proxy_manager.h"
 #include "uvcpp.h"
 #include "proxypp/socks/socks_req_parser.h"
+#include "proxypp/socks/socks4_req_parser.h"
+#include "proxypp/socks/socks_udp_relay.h"
 #include "nul/buffer_pool.hpp"
 
 namespace proxypp {
@@ -26,13 +31,65 @@ namespace proxypp {
       virtual void close() override;
       void setUsername(const std::string &username);
       void setPassword(const std::string &password);
+      void setUpstreamServer(
+        UpstreamType type, const std::string &host, uint16_t port);
+      // the upstreams the rules name, see RouteAction
+      void setUpstreamServers(
+        const std::shared_ptr<const UpstreamServers> &upstreamServers);
+      void setAutoProxyManager(
+        const std::shared_ptr<AutoProxyManager> &proxyRuleManager);
+      // reply success to CONNECT requests before the upstream is connected
+      void setOptimisticConnect(bool optimisticConnect);
+      // how long a BIND waits for the incoming connection, 2 minutes by
+      // default
+      void setBindTimeout(uint64_t timeoutMs);
 
     private:
-      void replySocksError();
+      // with BND.ADDR 0.0.0.0:0 if bndAddr is nullptr
+      void replySocksSuccess(const sockaddr *bndAddr);
+      void replySocksError(
+        SocksReqParser::ReplyField reply =
+        SocksReqParser::ReplyField::GENERAL_SOCKS_SERVER_FAILURE);
+      // feeds the parser, replies to each message that completes
+      void handleSocksMessages(const char *buf, std::size_t len);
+      void handleSocks4Request(const char *buf, std::size_t len);
+      // of either of the parsers
+      const SocksRequest &getRequest() const;
+      bool isRequestComplete() const;
+      // the target of the request as text, for the rules and upstreams
+      std::string getTargetAddress() const;
+      // connects directly, through an upstream or rejects the request, as
+      // the rules say
+      void routeRequest();
+      void connectThroughUpstream(
+        const UpstreamServer &upstream,
+        const std::string &addr, uint16_t port);
       void connectUpstream();
       void connectUpstream(uvcpp::SockAddr *sockAddr);
       void connectUpstream(const std::string &ip);
       void createUpstreamConnection();
+      // relays data both ways, starting with what the client sent before
+      // the upstream was connected
+      void startForwarding();
+      // reading pauses with too much data pending for the upstream
+      void resumeDownstreamRead();
+      void closeDownstream();
+      // UDP ASSOCIATE, the relay lives as long as the TCP connection
+      void startUdpRelay();
+      void resolveForUdpRelay(
+        const std::string &host, SocksUdpRelay::ResolvedCallback &&callback);
+      void startUdpPoll(int fd);
+      void stopUdpPoll(int fd);
+      void closeUdpRelay();
+      // BIND, listens for the one connection the client expects and
+      // relays it like a CONNECT once accepted
+      void startBind();
+      void onBindAccepted(std::shared_ptr<uvcpp::Tcp> conn);
+      void closeBindListener();
+      // one timer for either of the above
+      void startTimer(uint64_t timeoutMs, uint64_t repeatMs);
+      void onTimer();
+      void closeTimer();
     
     private:
       std::shared_ptr<uvcpp::Tcp> downstreamConn_;
@@ -41,12 +98,38 @@ namespace proxypp {
       uvcpp::EvDNSResult::DNSResultVector ipAddrs_;
       decltype(ipAddrs_.begin()) ipIt_{ipAddrs_.end()};
       bool upstreamConnected_{false};
+      bool optimisticConnect_{false};
+      // the client got its reply before the upstream was connected
+      bool successReplied_{false};
+      bool downstreamReadPaused_{false};
 
       std::shared_ptr<nul::BufferPool> bufferPool_;
 
       SocksReqParser socks_;
+      // set if the first byte the client sent is 4, socks_ is not used then
+      std::unique_ptr<Socks4ReqParser> socks4_;
+      bool protocolSniffed_{false};
+      // bytes that followed the request, written once connected
+      std::string pendingData_;
       std::string username_;
       std::string password_;
+
+      UpstreamServer defaultUpstream_;
+      std::shared_ptr<const UpstreamServers> upstreamServers_;
+      std::shared_ptr<AutoProxyManager> proxyRuleManager_;
+      // set if the request goes through an upstream, upstreamConn_ is
+      // not used then
+      std::shared_ptr<UpstreamConnector> connector_;
+
+      std::unique_ptr<SocksUdpRelay> udpRelay_;
+      // raw libuv handles, freed in their close callbacks. the polls of
+      // the relay socket and of the sockets of its entries, keyed by fd
+      std::unordered_map<int, uv_poll_t *> udpPolls_;
+      uv_timer_t *timer_{nullptr};
+      std::vector<std::shared_ptr<uvcpp::DNSRequest>> udpDnsRequests_;
+
+      std::shared_ptr<uvcpp::Tcp> bindListener_;
+      uint64_t bindTimeoutMs_;
   };
 } /* end of namspace: proxypp */
 
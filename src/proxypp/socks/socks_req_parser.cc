@@ -7,6 +7,9 @@
 #include "proxypp/socks/socks_req_parser.h"
 #include "nul/log.h"
 
+#include <algorithm>
+#include <cstring>
+
 namespace {
   #define SOCKS_ERROR(replyField, fmt, ...) \
     state_ = State::ERROR_OCCURRED; \
@@ -16,30 +19,95 @@ namespace {
 
 namespace proxypp {
 
-  SocksReqParser::ReplyField SocksReqParser::parse(const char *buf, std::size_t len) {
+  constexpr std::size_t SocksReqParser::kMaxMessageLength;
+
+  std::size_t SocksReqParser::parse(const char *buf, std::size_t len) {
     if (state_ > State::PARSING_REQUEST) {
-      SOCKS_ERROR(ReplyField::GENERAL_SOCKS_SERVER_FAILURE,
-                  "Invalid state: %d", static_cast<int>(state_));
+      errorReply_ = ReplyField::GENERAL_SOCKS_SERVER_FAILURE;
+      LOG_E("Invalid state: %d", static_cast<int>(state_));
+      state_ = State::ERROR_OCCURRED;
+      return 0;
     }
-    if (len < 3) {
-      SOCKS_ERROR(ReplyField::GENERAL_SOCKS_SERVER_FAILURE,
-                  "SOCKS message too short");
+
+    // a message may arrive in pieces or share a read with the next one,
+    // so only the bytes it still needs are taken from buf
+    std::size_t consumed = 0;
+    auto msgLen = getMessageLength();
+    while (bufLen_ < msgLen) {
+      if (consumed == len) {
+        return consumed;
+      }
+      auto n = std::min(msgLen - bufLen_, len - consumed);
+      memcpy(buf_ + bufLen_, buf + consumed, n);
+      bufLen_ += n;
+      consumed += n;
+      msgLen = getMessageLength();
     }
 
+    auto reply = ReplyField::GENERAL_SOCKS_SERVER_FAILURE;
     switch(state_) {
       case State::METHOD_IDENTIFICATION:
-        return identifyMethod(buf, len);
+        reply = identifyMethod(buf_, bufLen_);
+        break;
 
       case State::USERNAME_PASSWORD_AUTH:
-        return extractUsernamePassword(buf, len);
+        reply = extractUsernamePassword(buf_, bufLen_);
+        break;
 
       case State::PARSING_REQUEST:
-        return parseRequest(buf, len);
+        reply = parseRequest(buf_, bufLen_);
+        break;
 
       default:
-        return ReplyField::GENERAL_SOCKS_SERVER_FAILURE;
+        break;
+    }
+    bufLen_ = 0;
+    if (reply != ReplyField::SUCCEEDED) {
+      errorReply_ = reply;
+    }
+    return consumed;
+  }
+
+  std::size_t SocksReqParser::getMessageLength() const {
+    auto byteAt = [this](std::size_t i) {
+      return static_cast<std::size_t>(static_cast<uint8_t>(buf_[i]));
+    };
+
+    switch(state_) {
+      case State::METHOD_IDENTIFICATION:
+        // VER NMETHODS METHODS...
+        return bufLen_ < 2 ? 2 : 2 + byteAt(1);
+
+      case State::USERNAME_PASSWORD_AUTH: {
+        // VER ULEN UNAME PLEN PASSWD
+        if (bufLen_ < 2) {
+          return 2;
+        }
+        auto plenOffset = 2 + byteAt(1);
+        return bufLen_ <= plenOffset ?
+          plenOffset + 1 : plenOffset + 1 + byteAt(plenOffset);
+      }
+
+      case State::PARSING_REQUEST:
+        // VER CMD RSV ATYP DST.ADDR DST.PORT
+        if (bufLen_ < 4) {
+          return 4;
+        }
+        switch(static_cast<Socks::AddressType>(buf_[3])) {
+          case Socks::AddressType::IPV4:
+            return 4 + 4 + 2;
+          case Socks::AddressType::IPV6:
+            return 4 + 16 + 2;
+          case Socks::AddressType::DOMAIN_NAME:
+            return bufLen_ < 5 ? 5 : 5 + byteAt(4) + 2;
+          default:
+            // complete as it is, parseRequest() rejects it
+            return bufLen_;
+        }
+
+      default:
+        return bufLen_;
     }
-    return ReplyField::SUCCEEDED;
   }
 
   SocksReqParser::ReplyField SocksReqParser::identifyMethod(const char *buf, std::size_t len) {
@@ -47,11 +115,7 @@ namespace proxypp {
       SOCKS_ERROR(ReplyField::GENERAL_SOCKS_SERVER_FAILURE,
                   "Bad SOCKS version: %d", *buf);
     }
-    std::size_t count = *(buf + 1);
-    if (count != len - 2) {
-      SOCKS_ERROR(ReplyField::GENERAL_SOCKS_SERVER_FAILURE,
-                  "Bad SOCKS method identification message");
-    }
+    std::size_t count = len - 2;
     buf += 2;
     for (std::size_t i = 0; i < count; ++i) {
       auto authMethod = static_cast<Socks::Method>(*(buf + i));
@@ -75,45 +139,18 @@ namespace proxypp {
 
   SocksReqParser::ReplyField SocksReqParser::extractUsernamePassword(
     const char *buf, std::size_t len) {
-    if (len < 3) {
-      // simply return SUCCEEDED but do not parse username and password,
-      // so later authentication will certainly fail
-      return ReplyField::SUCCEEDED;
-    }
     //auto subVersion = *buf;
-    buf += 1;
-    len -= 1;
-
-    std::size_t usernameLen = *buf;
-    buf += 1;
-    len -= 1;
-    if (usernameLen >= len) {
-      // invalid username length, return SUCCEEDED but do not parse username,
-      // later authentication will fail
-      return ReplyField::SUCCEEDED;
-    }
-    parsedUsername_.assign(buf, usernameLen);
-    buf += usernameLen;
-    len -= usernameLen;
-
-    std::size_t passwordLen = *buf;
-    buf += 1;
-    len -= 1;
-    if (passwordLen != len) {
-      // invalid password length, return SUCCEEDED but do not parse password,
-      // later authentication will fail
-      return ReplyField::SUCCEEDED;
-    }
+    std::size_t usernameLen = static_cast<uint8_t>(buf[1]);
+    parsedUsername_.assign(buf + 2, usernameLen);
+    std::size_t passwordLen = static_cast<uint8_t>(buf[2 + usernameLen]);
+    parsedPassword_.assign(buf + 3 + usernameLen, passwordLen);
 
-    parsedPassword_.assign(buf, passwordLen);
+    // whether they match is for the session to check
+    state_ = State::PARSING_REQUEST;
     return ReplyField::SUCCEEDED;
   }
 
   SocksReqParser::ReplyField SocksReqParser::parseRequest(const char *buf, std::size_t len) {
-    if (len < 4) {
-      SOCKS_ERROR(ReplyField::GENERAL_SOCKS_SERVER_FAILURE,
-                  "SOCKS message too short");
-    }
     auto version = *buf;
     auto cmd     = *(buf + 1);
     //auto rsv     = *(buf + 2);
@@ -124,38 +161,28 @@ namespace proxypp {
                   "Invalid SOCKS version: %d", version);
     }
 
-    if (cmd != static_cast<int>(Socks::RequestType::CONNECT)) {
+    if (cmd != static_cast<int>(Socks::RequestType::CONNECT) &&
+        cmd != static_cast<int>(Socks::RequestType::BIND) &&
+        cmd != static_cast<int>(Socks::RequestType::UDP_ASSOCIATE)) {
       SOCKS_ERROR(ReplyField::COMMAND_NOT_SUPPORTED,
                   "unsupported command: %d", cmd);
     }
 
     buf += 4;
-    len -= 4;
 
+    // getMessageLength() made sure the lengths add up
     switch(static_cast<Socks::AddressType>(atyp)) {
       case Socks::AddressType::IPV4:
-        if (len != 4 + 2) {
-          SOCKS_ERROR(ReplyField::GENERAL_SOCKS_SERVER_FAILURE,
-                      "Incorrect IPV4 address length: %zu", len);
-        }
-        addr_.assign(buf, 4);
+        request_.addr.assign(buf, 4);
         buf += 4;
         break;
       case Socks::AddressType::IPV6:
-        if (len != 16 + 2) {
-          SOCKS_ERROR(ReplyField::GENERAL_SOCKS_SERVER_FAILURE,
-                      "Incorrect IPV6 address length: %zu", len);
-        }
-        addr_.assign(buf, 16);
+        request_.addr.assign(buf, 16);
         buf += 16;
         break;
       case Socks::AddressType::DOMAIN_NAME: {
-        std::size_t addrLen = *buf;
-        addr_.assign(buf + 1, addrLen);
-        if (len != 1 + addrLen + 2) {
-          SOCKS_ERROR(ReplyField::GENERAL_SOCKS_SERVER_FAILURE,
-                      "Incorrect domain address length: %zu", len);
-        }
+        std::size_t addrLen = static_cast<uint8_t>(*buf);
+        request_.addr.assign(buf + 1, addrLen);
         buf += (1 + addrLen);
         break;
       }
@@ -164,8 +191,9 @@ namespace proxypp {
                     "unknown atyp: %d", atyp);
     }
 
-    atyp_ = static_cast<Socks::AddressType>(atyp);
-    memcpy(&port_, buf, 2);
+    request_.cmd = static_cast<Socks::RequestType>(cmd);
+    request_.atyp = static_cast<Socks::AddressType>(atyp);
+    memcpy(&request_.port, buf, 2);
     state_ = State::NEGOTIATION_COMPLETE;
     return ReplyField::SUCCEEDED;
   }
@@ -178,16 +206,28 @@ namespace proxypp {
     return state_;
   }
 
+  SocksReqParser::ReplyField SocksReqParser::getErrorReply() const {
+    return errorReply_;
+  }
+
+  const SocksRequest &SocksReqParser::getRequest() const {
+    return request_;
+  }
+
+  Socks::RequestType SocksReqParser::getCommand() const {
+    return request_.cmd;
+  }
+
   Socks::AddressType SocksReqParser::getAddressType() const {
-    return atyp_;
+    return request_.atyp;
   }
 
   std::string SocksReqParser::getAddress() const {
-    return addr_;
+    return request_.addr;
   }
 
   uint16_t SocksReqParser::getPort() const {
-    return port_;
+    return request_.port;
   }
 
   void SocksReqParser::setRequireAuthMethod(Socks::Method method) {
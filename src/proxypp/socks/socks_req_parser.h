@@ -32,9 +32,18 @@ namespace proxypp {
         ADDRESS_TYPE_NOT_SUPPORTED   = 8
       };
 
-      ReplyField parse(const char *buf, std::size_t len);
+      // parses at most one message and returns the number of bytes
+      // consumed, which is less than len only if the message completes in
+      // the middle of buf or an error occurs. bytes of an incomplete
+      // message are kept until the rest arrives, the state moves on once
+      // the message completes
+      std::size_t parse(const char *buf, std::size_t len);
       void setState(State state);
       State getState() const;
+      // the reply to send if the state is ERROR_OCCURRED
+      ReplyField getErrorReply() const;
+      const SocksRequest &getRequest() const;
+      Socks::RequestType getCommand() const;
       Socks::AddressType getAddressType() const;
       std::string getAddress() const;
       uint16_t getPort() const;
@@ -44,16 +53,23 @@ namespace proxypp {
       std::string getParsedPassword() const;
 
     private:
+      // length of the message given the bytes buffered so far, grows as
+      // the length fields arrive
+      std::size_t getMessageLength() const;
       ReplyField identifyMethod(const char *buf, std::size_t len);
       ReplyField parseRequest(const char *buf, std::size_t len);
       ReplyField extractUsernamePassword(const char *buf, std::size_t len);
     
     private:
+      // the longest message is the username/password one
+      static constexpr std::size_t kMaxMessageLength = 2 + 255 + 1 + 255;
+
       State state_{State::METHOD_IDENTIFICATION};
+      ReplyField errorReply_{ReplyField::SUCCEEDED};
+      char buf_[kMaxMessageLength];
+      std::size_t bufLen_{0};
 
-      Socks::AddressType atyp_{Socks::AddressType::UNKNOWN};
-      std::string addr_;
-      uint16_t port_{0};
+      SocksRequest request_;
 
       Socks::Method requireAuthMethod_{Socks::Method::NO_AUTHENTICATION};
       std::string parsedUsername_;
@@ -0,0 +1,587 @@
+/*******************************************************************************
+**          File: socks_udp_relay.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 09:40 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/socks/socks_udp_relay.h"
+#include "proxypp/socks/socks.h"
+#include "nul/log.h"
+
+#include <cerrno>
+#include <cstring>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+  // datagrams received or sent with one syscall
+  const std::size_t kBatchSize = 32;
+  // larger datagrams are truncated by the kernel and dropped, DNS and
+  // QUIC stay far below it
+  const std::size_t kMaxDatagramSize = 8 * 1024;
+  // per association, datagrams for new targets are dropped beyond it.
+  // each entry holds a socket
+  const std::size_t kMaxEntries = 256;
+  // per entry, while its target is being resolved
+  const std::size_t kMaxPendingDatagrams = 8;
+
+  struct Batch {
+    char bufs[kBatchSize][kMaxDatagramSize];
+    sockaddr_storage from[kBatchSize];
+    socklen_t fromLen[kBatchSize];
+    std::size_t len[kBatchSize];
+    iovec iovs[kBatchSize];
+
+    // the datagrams queued for sending, the iovecs point into bufs or
+    // into the headers of the entries
+    int outFds[kBatchSize];
+    sockaddr_storage to[kBatchSize];
+    socklen_t toLen[kBatchSize];
+    iovec outIovs[kBatchSize][2];
+    std::size_t outCount{0};
+
+#ifdef __linux__
+    mmsghdr msgs[kBatchSize];
+    mmsghdr outMsgs[kBatchSize];
+#endif
+  };
+
+  // shared by the relays on the same loop, allocated on first use so
+  // that threads that never relay UDP don't pay for it
+  Batch &getBatch() {
+    static thread_local std::unique_ptr<Batch> batch;
+    if (!batch) {
+      batch.reset(new Batch{});
+    }
+    return *batch;
+  }
+
+  // the IP and port as bytes, IPv4-mapped IPv6 addresses are taken as
+  // IPv4 so that they compare equal to the IPv4 ones
+  std::string getAddrKey(const sockaddr *addr, bool withPort = true) {
+    std::string key;
+    if (addr->sa_family == AF_INET) {
+      auto addr4 = reinterpret_cast<const sockaddr_in *>(addr);
+      key.assign(reinterpret_cast<const char *>(&addr4->sin_addr), 4);
+      if (withPort) {
+        key.append(reinterpret_cast<const char *>(&addr4->sin_port), 2);
+      }
+    } else if (addr->sa_family == AF_INET6) {
+      auto addr6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+      if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+        key.assign(reinterpret_cast<const char *>(&addr6->sin6_addr) + 12, 4);
+      } else {
+        key.assign(reinterpret_cast<const char *>(&addr6->sin6_addr), 16);
+      }
+      if (withPort) {
+        key.append(reinterpret_cast<const char *>(&addr6->sin6_port), 2);
+      }
+    }
+    return key;
+  }
+
+  bool parseIp(
+    const std::string &ip, uint16_t port,
+    sockaddr_storage &addr, socklen_t &addrLen) {
+    memset(&addr, 0, sizeof(addr));
+    auto addr4 = reinterpret_cast<sockaddr_in *>(&addr);
+    if (inet_pton(AF_INET, ip.c_str(), &addr4->sin_addr) == 1) {
+      addr4->sin_family = AF_INET;
+      addr4->sin_port = htons(port);
+      addrLen = sizeof(sockaddr_in);
+      return true;
+    }
+    auto addr6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+    if (inet_pton(AF_INET6, ip.c_str(), &addr6->sin6_addr) == 1) {
+      addr6->sin6_family = AF_INET6;
+      addr6->sin6_port = htons(port);
+      addrLen = sizeof(sockaddr_in6);
+      return true;
+    }
+    return false;
+  }
+
+  // IPv4 targets are sent to as IPv4-mapped addresses from IPv6 sockets,
+  // IPv6 targets can't be reached from IPv4 sockets
+  bool toSocketFamily(int family, sockaddr_storage &addr, socklen_t &addrLen) {
+    if (addr.ss_family == family) {
+      return true;
+    }
+    if (family != AF_INET6) {
+      return false;
+    }
+    sockaddr_in6 addr6;
+    memset(&addr6, 0, sizeof(addr6));
+    auto addr4 = reinterpret_cast<const sockaddr_in *>(&addr);
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = addr4->sin_port;
+    addr6.sin6_addr.s6_addr[10] = 0xff;
+    addr6.sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&addr6.sin6_addr.s6_addr[12], &addr4->sin_addr, 4);
+    memcpy(&addr, &addr6, sizeof(addr6));
+    addrLen = sizeof(addr6);
+    return true;
+  }
+
+  std::chrono::steady_clock::time_point now() {
+    return std::chrono::steady_clock::now();
+  }
+
+  bool setNonBlocking(int fd) {
+    auto flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+  }
+}
+
+namespace proxypp {
+
+  SocksUdpRelay::~SocksUdpRelay() {
+    close();
+  }
+
+  bool SocksUdpRelay::open(const std::string &ip) {
+    sockaddr_storage addr;
+    socklen_t addrLen;
+    if (!parseIp(ip, 0, addr, addrLen)) {
+      LOG_E("Invalid UDP relay address: %s", ip.c_str());
+      return false;
+    }
+
+    fd_ = ::socket(addr.ss_family, SOCK_DGRAM, 0);
+    if (fd_ < 0) {
+      LOG_E("Failed to create UDP socket: %s", strerror(errno));
+      return false;
+    }
+    if (!setNonBlocking(fd_) ||
+        ::bind(fd_, reinterpret_cast<sockaddr *>(&addr), addrLen) != 0) {
+      LOG_E("Failed to bind UDP socket to %s: %s", ip.c_str(), strerror(errno));
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void SocksUdpRelay::setClientIp(const std::string &clientIp) {
+    socklen_t addrLen;
+    hasClientIp_ = parseIp(clientIp, 0, clientIp_, addrLen);
+  }
+
+  void SocksUdpRelay::setAllowCallback(AllowCallback &&callback) {
+    allowCallback_ = std::move(callback);
+  }
+
+  void SocksUdpRelay::setResolveCallback(ResolveCallback &&callback) {
+    resolveCallback_ = std::move(callback);
+  }
+
+  void SocksUdpRelay::setSocketCallback(SocketCallback &&callback) {
+    socketCallback_ = std::move(callback);
+  }
+
+  int SocksUdpRelay::getFd() const {
+    return fd_;
+  }
+
+  bool SocksUdpRelay::getBoundAddress(sockaddr_storage &addr) const {
+    socklen_t addrLen = sizeof(addr);
+    return fd_ >= 0 &&
+      getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &addrLen) == 0;
+  }
+
+  std::size_t SocksUdpRelay::getEntryCount() const {
+    return entries_.size();
+  }
+
+  void SocksUdpRelay::onReadable(int fd) {
+    if (fd_ < 0) {
+      return;
+    }
+    if (fd == fd_) {
+      readDatagrams(fd, nullptr);
+      return;
+    }
+    auto it = sockets_.find(fd);
+    if (it != sockets_.end()) {
+      readDatagrams(fd, it->second);
+    }
+  }
+
+  void SocksUdpRelay::readDatagrams(int fd, NatEntry *entry) {
+    auto &batch = getBatch();
+    while (fd_ >= 0) {
+      std::size_t count = 0;
+#ifdef __linux__
+      for (std::size_t i = 0; i < kBatchSize; ++i) {
+        batch.iovs[i] = iovec{batch.bufs[i], kMaxDatagramSize};
+        auto &hdr = batch.msgs[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &batch.from[i];
+        hdr.msg_namelen = sizeof(sockaddr_storage);
+        hdr.msg_iov = &batch.iovs[i];
+        hdr.msg_iovlen = 1;
+      }
+      auto n = recvmmsg(fd, batch.msgs, kBatchSize, MSG_DONTWAIT, nullptr);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      for (int i = 0; i < n; ++i) {
+        auto &hdr = batch.msgs[i].msg_hdr;
+        if (hdr.msg_flags & MSG_TRUNC) {
+          LOG_V("dropped a UDP datagram larger than %zu bytes",
+                kMaxDatagramSize);
+          continue;
+        }
+        batch.fromLen[count] = hdr.msg_namelen;
+        batch.len[count] = batch.msgs[i].msg_len;
+        if (count != static_cast<std::size_t>(i)) {
+          memcpy(batch.bufs[count], batch.bufs[i], batch.len[count]);
+          batch.from[count] = batch.from[i];
+        }
+        ++count;
+      }
+      auto drained = n < static_cast<int>(kBatchSize);
+#else
+      auto drained = false;
+      while (count < kBatchSize) {
+        batch.fromLen[count] = sizeof(sockaddr_storage);
+        auto n = recvfrom(
+          fd, batch.bufs[count], kMaxDatagramSize, MSG_TRUNC,
+          reinterpret_cast<sockaddr *>(&batch.from[count]),
+          &batch.fromLen[count]);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0) {
+          drained = true;
+          break;
+        }
+        if (static_cast<std::size_t>(n) > kMaxDatagramSize) {
+          continue;
+        }
+        batch.len[count++] = n;
+      }
+#endif
+
+      auto clientIpKey = hasClientIp_ ?
+        getAddrKey(reinterpret_cast<sockaddr *>(&clientIp_), false) :
+        std::string{};
+      for (std::size_t i = 0; i < count; ++i) {
+        auto from = reinterpret_cast<sockaddr *>(&batch.from[i]);
+        if (entry) {
+          // the socket is connected, only the target gets through
+          handleTargetDatagram(entry, batch.bufs[i], batch.len[i]);
+        } else if (hasClientIp_ && getAddrKey(from, false) == clientIpKey) {
+          handleClientDatagram(
+            batch.bufs[i], batch.len[i], from, batch.fromLen[i]);
+        } else {
+          LOG_V("dropped a UDP datagram from an unknown source");
+        }
+      }
+      flush();
+
+      if (drained) {
+        break;
+      }
+    }
+  }
+
+  void SocksUdpRelay::handleClientDatagram(
+    char *buf, std::size_t len, const sockaddr *from, socklen_t fromLen) {
+    // RSV(2) FRAG(1) ATYP(1) DST.ADDR DST.PORT(2) DATA
+    if (len < 4 || buf[0] != 0 || buf[1] != 0) {
+      return;
+    }
+    if (buf[2] != 0) {
+      // like most servers, fragments are not supported
+      LOG_V("dropped a fragmented UDP datagram");
+      return;
+    }
+
+    std::size_t headerLen = 0;
+    switch(static_cast<Socks::AddressType>(buf[3])) {
+      case Socks::AddressType::IPV4:
+        headerLen = 4 + 4 + 2;
+        break;
+      case Socks::AddressType::IPV6:
+        headerLen = 4 + 16 + 2;
+        break;
+      case Socks::AddressType::DOMAIN_NAME:
+        if (len > 4) {
+          headerLen = 4 + 1 + static_cast<uint8_t>(buf[4]) + 2;
+        }
+        break;
+      default:
+        break;
+    }
+    if (headerLen == 0 || len < headerLen) {
+      return;
+    }
+
+    auto key = getAddrKey(from);
+    key.append(buf, headerLen);
+    std::shared_ptr<NatEntry> entry;
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      entry = it->second;
+    } else if (entries_.size() < kMaxEntries) {
+      entry = createEntry(buf, headerLen, from, fromLen);
+      entries_.emplace(std::move(key), entry);
+      if (entry->allowed && entry->targetLen == 0) {
+        auto host = std::string{buf + 5, static_cast<uint8_t>(buf[4])};
+        std::weak_ptr<NatEntry> weakEntry = entry;
+        // may call back right away
+        resolveCallback_(host, [this, weakEntry](const std::string &ip) {
+          if (!weakEntry.expired()) {
+            this->onResolved(weakEntry, ip);
+          }
+        });
+      }
+    } else {
+      LOG_W("too many UDP targets, dropped the datagram");
+      return;
+    }
+
+    entry->lastActive = now();
+    if (!entry->allowed) {
+      return;
+    }
+    if (entry->targetLen == 0) {
+      if (entry->pending.size() < kMaxPendingDatagrams) {
+        entry->pending.emplace_back(buf + headerLen, len - headerLen);
+      }
+      return;
+    }
+    queueDatagram(entry->fd, nullptr, 0, nullptr, 0, buf + headerLen,
+                  len - headerLen);
+  }
+
+  void SocksUdpRelay::handleTargetDatagram(
+    NatEntry *entry, char *buf, std::size_t len) {
+    entry->lastActive = now();
+    queueDatagram(
+      fd_, reinterpret_cast<sockaddr *>(&entry->client), entry->clientLen,
+      entry->header.data(), entry->header.size(), buf, len);
+  }
+
+  std::shared_ptr<SocksUdpRelay::NatEntry> SocksUdpRelay::createEntry(
+    const char *header, std::size_t headerLen,
+    const sockaddr *from, socklen_t fromLen) {
+    auto entry = std::make_shared<NatEntry>();
+    entry->header.assign(header, headerLen);
+    memcpy(&entry->client, from, fromLen);
+    entry->clientLen = fromLen;
+
+    uint16_t port;
+    memcpy(&port, header + headerLen - 2, 2);
+    port = ntohs(port);
+
+    std::string addr;
+    auto atyp = static_cast<Socks::AddressType>(header[3]);
+    if (atyp == Socks::AddressType::DOMAIN_NAME) {
+      addr.assign(header + 5, static_cast<uint8_t>(header[4]));
+    } else {
+      char ip[INET6_ADDRSTRLEN];
+      auto family = atyp == Socks::AddressType::IPV4 ? AF_INET : AF_INET6;
+      if (inet_ntop(family, header + 4, ip, sizeof(ip))) {
+        addr = ip;
+      }
+    }
+
+    entry->allowed = !addr.empty() &&
+      (!allowCallback_ || allowCallback_(addr, port));
+    if (!entry->allowed) {
+      LOG_D("[%s:%d] UDP not allowed", addr.c_str(), port);
+      return entry;
+    }
+
+    if (atyp == Socks::AddressType::DOMAIN_NAME) {
+      // resolved by the caller once the entry is in the table
+      entry->allowed = static_cast<bool>(resolveCallback_);
+      return entry;
+    }
+
+    parseIp(addr, port, entry->target, entry->targetLen);
+    if (!openSocket(entry.get())) {
+      entry->allowed = false;
+      entry->targetLen = 0;
+    }
+    return entry;
+  }
+
+  void SocksUdpRelay::onResolved(
+    const std::weak_ptr<NatEntry> &weakEntry, const std::string &ip) {
+    auto entry = weakEntry.lock();
+    if (!entry) {
+      return;
+    }
+
+    uint16_t port;
+    memcpy(&port, entry->header.data() + entry->header.size() - 2, 2);
+    if (ip.empty() ||
+        !parseIp(ip, ntohs(port), entry->target, entry->targetLen) ||
+        !openSocket(entry.get())) {
+      entry->allowed = false;
+      entry->targetLen = 0;
+      std::vector<std::string>().swap(entry->pending);
+      return;
+    }
+
+    for (auto &payload : entry->pending) {
+      queueDatagram(entry->fd, nullptr, 0, nullptr, 0, payload.data(),
+                    payload.size());
+    }
+    flush();
+    std::vector<std::string>().swap(entry->pending);
+  }
+
+  bool SocksUdpRelay::openSocket(NatEntry *entry) {
+    // sends from the IP of the relay, with a port of its own
+    sockaddr_storage self;
+    if (!getBoundAddress(self) ||
+        !toSocketFamily(self.ss_family, entry->target, entry->targetLen)) {
+      return false;
+    }
+    socklen_t selfLen;
+    if (self.ss_family == AF_INET) {
+      reinterpret_cast<sockaddr_in *>(&self)->sin_port = 0;
+      selfLen = sizeof(sockaddr_in);
+    } else {
+      reinterpret_cast<sockaddr_in6 *>(&self)->sin6_port = 0;
+      selfLen = sizeof(sockaddr_in6);
+    }
+
+    auto fd = ::socket(self.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+      LOG_E("Failed to create UDP socket: %s", strerror(errno));
+      return false;
+    }
+    if (!setNonBlocking(fd) ||
+        ::bind(fd, reinterpret_cast<sockaddr *>(&self), selfLen) != 0 ||
+        ::connect(fd, reinterpret_cast<sockaddr *>(&entry->target),
+                  entry->targetLen) != 0) {
+      LOG_E("Failed to set up UDP socket: %s", strerror(errno));
+      ::close(fd);
+      return false;
+    }
+
+    entry->fd = fd;
+    sockets_[fd] = entry;
+    if (socketCallback_) {
+      socketCallback_(fd, true);
+    }
+    return true;
+  }
+
+  void SocksUdpRelay::closeSocket(NatEntry *entry, bool notify) {
+    if (entry->fd < 0) {
+      return;
+    }
+    sockets_.erase(entry->fd);
+    if (notify && socketCallback_) {
+      socketCallback_(entry->fd, false);
+    }
+    ::close(entry->fd);
+    entry->fd = -1;
+  }
+
+  void SocksUdpRelay::expireIdleEntries(std::chrono::milliseconds idleTimeout) {
+    auto t = now();
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (t - it->second->lastActive >= idleTimeout) {
+        closeSocket(it->second.get(), true);
+        it = entries_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void SocksUdpRelay::queueDatagram(
+    int fd, const sockaddr *to, socklen_t toLen,
+    const char *header, std::size_t headerLen,
+    const char *payload, std::size_t payloadLen) {
+    auto &batch = getBatch();
+    if (batch.outCount == kBatchSize) {
+      flush();
+    }
+    auto i = batch.outCount++;
+    batch.outFds[i] = fd;
+    if (to) {
+      memcpy(&batch.to[i], to, toLen);
+    }
+    batch.toLen[i] = toLen;
+    batch.outIovs[i][0] = iovec{const_cast<char *>(header), headerLen};
+    batch.outIovs[i][1] = iovec{const_cast<char *>(payload), payloadLen};
+  }
+
+  void SocksUdpRelay::flush() {
+    auto &batch = getBatch();
+    auto count = batch.outCount;
+    batch.outCount = 0;
+    if (fd_ < 0) {
+      return;
+    }
+
+#ifdef __linux__
+    for (std::size_t i = 0; i < count; ++i) {
+      auto &hdr = batch.outMsgs[i].msg_hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_name = batch.toLen[i] > 0 ? &batch.to[i] : nullptr;
+      hdr.msg_namelen = batch.toLen[i];
+      // no header for the datagrams going to the targets
+      auto hasHeader = batch.outIovs[i][0].iov_len > 0;
+      hdr.msg_iov = hasHeader ? batch.outIovs[i] : &batch.outIovs[i][1];
+      hdr.msg_iovlen = hasHeader ? 2 : 1;
+    }
+    // one sendmmsg() per run of datagrams going out of the same socket
+    std::size_t sent = 0;
+    while (sent < count) {
+      auto end = sent + 1;
+      while (end < count && batch.outFds[end] == batch.outFds[sent]) {
+        ++end;
+      }
+      auto n = sendmmsg(
+        batch.outFds[sent], batch.outMsgs + sent, end - sent, 0);
+      if (n > 0) {
+        sent += n;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // the socket buffer is full, UDP may drop them
+        sent = end;
+      } else if (errno != EINTR) {
+        // skip the one that failed, e.g. with an unreachable target
+        ++sent;
+      }
+    }
+#else
+    for (std::size_t i = 0; i < count; ++i) {
+      msghdr hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_name = batch.toLen[i] > 0 ? &batch.to[i] : nullptr;
+      hdr.msg_namelen = batch.toLen[i];
+      auto hasHeader = batch.outIovs[i][0].iov_len > 0;
+      hdr.msg_iov = hasHeader ? batch.outIovs[i] : &batch.outIovs[i][1];
+      hdr.msg_iovlen = hasHeader ? 2 : 1;
+      if (sendmsg(batch.outFds[i], &hdr, 0) < 0 && errno == EINTR) {
+        --i;
+      }
+    }
+#endif
+  }
+
+  void SocksUdpRelay::close() {
+    for (auto &pair : entries_) {
+      closeSocket(pair.second.get(), false);
+    }
+    entries_.clear();
+    allowCallback_ = nullptr;
+    resolveCallback_ = nullptr;
+    socketCallback_ = nullptr;
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+} /* end of namspace: proxypp */
@@ -0,0 +1,130 @@
+/*******************************************************************************
+**          File: socks_udp_relay.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 09:40 PM
+**   Description: relays the datagrams of a SOCKS5 UDP ASSOCIATE
+*******************************************************************************/
+#ifndef PROXYPP_SOCKS_UDP_RELAY_H_
+#define PROXYPP_SOCKS_UDP_RELAY_H_
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace proxypp {
+  /**
+   * Datagrams from the client carry the SOCKS UDP header, which is
+   * stripped before they are sent to the target and prepended to the ones
+   * coming back. Each (client endpoint, target) pair gets an entry in a
+   * NAT table, entries expire when idle. Every entry sends from a socket
+   * of its own connected to the target, so the replies reach the client
+   * endpoint that the entry belongs to even if several entries share a
+   * target. On Linux datagrams are received and sent in batches with
+   * recvmmsg()/sendmmsg().
+   *
+   * The relay doesn't poll the sockets itself, the owner is told about
+   * them through the SocketCallback, calls onReadable() when one of them
+   * is readable and expireIdleEntries() now and then. No callback is
+   * fired after close() is called.
+   */
+  class SocksUdpRelay final {
+    public:
+      // whether datagrams may be sent to the target, asked once per entry
+      using AllowCallback =
+        std::function<bool(const std::string &addr, uint16_t port)>;
+      // called with an empty IP if the host can't be resolved
+      using ResolvedCallback = std::function<void(const std::string &ip)>;
+      using ResolveCallback = std::function<
+        void(const std::string &host, ResolvedCallback &&callback)>;
+      // called with opened set after the socket of an entry is opened and
+      // with opened unset right before it is closed
+      using SocketCallback = std::function<void(int fd, bool opened)>;
+
+      SocksUdpRelay() = default;
+      ~SocksUdpRelay();
+      SocksUdpRelay(const SocksUdpRelay &) = delete;
+      SocksUdpRelay &operator=(const SocksUdpRelay &) = delete;
+
+      // binds a non-blocking UDP socket to ip with an ephemeral port
+      bool open(const std::string &ip);
+      // only datagrams from clientIp are taken from the client, it should
+      // be the IP the TCP connection of the association comes from
+      void setClientIp(const std::string &clientIp);
+      void setAllowCallback(AllowCallback &&callback);
+      // domain targets are dropped if not set
+      void setResolveCallback(ResolveCallback &&callback);
+      void setSocketCallback(SocketCallback &&callback);
+
+      // the socket the client sends to, the sockets of the entries are
+      // reported through the SocketCallback
+      int getFd() const;
+      // the address to put in the reply to UDP ASSOCIATE
+      bool getBoundAddress(sockaddr_storage &addr) const;
+      std::size_t getEntryCount() const;
+
+      // reads until the socket fd is drained, fd is getFd() or one that
+      // was reported through the SocketCallback
+      void onReadable(int fd);
+      void expireIdleEntries(std::chrono::milliseconds idleTimeout);
+      void close();
+
+    private:
+      struct NatEntry {
+        // RSV FRAG ATYP DST.ADDR DST.PORT as the client sent it, replies
+        // go back with it
+        std::string header;
+        sockaddr_storage client;
+        socklen_t clientLen{0};
+        // unset until a domain target is resolved
+        sockaddr_storage target;
+        socklen_t targetLen{0};
+        // connected to the target once it is known
+        int fd{-1};
+        bool allowed{false};
+        std::chrono::steady_clock::time_point lastActive;
+        // datagrams that arrived while the target was being resolved
+        std::vector<std::string> pending;
+      };
+
+      // entry is null for the socket the client sends to
+      void readDatagrams(int fd, NatEntry *entry);
+      void handleClientDatagram(
+        char *buf, std::size_t len, const sockaddr *from, socklen_t fromLen);
+      void handleTargetDatagram(NatEntry *entry, char *buf, std::size_t len);
+      std::shared_ptr<NatEntry> createEntry(
+        const char *header, std::size_t headerLen,
+        const sockaddr *from, socklen_t fromLen);
+      void onResolved(
+        const std::weak_ptr<NatEntry> &weakEntry, const std::string &ip);
+      bool openSocket(NatEntry *entry);
+      void closeSocket(NatEntry *entry, bool notify);
+
+      // queues a datagram to be sent from fd for the next flush(), which
+      // must happen before the buffers handed in are reused. to is null
+      // for the connected sockets of the entries
+      void queueDatagram(
+        int fd, const sockaddr *to, socklen_t toLen,
+        const char *header, std::size_t headerLen,
+        const char *payload, std::size_t payloadLen);
+      void flush();
+
+    private:
+      int fd_{-1};
+      sockaddr_storage clientIp_;
+      bool hasClientIp_{false};
+      AllowCallback allowCallback_;
+      ResolveCallback resolveCallback_;
+      SocketCallback socketCallback_;
+
+      // keyed by the client endpoint and the header
+      std::unordered_map<std::string, std::shared_ptr<NatEntry>> entries_;
+      // keyed by the socket of the entry, for the datagrams coming back
+      std::unordered_map<int, NatEntry *> sockets_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_SOCKS_UDP_RELAY_H_ */
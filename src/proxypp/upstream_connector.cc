@@ -0,0 +1,423 @@
+/*******************************************************************************
+**          File: upstream_connector.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 05:52 PM
+**   Description: see the header file
+*******************************************************************************/
+#include "proxypp/upstream_connector.h"
+#include "nul/log.h"
+#include "nul/util.hpp"
+#include "nul/uri.hpp"
+
+#include <algorithm>
+
+namespace {
+  static const std::size_t MAX_WRITE_CHUNK_BYTES = 8192U;
+  static const auto MAX_TUNNEL_RESPONSE_BYTES = 16 * 1024U;
+}
+
+namespace proxypp {
+  UpstreamConnector::UpstreamConnector(
+    const std::shared_ptr<uvcpp::Loop> &loop,
+    const std::shared_ptr<nul::BufferPool> &bufferPool) :
+    loop_(loop), bufferPool_(bufferPool) {
+  }
+
+  bool UpstreamConnector::parseUpstreamServer(
+    const std::string &uriStr, UpstreamServer &upstream) {
+    nul::URI uri;
+    if (!uri.parse(uriStr)) {
+      LOG_W("Invalid upstream server ignored: %s", uriStr.c_str());
+      return false;
+    }
+    auto scheme = uri.getScheme();
+    if (scheme == "socks5") {
+      upstream.type = UpstreamType::kSOCKS5;
+
+    } else if (scheme == "http" || scheme == "https") {
+      upstream.type = UpstreamType::kHTTP;
+
+    } else {
+      LOG_W("Only 'socks5' or 'http' proxy server is support for upstream");
+      return false;
+    }
+
+    upstream.host = uri.getHost();
+    upstream.port = uri.getPort();
+
+    if (upstream.host.empty()) {
+      LOG_W("Invalid upstream server ignored: %s", uriStr.c_str());
+      upstream.type = UpstreamType::kUnknown;
+      return false;
+    }
+
+    if (upstream.port == 0) {
+      LOG_W("Invalid upstream server port: %d", upstream.port);
+      upstream.type = UpstreamType::kUnknown;
+      return false;
+    }
+    return true;
+  }
+
+  std::shared_ptr<const UpstreamServers> UpstreamConnector::parseUpstreamServers(
+    const std::string &servers) {
+    auto upstreamServers = std::make_shared<UpstreamServers>();
+    std::string::size_type pos = 0;
+    while (pos < servers.size()) {
+      auto end = std::min(servers.find(',', pos), servers.size());
+      auto server = servers.substr(pos, end - pos);
+      pos = end + 1;
+
+      auto eq = server.find('=');
+      if (eq == 0 || eq == std::string::npos) {
+        LOG_W("Invalid upstream server ignored: %s", server.c_str());
+        continue;
+      }
+      auto name = server.substr(0, eq);
+      auto action = RouteAction::getId(name);
+      if (action <= RouteAction::kProxy) {
+        LOG_W("Reserved upstream name ignored: %s", name.c_str());
+        continue;
+      }
+      UpstreamServer upstream;
+      if (!parseUpstreamServer(server.substr(eq + 1), upstream)) {
+        continue;
+      }
+      if (upstreamServers->size() <= action) {
+        upstreamServers->resize(action + 1);
+      }
+      (*upstreamServers)[action] = upstream;
+      LOG_I("set upstream server %s: %s:%d",
+            name.c_str(), upstream.host.c_str(), upstream.port);
+    }
+    return upstreamServers;
+  }
+
+  void UpstreamConnector::setUpstreamServer(
+    UpstreamType type, const std::string &host, uint16_t port) {
+    upstreamType_ = type;
+    upstreamServerHost_ = host;
+    upstreamServerPort_ = port;
+  }
+
+  void UpstreamConnector::setConnectCallback(ConnectCallback &&callback) {
+    connectCallback_ = std::move(callback);
+  }
+
+  void UpstreamConnector::setDataCallback(DataCallback &&callback) {
+    dataCallback_ = std::move(callback);
+  }
+
+  void UpstreamConnector::setWriteCallback(WriteCallback &&callback) {
+    writeCallback_ = std::move(callback);
+  }
+
+  void UpstreamConnector::setCloseCallback(CloseCallback &&callback) {
+    closeCallback_ = std::move(callback);
+  }
+
+  void UpstreamConnector::connect(
+    const std::string &addr, uint16_t port, bool useUpstream, bool tunnel) {
+    if (!useUpstream || upstreamType_ == UpstreamType::kUnknown) {
+      connectWithAddr(addr, port);
+
+    } else if (upstreamType_ == UpstreamType::kSOCKS5) {
+      initiateSocksConnection(addr, port);
+
+    } else {
+      if (tunnel) {
+        tunnelHandshaking_ = true;
+        prepareConnectRequest(addr, port);
+      }
+      connectWithAddr(upstreamServerHost_, upstreamServerPort_);
+    }
+  }
+
+  void UpstreamConnector::connectWithAddr(
+    const std::string &addr, uint16_t port) {
+    if (nul::NetUtil::isIPv4(addr) || nul::NetUtil::isIPv6(addr)) {
+      connectWithIp(addr, port);
+      return;
+    }
+
+    dnsRequest_ = uvcpp::DNSRequest::create(loop_);
+    dnsRequest_->once<uvcpp::EvDNSRequestFinish>(
+      // intentionally cycle-ref the UpstreamConnector object to avoid
+      // deletion of it before this callback is fired
+      [this, _ = shared_from_this()](const auto &e, auto &req){
+        dnsRequest_ = nullptr;
+      });
+
+    dnsRequest_->once<uvcpp::EvError>([this, addr](const auto &e, auto &r) {
+      LOG_W("Failed to resolve address: %s", addr.c_str());
+      this->onClosed();
+    });
+
+    dnsRequest_->once<uvcpp::EvDNSResult>(
+      [this, addr, port](const auto &e, auto &req) {
+        if (e.dnsResults.empty()) {
+          LOG_W("[%s] resolved to zero IPs", addr.c_str());
+          this->onClosed();
+          return;
+        }
+
+        ipAddrs_ = std::move(e.dnsResults);
+        ipIt_ = ipAddrs_.begin();
+        auto newIp = *ipIt_;
+        ++ipIt_;
+
+        if (!closed_) {
+          this->connectWithIp(newIp, port);
+        }
+      });
+
+    dnsRequest_->resolve(addr);
+    LOG_D("Resolving address: %s", addr.c_str());
+  }
+
+  void UpstreamConnector::connectWithIp(const std::string &ip, uint16_t port) {
+    conn_ = uvcpp::Tcp::create(loop_);
+    conn_->once<uvcpp::EvError>([](const auto &e, auto &conn) {
+      LOG_D("upstream connection error: %s:%d",
+            conn.getIP().c_str(), conn.getPort());
+    });
+    conn_->once<uvcpp::EvClose>(
+      // intentionally cycle-ref the UpstreamConnector object to avoid
+      // deletion of it before this callback is fired
+      [this, port, _ = shared_from_this()](const auto &e, auto &conn) {
+        if (!connected_ && !closed_ && ipIt_ != ipAddrs_.end()) {
+          auto newIp = *ipIt_;
+          ++ipIt_;
+          this->connectWithIp(newIp, port);
+        } else {
+          this->onClosed();
+        }
+      });
+    conn_->on<uvcpp::EvBufferRecycled>([this](const auto &e, auto &conn) {
+      bufferPool_->returnBuffer(std::forward<std::unique_ptr<nul::Buffer>>(
+          const_cast<uvcpp::EvBufferRecycled &>(e).buffer));
+      this->onBufferRecycled();
+    });
+    conn_->once<uvcpp::EvConnect>([this](const auto &e, auto &conn) {
+      LOG_D("Connected to: %s:%d", conn.getIP().c_str(), conn.getPort());
+      conn.template on<uvcpp::EvRead>([this](const auto &e, auto &conn) {
+        if (tunnelHandshaking_) {
+          this->onTunnelResponse(e.buf, e.nread);
+        } else {
+          this->onData(e.buf, e.nread);
+        }
+      });
+      conn.readStart();
+
+      if (tunnelHandshaking_) {
+        doWrite(tunnelRequest_.c_str(), tunnelRequest_.size(), false);
+        tunnelRequest_.clear();
+      } else {
+        this->onConnected();
+      }
+    });
+
+    if (!conn_->connect(ip, port)) {
+      conn_->close();
+    }
+  }
+
+  void UpstreamConnector::initiateSocksConnection(
+    const std::string &targetAddr, uint16_t targetPort) {
+    socksClient_ = std::make_unique<SocksClient>(loop_, bufferPool_);
+    if (!socksClient_->connect(upstreamServerHost_, upstreamServerPort_)) {
+      LOG_E("Failed to connect to SOCKS server: %s:%d",
+            upstreamServerHost_.c_str(), upstreamServerPort_);
+      socksClient_->close();
+      onClosed();
+      return;
+    }
+
+    socksClient_->once<uvcpp::EvClose>(
+      // ref the connector object until the SocksClient connection is closed
+      [this, _ = shared_from_this()](const auto &e, auto &conn) {
+        this->onClosed();
+      });
+
+    socksClient_->once<EvSocksHandshake>(
+      [this, targetAddr, targetPort](const auto &e, auto &conn) {
+        if (!e.succeeded) {
+          LOG_E("SOCKS handshake failed for: %s:%d",
+                targetAddr.c_str(), targetPort);
+          conn.close();
+          return;
+        }
+
+        // SocksClient returns the buffers to the pool itself, this only
+        // keeps track of what is written
+        conn.template on<uvcpp::EvBufferRecycled>(
+          [this](const auto &e, auto &conn) {
+            this->onBufferRecycled();
+          });
+        conn.template on<EvSocksRead>([this](const auto &e, auto &conn) {
+          this->onData(e.buf, e.nread);
+        });
+        this->onConnected();
+      });
+
+    socksClient_->startHandshake(targetAddr, targetPort);
+  }
+
+  void UpstreamConnector::prepareConnectRequest(
+    const std::string &targetAddr, uint16_t targetPort) {
+    auto authority = nul::NetUtil::isIPv6(targetAddr) ?
+      "[" + targetAddr + "]" : targetAddr;
+    authority.append(":").append(std::to_string(targetPort));
+    tunnelRequest_ = "CONNECT " + authority + " HTTP/1.1\r\nHost: " +
+      authority + "\r\n\r\n";
+  }
+
+  void UpstreamConnector::onTunnelResponse(const char *buf, std::size_t len) {
+    tunnelResponse_.append(buf, len);
+    auto pos = tunnelResponse_.find("\r\n\r\n");
+    if (pos == std::string::npos) {
+      if (tunnelResponse_.size() > MAX_TUNNEL_RESPONSE_BYTES) {
+        LOG_E("response to CONNECT too large");
+        ipIt_ = ipAddrs_.end();
+        conn_->close();
+      }
+      return;
+    }
+
+    // HTTP/1.1 200 Connection established
+    auto sp = tunnelResponse_.find(' ');
+    if (tunnelResponse_.compare(0, 5, "HTTP/") != 0 ||
+        sp == std::string::npos || sp > pos ||
+        tunnelResponse_[sp + 1] != '2') {
+      LOG_E("upstream refused CONNECT: %s",
+            tunnelResponse_.substr(0, tunnelResponse_.find('\r')).c_str());
+      ipIt_ = ipAddrs_.end();
+      conn_->close();
+      return;
+    }
+
+    tunnelHandshaking_ = false;
+    auto rest = tunnelResponse_.substr(pos + 4);
+    tunnelResponse_.clear();
+    onConnected();
+    if (!rest.empty()) {
+      onData(rest.c_str(), rest.size());
+    }
+  }
+
+  void UpstreamConnector::onConnected() {
+    if (closed_) {
+      return;
+    }
+    connected_ = true;
+    if (!pendingData_.empty()) {
+      std::string data;
+      std::swap(data, pendingData_);
+      // already counted in queuedBytes_
+      doWrite(data.c_str(), data.size(), true);
+    }
+    if (connectCallback_) {
+      connectCallback_(true);
+    }
+  }
+
+  void UpstreamConnector::onClosed() {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    if (!connected_) {
+      if (connectCallback_) {
+        connectCallback_(false);
+      }
+    } else if (closeCallback_) {
+      closeCallback_();
+    }
+  }
+
+  void UpstreamConnector::onData(const char *buf, std::size_t len) {
+    if (!closed_ && dataCallback_) {
+      dataCallback_(buf, len);
+    }
+  }
+
+  void UpstreamConnector::onBufferRecycled() {
+    if (writeSizes_.empty()) {
+      return;
+    }
+    auto n = writeSizes_.front();
+    writeSizes_.pop_front();
+    if (n > 0) {
+      queuedBytes_ -= n;
+      if (!closed_ && writeCallback_) {
+        writeCallback_(n);
+      }
+    }
+  }
+
+  void UpstreamConnector::write(const char *buf, std::size_t len) {
+    if (closed_ || len == 0) {
+      return;
+    }
+    queuedBytes_ += len;
+    if (!connected_) {
+      pendingData_.append(buf, len);
+      return;
+    }
+    doWrite(buf, len, true);
+  }
+
+  void UpstreamConnector::doWrite(
+    const char *buf, std::size_t len, bool counted) {
+    while (len > 0) {
+      auto n = std::min(len, MAX_WRITE_CHUNK_BYTES);
+      writeSizes_.push_back(counted ? n : 0);
+      if (socksClient_) {
+        socksClient_->writeAsync(bufferPool_->assembleDataBuffer(buf, n));
+      } else if (conn_) {
+        conn_->writeAsync(bufferPool_->assembleDataBuffer(buf, n));
+      }
+      buf += n;
+      len -= n;
+    }
+  }
+
+  void UpstreamConnector::readStart() {
+    if (socksClient_) {
+      socksClient_->readStart();
+    } else if (conn_ && connected_) {
+      conn_->readStart();
+    }
+  }
+
+  void UpstreamConnector::readStop() {
+    if (socksClient_) {
+      socksClient_->readStop();
+    } else if (conn_ && connected_) {
+      conn_->readStop();
+    }
+  }
+
+  void UpstreamConnector::close() {
+    closed_ = true;
+    ipIt_ = ipAddrs_.end();
+    if (dnsRequest_) {
+      dnsRequest_->cancel();
+    }
+    if (conn_) {
+      conn_->close();
+    }
+    if (socksClient_) {
+      socksClient_->close();
+    }
+  }
+
+  bool UpstreamConnector::isConnected() const {
+    return connected_ && !closed_;
+  }
+
+  std::size_t UpstreamConnector::getQueuedBytes() const {
+    return queuedBytes_;
+  }
+
+} /* end of namspace: proxypp */
@@ -0,0 +1,114 @@
+/*******************************************************************************
+**          File: upstream_connector.h
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-19 Mon 05:30 PM
+**   Description: one connection to a target server, made directly, through
+**                a SOCKS5 upstream or through an HTTP upstream, for the
+**                sessions that multiplex many targets on one client
+**                connection
+*******************************************************************************/
+#ifndef PROXYPP_UPSTREAM_CONNECTOR_H_
+#define PROXYPP_UPSTREAM_CONNECTOR_H_
+#include "proxypp/upstream_type.h"
+#include "proxypp/socks/socks_client.h"
+#include "uvcpp.h"
+#include "nul/buffer_pool.hpp"
+
+#include <deque>
+#include <functional>
+
+namespace proxypp {
+  /**
+   * This class MUST be used with std::shared_ptr, no callback is fired
+   * after close() is called
+   */
+  class UpstreamConnector final :
+    public std::enable_shared_from_this<UpstreamConnector> {
+    public:
+      using ConnectCallback = std::function<void(bool succeeded)>;
+      using DataCallback = std::function<void(const char *buf, std::size_t len)>;
+      // called with the number of bytes written to the socket
+      using WriteCallback = std::function<void(std::size_t len)>;
+      using CloseCallback = std::function<void()>;
+
+      UpstreamConnector(
+        const std::shared_ptr<uvcpp::Loop> &loop,
+        const std::shared_ptr<nul::BufferPool> &bufferPool);
+
+      // socks5://127.0.0.1:1080 or http://127.0.0.1:8080
+      static bool parseUpstreamServer(
+        const std::string &uriStr, UpstreamServer &upstream);
+      // "NAME=URI,NAME2=URI2", the names are given their RouteAction ids
+      // in this order, the ones that are invalid are skipped
+      static std::shared_ptr<const UpstreamServers> parseUpstreamServers(
+        const std::string &servers);
+
+      void setUpstreamServer(
+        UpstreamType type, const std::string &host, uint16_t port);
+      void setConnectCallback(ConnectCallback &&callback);
+      void setDataCallback(DataCallback &&callback);
+      void setWriteCallback(WriteCallback &&callback);
+      // fired when a connection that succeeded is closed
+      void setCloseCallback(CloseCallback &&callback);
+
+      // with an HTTP upstream, tunnel asks the upstream for a CONNECT
+      // tunnel first, otherwise the caller speaks HTTP to the upstream
+      void connect(
+        const std::string &addr, uint16_t port, bool useUpstream, bool tunnel);
+      // data written before the connection is made is sent once connected
+      void write(const char *buf, std::size_t len);
+      void readStart();
+      void readStop();
+      void close();
+
+      bool isConnected() const;
+      // bytes passed to write() but not yet written to the socket
+      std::size_t getQueuedBytes() const;
+
+    private:
+      void connectWithAddr(const std::string &addr, uint16_t port);
+      void connectWithIp(const std::string &ip, uint16_t port);
+      void initiateSocksConnection(
+        const std::string &targetAddr, uint16_t targetPort);
+      void prepareConnectRequest(
+        const std::string &targetAddr, uint16_t targetPort);
+      void onTunnelResponse(const char *buf, std::size_t len);
+      void onConnected();
+      void onClosed();
+      void onData(const char *buf, std::size_t len);
+      void onBufferRecycled();
+      void doWrite(const char *buf, std::size_t len, bool counted);
+
+    private:
+      std::shared_ptr<uvcpp::Loop> loop_;
+      std::shared_ptr<nul::BufferPool> bufferPool_;
+      UpstreamType upstreamType_{UpstreamType::kUnknown};
+      std::string upstreamServerHost_;
+      uint16_t upstreamServerPort_{0};
+
+      std::shared_ptr<uvcpp::Tcp> conn_;
+      std::unique_ptr<SocksClient> socksClient_;
+      std::shared_ptr<uvcpp::DNSRequest> dnsRequest_;
+      uvcpp::EvDNSResult::DNSResultVector ipAddrs_;
+      decltype(ipAddrs_.begin()) ipIt_{ipAddrs_.end()};
+
+      bool connected_{false};
+      bool closed_{false};
+      // waiting for the reply of the HTTP upstream to CONNECT
+      bool tunnelHandshaking_{false};
+      std::string tunnelRequest_;
+      std::string tunnelResponse_;
+      std::string pendingData_;
+      // sizes of the buffers handed to writeAsync(), in order, 0 for the
+      // ones that are not counted in queuedBytes_
+      std::deque<std::size_t> writeSizes_;
+      std::size_t queuedBytes_{0};
+
+      ConnectCallback connectCallback_;
+      DataCallback dataCallback_;
+      WriteCallback writeCallback_;
+      CloseCallback closeCallback_;
+  };
+} /* end of namspace: proxypp */
+
+#endif /* end of include guard: PROXYPP_UPSTREAM_CONNECTOR_H_ */
@@ -6,6 +6,11 @@
 *******************************************************************************/
 #ifndef PROXYPP_UPSTREAM_TYPE_H_
 #define PROXYPP_UPSTREAM_TYPE_H_
+#include "proxypp/rule/route_action.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
 
 namespace proxypp {
   enum class UpstreamType {
@@ -13,6 +18,35 @@ namespace proxypp {
     kSOCKS5,
     kHTTP
   };
+
+  struct UpstreamServer {
+    UpstreamType type{UpstreamType::kUnknown};
+    std::string host;
+    uint16_t port{0};
+  };
+
+  // indexed by the RouteAction ids of the named upstreams, the others
+  // are kUnknown
+  using UpstreamServers = std::vector<UpstreamServer>;
+
+  // the upstream that action goes to, the default one for kProxy and for
+  // a named upstream that is not configured, null if there is none or
+  // action is not an upstream
+  inline const UpstreamServer *findUpstreamServer(
+    const UpstreamServer &defaultUpstream,
+    const UpstreamServers *upstreamServers,
+    RouteAction::Id action) {
+    if (!RouteAction::isUpstream(action)) {
+      return nullptr;
+    }
+    if (action != RouteAction::kProxy && upstreamServers &&
+        action < upstreamServers->size() &&
+        (*upstreamServers)[action].type != UpstreamType::kUnknown) {
+      return &(*upstreamServers)[action];
+    }
+    return defaultUpstream.type != UpstreamType::kUnknown ?
+      &defaultUpstream : nullptr;
+  }
 } /* end of namspace: proxypp */
 
 #endif /* end of include guard: PROXYPP_UPSTREAM_TYPE_H_ */
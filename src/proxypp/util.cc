@@ -6,6 +6,29 @@
 *******************************************************************************/
 #include "util.h"
 
+#include <cstdint>
+
+namespace {
+  inline int base64Value(char ch) {
+    if (ch >= 'A' && ch <= 'Z') {
+      return ch - 'A';
+    }
+    if (ch >= 'a' && ch <= 'z') {
+      return ch - 'a' + 26;
+    }
+    if (ch >= '0' && ch <= '9') {
+      return ch - '0' + 52;
+    }
+    if (ch == '+') {
+      return 62;
+    }
+    if (ch == '/') {
+      return 63;
+    }
+    return -1;
+  }
+}
+
 namespace proxypp {
   bool Util::strStartsWith(
     const std::string &s,
@@ -23,4 +46,35 @@ namespace proxypp {
     }
     return true;
   }
+
+  bool Util::base64Decode(
+    const char *data, std::size_t size, std::string &out) {
+    out.clear();
+    out.reserve(size / 4 * 3);
+    uint32_t bits = 0;
+    int bitCount = 0;
+    std::size_t padding = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+      auto ch = data[i];
+      if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n') {
+        continue;
+      }
+      if (ch == '=') {
+        ++padding;
+        continue;
+      }
+      auto value = base64Value(ch);
+      if (value < 0 || padding > 0) {
+        return false;
+      }
+      bits = (bits << 6) | static_cast<uint32_t>(value);
+      bitCount += 6;
+      if (bitCount >= 8) {
+        bitCount -= 8;
+        out.push_back(static_cast<char>((bits >> bitCount) & 0xff));
+      }
+    }
+    // 6 bits left over is not a whole byte of any input
+    return padding <= 2 && bitCount < 6;
+  }
 } /* end of namespace: proxypp */
@@ -15,6 +15,9 @@ namespace proxypp {
         const std::string &s,
         const std::string &prefix,
         std::size_t prefixOffset);
+      // whitespace is skipped, false if anything else is not base64
+      static bool base64Decode(
+        const char *data, std::size_t size, std::string &out);
   };
 } /* end of namespace: proxypp */
 
@@ -0,0 +1,198 @@
+#include "proxypp/rule/ip_prefix_tree.h"
+#include "proxypp/rule/rule_snapshot.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace proxypp;
+
+// numbers for the IPv4 address rules and the derived rule snapshots, run
+// it with an optimized build, it is not run by ctest
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  double elapsedNs(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(
+      Clock::now() - start).count();
+  }
+
+  // the path compressed radix tree IpPrefixTree inserts the prefixes
+  // into, looked up by walking it the way it was before build() flattened
+  // it into ranges, IPv4 only
+  class RadixTree {
+    public:
+      RadixTree() {
+        nodes_.push_back(Node{0, 0, false, {0, 0}});
+      }
+
+      void insert(uint32_t prefix, uint8_t len) {
+        uint32_t index = 0;
+        while (true) {
+          auto &node = nodes_[index];
+          auto common = commonPrefixLen(node.prefix, prefix,
+                                        std::min(node.len, len));
+          if (common < node.len) {
+            // split the node at the bit they differ at
+            auto split = static_cast<uint32_t>(nodes_.size());
+            nodes_.push_back(nodes_[index]);
+            auto &parent = nodes_[index];
+            parent.len = common;
+            parent.prefix = mask(prefix, common);
+            parent.match = false;
+            parent.children[0] = parent.children[1] = 0;
+            parent.children[bitAt(nodes_[split].prefix, common)] = split;
+            continue;
+          }
+          if (node.len == len) {
+            node.match = true;
+            return;
+          }
+          auto bit = bitAt(prefix, node.len);
+          if (node.children[bit] == 0) {
+            auto child = static_cast<uint32_t>(nodes_.size());
+            nodes_[index].children[bit] = child;
+            nodes_.push_back(Node{prefix, len, true, {0, 0}});
+            return;
+          }
+          index = node.children[bit];
+        }
+      }
+
+      bool lookup(uint32_t addr) const {
+        auto matched = false;
+        uint32_t index = 0;
+        while (true) {
+          auto &node = nodes_[index];
+          if (mask(addr, node.len) != node.prefix) {
+            return matched;
+          }
+          matched = matched || node.match;
+          if (node.len == 32) {
+            return matched;
+          }
+          auto child = node.children[bitAt(addr, node.len)];
+          if (child == 0) {
+            return matched;
+          }
+          index = child;
+        }
+      }
+
+    private:
+      struct Node {
+        uint32_t prefix;
+        uint8_t len;
+        bool match;
+        uint32_t children[2];
+      };
+
+      static uint32_t mask(uint32_t addr, uint8_t len) {
+        return len == 0 ? 0 : addr & (~0U << (32 - len));
+      }
+
+      static int bitAt(uint32_t addr, uint8_t pos) {
+        return (addr >> (31 - pos)) & 1;
+      }
+
+      static uint8_t commonPrefixLen(uint32_t a, uint32_t b, uint8_t maxLen) {
+        uint8_t len = 0;
+        while (len < maxLen && bitAt(a, len) == bitAt(b, len)) {
+          ++len;
+        }
+        return len;
+      }
+
+      std::vector<Node> nodes_;
+  };
+
+  IpPrefixTree::Address toMapped(uint32_t addr) {
+    return IpPrefixTree::Address{0, (0xffffULL << 32) | addr};
+  }
+
+  void benchAddressRules(std::size_t prefixCount, std::size_t lookupCount) {
+    std::mt19937 rng(20261020);
+    IpPrefixTree tree;
+    RadixTree radixTree;
+    for (std::size_t i = 0; i < prefixCount; ++i) {
+      // mostly /24s and the like, as in a list of a country's networks
+      auto len = static_cast<uint8_t>(12 + rng() % 13);
+      auto prefix = static_cast<uint32_t>(rng()) & (~0U << (32 - len));
+      tree.insert(toMapped(prefix), 96 + len, IpPrefixTree::Action::kMatch);
+      radixTree.insert(prefix, len);
+    }
+    tree.build();
+
+    std::vector<uint32_t> addrs(lookupCount);
+    for (auto &addr : addrs) {
+      addr = static_cast<uint32_t>(rng());
+    }
+
+    std::size_t treeMatches = 0;
+    auto start = Clock::now();
+    for (auto addr : addrs) {
+      treeMatches += radixTree.lookup(addr);
+    }
+    auto treeNs = elapsedNs(start) / lookupCount;
+
+    std::size_t flatMatches = 0;
+    start = Clock::now();
+    for (auto addr : addrs) {
+      flatMatches += tree.lookup(toMapped(addr)) ==
+        IpPrefixTree::Action::kMatch;
+    }
+    auto flatNs = elapsedNs(start) / lookupCount;
+
+    printf("address rules, %zu IPv4 prefixes, %zu lookups\n",
+           prefixCount, lookupCount);
+    printf("  radix tree walk: %8.1f ns/lookup\n", treeNs);
+    printf("  flat ranges:     %8.1f ns/lookup\n", flatNs);
+    if (treeMatches != flatMatches) {
+      printf("  MISMATCH: %zu vs %zu matches\n", treeMatches, flatMatches);
+    }
+  }
+
+  void benchDerivedSnapshot(std::size_t ruleCount) {
+    std::vector<std::string> rules;
+    for (std::size_t i = 0; i < ruleCount; ++i) {
+      rules.push_back("||domain" + std::to_string(i) + ".com");
+    }
+
+    auto start = Clock::now();
+    RuleSnapshot base(1, rules);
+    auto fullMs = elapsedNs(start) / 1e6;
+
+    // a one line edit of the rule file
+    auto removed = rules[1];
+    rules[1] = "||example.org";
+    start = Clock::now();
+    RuleSnapshot derived(2, base, rules, {rules[1]}, {removed});
+    auto derivedMs = elapsedNs(start) / 1e6;
+
+    start = Clock::now();
+    RuleSnapshot rebuilt(3, rules);
+    auto rebuiltMs = elapsedNs(start) / 1e6;
+
+    printf("rule snapshot, %zu domain rules\n", ruleCount);
+    printf("  from scratch:       %8.2f ms\n", fullMs);
+    printf("  one line, derived:  %8.2f ms\n", derivedMs);
+    printf("  one line, rebuilt:  %8.2f ms\n", rebuiltMs);
+    if (!derived.scan("www.example.org", 443).matched ||
+        derived.scan("www.domain1.com", 443).matched) {
+      printf("  MISMATCH\n");
+    }
+  }
+}
+
+// bench_rules [PREFIX_COUNT] [RULE_COUNT]
+int main(int argc, char *argv[]) {
+  auto prefixCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 170000;
+  auto ruleCount = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 30000;
+  benchAddressRules(prefixCount, 1000000);
+  benchDerivedSnapshot(ruleCount);
+  return 0;
+}
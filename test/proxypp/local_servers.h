@@ -0,0 +1,180 @@
+#ifndef PROXYPP_TEST_LOCAL_SERVERS_H_
+#define PROXYPP_TEST_LOCAL_SERVERS_H_
+#include "proxypp/proxy_server.hpp"
+#include "uvcpp.h"
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// blocking TCP servers and clients on threads for the tests that run a
+// proxy session on a loop, standing in for its clients, targets and
+// upstreams
+namespace proxypp_test {
+  inline int listenLocalTcp(uint16_t &port) {
+    auto fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    bind(fd, reinterpret_cast<sockaddr *>(&addr), addrLen);
+    getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &addrLen);
+    port = ntohs(addr.sin_port);
+    listen(fd, 16);
+    return fd;
+  }
+
+  // a port nothing listens on, for the proxy to bind to or to fail
+  // connecting to
+  inline uint16_t getFreePort() {
+    uint16_t port;
+    close(listenLocalTcp(port));
+    return port;
+  }
+
+  // accepts connections on a thread and hands them to the handler one at
+  // a time, with blocking reads that give up after 2 seconds
+  class TcpServer {
+    public:
+      using Handler = std::function<void(int fd)>;
+
+      explicit TcpServer(Handler &&handler) : handler_(std::move(handler)) {
+        fd_ = listenLocalTcp(port_);
+        thread_ = std::thread([this]() {
+          while (!stopped_) {
+            pollfd pfd{fd_, POLLIN, 0};
+            if (poll(&pfd, 1, 20) <= 0) {
+              continue;
+            }
+            auto conn = accept(fd_, nullptr, nullptr);
+            if (conn < 0) {
+              continue;
+            }
+            timeval timeout{2, 0};
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO,
+                       &timeout, sizeof(timeout));
+            handler_(conn);
+            close(conn);
+          }
+        });
+      }
+
+      ~TcpServer() {
+        stopped_ = true;
+        thread_.join();
+        close(fd_);
+      }
+
+      uint16_t getPort() const { return port_; }
+
+    private:
+      Handler handler_;
+      int fd_;
+      uint16_t port_;
+      std::atomic<bool> stopped_{false};
+      std::thread thread_;
+  };
+
+  // writes back what it reads, true if the peer closed the connection
+  inline bool echo(int fd) {
+    char buf[2048];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      send(fd, buf, n, 0);
+    }
+    return n == 0;
+  }
+
+  // reads up to the end of the header block of a request or response
+  inline std::string readHead(int fd) {
+    std::string head;
+    char ch;
+    while (head.find("\r\n\r\n") == std::string::npos &&
+           recv(fd, &ch, 1, 0) == 1) {
+      head.push_back(ch);
+    }
+    return head;
+  }
+
+  // a blocking connection to a local port, from sourceIp if given, with
+  // reads that give up after 2 seconds. -1 if it failed
+  inline int connectLocalTcp(uint16_t port, const char *sourceIp = nullptr) {
+    auto fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (sourceIp) {
+      inet_pton(AF_INET, sourceIp, &addr.sin_addr);
+      if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+      }
+    }
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+      close(fd);
+      return -1;
+    }
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+  }
+
+  inline void sendAll(int fd, const std::string &data) {
+    std::size_t sent = 0;
+    ssize_t n;
+    while (sent < data.size() &&
+           (n = send(fd, data.data() + sent, data.size() - sent,
+                     MSG_NOSIGNAL)) > 0) {
+      sent += n;
+    }
+  }
+
+  // reads len bytes, or fewer if the peer closed the connection or the
+  // read timed out
+  inline std::string readBytes(int fd, std::size_t len) {
+    std::string data(len, 0);
+    std::size_t received = 0;
+    ssize_t n;
+    while (received < len &&
+           (n = recv(fd, &data[received], len - received, 0)) > 0) {
+      received += n;
+    }
+    data.resize(received);
+    return data;
+  }
+
+  // runs the loop until client, which talks to the proxy with blocking
+  // sockets on a thread of its own, returns
+  inline void runClient(
+    const std::shared_ptr<uvcpp::Loop> &loop, proxypp::ProxyServer &server,
+    std::function<void()> &&client) {
+    std::atomic<bool> done{false};
+    std::thread thread{[&client, &done]() {
+      client();
+      done = true;
+    }};
+    auto timer = uvcpp::Timer::create(loop);
+    timer->on<uvcpp::EvTimer>([&server, &done](const auto &e, auto &timer) {
+      if (done) {
+        timer.stop();
+        timer.close();
+        server.shutdown();
+      }
+    });
+    timer->start(10, 10);
+    loop->run();
+    thread.join();
+  }
+} /* end of namspace: proxypp_test */
+
+#endif /* end of include guard: PROXYPP_TEST_LOCAL_SERVERS_H_ */
@@ -1,12 +1,32 @@
 #include <gtest/gtest.h>
 #include "proxypp/auto_proxy_manager.h"
+#include "proxypp/auto_proxy_rule.h"
+#include "proxypp/rule/regex_set.h"
+#include "proxypp/rule/route_cache.h"
+#include "proxypp/rule/rule_bloom_filter.h"
+#include "proxypp/rule/layered_rule_automaton.h"
+#include "proxypp/rule/rule_file_loader.h"
+#include "proxypp/rule/wildcard_rule.h"
+#include "proxypp/rule/compiled_rule_file.h"
+#include "proxypp/rule/ip_prefix_tree.h"
+#include "proxypp/rule/geoip_database.h"
+#include "proxypp/util.h"
 #include "nul/util.hpp"
 
+#include <random>
+#include <fstream>
+#include <cstdio>
+#include <unistd.h>
+#include <regex>
+#include <thread>
+#include <chrono>
+
 using namespace proxypp;
 
 TEST(AutoProxyManager, Test1) {
   AutoProxyManager m;
   m.parseFileAsRules("/Users/neevek/Desktop/test.rule");
+  m.waitUntilCompiled();
 
   EXPECT_TRUE(m.matches("google.com", 80));
   EXPECT_TRUE(m.matches("gmail.com", 80));
@@ -23,3 +43,1230 @@ TEST(AutoProxyManager, Test1) {
 
 }
 
+
+namespace {
+  // the linear matcher AutoProxyManager used before the rules were compiled
+  // into tries, kept to check that the rule files still mean the same, its
+  // regex patterns no longer keep the closing '/'
+  class LegacyAutoProxyManager {
+    public:
+      bool addRule(const std::string &ruleStr) {
+        auto rule = parse(ruleStr);
+        if (rule) {
+          matchRules_.emplace_back(ruleStr, std::move(rule));
+          return true;
+        }
+        rule = parseExceptionRule(ruleStr);
+        if (rule) {
+          exceptionRules_.emplace_back(ruleStr, std::move(rule));
+          return true;
+        }
+        return false;
+      }
+
+      bool removeRule(const std::string &rule) {
+        return removeRuleFrom(matchRules_, rule) ||
+          removeRuleFrom(exceptionRules_, rule);
+      }
+
+      bool matches(const std::string &host, uint16_t port) {
+        for (auto &rule : matchRules_) {
+          if (rule.matches(host, port)) {
+            for (auto &exceptRule : exceptionRules_) {
+              if (exceptRule.matches(host, port)) {
+                return false;
+              }
+            }
+            return true;
+          }
+        }
+        return false;
+      }
+
+    private:
+      static AutoProxyRule::MatchFun parse(const std::string &rule) {
+        if (rule.empty()) {
+          return nullptr;
+        }
+        auto size = rule.size();
+        auto ch = std::tolower(rule[0]);
+        if (size > 2 && ch == '/' && rule[size - 1] == '/') {
+          return [r = std::regex(rule.substr(1, size - 2))] (
+            const std::string &rule, const std::string &host, uint16_t port) {
+            return std::regex_match(host, r);
+          };
+        }
+        if (ch != '|' && ch != '.' &&
+            (ch < '0' || ch > '9') && (ch < 'a' || ch > 'z')) {
+          return nullptr;
+        }
+        if (Util::strStartsWith(rule, "|https://", 0)) {
+          return [] (
+            const std::string &rule, const std::string &host, uint16_t port) {
+            return port == 443 && Util::strStartsWith(host, rule, 9);
+          };
+        }
+        if (Util::strStartsWith(rule, "|http://", 0)) {
+          return [] (
+            const std::string &rule, const std::string &host, uint16_t port) {
+            return port != 443 && Util::strStartsWith(host, rule, 8);
+          };
+        }
+        std::string ruleStartsWithDot;
+        if (Util::strStartsWith(rule, "||.", 0)) {
+          ruleStartsWithDot = rule.substr(2);
+        } else if (Util::strStartsWith(rule, "||", 0)) {
+          ruleStartsWithDot = "." + rule.substr(2);
+        } else if (rule[0] != '.') {
+          ruleStartsWithDot = "." + rule;
+        } else {
+          ruleStartsWithDot = rule;
+        }
+        return [ruleStartsWithDot] (
+          const std::string &, const std::string &host, uint16_t port) {
+          return host.find(ruleStartsWithDot) != std::string::npos ||
+            (Util::strStartsWith(host, ruleStartsWithDot, 1));
+        };
+      }
+
+      static AutoProxyRule::MatchFun parseExceptionRule(
+        const std::string &rule) {
+        if (Util::strStartsWith(rule, "@@|https://", 0)) {
+          return [] (
+            const std::string &rule, const std::string &host, uint16_t port) {
+            return port == 443 && Util::strStartsWith(host, rule, 11);
+          };
+        }
+        if (Util::strStartsWith(rule, "@@|http://", 0)) {
+          return [] (
+            const std::string &rule, const std::string &host, uint16_t port) {
+            return port != 443 && Util::strStartsWith(host, rule, 10);
+          };
+        }
+        if (Util::strStartsWith(rule, "@@||", 0)) {
+          auto ruleStartsWithDot = "." + rule.substr(4);
+          return [ruleStartsWithDot] (
+            const std::string &, const std::string &host, uint16_t port) {
+            return host.find(ruleStartsWithDot) != std::string::npos ||
+              (Util::strStartsWith(host, ruleStartsWithDot, 1));
+          };
+        }
+        return nullptr;
+      }
+
+      static bool removeRuleFrom(
+        std::vector<AutoProxyRule> &vec, const std::string &rule) {
+        for (auto it = vec.begin(); it != vec.end(); ++it) {
+          if (it->isRule(rule)) {
+            vec.erase(it);
+            return true;
+          }
+        }
+        return false;
+      }
+
+    private:
+      std::vector<AutoProxyRule> matchRules_;
+      std::vector<AutoProxyRule> exceptionRules_;
+  };
+
+  std::string randomName(std::mt19937 &rng, std::size_t maxLabels) {
+    static const std::vector<std::string> LABELS{
+      "a", "b", "ab", "ba", "g", "go", "goo", "google", "com", "cn", "hk",
+      "x-y", "1", "12", "", "A", "com/path", "cn:80"
+    };
+    auto labels = 1 + rng() % maxLabels;
+    std::string name;
+    for (std::size_t i = 0; i < labels; ++i) {
+      if (i > 0) {
+        name.push_back('.');
+      }
+      name.append(LABELS[rng() % LABELS.size()]);
+    }
+    return name;
+  }
+
+  std::string randomRule(std::mt19937 &rng) {
+    static const std::vector<std::string> PREFIXES{
+      "", "", "", ".", "||", "||.", "|http://", "|https://", "@@||",
+      "@@|http://", "@@|https://", "@@", "!", "|", "/", "G"
+    };
+    static const std::vector<std::string> REGEXES{
+      "/a.*/", "/g.+c/", "/^(a|b)+\\.com$/", "/[a-c]{1,3}\\..*/",
+      "/go+gle\\.(?:com|cn)/", "/\\w+\\.hk/", "/[^.]+\\.g.*/",
+      // not supported by RegexSet
+      "/(a)\\1\\..*/", "/.*\\bcn/"
+    };
+    auto rule = PREFIXES[rng() % PREFIXES.size()] + randomName(rng, 3);
+    if (rule[0] == '/' && rng() % 2 == 0) {
+      rule = REGEXES[rng() % REGEXES.size()];
+    }
+    return rule;
+  }
+
+  // in lines of 64 like gfwlist
+  std::string base64Encode(const std::string &s) {
+    static const char CHARS[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (std::size_t i = 0; i < s.size(); i += 3) {
+      uint32_t n = static_cast<uint8_t>(s[i]) << 16;
+      if (i + 1 < s.size()) {
+        n |= static_cast<uint8_t>(s[i + 1]) << 8;
+      }
+      if (i + 2 < s.size()) {
+        n |= static_cast<uint8_t>(s[i + 2]);
+      }
+      out.push_back(CHARS[(n >> 18) & 63]);
+      out.push_back(CHARS[(n >> 12) & 63]);
+      out.push_back(i + 1 < s.size() ? CHARS[(n >> 6) & 63] : '=');
+      out.push_back(i + 2 < s.size() ? CHARS[n & 63] : '=');
+      if (out.size() % 65 == 64) {
+        out.push_back('\n');
+      }
+    }
+    return out;
+  }
+
+  // a file under /tmp that is removed when it goes out of scope, also if
+  // an assertion ends the test early
+  class TempFile {
+    public:
+      explicit TempFile(const std::string &name) :
+        path_("/tmp/proxypp_test_" + name + "_" +
+              std::to_string(::getpid())) {
+      }
+      ~TempFile() {
+        std::remove(path_.c_str());
+      }
+      TempFile(const TempFile &) = delete;
+      TempFile &operator=(const TempFile &) = delete;
+
+      const std::string &getPath() const { return path_; }
+
+    private:
+      std::string path_;
+  };
+}
+
+TEST(AutoProxyManager, MatchesLikeTheLinearScan) {
+  std::mt19937 rng(20261019);
+  for (int round = 0; round < 50; ++round) {
+    AutoProxyManager m;
+    LegacyAutoProxyManager legacy;
+    std::vector<std::string> rules;
+    auto ruleCount = 1 + rng() % 30;
+    for (std::size_t i = 0; i < ruleCount; ++i) {
+      auto rule = randomRule(rng);
+      ASSERT_EQ(legacy.addRule(rule), m.addRule(rule)) << rule;
+      rules.push_back(rule);
+    }
+    m.addRule("||");
+    legacy.addRule("||");
+    m.waitUntilCompiled();
+
+    for (int pass = 0; pass < 2; ++pass) {
+      for (int i = 0; i < 200; ++i) {
+        auto host = randomName(rng, 5);
+        for (uint16_t port : {80, 443}) {
+          ASSERT_EQ(legacy.matches(host, port), m.matches(host, port))
+            << "host: " << host << ":" << port << ", round: " << round;
+        }
+      }
+      // remove some of the rules, and some that were never added
+      for (std::size_t i = 0; i < rules.size(); i += 2) {
+        auto rule = i % 4 == 0 ? rules[i] : randomRule(rng);
+        ASSERT_EQ(legacy.removeRule(rule), m.removeRule(rule)) << rule;
+      }
+      m.waitUntilCompiled();
+    }
+  }
+}
+
+TEST(AutoProxyManager, RuleSyntax) {
+  AutoProxyManager m;
+  EXPECT_TRUE(m.addRule("google.com"));
+  EXPECT_TRUE(m.addRule("|https://mail.example.org"));
+  EXPECT_TRUE(m.addRule("|http://plain.example.org"));
+  EXPECT_TRUE(m.addRule("@@||cn.google.com"));
+  EXPECT_FALSE(m.addRule("!comment"));
+  EXPECT_FALSE(m.addRule("[AutoProxy 0.2.9]"));
+  m.waitUntilCompiled();
+
+  EXPECT_TRUE(m.matches("google.com", 80));
+  EXPECT_TRUE(m.matches("www.google.com", 80));
+  // the rule may end in the middle of a label
+  EXPECT_TRUE(m.matches("google.com.hk", 80));
+  EXPECT_FALSE(m.matches("agoogle.com", 80));
+  EXPECT_FALSE(m.matches("www.cn.google.com", 80));
+
+  EXPECT_TRUE(m.matches("mail.example.org", 443));
+  EXPECT_FALSE(m.matches("mail.example.org", 80));
+  EXPECT_FALSE(m.matches("www.mail.example.org", 443));
+  EXPECT_TRUE(m.matches("plain.example.org", 8080));
+  EXPECT_FALSE(m.matches("plain.example.org", 443));
+
+  EXPECT_TRUE(m.removeRule("google.com"));
+  EXPECT_FALSE(m.removeRule("google.com"));
+  // never added, though it shares the key with the rule removed above
+  EXPECT_FALSE(m.removeRule("||google.com"));
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.google.com", 80));
+  EXPECT_TRUE(m.removeRule("@@||cn.google.com"));
+
+  m.clearAll();
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("mail.example.org", 443));
+}
+
+TEST(AutoProxyManager, ReloadFile) {
+  TempFile rulesFile{"rules"};
+  auto &file = rulesFile.getPath();
+  std::ofstream{file} << "||google.com\n@@||cn.google.com\n/^a\\.b\\.c$/\n";
+
+  AutoProxyManager m;
+  EXPECT_EQ(3U, m.parseFileAsRules(file));
+  m.addRule("twitter.com");
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("www.google.com", 443));
+  EXPECT_FALSE(m.matches("www.cn.google.com", 443));
+  EXPECT_TRUE(m.matches("twitter.com", 443));
+
+  std::ofstream{file} << "facebook.com\n";
+  m.reloadFile(file);
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.google.com", 443));
+  EXPECT_FALSE(m.matches("twitter.com", 443));
+  EXPECT_TRUE(m.matches("www.facebook.com", 443));
+
+  // changes made while the file is read are applied on top of it
+  m.reloadFile(file);
+  m.addRule("twitter.com");
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("twitter.com", 443));
+  EXPECT_TRUE(m.matches("www.facebook.com", 443));
+  m.reloadFile(file);
+  EXPECT_TRUE(m.removeRule("facebook.com"));
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.facebook.com", 443));
+  EXPECT_FALSE(m.matches("twitter.com", 443));
+}
+
+TEST(AutoProxyManager, ReloadFiles) {
+  TempFile rulesFile1{"rules1"};
+  TempFile rulesFile2{"rules2"};
+  auto &file1 = rulesFile1.getPath();
+  auto &file2 = rulesFile2.getPath();
+  std::ofstream{file1} << "||google.com\n";
+  std::ofstream{file2} << "||twitter.com\n";
+
+  AutoProxyManager m;
+  EXPECT_EQ(2U, m.parseFilesAsRules({file1, file2}));
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("www.google.com", 443));
+  EXPECT_TRUE(m.matches("twitter.com", 443));
+
+  // one of the files changed, the rules of the other are kept
+  std::ofstream{file2} << "||facebook.com\n";
+  m.reloadFiles({file1, file2});
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("www.google.com", 443));
+  EXPECT_FALSE(m.matches("twitter.com", 443));
+  EXPECT_TRUE(m.matches("www.facebook.com", 443));
+
+  // reloading one of them drops the rules of the other
+  m.reloadFile(file2);
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.google.com", 443));
+  EXPECT_TRUE(m.matches("www.facebook.com", 443));
+}
+
+TEST(AutoProxyManager, ReloadBackToBack) {
+  TempFile bigRulesFile{"big_rules"};
+  TempFile smallRulesFile{"small_rules"};
+  auto &bigFile = bigRulesFile.getPath();
+  auto &smallFile = smallRulesFile.getPath();
+  {
+    std::ofstream out{bigFile};
+    for (int i = 0; i < 200000; ++i) {
+      out << "||host" << i << ".big.test\n";
+    }
+  }
+  std::ofstream{smallFile} << "||small.test\n";
+
+  // the second reload comes while the big file is still being read, and
+  // the rules that end up compiled are the ones of the small file
+  AutoProxyManager m;
+  m.reloadFile(bigFile);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  m.reloadFile(smallFile);
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("www.small.test", 443));
+  EXPECT_FALSE(m.matches("host1.big.test", 443));
+  EXPECT_FALSE(m.matches("host199999.big.test", 443));
+}
+
+TEST(AutoProxyManager, CompiledRuleFile) {
+  TempFile compiledRulesFile{"compiled_rules"};
+  auto &file = compiledRulesFile.getPath();
+  std::mt19937 rng(20261020);
+  for (int round = 0; round < 20; ++round) {
+    AutoProxyManager text;
+    std::vector<std::string> rules;
+    auto ruleCount = 1 + rng() % 30;
+    for (std::size_t i = 0; i < ruleCount; ++i) {
+      auto rule = randomRule(rng);
+      if (text.addRule(rule)) {
+        rules.push_back(rule);
+      }
+    }
+    ASSERT_TRUE(CompiledRuleFile::write(file, rules));
+    ASSERT_TRUE(CompiledRuleFile::isCompiledRuleFile(file));
+
+    AutoProxyManager compiled;
+    EXPECT_EQ(rules.size(), compiled.parseFileAsRules(file));
+    text.waitUntilCompiled();
+    compiled.waitUntilCompiled();
+    for (int i = 0; i < 200; ++i) {
+      auto host = randomName(rng, 5);
+      for (uint16_t port : {80, 443}) {
+        ASSERT_EQ(text.matches(host, port), compiled.matches(host, port))
+          << "host: " << host << ":" << port << ", round: " << round;
+      }
+    }
+  }
+
+  // rules added on top of the compiled ones, and a reload back to text
+  ASSERT_TRUE(CompiledRuleFile::write(
+      file, {"google.com", "@@||cn.google.com", "10.0.0.0/8", "@@10.1.0.0/16"}));
+  AutoProxyManager m;
+  EXPECT_EQ(4U, m.parseFileAsRules(file));
+  m.addRule("twitter.com");
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("www.google.com", 443));
+  EXPECT_FALSE(m.matches("cn.google.com", 443));
+  EXPECT_TRUE(m.matches("10.2.3.4", 443));
+  EXPECT_FALSE(m.matches("10.1.3.4", 443));
+  EXPECT_TRUE(m.matches("twitter.com", 443));
+  EXPECT_FALSE(m.removeRule("google.com"));
+
+  std::ofstream{file} << "facebook.com\n";
+  EXPECT_FALSE(CompiledRuleFile::isCompiledRuleFile(file));
+  m.reloadFile(file);
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.google.com", 443));
+  EXPECT_TRUE(m.matches("www.facebook.com", 443));
+
+  // a file of another format version is refused
+  ASSERT_TRUE(CompiledRuleFile::write(file, {"google.com"}));
+  {
+    std::fstream f{file, std::ios::in | std::ios::out | std::ios::binary};
+    f.seekp(8);
+    uint32_t version = CompiledRuleFile::FORMAT_VERSION + 1;
+    f.write(reinterpret_cast<const char *>(&version), sizeof(version));
+  }
+  EXPECT_EQ(nullptr, CompiledRuleFile::load(file));
+  EXPECT_EQ(0U, m.parseFileAsRules(file));
+}
+
+TEST(AutoProxyManager, CorruptedCompiledRuleFile) {
+  TempFile compiledRulesFile{"compiled_rules"};
+  auto &file = compiledRulesFile.getPath();
+  auto patch = [&file](std::streamoff pos, const void *value, std::size_t n) {
+    std::fstream f{file, std::ios::in | std::ios::out | std::ios::binary};
+    f.seekp(pos);
+    f.write(static_cast<const char *>(value), n);
+  };
+  auto readUint64 = [&file](std::streamoff pos) {
+    std::ifstream f{file, std::ios::binary};
+    f.seekg(pos);
+    uint64_t value = 0;
+    f.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return value;
+  };
+
+  // offsets that only fit in the file once the sums wrap around, of the
+  // transitions and of the regex rules
+  const std::vector<std::string> rules{"google.com", "/goo+gle/"};
+  uint64_t offset = ~static_cast<uint64_t>(7);
+  ASSERT_TRUE(CompiledRuleFile::write(file, rules));
+  patch(64, &offset, sizeof(offset));
+  EXPECT_EQ(nullptr, CompiledRuleFile::load(file));
+  offset = ~static_cast<uint64_t>(1);
+  ASSERT_TRUE(CompiledRuleFile::write(file, rules));
+  patch(96, &offset, sizeof(offset));
+  EXPECT_EQ(nullptr, CompiledRuleFile::load(file));
+
+  // a transition to a state past the table
+  ASSERT_TRUE(CompiledRuleFile::write(file, rules));
+  auto ruleFile = CompiledRuleFile::load(file);
+  ASSERT_NE(nullptr, ruleFile);
+  auto stateCount = ruleFile->getTables().stateCount;
+  ruleFile.reset();
+  patch(static_cast<std::streamoff>(readUint64(64)) + 8,
+        &stateCount, sizeof(stateCount));
+  EXPECT_EQ(nullptr, CompiledRuleFile::load(file));
+}
+
+TEST(AutoProxyManager, RegexRules) {
+  AutoProxyManager m;
+  EXPECT_TRUE(m.addRule("/^www\\.google\\.[a-z]{2,3}$/"));
+  // backreferences are matched with std::regex
+  EXPECT_TRUE(m.addRule("/(ab)\\1\\.com/"));
+  EXPECT_FALSE(m.addRule("/a(b/"));
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("www.google.com", 80));
+  EXPECT_TRUE(m.matches("www.google.hk", 80));
+  EXPECT_FALSE(m.matches("www.google.com.hk", 80));
+  EXPECT_TRUE(m.matches("abab.com", 80));
+
+  EXPECT_TRUE(m.removeRule("/^www\\.google\\.[a-z]{2,3}$/"));
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.google.com", 80));
+  EXPECT_TRUE(m.removeRule("/(ab)\\1\\.com/"));
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("abab.com", 80));
+}
+
+TEST(RegexSet, ReportsTheFirstMatch) {
+  RegexSet set;
+  EXPECT_TRUE(set.add("[a-z]+\\.example\\.com"));
+  EXPECT_TRUE(set.add(".*\\.com"));
+  EXPECT_TRUE(set.add("^(?:www|mail)\\..*$|ftp\\..*"));
+  EXPECT_EQ(3U, set.size());
+
+  EXPECT_EQ(0, set.match("www.example.com"));
+  EXPECT_EQ(1, set.match("example.com"));
+  EXPECT_EQ(2, set.match("mail.example.org"));
+  EXPECT_EQ(2, set.match("ftp.x"));
+  EXPECT_EQ(-1, set.match("example.org"));
+  EXPECT_EQ(-1, set.match(""));
+}
+
+TEST(RegexSet, Unsupported) {
+  EXPECT_TRUE(RegexSet::isSupported("a{2,5}b*?[^\\d\\s]"));
+  EXPECT_FALSE(RegexSet::isSupported("(a)\\1"));
+  EXPECT_FALSE(RegexSet::isSupported("a(?=b)"));
+  EXPECT_FALSE(RegexSet::isSupported("\\bcom"));
+  EXPECT_FALSE(RegexSet::isSupported("a^b"));
+  EXPECT_FALSE(RegexSet::isSupported("a{1000}"));
+  EXPECT_FALSE(RegexSet::isSupported("a(b"));
+  EXPECT_FALSE(RegexSet::isSupported("*a"));
+}
+
+TEST(RegexSet, CacheLimit) {
+  // every state over the limit drops the cache, the answers stay right
+  RegexSet set(1);
+  EXPECT_TRUE(set.add("(a|b)*abb"));
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(0, set.match("babaabb"));
+    EXPECT_EQ(-1, set.match("babaab"));
+  }
+  EXPECT_LE(set.getCachedStateCount(), 1U);
+  EXPECT_GT(set.getCacheResetCount(), 0U);
+}
+
+TEST(AutoProxyManager, RouteCache) {
+  AutoProxyManager m;
+  m.addRule("google.com");
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("www.google.com", 443));
+  EXPECT_TRUE(m.matches("www.google.com", 443));
+  EXPECT_FALSE(m.matches("example.com", 443));
+  EXPECT_EQ(1U, m.getRouteCacheStats().hits);
+
+  // every change to the rules drops the cached decisions
+  m.addRule("@@||www.google.com");
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.google.com", 443));
+  m.addRule("/^example\\.com$/");
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("example.com", 443));
+  m.clearAll();
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("example.com", 443));
+
+  auto &stats = m.getRouteCacheStats();
+  EXPECT_EQ(1U, stats.hits);
+  EXPECT_GT(stats.avgMissNanos(), 0U);
+  EXPECT_GT(stats.hitRatio(), 0);
+
+  m.setRouteCacheCapacity(0);
+  m.matches("example.com", 443);
+  m.matches("example.com", 443);
+  EXPECT_EQ(1U, stats.hits);
+}
+
+TEST(RouteCache, EvictsLeastRecentlyUsed) {
+  RouteCache cache(2);
+  auto action = RouteAction::kNone;
+  EXPECT_FALSE(cache.lookup("a.com", 443, 1, action));
+  cache.store("a.com", 443, 1, RouteAction::kProxy, 10);
+  cache.store("b.com", 443, 1, RouteAction::kDirect, 10);
+  EXPECT_TRUE(cache.lookup("a.com", 443, 1, action));
+  EXPECT_EQ(RouteAction::kProxy, action);
+  EXPECT_FALSE(cache.lookup("a.com", 80, 1, action));
+  cache.store("c.com", 443, 1, RouteAction::kReject, 10);
+  EXPECT_FALSE(cache.lookup("b.com", 443, 1, action));
+  EXPECT_TRUE(cache.lookup("c.com", 443, 1, action));
+  EXPECT_EQ(RouteAction::kReject, action);
+
+  // a decision made with older rules is not stored
+  cache.store("d.com", 443, 0, RouteAction::kProxy, 10);
+  EXPECT_FALSE(cache.lookup("d.com", 443, 1, action));
+  EXPECT_FALSE(cache.lookup("a.com", 443, 2, action));
+  EXPECT_EQ(0U, cache.getSize());
+}
+
+TEST(AutoProxyManager, ReloadDoesNotExposePartialRules) {
+  TempFile rulesFile{"rules"};
+  auto &file = rulesFile.getPath();
+  {
+    std::ofstream out{file};
+    for (int i = 0; i < 20000; ++i) {
+      out << "||host" << i << ".example.com\n";
+    }
+  }
+
+  AutoProxyManager m;
+  m.setRouteCacheCapacity(0);
+  m.addRule("||host19999.example.com");
+  m.waitUntilCompiled();
+  m.reloadFile(file);
+  // the old snapshot answers until the new one is published as a whole
+  while (!m.matches("host0.example.com", 443)) {
+    EXPECT_TRUE(m.matches("host19999.example.com", 443));
+  }
+  EXPECT_TRUE(m.matches("host19999.example.com", 443));
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("host12345.example.com", 443));
+
+  // a clearAll() after a reload wins
+  m.reloadFile(file);
+  m.clearAll();
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("host0.example.com", 443));
+}
+
+TEST(IpPrefixTree, LongestPrefixMatch) {
+  std::mt19937 rng(20261021);
+  struct Prefix {
+    IpPrefixTree::Address addr;
+    uint8_t len;
+    IpPrefixTree::Action action;
+  };
+  auto contains = [](const Prefix &p, const IpPrefixTree::Address &a) {
+    for (int i = 0; i < p.len; ++i) {
+      auto word = i < 64 ? a.hi ^ p.addr.hi : a.lo ^ p.addr.lo;
+      if ((word >> (63 - i % 64)) & 1) {
+        return false;
+      }
+    }
+    return true;
+  };
+  // addresses drawn from a few blocks, so that prefixes nest, half of
+  // them IPv4-mapped
+  auto randomAddress = [&rng]() {
+    IpPrefixTree::Address a;
+    if (rng() % 2 == 0) {
+      a.hi = 0;
+      a.lo = (0xffffULL << 32) | ((rng() % 4) << 30) | ((rng() % 4) << 16) |
+        (rng() % 256);
+    } else {
+      a.hi = (static_cast<uint64_t>(rng() % 4) << 62) | (rng() % 8);
+      a.lo = (static_cast<uint64_t>(rng() % 16) << 60) | (rng() % 256);
+    }
+    return a;
+  };
+
+  IpPrefixTree tree;
+  std::vector<Prefix> prefixes;
+  for (int i = 0; i < 2000; ++i) {
+    Prefix p;
+    p.len = rng() % 129;
+    p.action = rng() % 3 == 0 ?
+      IpPrefixTree::Action::kException : IpPrefixTree::Action::kMatch;
+    // let the tree clear the bits after the prefix
+    p.addr = randomAddress();
+    tree.insert(p.addr, p.len, p.action);
+    prefixes.push_back(p);
+  }
+  tree.build();
+
+  for (int i = 0; i < 20000; ++i) {
+    auto addr = randomAddress();
+    int bestLen = -1;
+    auto expected = IpPrefixTree::Action::kNone;
+    for (auto &p : prefixes) {
+      if (p.len >= bestLen && contains(p, addr)) {
+        if (p.len > bestLen || p.action == IpPrefixTree::Action::kException) {
+          expected = p.action;
+        }
+        bestLen = p.len;
+      }
+    }
+    ASSERT_EQ(expected, tree.lookup(addr)) << i;
+  }
+}
+
+TEST(AutoProxyManager, AddressRules) {
+  AutoProxyManager m;
+  EXPECT_TRUE(m.addRule("10.0.0.0/8"));
+  EXPECT_TRUE(m.addRule("@@10.1.0.0/16"));
+  EXPECT_TRUE(m.addRule("10.1.2.0/24"));
+  EXPECT_TRUE(m.addRule("2001:db8::/32"));
+  EXPECT_TRUE(m.addRule("@@2001:db8:1::/48"));
+  // not a prefix, and only "@@||" and "@@|http" are domain exceptions
+  EXPECT_FALSE(m.addRule("@@10.0.0.0/33"));
+  EXPECT_FALSE(m.addRule("@@10.0.0.0/"));
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.hasAddressRules());
+
+  EXPECT_TRUE(m.matches("10.200.0.1", 443));
+  EXPECT_FALSE(m.matches("10.1.0.1", 443));
+  EXPECT_TRUE(m.matches("10.1.2.3", 80));
+  EXPECT_FALSE(m.matches("11.0.0.1", 443));
+  EXPECT_TRUE(m.matches("2001:db8:2::1", 443));
+  EXPECT_FALSE(m.matches("2001:db8:1::1", 443));
+  // IPv4 rules don't match IPv6 addresses other than the mapped ones
+  EXPECT_TRUE(m.matches("::ffff:10.0.0.1", 443));
+  EXPECT_FALSE(m.matches("::10.0.0.1", 443));
+
+  // names are matched by their resolved addresses unless excepted
+  m.addRule("@@||intranet.example.com");
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.example.com", 443));
+  EXPECT_TRUE(m.matchesResolvedAddress("www.example.com", 443, "10.0.0.1"));
+  EXPECT_FALSE(m.matchesResolvedAddress("www.example.com", 443, "10.1.0.1"));
+  EXPECT_FALSE(
+    m.matchesResolvedAddress("intranet.example.com", 443, "10.0.0.1"));
+
+  m.removeRule("10.0.0.0/8");
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("10.200.0.1", 443));
+}
+
+TEST(GeoIpDatabase, Lookup) {
+  TempFile geoipCsvFile{"geoip_csv"};
+  auto &csv = geoipCsvFile.getPath();
+  TempFile geoipFile{"geoip"};
+  auto &file = geoipFile.getPath();
+  std::ofstream{csv} <<
+    "\"1.0.1.0\",\"1.0.3.255\",\"cn\"\n"
+    "1.0.4.0,1.0.7.255,AU,Australia\n"
+    "1.0.8.0,1.0.15.255,CN\n"
+    // overlaps the one before
+    "1.0.15.0,1.0.16.255,JP\n"
+    "255.255.255.0,255.255.255.255,ZZ\n"
+    "2001:250::,2001:252:ffff:ffff:ffff:ffff:ffff:ffff,CN\n"
+    "not,an,entry\n";
+  ASSERT_TRUE(GeoIpDatabase::compileCsv(csv, file));
+  auto db = GeoIpDatabase::load(file);
+  ASSERT_NE(nullptr, db);
+
+  auto lookup = [&db](const std::string &ip) {
+    IpPrefixTree::Address addr;
+    EXPECT_TRUE(IpPrefixTree::parseAddress(ip, addr)) << ip;
+    auto code = db->lookup(addr);
+    return code == 0 ? std::string{} : std::string{
+      static_cast<char>(code >> 8), static_cast<char>(code & 0xff)};
+  };
+  EXPECT_EQ("", lookup("0.0.0.0"));
+  EXPECT_EQ("", lookup("1.0.0.255"));
+  EXPECT_EQ("CN", lookup("1.0.1.0"));
+  EXPECT_EQ("CN", lookup("1.0.3.255"));
+  EXPECT_EQ("AU", lookup("1.0.4.0"));
+  EXPECT_EQ("CN", lookup("1.0.15.255"));
+  EXPECT_EQ("", lookup("1.0.16.0"));
+  EXPECT_EQ("ZZ", lookup("255.255.255.255"));
+  EXPECT_EQ("", lookup("::"));
+  EXPECT_EQ("CN", lookup("2001:251::1"));
+  EXPECT_EQ("", lookup("2001:253::"));
+  // IPv4 ranges are only for IPv4 addresses
+  EXPECT_EQ("", lookup("::1.0.1.0"));
+
+  AutoProxyManager m;
+  EXPECT_TRUE(m.addRule("||"));
+  EXPECT_TRUE(m.addRule("@@geoip:cn"));
+  EXPECT_TRUE(m.addRule("1.0.9.0/24"));
+  EXPECT_FALSE(m.addRule("geoip:CHN"));
+  m.waitUntilCompiled();
+  // the GeoIP rules need the database
+  EXPECT_TRUE(m.matches("1.0.1.1", 443));
+  EXPECT_TRUE(m.setGeoIpDatabase(file));
+  EXPECT_FALSE(m.setGeoIpDatabase(csv));
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.hasAddressRules());
+  EXPECT_FALSE(m.matches("1.0.1.1", 443));
+  EXPECT_TRUE(m.matches("1.0.4.1", 443));
+  // the longest prefix rule comes before the country
+  EXPECT_TRUE(m.matches("1.0.9.1", 443));
+  EXPECT_FALSE(m.matchesResolvedAddress("www.example.cn", 443, "1.0.1.1"));
+  EXPECT_TRUE(m.matchesResolvedAddress("www.example.com", 443, "1.0.4.1"));
+  EXPECT_FALSE(m.matchesResolvedAddress("www.example.cn", 443, "2001:250::1"));
+
+  // an offset that only fits in the file once the sum wraps around
+  {
+    std::fstream f{file, std::ios::in | std::ios::out | std::ios::binary};
+    f.seekp(24);
+    uint64_t offset = ~static_cast<uint64_t>(3);
+    f.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+  }
+  EXPECT_EQ(nullptr, GeoIpDatabase::load(file));
+}
+
+TEST(RuleBloomFilter, NoFalseNegatives) {
+  std::mt19937 rng(20261021);
+  for (int round = 0; round < 50; ++round) {
+    std::vector<std::string> rules;
+    auto ruleCount = 1 + rng() % 30;
+    for (std::size_t i = 0; i < ruleCount; ++i) {
+      rules.push_back(randomRule(rng));
+    }
+    auto keys = RuleSnapshot::collectKeys(rules);
+    RuleAutomaton automaton(keys);
+    RuleBloomFilter filter(keys);
+    for (int i = 0; i < 500; ++i) {
+      auto host = randomName(rng, 5);
+      if (filter.mayMatch(host)) {
+        continue;
+      }
+      for (uint16_t port : {80, 443}) {
+        ASSERT_FALSE(automaton.scan(host, port).matched)
+          << "host: " << host << ":" << port << ", round: " << round;
+      }
+    }
+  }
+
+  // long keys are cut at MAX_ITEM_LEN
+  RuleBloomFilter filter(RuleSnapshot::collectKeys(
+      {"verylongdomainname.com", "|https://anchored.example.org", "@@cn"}));
+  EXPECT_TRUE(filter.mayMatch("verylongdomainname.com"));
+  EXPECT_TRUE(filter.mayMatch("www.verylongdomainname.com.hk"));
+  EXPECT_TRUE(filter.mayMatch("anchored.example.org"));
+  EXPECT_FALSE(filter.mayMatch("www.anchored.example.org"));
+  // exceptions are not in the filter
+  EXPECT_FALSE(filter.mayMatch("www.cn"));
+  EXPECT_FALSE(filter.mayMatch(""));
+  EXPECT_FALSE(RuleBloomFilter{{}}.mayMatch("a.com"));
+}
+
+TEST(AutoProxyManager, BloomFilter) {
+  std::mt19937 rng(20261022);
+  auto randomLabel = [&rng]() {
+    std::string label;
+    auto len = 3 + rng() % 10;
+    for (std::size_t i = 0; i < len; ++i) {
+      label.push_back(static_cast<char>('a' + rng() % 26));
+    }
+    return label;
+  };
+
+  AutoProxyManager m;
+  std::vector<std::string> domains;
+  for (int i = 0; i < 20000; ++i) {
+    domains.push_back(randomLabel() + ".com");
+    m.addRule(domains.back());
+  }
+  // matched by an address rule, the exception is still found
+  m.addRule("10.0.0.0/8");
+  m.addRule("@@||10.1.2.3");
+  m.setRouteCacheCapacity(0);
+  m.waitUntilCompiled();
+
+  for (auto &domain : domains) {
+    ASSERT_TRUE(m.matches("www." + domain, 443)) << domain;
+  }
+  EXPECT_TRUE(m.matches("10.1.2.4", 443));
+  EXPECT_FALSE(m.matches("10.1.2.3", 443));
+
+  auto &stats = m.getFilterStats();
+  for (int i = 0; i < 20000; ++i) {
+    m.matches(randomLabel() + "." + randomLabel() + ".net", 443);
+  }
+  EXPECT_GT(stats.rejects, 19000U);
+  EXPECT_LT(stats.falsePositiveRate(), 0.05);
+}
+
+TEST(RuleSnapshot, ReordersRegexesByMatchCount) {
+  // backreferences, so RegexSet can't do them
+  RuleSnapshot snapshot(1, {
+    "/(a)\\1\\.com/", "/(b)\\1\\.com/", "/(c)\\1\\.com/"});
+  EXPECT_TRUE(snapshot.getRegexPatterns().empty());
+  EXPECT_TRUE(snapshot.matchesOtherRegexes("aa.com"));
+  EXPECT_FALSE(snapshot.needsReordering());
+  EXPECT_FALSE(snapshot.reorderOtherRegexes());
+
+  for (int i = 0; i < 40; ++i) {
+    EXPECT_TRUE(snapshot.matchesOtherRegexes("cc.com"));
+  }
+  EXPECT_TRUE(snapshot.needsReordering());
+  EXPECT_TRUE(snapshot.reorderOtherRegexes());
+  EXPECT_FALSE(snapshot.needsReordering());
+  EXPECT_FALSE(snapshot.reorderOtherRegexes());
+  EXPECT_TRUE(snapshot.matchesOtherRegexes("aa.com"));
+  EXPECT_TRUE(snapshot.matchesOtherRegexes("bb.com"));
+  EXPECT_TRUE(snapshot.matchesOtherRegexes("cc.com"));
+  EXPECT_FALSE(snapshot.matchesOtherRegexes("ab.com"));
+  EXPECT_FALSE(snapshot.needsReordering());
+
+  // reordered on the background thread
+  AutoProxyManager m;
+  m.addRule("/(a)\\1\\.com/");
+  m.addRule("/(b)\\1\\.com/");
+  m.setRouteCacheCapacity(0);
+  m.waitUntilCompiled();
+  for (int i = 0; i < 200; ++i) {
+    ASSERT_TRUE(m.matches(i % 4 == 0 ? "aa.com" : "bb.com", 443));
+    ASSERT_FALSE(m.matches("cc.com", 443));
+  }
+}
+
+TEST(LayeredRuleAutomaton, MatchesAFreshBuild) {
+  std::mt19937 rng(20261023);
+  for (int round = 0; round < 30; ++round) {
+    std::vector<std::string> rules;
+    auto ruleCount = 1 + rng() % 40;
+    for (std::size_t i = 0; i < ruleCount; ++i) {
+      rules.push_back(randomRule(rng));
+    }
+    std::unique_ptr<LayeredRuleAutomaton> layered(
+      new LayeredRuleAutomaton(RuleSnapshot::collectKeys(rules)));
+
+    for (int change = 0; change < 10; ++change) {
+      // duplicates of the rules included
+      std::vector<std::string> added;
+      std::vector<std::string> removed;
+      for (int i = rng() % 5; i > 0; --i) {
+        added.push_back(rng() % 3 == 0 && !rules.empty() ?
+          rules[rng() % rules.size()] : randomRule(rng));
+      }
+      for (int i = rng() % 5; i > 0 && !rules.empty(); --i) {
+        auto index = rng() % rules.size();
+        removed.push_back(rules[index]);
+        rules.erase(rules.begin() + index);
+      }
+      rules.insert(rules.end(), added.begin(), added.end());
+      layered.reset(new LayeredRuleAutomaton(
+          *layered, RuleSnapshot::collectKeys(added),
+          RuleSnapshot::collectKeys(removed)));
+
+      RuleAutomaton fresh(RuleSnapshot::collectKeys(rules));
+      for (int i = 0; i < 100; ++i) {
+        auto host = randomName(rng, 5);
+        for (uint16_t port : {80, 443}) {
+          auto expected = fresh.scan(host, port);
+          auto result = layered->scan(host, port);
+          ASSERT_EQ(expected.matched, result.matched)
+            << "host: " << host << ":" << port << ", round: " << round;
+          ASSERT_EQ(expected.excepted, result.excepted)
+            << "host: " << host << ":" << port << ", round: " << round;
+          if (expected.matched) {
+            ASSERT_TRUE(layered->mayMatch(host)) << host;
+          }
+        }
+      }
+    }
+  }
+
+  LayeredRuleAutomaton base(RuleSnapshot::collectKeys({"google.com"}));
+  EXPECT_TRUE(base.canLayer(1024));
+  EXPECT_FALSE(base.canLayer(1025));
+  LayeredRuleAutomaton layered(
+    base, RuleSnapshot::collectKeys({"twitter.com"}),
+    RuleSnapshot::collectKeys({"google.com"}));
+  EXPECT_EQ(2U, layered.getLayeredKeyCount());
+  EXPECT_FALSE(layered.canLayer(1023));
+  EXPECT_FALSE(layered.scan("google.com", 443).matched);
+  EXPECT_TRUE(layered.scan("twitter.com", 443).matched);
+}
+
+TEST(AutoProxyManager, IncrementalReload) {
+  TempFile incrementalRulesFile{"incremental_rules"};
+  auto &file = incrementalRulesFile.getPath();
+  std::vector<std::string> lines;
+  for (int i = 0; i < 5000; ++i) {
+    lines.push_back("domain" + std::to_string(i) + ".com");
+  }
+  lines.push_back("/(a)\\1\\.com/");
+  lines.push_back("/(b)\\1\\.com/");
+  auto writeFile = [&file, &lines]() {
+    std::ofstream out{file};
+    for (auto &line : lines) {
+      out << line << "\n";
+    }
+  };
+  writeFile();
+
+  AutoProxyManager m;
+  m.setRouteCacheCapacity(0);
+  m.reloadFile(file);
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("www.domain1.com", 443));
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_TRUE(m.matches("bb.com", 443));
+  }
+
+  // a one line edit, the match counts of the regex rules are kept
+  lines[1] = "||example.org";
+  writeFile();
+  m.reloadFile(file);
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.domain1.com", 443));
+  EXPECT_TRUE(m.matches("www.domain2.com", 443));
+  EXPECT_TRUE(m.matches("www.example.org", 443));
+  EXPECT_TRUE(m.matches("bb.com", 443));
+  EXPECT_TRUE(m.matches("aa.com", 443));
+
+  // and removed again with the rule, added the other way
+  m.removeRule("||example.org");
+  m.addRule("domain1.com");
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("www.example.org", 443));
+  EXPECT_TRUE(m.matches("www.domain1.com", 443));
+
+  RuleSnapshot previous(1, {"/(a)\\1\\.com/", "/(b)\\1\\.com/", "x.com"});
+  for (int i = 0; i < 40; ++i) {
+    EXPECT_TRUE(previous.matchesOtherRegexes("bb.com"));
+  }
+  EXPECT_TRUE(previous.needsReordering());
+  RuleSnapshot derived(
+    2, previous, {"/(a)\\1\\.com/", "/(b)\\1\\.com/", "y.com"},
+    {"y.com"}, {"x.com"});
+  // already in the order of the counts taken over
+  EXPECT_FALSE(derived.reorderOtherRegexes());
+  EXPECT_TRUE(derived.scan("y.com", 443).matched);
+  EXPECT_FALSE(derived.scan("x.com", 443).matched);
+}
+
+TEST(RuleFileLoader, MatchesReadingLineByLine) {
+  TempFile loaderRules1File{"loader_rules1"};
+  auto &file1 = loaderRules1File.getPath();
+  TempFile loaderRules2File{"loader_rules2"};
+  auto &file2 = loaderRules2File.getPath();
+  std::mt19937 rng(20261024);
+  {
+    // large enough for a few chunks, the last line with no newline
+    std::ofstream out1{file1};
+    for (int i = 0; i < 60000; ++i) {
+      out1 << randomRule(rng) << (i % 7 == 0 ? "\r\n" : "\n");
+    }
+    out1 << "\n\n[AutoProxy 0.2.9]\n!comment\nlast.com";
+    std::ofstream out2{file2};
+    out2 << "first.com\n/(a)\\1\\.com/\n/[/\n";
+  }
+
+  std::vector<std::string> expected;
+  for (auto &file : {file1, file2}) {
+    std::ifstream in{file, std::ios::binary};
+    std::string line;
+    while (std::getline(in, line)) {
+      if (RuleSnapshot::isValid(line)) {
+        expected.push_back(line);
+      }
+    }
+  }
+
+  for (std::size_t threadCount : {1, 4}) {
+    std::vector<std::string> rules{"existing.com"};
+    auto count = RuleFileLoader::load(
+      {file1, "/tmp/proxypp_test_no_such_file", file2}, rules, threadCount);
+    ASSERT_EQ(expected.size(), count);
+    ASSERT_EQ(expected.size() + 1, rules.size());
+    EXPECT_EQ("existing.com", rules.front());
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), rules.begin() + 1));
+  }
+
+  // the std::regex compiled to validate a rule is handed out, the one
+  // RegexSet can do isn't compiled
+  std::vector<std::string> rules;
+  RuleSnapshot::RegexMap regexes;
+  RuleFileLoader::load({file2}, rules, 1, &regexes);
+  ASSERT_EQ(1U, regexes.size());
+  RuleSnapshot snapshot(1, rules, nullptr, nullptr, regexes);
+  EXPECT_TRUE(snapshot.matchesOtherRegexes("aa.com"));
+
+  // rules added from a file after the first snapshot are compiled too
+  AutoProxyManager m;
+  m.addRule("twitter.com");
+  m.waitUntilCompiled();
+  EXPECT_EQ(2U, m.parseFilesAsRules({file2}));
+  m.waitUntilCompiled();
+  EXPECT_TRUE(m.matches("twitter.com", 443));
+  EXPECT_TRUE(m.matches("first.com", 443));
+  EXPECT_TRUE(m.matches("aa.com", 443));
+}
+
+TEST(WildcardRule, Matches) {
+  auto domain = RuleAutomaton::KeyType::kDomain;
+  WildcardRule r1{"*.blogspot.com", domain, false};
+  EXPECT_TRUE(r1.matches("a.blogspot.com", 80));
+  EXPECT_TRUE(r1.matches("x.a.blogspot.com.hk", 80));
+  EXPECT_FALSE(r1.matches("blogspot.com", 80));
+
+  WildcardRule r2{"google.*^", domain, false};
+  EXPECT_TRUE(r2.matches("google.com", 80));
+  EXPECT_TRUE(r2.matches("www.google.co.jp", 80));
+  EXPECT_FALSE(r2.matches("googleapis.com", 80));
+  EXPECT_FALSE(r2.matches("agoogle.com", 80));
+
+  // '^' is not a dot, but the end of the host or any other separator
+  WildcardRule r3{"example.org^", domain, false};
+  EXPECT_TRUE(r3.matches("www.example.org", 80));
+  EXPECT_TRUE(r3.matches("example.org:8080", 80));
+  EXPECT_FALSE(r3.matches("example.org.cn", 80));
+
+  WildcardRule r4{"plain.*.net^", RuleAutomaton::KeyType::kHttp, false};
+  EXPECT_TRUE(r4.matches("plain.example.net", 80));
+  EXPECT_FALSE(r4.matches("plain.example.net", 443));
+  EXPECT_FALSE(r4.matches("www.plain.example.net", 80));
+
+  std::string key;
+  EXPECT_TRUE(WildcardRule::getIndexKey("ads.*.tracker.com", key));
+  EXPECT_EQ("tracker.com", key);
+  EXPECT_TRUE(WildcardRule::getIndexKey("*.blogspot.com", key));
+  EXPECT_EQ("blogspot.com", key);
+  EXPECT_FALSE(WildcardRule::getIndexKey("*abc^", key));
+}
+
+TEST(AutoProxyManager, AdblockPlusSyntax) {
+  std::vector<std::string> rules{
+    "||*.blogspot.com",
+    "@@||*.cn.blogspot.com^",
+    "google.*/",
+    "||example.org^",
+    "|http://plain.example.net/",
+    "||ads.*.tracker.com$third-party",
+    "*abc*",
+    "||path.example.com/some/path",
+  };
+  std::vector<std::pair<std::string, uint16_t>> proxied{
+    {"a.blogspot.com", 443}, {"a.cn.blogspot.com.hk", 443},
+    {"google.com", 443}, {"www.google.co.jp", 443},
+    {"example.org", 443}, {"www.example.org", 443},
+    {"plain.example.net", 80}, {"ads.x.tracker.com", 443},
+    {"xabcy.org", 443}
+  };
+  std::vector<std::pair<std::string, uint16_t>> direct{
+    {"blogspot.com", 443}, {"x.cn.blogspot.com", 443},
+    {"googleapis.com", 443}, {"example.org.cn", 443},
+    {"plain.example.net", 443}, {"plain.example.net.cn", 80},
+    {"ads.tracker.com", 443}, {"path.example.com", 443}
+  };
+
+  AutoProxyManager m;
+  for (auto &rule : rules) {
+    EXPECT_TRUE(m.addRule(rule)) << rule;
+  }
+  m.waitUntilCompiled();
+  for (auto &host : proxied) {
+    EXPECT_TRUE(m.matches(host.first, host.second)) << host.first;
+  }
+  for (auto &host : direct) {
+    EXPECT_FALSE(m.matches(host.first, host.second)) << host.first;
+  }
+
+  // the same from a compiled file, and once a rule is removed again
+  TempFile abpRulesFile{"abp_rules"};
+  auto &file = abpRulesFile.getPath();
+  ASSERT_TRUE(CompiledRuleFile::write(file, rules));
+  AutoProxyManager compiled;
+  EXPECT_EQ(rules.size(), compiled.parseFileAsRules(file));
+  compiled.waitUntilCompiled();
+  for (auto &host : proxied) {
+    EXPECT_TRUE(compiled.matches(host.first, host.second)) << host.first;
+  }
+  for (auto &host : direct) {
+    EXPECT_FALSE(compiled.matches(host.first, host.second)) << host.first;
+  }
+  EXPECT_TRUE(m.removeRule("google.*/"));
+  m.waitUntilCompiled();
+  EXPECT_FALSE(m.matches("google.com", 443));
+  EXPECT_TRUE(m.matches("a.blogspot.com", 443));
+
+  // a gfwlist as it is published, base64 with the header and comments
+  std::ofstream{file} << base64Encode(
+    "[AutoProxy 0.2.9]\n! Checksum: xxx\n!---comment---\n"
+    "||*.blogspot.com\n|http://plain.example.net/\n@@||cn.blogspot.com\n");
+  AutoProxyManager list;
+  EXPECT_EQ(3U, list.parseFileAsRules(file));
+  list.waitUntilCompiled();
+  EXPECT_TRUE(list.matches("a.blogspot.com", 443));
+  EXPECT_FALSE(list.matches("a.cn.blogspot.com", 443));
+  EXPECT_TRUE(list.matches("plain.example.net", 80));
+}
+
+TEST(AutoProxyManager, PolicyRouting) {
+  std::vector<std::string> rules{
+    "example.com",
+    "||cdn.example.com$action=direct",
+    "||ads.example.com$action=reject",
+    "@@||ok.ads.example.com",
+    "||video.com$action=us",
+    "||both.video.com$action=reject",
+    "||*.wild.org$action=us",
+    "/^.*\\.stream\\.net$/$action=us",
+    "10.0.0.0/8$action=reject",
+  };
+  auto us = RouteAction::getId("us");
+  EXPECT_LT(RouteAction::kProxy, us);
+  EXPECT_EQ("us", RouteAction::getName(us));
+  std::vector<std::pair<std::string, RouteAction::Id>> expected{
+    {"www.example.com", RouteAction::kProxy},
+    // the lower action wins
+    {"cdn.example.com", RouteAction::kDirect},
+    {"x.ads.example.com", RouteAction::kReject},
+    {"ok.ads.example.com", RouteAction::kDirect},
+    {"video.com", us},
+    {"both.video.com", RouteAction::kReject},
+    {"a.wild.org", us},
+    {"x.stream.net", us},
+    {"10.1.2.3", RouteAction::kReject},
+    {"other.org", RouteAction::kDirect},
+  };
+
+  AutoProxyManager m;
+  for (auto &rule : rules) {
+    EXPECT_TRUE(m.addRule(rule)) << rule;
+  }
+  m.waitUntilCompiled();
+  for (auto &host : expected) {
+    EXPECT_EQ(host.second, m.getAction(host.first, 443)) << host.first;
+    EXPECT_EQ(RouteAction::isUpstream(host.second),
+              m.matches(host.first, 443)) << host.first;
+  }
+
+  // a rule layered over the automaton of the previous snapshot
+  EXPECT_TRUE(m.addRule("||video.com$action=direct"));
+  m.waitUntilCompiled();
+  EXPECT_EQ(RouteAction::kDirect, m.getAction("video.com", 443));
+  EXPECT_TRUE(m.removeRule("||video.com$action=direct"));
+  m.waitUntilCompiled();
+  EXPECT_EQ(us, m.getAction("video.com", 443));
+
+  TempFile policyRulesFile{"policy_rules"};
+  auto &file = policyRulesFile.getPath();
+  ASSERT_TRUE(CompiledRuleFile::write(file, rules));
+  AutoProxyManager compiled;
+  EXPECT_EQ(rules.size(), compiled.parseFileAsRules(file));
+  compiled.waitUntilCompiled();
+  for (auto &host : expected) {
+    EXPECT_EQ(host.second, compiled.getAction(host.first, 443)) << host.first;
+  }
+
+  // the sections of a file end with it
+  TempFile policyRules2File{"policy_rules_2"};
+  auto &file2 = policyRules2File.getPath();
+  std::ofstream{file} <<
+    "||plain.com\n[action: us]\n||sect.com\n||named.com$action=reject\n"
+    "[action:]\n||plain2.com\n[action: reject]\n";
+  std::ofstream{file2} << "||plain3.com\n";
+  AutoProxyManager sections;
+  EXPECT_EQ(5U, sections.parseFilesAsRules({file, file2}));
+  sections.waitUntilCompiled();
+  EXPECT_EQ(RouteAction::kProxy, sections.getAction("plain.com", 443));
+  EXPECT_EQ(us, sections.getAction("sect.com", 443));
+  EXPECT_EQ(RouteAction::kReject, sections.getAction("named.com", 443));
+  EXPECT_EQ(RouteAction::kProxy, sections.getAction("plain2.com", 443));
+  EXPECT_EQ(RouteAction::kProxy, sections.getAction("plain3.com", 443));
+}
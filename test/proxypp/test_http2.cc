@@ -0,0 +1,196 @@
+#include <gtest/gtest.h>
+#include "proxypp/http/hpack.h"
+#include "proxypp/http/http2_frame.h"
+
+using namespace proxypp;
+
+namespace {
+  std::string fromHex(const std::string &hex) {
+    std::string out;
+    for (std::size_t i = 0; i + 1 < hex.size(); ) {
+      if (hex[i] == ' ') {
+        ++i;
+        continue;
+      }
+      out.push_back(
+        static_cast<char>(std::stoi(hex.substr(i, 2), nullptr, 16)));
+      i += 2;
+    }
+    return out;
+  }
+
+  HeaderList decode(HpackDecoder &decoder, const std::string &hex) {
+    auto block = fromHex(hex);
+    HeaderList headers;
+    EXPECT_TRUE(decoder.decode(block.c_str(), block.size(), headers));
+    return headers;
+  }
+}
+
+// RFC 7541 C.3, requests without Huffman coding on one connection
+TEST(Hpack, DecodeRequests) {
+  HpackDecoder decoder;
+  auto headers = decode(
+    decoder, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d");
+  EXPECT_EQ((HeaderList{
+    {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+    {":authority", "www.example.com"}}), headers);
+
+  headers = decode(decoder, "8286 84be 5808 6e6f 2d63 6163 6865");
+  EXPECT_EQ((HeaderList{
+    {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+    {":authority", "www.example.com"}, {"cache-control", "no-cache"}}),
+    headers);
+
+  headers = decode(
+    decoder, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f "
+    "6d2d 7661 6c75 65");
+  EXPECT_EQ((HeaderList{
+    {":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+    {":authority", "www.example.com"}, {"custom-key", "custom-value"}}),
+    headers);
+}
+
+// RFC 7541 C.4, the same requests with Huffman coding
+TEST(Hpack, DecodeHuffman) {
+  HpackDecoder decoder;
+  auto headers = decode(
+    decoder, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff");
+  EXPECT_EQ("www.example.com", headers[3].second);
+
+  headers = decode(decoder, "8286 84be 5886 a8eb 1064 9cbf");
+  EXPECT_EQ("no-cache", headers[4].second);
+
+  headers = decode(
+    decoder, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf");
+  EXPECT_EQ("custom-key", headers[4].first);
+  EXPECT_EQ("custom-value", headers[4].second);
+}
+
+TEST(Hpack, DecodeErrors) {
+  HpackDecoder decoder;
+  HeaderList headers;
+  // index 0
+  auto block = fromHex("80");
+  EXPECT_FALSE(decoder.decode(block.c_str(), block.size(), headers));
+  // dynamic table index out of range
+  block = fromHex("be");
+  EXPECT_FALSE(HpackDecoder{}.decode(block.c_str(), block.size(), headers));
+  // string longer than the block
+  block = fromHex("400a 6375");
+  EXPECT_FALSE(HpackDecoder{}.decode(block.c_str(), block.size(), headers));
+  // table size update larger than the limit
+  block = fromHex("3fe2 1f");
+  EXPECT_FALSE(
+    HpackDecoder{4096}.decode(block.c_str(), block.size(), headers));
+
+  std::string out;
+  // padding longer than 7 bits, and padding that is not all 1s
+  EXPECT_FALSE(HpackDecoder::decodeHuffman(
+      reinterpret_cast<const uint8_t *>("\xff\xff"), 2, out));
+  EXPECT_FALSE(HpackDecoder::decodeHuffman(
+      reinterpret_cast<const uint8_t *>("\x1e"), 1, out));
+  // 'a' is 00011, followed by 3 bits of padding
+  EXPECT_TRUE(HpackDecoder::decodeHuffman(
+      reinterpret_cast<const uint8_t *>("\x1f"), 1, out));
+  EXPECT_EQ("a", out);
+}
+
+TEST(Hpack, EncodeRoundTrip) {
+  HeaderList headers{
+    {":status", "200"}, {":status", "302"}, {"content-type", "text/html"},
+    {"set-cookie", "a=1"}, {"set-cookie", "b=2"},
+    {"x-long", std::string(300, 'x')}};
+  std::string block;
+  HpackEncoder{}.encode(headers, block);
+  // fully indexed
+  EXPECT_EQ('\x88', block[0]);
+
+  HpackDecoder decoder;
+  HeaderList decoded;
+  ASSERT_TRUE(decoder.decode(block.c_str(), block.size(), decoded));
+  EXPECT_EQ(headers, decoded);
+
+  std::string integer;
+  HpackEncoder::encodeInteger(1337, 5, 0, integer);
+  EXPECT_EQ(fromHex("1f9a 0a"), integer);
+  auto p = reinterpret_cast<const uint8_t *>(integer.c_str());
+  uint64_t value;
+  ASSERT_TRUE(HpackDecoder::decodeInteger(p, p + integer.size(), 5, value));
+  EXPECT_EQ(1337U, value);
+}
+
+TEST(Http2Frame, ParseIncrementally) {
+  std::string data;
+  Http2FrameBuilder::appendSettings(data, {
+    { Http2::Setting::INITIAL_WINDOW_SIZE, 1024 }});
+  Http2FrameBuilder::appendData(data, 3, "hello", 5, true);
+
+  Http2FrameParser parser;
+  Http2Frame frame;
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    parser.feed(&data[i], 1);
+    auto result = parser.next(frame);
+    if (i == 14) {
+      ASSERT_EQ(Http2FrameParser::Result::FRAME, result);
+      EXPECT_EQ(Http2::FrameType::SETTINGS, frame.type);
+      EXPECT_EQ(1024U, Http2FrameBuilder::readUint32(&frame.payload[2]));
+    } else if (i == data.size() - 1) {
+      ASSERT_EQ(Http2FrameParser::Result::FRAME, result);
+      EXPECT_EQ(Http2::FrameType::DATA, frame.type);
+      EXPECT_EQ(3U, frame.streamId);
+      EXPECT_TRUE(frame.hasFlag(Http2::FLAG_END_STREAM));
+      EXPECT_EQ("hello", frame.payload);
+    } else {
+      EXPECT_EQ(Http2FrameParser::Result::NEED_MORE_DATA, result);
+    }
+  }
+  EXPECT_EQ(0U, parser.getBufferedBytes());
+
+  std::string tooLarge;
+  Http2FrameBuilder::appendFrameHeader(
+    tooLarge, 16385, Http2::FrameType::DATA, 0, 1);
+  parser.feed(tooLarge.c_str(), tooLarge.size());
+  EXPECT_EQ(Http2FrameParser::Result::FRAME_SIZE_ERROR, parser.next(frame));
+}
+
+TEST(Http2Frame, RemovePadding) {
+  Http2Frame frame;
+  frame.type = Http2::FrameType::DATA;
+  frame.flags = Http2::FLAG_PADDED;
+  frame.payload = std::string{"\x02" "abc" "\0\0", 6};
+  ASSERT_TRUE(Http2FrameParser::removePadding(frame));
+  EXPECT_EQ("abc", frame.payload);
+
+  frame.payload = std::string{"\x05" "abc", 4};
+  EXPECT_FALSE(Http2FrameParser::removePadding(frame));
+
+  frame.type = Http2::FrameType::HEADERS;
+  frame.flags = Http2::FLAG_PRIORITY;
+  frame.payload = std::string{"\0\0\0\0\x10" "\x82", 6};
+  ASSERT_TRUE(Http2FrameParser::removePadding(frame));
+  EXPECT_EQ("\x82", frame.payload);
+}
+
+TEST(Http2Frame, HeadersWithContinuation) {
+  std::string block(40000, 'h');
+  std::string data;
+  Http2FrameBuilder::appendHeaders(data, 5, block, true, 16384);
+
+  Http2FrameParser parser;
+  parser.feed(data.c_str(), data.size());
+  Http2Frame frame;
+  std::string reassembled;
+  std::vector<Http2::FrameType> types;
+  while (parser.next(frame) == Http2FrameParser::Result::FRAME) {
+    types.push_back(frame.type);
+    reassembled.append(frame.payload);
+    EXPECT_EQ(5U, frame.streamId);
+    EXPECT_EQ(types.size() == 1, frame.hasFlag(Http2::FLAG_END_STREAM));
+    EXPECT_EQ(types.size() == 3, frame.hasFlag(Http2::FLAG_END_HEADERS));
+  }
+  EXPECT_EQ((std::vector<Http2::FrameType>{
+    Http2::FrameType::HEADERS, Http2::FrameType::CONTINUATION,
+    Http2::FrameType::CONTINUATION}), types);
+  EXPECT_EQ(block, reassembled);
+}
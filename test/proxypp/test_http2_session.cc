@@ -0,0 +1,297 @@
+#include <gtest/gtest.h>
+#include "proxypp/http/http_proxy_session.h"
+#include "proxypp/http/http2_frame.h"
+#include "proxypp/http/hpack.h"
+#include "proxypp/proxy_server.hpp"
+#include "local_servers.h"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+
+using namespace proxypp;
+using namespace proxypp_test;
+
+namespace {
+  // an h2c client with prior knowledge on the loop, every frame it reads
+  // is handed to the frame callback
+  class H2Client {
+    public:
+      using FrameCallback = std::function<void(Http2Frame &frame)>;
+
+      H2Client(
+        const std::shared_ptr<uvcpp::Loop> &loop,
+        const std::shared_ptr<nul::BufferPool> &bufferPool) :
+        loop_(loop), bufferPool_(bufferPool) {
+      }
+
+      // the preface goes out with the first frames
+      void connect(
+        uint16_t port, const std::string &frames, FrameCallback &&onFrame,
+        std::function<void()> &&onClose) {
+        onFrame_ = std::move(onFrame);
+        conn_ = uvcpp::Tcp::create(loop_);
+        conn_->on<uvcpp::EvBufferRecycled>([this](const auto &e, auto &conn) {
+          bufferPool_->returnBuffer(std::forward<std::unique_ptr<nul::Buffer>>(
+              const_cast<uvcpp::EvBufferRecycled &>(e).buffer));
+        });
+        conn_->once<uvcpp::EvClose>([onClose](const auto &e, auto &conn) {
+          onClose();
+        });
+        conn_->once<uvcpp::EvConnect>(
+          [this, frames](const auto &e, auto &conn) {
+            conn.template on<uvcpp::EvRead>([this](const auto &e, auto &conn) {
+              this->onData(e.buf, e.nread);
+            });
+            conn.readStart();
+            this->send(Http2::CONNECTION_PREFACE + frames);
+          });
+        if (!conn_->connect("127.0.0.1", port)) {
+          conn_->close();
+        }
+      }
+
+      void send(const std::string &frames) {
+        conn_->writeAsync(
+          bufferPool_->assembleDataBuffer(frames.data(), frames.size()));
+      }
+
+      std::string encode(const HeaderList &headers) const {
+        std::string headerBlock;
+        encoder_.encode(headers, headerBlock);
+        return headerBlock;
+      }
+
+      HeaderList decode(const std::string &headerBlock) {
+        HeaderList headers;
+        decoder_.decode(headerBlock.c_str(), headerBlock.size(), headers);
+        return headers;
+      }
+
+    private:
+      void onData(const char *buf, std::size_t len) {
+        parser_.feed(buf, len);
+        Http2Frame frame;
+        while (conn_->isValid() &&
+               parser_.next(frame) == Http2FrameParser::Result::FRAME) {
+          onFrame_(frame);
+        }
+      }
+
+    private:
+      std::shared_ptr<uvcpp::Loop> loop_;
+      std::shared_ptr<nul::BufferPool> bufferPool_;
+      std::shared_ptr<uvcpp::Tcp> conn_;
+      Http2FrameParser parser_;
+      HpackEncoder encoder_;
+      HpackDecoder decoder_;
+      FrameCallback onFrame_;
+  };
+
+  std::string findHeader(const HeaderList &headers, const std::string &name) {
+    for (auto &h : headers) {
+      if (h.first == name) {
+        return h.second;
+      }
+    }
+    return {};
+  }
+}
+
+TEST(Http2Session, PriorKnowledge) {
+  // the response of the origin is larger than the stream window the client
+  // gives, so it only gets through as the client grants more
+  const std::size_t bodySize = 100000;
+  const uint32_t streamWindow = 16384;
+  std::string body(bodySize, 0);
+  for (std::size_t i = 0; i < bodySize; ++i) {
+    body[i] = static_cast<char>('a' + i % 26);
+  }
+
+  std::mutex mutex;
+  std::string originRequest;
+  TcpServer origin{[&](int fd) {
+    auto head = readHead(fd);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      originRequest = head;
+    }
+    auto response = "HTTP/1.1 200 OK\r\nContent-Length: " +
+      std::to_string(bodySize) + "\r\n\r\n" + body;
+    send(fd, response.data(), response.size(), 0);
+  }};
+
+  // the target of the tunnel, which the session closes when the client
+  // resets the stream
+  std::atomic<bool> tunnelClosed{false};
+  TcpServer target{[&](int fd) {
+    tunnelClosed = echo(fd);
+  }};
+
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+
+  auto server = ProxyServer{};
+  server.setSessionCreator([](
+      const std::shared_ptr<uvcpp::Tcp> &conn,
+      const std::shared_ptr<nul::BufferPool> &bufferPool) {
+    return std::make_shared<HttpProxySession>(conn, bufferPool);
+  });
+  auto proxyPort = getFreePort();
+  ASSERT_TRUE(server.start(loop, "127.0.0.1", proxyPort, 50));
+
+  auto bufferPool = std::make_shared<nul::BufferPool>(8192, 20);
+  H2Client client{loop, bufferPool};
+
+  auto originAuthority = "127.0.0.1:" + std::to_string(origin.getPort());
+  auto deadAuthority = "127.0.0.1:" + std::to_string(getFreePort());
+  auto targetAuthority = "127.0.0.1:" + std::to_string(target.getPort());
+
+  // 1: a plain GET, 3: an https URL, which can only be CONNECTed to,
+  // 5: a CONNECT that fails, 7 is opened later
+  std::string frames;
+  Http2FrameBuilder::appendSettings(frames, {
+    { Http2::Setting::INITIAL_WINDOW_SIZE, streamWindow }
+  });
+  Http2FrameBuilder::appendHeaders(frames, 1, client.encode({
+    { ":method", "GET" }, { ":scheme", "http" },
+    { ":authority", originAuthority }, { ":path", "/big" },
+    { "accept", "*/*" }
+  }), true, Http2::DEFAULT_MAX_FRAME_SIZE);
+  Http2FrameBuilder::appendHeaders(frames, 3, client.encode({
+    { ":method", "GET" }, { ":scheme", "https" },
+    { ":authority", "127.0.0.1:443" }, { ":path", "/" }
+  }), true, Http2::DEFAULT_MAX_FRAME_SIZE);
+  Http2FrameBuilder::appendHeaders(frames, 5, client.encode({
+    { ":method", "CONNECT" }, { ":authority", deadAuthority }
+  }), false, Http2::DEFAULT_MAX_FRAME_SIZE);
+
+  std::map<uint32_t, std::string> statuses;
+  std::map<uint32_t, std::string> contentLengths;
+  std::map<uint32_t, std::string> data;
+  std::map<uint32_t, bool> ended;
+  std::map<uint32_t, Http2::ErrorCode> resets;
+  // what the client allows the session to send, on the connection (0) and
+  // on each stream, and how much was sent
+  std::map<uint32_t, int64_t> windows{{ 0, Http2::DEFAULT_WINDOW_SIZE }};
+  std::map<uint32_t, int64_t> received;
+  auto overrun = false;
+  auto settingsAcked = false;
+  auto tunnelOpened = false;
+
+  auto onFrame = [&](Http2Frame &frame) {
+    auto streamId = frame.streamId;
+    std::string out;
+    switch (frame.type) {
+      case Http2::FrameType::SETTINGS:
+        if (frame.hasFlag(Http2::FLAG_ACK)) {
+          settingsAcked = true;
+        } else {
+          Http2FrameBuilder::appendSettingsAck(out);
+        }
+        break;
+
+      case Http2::FrameType::HEADERS: {
+        auto headers = client.decode(frame.payload);
+        statuses[streamId] = findHeader(headers, ":status");
+        contentLengths[streamId] = findHeader(headers, "content-length");
+        ended[streamId] = frame.hasFlag(Http2::FLAG_END_STREAM);
+        if (streamId == 7 && statuses[streamId] == "200") {
+          Http2FrameBuilder::appendData(out, 7, "ping", 4, false);
+        }
+        break;
+      }
+
+      case Http2::FrameType::DATA: {
+        auto len = static_cast<int64_t>(frame.payload.size());
+        if (!windows.count(streamId)) {
+          windows[streamId] = streamWindow;
+        }
+        received[streamId] += len;
+        received[0] += len;
+        overrun = overrun || received[streamId] > windows[streamId] ||
+          received[0] > windows[0];
+        data[streamId].append(frame.payload);
+        ended[streamId] = frame.hasFlag(Http2::FLAG_END_STREAM);
+
+        if (streamId == 1 && received[1] == streamWindow && !tunnelOpened) {
+          // stream 1 is stalled with its window used up, a tunnel opens
+          // next to it
+          tunnelOpened = true;
+          Http2FrameBuilder::appendHeaders(out, 7, client.encode({
+            { ":method", "CONNECT" }, { ":authority", targetAuthority }
+          }), false, Http2::DEFAULT_MAX_FRAME_SIZE);
+        } else if (streamId == 7 && data[7] == "ping") {
+          // the stream is gone once reset, so the data that follows is
+          // refused
+          Http2FrameBuilder::appendRstStream(
+            out, 7, Http2::ErrorCode::CANCEL);
+          Http2FrameBuilder::appendData(out, 7, "late", 4, false);
+        } else if (streamId == 1 && ended[1]) {
+          Http2FrameBuilder::appendGoaway(out, 0, Http2::ErrorCode::NO_ERROR);
+        }
+        break;
+      }
+
+      case Http2::FrameType::RST_STREAM:
+        resets[streamId] = static_cast<Http2::ErrorCode>(
+          Http2FrameBuilder::readUint32(frame.payload.c_str()));
+        if (streamId == 7) {
+          // the rest of the body of stream 1 is let through
+          auto increment = static_cast<uint32_t>(bodySize);
+          Http2FrameBuilder::appendWindowUpdate(out, 1, increment);
+          Http2FrameBuilder::appendWindowUpdate(out, 0, increment);
+          windows[1] += increment;
+          windows[0] += increment;
+        }
+        break;
+
+      default:
+        break;
+    }
+    if (!out.empty()) {
+      client.send(out);
+    }
+  };
+
+  auto closed = false;
+  client.connect(proxyPort, frames, onFrame, [&]() {
+    closed = true;
+    server.shutdown();
+  });
+  loop->run();
+
+  // the session closes the connection after GOAWAY once no stream is open
+  ASSERT_TRUE(closed);
+  ASSERT_TRUE(settingsAcked);
+  ASSERT_FALSE(overrun);
+
+  ASSERT_EQ("200", statuses[1]);
+  ASSERT_EQ(std::to_string(bodySize), contentLengths[1]);
+  ASSERT_EQ(body, data[1]);
+  ASSERT_TRUE(ended[1]);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(0u, originRequest.find(
+        "GET /big HTTP/1.1\r\nHost: " + originAuthority + "\r\n"));
+    ASSERT_NE(std::string::npos, originRequest.find("accept: */*\r\n"));
+    ASSERT_NE(std::string::npos, originRequest.find("Connection: close\r\n"));
+  }
+
+  // the statuses the session makes up itself, which end the streams
+  ASSERT_EQ("400", statuses[3]);
+  ASSERT_TRUE(ended[3]);
+  ASSERT_EQ("502", statuses[5]);
+  ASSERT_TRUE(ended[5]);
+  // the request of stream 5 was never ended by the client
+  ASSERT_EQ(Http2::ErrorCode::NO_ERROR, resets[5]);
+
+  ASSERT_EQ("200", statuses[7]);
+  ASSERT_FALSE(ended[7]);
+  ASSERT_EQ("ping", data[7]);
+  ASSERT_EQ(Http2::ErrorCode::STREAM_CLOSED, resets[7]);
+  for (int i = 0; i < 100 && !tunnelClosed; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_TRUE(tunnelClosed);
+}
@@ -0,0 +1,385 @@
+#include <gtest/gtest.h>
+#include "proxypp/http/http_cache.h"
+#include "proxypp/http/http_response_parser.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+#include <unistd.h>
+
+using namespace proxypp;
+
+namespace {
+  HttpHeaderParser parseRequest(const std::string &req) {
+    HttpHeaderParser parser;
+    EXPECT_TRUE(parser.parse(req, std::string::npos));
+    return parser;
+  }
+
+  bool storeResponse(
+    HttpCache &cache, const std::string &key, const std::string &resp) {
+    HttpResponseParser parser;
+    EXPECT_EQ(resp.size(), parser.parse(resp.c_str(), resp.size()));
+    EXPECT_TRUE(parser.isComplete());
+    return cache.store(
+      key, std::string{resp}, parser, HttpCache::Clock::now());
+  }
+
+  bool storeResponseOnDisk(
+    HttpCache &cache, const std::string &key, const std::string &resp) {
+    HttpResponseParser parser;
+    parser.parse(resp.c_str(), resp.size());
+    auto reservation =
+      cache.reserveOnDisk(key, parser, HttpCache::Clock::now());
+    return reservation &&
+      cache.writeOnDisk(*reservation, resp) &&
+      cache.commitOnDisk(*reservation);
+  }
+
+  std::string readBody(const HttpCache::Entry &entry) {
+    std::string body(entry.bodyLength, '\0');
+    auto n = ::pread(entry.bodyFd, &body[0], body.size(),
+                     static_cast<off_t>(entry.bodyOffset));
+    EXPECT_EQ(static_cast<ssize_t>(body.size()), n);
+    return body;
+  }
+
+  // a directory under /tmp that is removed with everything in it when it
+  // goes out of scope
+  class TempDir {
+    public:
+      TempDir() {
+        char dir[] = "/tmp/proxypp_disk_cache_XXXXXX";
+        EXPECT_NE(nullptr, ::mkdtemp(dir));
+        path_ = dir;
+      }
+      ~TempDir() {
+        ::nftw(path_.c_str(), [](const char *path, const struct stat *,
+                                 int, struct FTW *) {
+          return std::remove(path);
+        }, 16, FTW_DEPTH | FTW_PHYS);
+      }
+      TempDir(const TempDir &) = delete;
+      TempDir &operator=(const TempDir &) = delete;
+
+      const std::string &getPath() const { return path_; }
+
+    private:
+      std::string path_;
+  };
+}
+
+TEST(HttpResponseParser, ContentLength) {
+  const std::string resp =
+    "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhelloHTTP/1.1";
+  HttpResponseParser parser;
+  // split in the middle of the header
+  EXPECT_EQ(10U, parser.parse(resp.c_str(), 10));
+  EXPECT_FALSE(parser.isHeaderComplete());
+  EXPECT_EQ(resp.size() - 10 - 8,
+            parser.parse(resp.c_str() + 10, resp.size() - 10));
+  EXPECT_TRUE(parser.isComplete());
+  EXPECT_EQ(200, parser.getStatusCode());
+  EXPECT_EQ("5", parser.getHeader("content-length"));
+}
+
+TEST(HttpResponseParser, Chunked) {
+  const std::string resp =
+    "HTTP/1.1 404 Not Found\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5;ext=1\r\nhello\r\n6\r\n world\r\n0\r\nX-Trailer: 1\r\n\r\n";
+  HttpResponseParser parser;
+  for (std::size_t i = 0; i < resp.size(); ++i) {
+    EXPECT_FALSE(parser.isComplete());
+    EXPECT_EQ(1U, parser.parse(resp.c_str() + i, 1));
+  }
+  EXPECT_TRUE(parser.isComplete());
+  EXPECT_EQ(404, parser.getStatusCode());
+}
+
+TEST(HttpResponseParser, BodyCallback) {
+  const std::string resp =
+    "HTTP/1.1 200 OK\r\nSet-Cookie: a=1\r\nSet-Cookie: b=2\r\n"
+    "Transfer-Encoding: chunked\r\n\r\n"
+    "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n";
+  HttpResponseParser parser;
+  std::string body;
+  parser.setBodyCallback([&body](const char *buf, std::size_t len) {
+    body.append(buf, len);
+  });
+  for (std::size_t i = 0; i < resp.size(); i += 7) {
+    auto n = std::min<std::size_t>(7, resp.size() - i);
+    EXPECT_EQ(n, parser.parse(resp.c_str() + i, n));
+  }
+  EXPECT_TRUE(parser.isComplete());
+  EXPECT_EQ("hello world", body);
+
+  auto fields = parser.getHeaderFields();
+  ASSERT_EQ(3U, fields.size());
+  EXPECT_EQ("set-cookie", fields[0].first);
+  EXPECT_EQ("a=1", fields[0].second);
+  EXPECT_EQ("b=2", fields[1].second);
+}
+
+TEST(HttpResponseParser, NoBody) {
+  const std::string resp =
+    "HTTP/1.1 304 Not Modified\r\nETag: \"x\"\r\n\r\nHTTP";
+  HttpResponseParser parser;
+  EXPECT_EQ(resp.size() - 4, parser.parse(resp.c_str(), resp.size()));
+  EXPECT_TRUE(parser.isComplete());
+
+  parser.reset(true);
+  const std::string head = "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n";
+  EXPECT_EQ(head.size(), parser.parse(head.c_str(), head.size()));
+  EXPECT_TRUE(parser.isComplete());
+}
+
+TEST(HttpCache, MakeKey) {
+  auto key = HttpCache::makeKey(
+    parseRequest("GET http://a.com/x HTTP/1.1\r\nHost: a.com\r\n\r\n"),
+    "a.com", 80);
+  EXPECT_EQ("http://a.com/x\n", key);
+
+  key = HttpCache::makeKey(
+    parseRequest("GET /x HTTP/1.1\r\nHost: a.com:8080\r\n"
+                 "Accept-Encoding: gzip\r\n\r\n"), "a.com", 8080);
+  EXPECT_EQ("http://a.com:8080/x\ngzip", key);
+
+  EXPECT_TRUE(HttpCache::makeKey(
+      parseRequest("POST /x HTTP/1.1\r\nHost: a.com\r\n\r\n"),
+      "a.com", 80).empty());
+  EXPECT_TRUE(HttpCache::makeKey(
+      parseRequest("GET /x HTTP/1.1\r\nHost: a.com\r\n"
+                   "Authorization: Basic eA==\r\n\r\n"),
+      "a.com", 80).empty());
+  EXPECT_TRUE(HttpCache::requiresRevalidation(
+      parseRequest("GET /x HTTP/1.1\r\nHost: a.com\r\n"
+                   "Cache-Control: no-cache\r\n\r\n")));
+}
+
+TEST(HttpCache, Freshness) {
+  HttpCache cache{1024 * 1024};
+  EXPECT_TRUE(storeResponse(cache, "fresh",
+      "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nAge: 10\r\n"
+      "Content-Length: 2\r\n\r\nok"));
+  auto entry = cache.lookup("fresh");
+  ASSERT_NE(nullptr, entry);
+  EXPECT_TRUE(cache.isFresh(*entry));
+
+  auto resp = cache.buildResponse(*entry);
+  EXPECT_NE(std::string::npos, resp.find("\r\nAge: 10\r\n"));
+  EXPECT_EQ(std::string::npos, resp.find("Age: 10\r\nAge"));
+  EXPECT_EQ("ok", resp.substr(resp.size() - 2));
+
+  EXPECT_TRUE(storeResponse(cache, "stale",
+      "HTTP/1.1 200 OK\r\nCache-Control: no-cache\r\nETag: \"v1\"\r\n"
+      "Content-Length: 2\r\n\r\nok"));
+  entry = cache.lookup("stale");
+  ASSERT_NE(nullptr, entry);
+  EXPECT_FALSE(cache.isFresh(*entry));
+  EXPECT_EQ("\"v1\"", entry->etag);
+
+  EXPECT_TRUE(storeResponse(cache, "expired",
+      "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+      "Expires: Sun, 06 Nov 1994 08:50:37 GMT\r\n"
+      "Last-Modified: Sun, 06 Nov 1994 08:00:00 GMT\r\n"
+      "Content-Length: 2\r\n\r\nok"));
+  EXPECT_FALSE(cache.isFresh(*cache.lookup("expired")));
+
+  EXPECT_FALSE(storeResponse(cache, "nostore",
+      "HTTP/1.1 200 OK\r\nCache-Control: no-store, max-age=60\r\n"
+      "Content-Length: 2\r\n\r\nok"));
+  EXPECT_FALSE(storeResponse(cache, "private",
+      "HTTP/1.1 200 OK\r\nCache-Control: private, max-age=60\r\n"
+      "Content-Length: 2\r\n\r\nok"));
+  EXPECT_FALSE(storeResponse(cache, "vary",
+      "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nVary: Cookie\r\n"
+      "Content-Length: 2\r\n\r\nok"));
+  EXPECT_FALSE(storeResponse(cache, "nofreshness",
+      "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"));
+}
+
+TEST(HttpCache, Revalidate) {
+  HttpCache cache{1024 * 1024};
+  EXPECT_TRUE(storeResponse(cache, "k",
+      "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\nCache-Control: max-age=0\r\n"
+      "Content-Length: 2\r\n\r\nok"));
+  EXPECT_FALSE(cache.isFresh(*cache.lookup("k")));
+
+  const std::string notModified =
+    "HTTP/1.1 304 Not Modified\r\nETag: \"v2\"\r\n"
+    "Cache-Control: max-age=60\r\n\r\n";
+  HttpResponseParser parser;
+  parser.parse(notModified.c_str(), notModified.size());
+  auto entry = cache.refresh("k", parser);
+  ASSERT_NE(nullptr, entry);
+  EXPECT_TRUE(cache.isFresh(*entry));
+  EXPECT_EQ("\"v2\"", entry->etag);
+  EXPECT_EQ(1U, cache.getStats().revalidated);
+}
+
+TEST(HttpCache, NotModified) {
+  HttpCache cache{1024 * 1024};
+  EXPECT_TRUE(storeResponse(cache, "k",
+      "HTTP/1.1 200 OK\r\nETag: W/\"v1\"\r\nCache-Control: max-age=60\r\n"
+      "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+      "Content-Type: text/plain\r\nContent-Length: 2\r\n\r\nok"));
+  auto entry = cache.lookup("k");
+  ASSERT_NE(nullptr, entry);
+
+  auto request = [](const std::string &headers) {
+    return parseRequest("GET /x HTTP/1.1\r\nHost: a.com\r\n" + headers +
+                        "\r\n");
+  };
+  EXPECT_TRUE(HttpCache::isNotModified(
+      request("If-None-Match: \"v0\", \"v1\"\r\n"), *entry));
+  EXPECT_TRUE(HttpCache::isNotModified(request("If-None-Match: *\r\n"),
+                                       *entry));
+  EXPECT_FALSE(HttpCache::isNotModified(
+      request("If-None-Match: \"v2\"\r\n"), *entry));
+  // If-Modified-Since is ignored with If-None-Match
+  EXPECT_FALSE(HttpCache::isNotModified(request(
+      "If-None-Match: \"v2\"\r\n"
+      "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"), *entry));
+  EXPECT_TRUE(HttpCache::isNotModified(request(
+      "If-Modified-Since: Mon, 07 Nov 1994 08:49:37 GMT\r\n"), *entry));
+  EXPECT_FALSE(HttpCache::isNotModified(request(
+      "If-Modified-Since: Sat, 05 Nov 1994 08:49:37 GMT\r\n"), *entry));
+  EXPECT_FALSE(HttpCache::isNotModified(request(""), *entry));
+
+  auto response = cache.buildNotModifiedResponse(*entry);
+  EXPECT_EQ(0U, response.find("HTTP/1.1 304 Not Modified\r\n"));
+  EXPECT_NE(std::string::npos, response.find("\r\nETag: W/\"v1\"\r\n"));
+  EXPECT_NE(std::string::npos, response.find("\r\nCache-Control: max-age"));
+  EXPECT_NE(std::string::npos, response.find("\r\nAge: "));
+  EXPECT_EQ(std::string::npos, response.find("Content-"));
+  EXPECT_EQ("\r\n\r\n", response.substr(response.size() - 4));
+}
+
+TEST(HttpCache, SegmentedLRU) {
+  const std::string body(1000, 'x');
+  const std::string resp =
+    "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+    "Content-Length: 1000\r\n\r\n" + body;
+  // room for about 8 entries
+  HttpCache cache{8 * 1400};
+
+  EXPECT_TRUE(storeResponse(cache, "hot", resp));
+  // second access promotes the entry to the protected segment
+  EXPECT_NE(nullptr, cache.lookup("hot"));
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_TRUE(storeResponse(cache, "k" + std::to_string(i), resp));
+  }
+  EXPECT_LE(cache.getSize(), 8 * 1400U);
+  EXPECT_NE(nullptr, cache.lookup("hot"));
+  EXPECT_EQ(nullptr, cache.lookup("k0"));
+  EXPECT_NE(nullptr, cache.lookup("k19"));
+  EXPECT_GT(cache.getStats().evictions, 0U);
+}
+
+TEST(HttpCache, CollapsedFetch) {
+  HttpCache cache{1024 * 1024};
+  int woken = 0;
+  EXPECT_TRUE(cache.beginFetch("k", [&woken]{ ++woken; }));
+  EXPECT_FALSE(cache.beginFetch("k", [&woken]{ ++woken; }));
+  EXPECT_FALSE(cache.beginFetch("k", [&woken]{ ++woken; }));
+  cache.endFetch("k");
+  EXPECT_EQ(2, woken);
+  EXPECT_EQ(2U, cache.getStats().collapsed);
+  EXPECT_TRUE(cache.beginFetch("k", []{}));
+}
+
+TEST(HttpCache, Stats) {
+  HttpCache cache{1024 * 1024};
+  cache.recordServed(300, false);
+  cache.recordServed(100, true);
+  EXPECT_DOUBLE_EQ(0.5, cache.getStats().hitRatio());
+  EXPECT_DOUBLE_EQ(0.25, cache.getStats().byteHitRatio());
+}
+
+TEST(HttpDiskCache, StoreAndReload) {
+  const std::string body(100 * 1024, 'x');
+  const std::string resp =
+    "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nAge: 5\r\n"
+    "ETag: \"v1\"\r\nContent-Length: " + std::to_string(body.size()) +
+    "\r\n\r\n" + body;
+  TempDir tempDir;
+  auto &dir = tempDir.getPath();
+  const std::size_t segmentSize = 1024 * 1024;
+
+  {
+    // objects up to 8KB stay in memory
+    HttpCache cache{64 * 1024};
+    auto diskCache = std::make_unique<HttpDiskCache>();
+    ASSERT_TRUE(diskCache->open(dir, 4 * segmentSize, segmentSize));
+    cache.setDiskCache(std::move(diskCache));
+
+    EXPECT_TRUE(storeResponseOnDisk(cache, "k", resp));
+    auto entry = cache.lookup("k");
+    ASSERT_NE(nullptr, entry);
+    EXPECT_NE(-1, entry->bodyFd);
+    EXPECT_TRUE(cache.isFresh(*entry));
+    EXPECT_EQ(body, readBody(*entry));
+    auto head = cache.buildResponse(*entry);
+    EXPECT_EQ(head.find("Age:"), head.rfind("Age:"));
+    EXPECT_EQ("\r\n\r\n", head.substr(head.size() - 4));
+
+    // small responses are not meant for the disk tier
+    EXPECT_FALSE(storeResponseOnDisk(cache, "small",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+        "Content-Length: 2\r\n\r\nok"));
+  }
+
+  // the index is rebuilt from the segment files
+  HttpDiskCache diskCache;
+  ASSERT_TRUE(diskCache.open(dir, 4 * segmentSize, segmentSize));
+  auto loc = diskCache.find("k");
+  ASSERT_NE(nullptr, loc);
+  EXPECT_EQ(resp.size(), loc->dataLength);
+  EXPECT_EQ("\"v1\"", loc->meta.etag);
+  EXPECT_EQ(60, loc->meta.freshnessLifetime);
+}
+
+TEST(HttpDiskCache, RecycleSegments) {
+  TempDir tempDir;
+  auto &dir = tempDir.getPath();
+  const std::size_t segmentSize = 1024 * 1024;
+  HttpDiskCache diskCache;
+  ASSERT_TRUE(diskCache.open(dir, 2 * segmentSize, segmentSize));
+
+  const std::string data(300 * 1024, 'y');
+  HttpDiskCache::Meta meta;
+  meta.freshnessLifetime = 60;
+  for (int i = 0; i < 8; ++i) {
+    auto key = "k" + std::to_string(i);
+    auto reservation = diskCache.reserve(key, meta, 10, data.size());
+    ASSERT_NE(nullptr, reservation);
+    EXPECT_TRUE(diskCache.write(*reservation, data.c_str(), data.size()));
+    EXPECT_TRUE(diskCache.commit(*reservation));
+  }
+  // 3 objects per segment, the oldest segments are recycled first
+  EXPECT_EQ(nullptr, diskCache.find("k0"));
+  EXPECT_NE(nullptr, diskCache.find("k7"));
+  EXPECT_LE(diskCache.getObjectCount(), 6U);
+
+  // a pinned segment is never recycled
+  auto pin = diskCache.pin(diskCache.find("k7")->segment);
+  auto pinnedSegment = diskCache.find("k7")->segment;
+  for (int i = 0; i < 8; ++i) {
+    auto reservation = diskCache.reserve("x", meta, 10, data.size());
+    if (!reservation) {
+      break;
+    }
+    EXPECT_TRUE(diskCache.write(*reservation, data.c_str(), data.size()));
+    EXPECT_TRUE(diskCache.commit(*reservation));
+  }
+  ASSERT_NE(nullptr, diskCache.find("k7"));
+  EXPECT_EQ(pinnedSegment, diskCache.find("k7")->segment);
+
+  // an uncommitted record is skipped after restart
+  pin = nullptr;
+  auto pending = diskCache.reserve("pending", meta, 10, data.size());
+  ASSERT_NE(nullptr, pending);
+  HttpDiskCache reloaded;
+  ASSERT_TRUE(reloaded.open(dir, 2 * segmentSize, segmentSize));
+  EXPECT_EQ(nullptr, reloaded.find("pending"));
+}
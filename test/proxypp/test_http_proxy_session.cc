@@ -0,0 +1,363 @@
+#include <gtest/gtest.h>
+#include "proxypp/http/http_proxy_session.h"
+#include "proxypp/proxy_server.hpp"
+#include "local_servers.h"
+
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <netinet/tcp.h>
+
+using namespace proxypp;
+using namespace proxypp_test;
+
+namespace {
+  const std::string REPLY_OK_FOR_CONNECT_REQUEST{
+    "HTTP/1.1 200 OK\r\nServer: hpd\r\n\r\n"};
+
+  // an HTTP proxy on the loop, every session is set up by configure
+  uint16_t startProxy(
+    const std::shared_ptr<uvcpp::Loop> &loop, ProxyServer &server,
+    std::function<void(HttpProxySession &sess)> &&configure) {
+    server.setSessionCreator([configure](
+        const std::shared_ptr<uvcpp::Tcp> &conn,
+        const std::shared_ptr<nul::BufferPool> &bufferPool) {
+      auto sess = std::make_shared<HttpProxySession>(conn, bufferPool);
+      configure(*sess);
+      return sess;
+    });
+    auto port = getFreePort();
+    return server.start(loop, "127.0.0.1", port, 50) ? port : 0;
+  }
+
+  std::string getRequest(uint16_t port, const std::string &path) {
+    auto authority = "127.0.0.1:" + std::to_string(port);
+    return "GET http://" + authority + path + " HTTP/1.1\r\nHost: " +
+      authority + "\r\nProxy-Connection: keep-alive\r\n\r\n";
+  }
+
+  // what the origins answer, the request target is the body
+  std::string response(const std::string &target) {
+    return "HTTP/1.1 200 OK\r\nContent-Length: " +
+      std::to_string(target.size()) + "\r\n\r\n" + target;
+  }
+
+  std::string getTarget(const std::string &head) {
+    auto begin = head.find(' ') + 1;
+    return head.substr(begin, head.find(' ', begin) - begin);
+  }
+
+  // reads the requests of a connection batchSize at a time and answers a
+  // batch once all of it is read, so it only gets answered if the session
+  // sends the requests without waiting for the responses. returns the
+  // targets in the order they were read
+  std::vector<std::string> serve(int fd, std::size_t batchSize) {
+    std::vector<std::string> targets;
+    while (true) {
+      std::string answers;
+      for (std::size_t i = 0; i < batchSize; ++i) {
+        auto head = readHead(fd);
+        if (head.empty()) {
+          return targets;
+        }
+        targets.push_back(getTarget(head));
+        answers.append(response(targets.back()));
+      }
+      sendAll(fd, answers);
+    }
+  }
+}
+
+TEST(HttpProxySession, PipelinedRequests) {
+  std::mutex mutex;
+  std::vector<std::vector<std::string>> connections;
+  TcpServer origin{[&](int fd) {
+    auto targets = serve(fd, 3);
+    std::lock_guard<std::mutex> lock(mutex);
+    connections.push_back(targets);
+  }};
+
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  auto proxyPort = startProxy(loop, server, [](auto &sess) {});
+  ASSERT_NE(0, proxyPort);
+
+  auto port = origin.getPort();
+  auto requests = getRequest(port, "/a") + getRequest(port, "/b") +
+    getRequest(port, "/c");
+  auto prefix = "http://127.0.0.1:" + std::to_string(port);
+  auto expected = response(prefix + "/a") + response(prefix + "/b") +
+    response(prefix + "/c");
+
+  std::string oneRead, splitReads;
+  runClient(loop, server, [&]() {
+    // all of them in one read
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, requests);
+    oneRead = readBytes(fd, expected.size());
+    close(fd);
+
+    // a few bytes per read, so that the requests and the header ends are
+    // cut in the middle
+    fd = connectLocalTcp(proxyPort);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    for (std::size_t i = 0; i < requests.size(); i += 7) {
+      sendAll(fd, requests.substr(i, 7));
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    splitReads = readBytes(fd, expected.size());
+    close(fd);
+  });
+
+  // answered in order, by one upstream connection that had the requests
+  // before any of them was answered
+  ASSERT_EQ(expected, oneRead);
+  ASSERT_EQ(expected, splitReads);
+  for (int i = 0; i < 100; ++i) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (connections.size() == 2) {
+        break;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(2u, connections.size());
+  for (auto &targets : connections) {
+    ASSERT_EQ(
+      (std::vector<std::string>{prefix + "/a", prefix + "/b", prefix + "/c"}),
+      targets);
+  }
+}
+
+TEST(HttpProxySession, ResponsesInRequestOrder) {
+  // the first origin is slow to answer, the requests for the second one
+  // must wait for it
+  std::atomic<bool> slowAnswered{false};
+  std::atomic<bool> fastAnsweredFirst{false};
+  TcpServer slowOrigin{[&](int fd) {
+    std::string head;
+    while (!(head = readHead(fd)).empty()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      sendAll(fd, response(getTarget(head)));
+      slowAnswered = true;
+    }
+  }};
+  TcpServer fastOrigin{[&](int fd) {
+    std::string head;
+    while (!(head = readHead(fd)).empty()) {
+      fastAnsweredFirst = fastAnsweredFirst || !slowAnswered;
+      sendAll(fd, response(getTarget(head)));
+    }
+  }};
+
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  auto proxyPort = startProxy(loop, server, [](auto &sess) {});
+  ASSERT_NE(0, proxyPort);
+
+  auto slowPort = slowOrigin.getPort();
+  auto fastPort = fastOrigin.getPort();
+  auto expected =
+    response("http://127.0.0.1:" + std::to_string(slowPort) + "/1") +
+    response("http://127.0.0.1:" + std::to_string(fastPort) + "/2") +
+    response("http://127.0.0.1:" + std::to_string(slowPort) + "/3");
+
+  std::string received;
+  runClient(loop, server, [&]() {
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, getRequest(slowPort, "/1") + getRequest(fastPort, "/2") +
+            getRequest(slowPort, "/3"));
+    received = readBytes(fd, expected.size());
+    close(fd);
+  });
+
+  ASSERT_EQ(expected, received);
+  ASSERT_FALSE(fastAnsweredFirst);
+}
+
+TEST(HttpProxySession, ConnectAfterPipelinedRequest) {
+  std::mutex mutex;
+  std::vector<std::string> originTargets;
+  TcpServer origin{[&](int fd) {
+    auto targets = serve(fd, 1);
+    std::lock_guard<std::mutex> lock(mutex);
+    originTargets.insert(originTargets.end(), targets.begin(), targets.end());
+  }};
+  TcpServer target{[](int fd) { echo(fd); }};
+
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  auto proxyPort = startProxy(loop, server, [](auto &sess) {});
+  ASSERT_NE(0, proxyPort);
+
+  auto originPort = origin.getPort();
+  auto targetAuthority = "127.0.0.1:" + std::to_string(target.getPort());
+  auto url = "http://127.0.0.1:" + std::to_string(originPort) + "/a";
+  auto expected = response(url) + REPLY_OK_FOR_CONNECT_REQUEST;
+
+  std::string received, echoed;
+  runClient(loop, server, [&]() {
+    // the CONNECT is read along with the GET, and is held until the GET
+    // is answered
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, getRequest(originPort, "/a") + "CONNECT " + targetAuthority +
+            " HTTP/1.1\r\nHost: " + targetAuthority + "\r\n\r\n");
+    received = readBytes(fd, expected.size());
+    sendAll(fd, "hello");
+    echoed = readBytes(fd, 5);
+    close(fd);
+  });
+
+  ASSERT_EQ(expected, received);
+  ASSERT_EQ("hello", echoed);
+  for (int i = 0; i < 100; ++i) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!originTargets.empty()) {
+        break;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  // the CONNECT didn't go to the origin of the GET
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(std::vector<std::string>{url}, originTargets);
+}
+
+TEST(HttpProxySession, OptimisticConnect) {
+  // more than the buffers of the kernel hold on the two ends of the
+  // connection, so the client only gets it all out if the session reads it
+  const std::size_t payloadSize = 16 * 1024 * 1024;
+  std::string payload(payloadSize, 0);
+  for (std::size_t i = 0; i < payloadSize; ++i) {
+    payload[i] = static_cast<char>('a' + i % 26);
+  }
+  const std::string early{"early"};
+
+  // a SOCKS5 upstream that holds the CONNECT until the client lets it go,
+  // an HTTP upstream would answer the CONNECT itself
+  std::atomic<bool> released{false};
+  std::atomic<bool> payloadIntact{false};
+  std::mutex mutex;
+  std::string socksRequest;
+  TcpServer upstream{[&](int fd) {
+    readBytes(fd, 3);
+    sendAll(fd, std::string{"\5\0", 2});
+    auto request = readBytes(fd, 10);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      socksRequest = request;
+    }
+    for (int i = 0; i < 500 && !released; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    sendAll(fd, std::string{"\5\0\0\1\0\0\0\0\0\0", 10});
+    payloadIntact =
+      readBytes(fd, early.size() + payloadSize) == early + payload;
+  }};
+
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  auto upstreamPort = upstream.getPort();
+  auto proxyPort = startProxy(loop, server, [upstreamPort](auto &sess) {
+    sess.setUpstreamServer(UpstreamType::kSOCKS5, "127.0.0.1", upstreamPort);
+    sess.setOptimisticConnect(true);
+  });
+  ASSERT_NE(0, proxyPort);
+
+  std::string reply;
+  auto repliedBeforeConnected = false;
+  std::size_t sentBeforeConnected = 0;
+  auto closed = false;
+  runClient(loop, server, [&]() {
+    // the bytes after the CONNECT header are read along with it
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, "CONNECT 127.0.0.1:443 HTTP/1.1\r\n"
+            "Host: 127.0.0.1:443\r\n\r\n" + early);
+    reply = readBytes(fd, REPLY_OK_FOR_CONNECT_REQUEST.size());
+    repliedBeforeConnected = !released;
+
+    // the session buffers what comes before the upstream is connected,
+    // up to a limit, sending stalls once it stops reading
+    timeval timeout{0, 300 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    ssize_t n;
+    while (sentBeforeConnected < payloadSize &&
+           (n = send(fd, payload.data() + sentBeforeConnected,
+                     payloadSize - sentBeforeConnected, MSG_NOSIGNAL)) > 0) {
+      sentBeforeConnected += n;
+    }
+
+    released = true;
+    timeout = timeval{0, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    sendAll(fd, payload.substr(sentBeforeConnected));
+    // the upstream closes once it has read the payload
+    char ch;
+    closed = recv(fd, &ch, 1, 0) == 0;
+    close(fd);
+  });
+
+  // the 200 came before the upstream answered the CONNECT
+  ASSERT_EQ(REPLY_OK_FOR_CONNECT_REQUEST, reply);
+  ASSERT_TRUE(repliedBeforeConnected);
+  ASSERT_GE(sentBeforeConnected, 64 * 1024u);
+  ASSERT_LT(sentBeforeConnected, payloadSize);
+  // and nothing was lost across the pause, the early bytes first
+  ASSERT_TRUE(payloadIntact);
+  ASSERT_TRUE(closed);
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(std::string("\5\1\0\1\177\0\0\1\1\273", 10), socksRequest);
+}
+
+TEST(HttpProxySession, FailedConnect) {
+  auto deadAuthority = "127.0.0.1:" + std::to_string(getFreePort());
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  std::atomic<bool> optimistic{false};
+  auto proxyPort = startProxy(loop, server, [&optimistic](auto &sess) {
+    sess.setOptimisticConnect(optimistic);
+  });
+  ASSERT_NE(0, proxyPort);
+
+  const auto request = "CONNECT " + deadAuthority + " HTTP/1.1\r\nHost: " +
+    deadAuthority + "\r\n\r\n";
+  const std::string badGateway{
+    "HTTP/1.1 502 Bad Gateway\r\nServer: hpd\r\n\r\n"};
+  std::string reply, optimisticReply;
+  auto closed = false;
+  auto reset = false;
+  runClient(loop, server, [&]() {
+    char ch;
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, request);
+    reply = readBytes(fd, badGateway.size());
+    closed = recv(fd, &ch, 1, 0) == 0;
+    close(fd);
+
+    optimistic = true;
+    fd = connectLocalTcp(proxyPort);
+    sendAll(fd, request + "hello");
+    optimisticReply = readBytes(fd, REPLY_OK_FOR_CONNECT_REQUEST.size());
+    reset = recv(fd, &ch, 1, 0) == -1 && errno == ECONNRESET;
+    close(fd);
+  });
+
+  // the failure is told in the reply, and the connection is closed
+  ASSERT_EQ(badGateway, reply);
+  ASSERT_TRUE(closed);
+
+  // after a 200 only a reset tells the client it failed
+  ASSERT_EQ(REPLY_OK_FOR_CONNECT_REQUEST, optimisticReply);
+  ASSERT_TRUE(reset);
+}
@@ -0,0 +1,400 @@
+#include <gtest/gtest.h>
+#include "proxypp/socks/socks_proxy_session.h"
+#include "proxypp/proxy_server.hpp"
+#include "proxypp/auto_proxy_manager.h"
+#include "local_servers.h"
+
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <cerrno>
+
+using namespace proxypp;
+using namespace proxypp_test;
+
+namespace {
+  const std::string GREETING{"\5\1\0", 3};
+  // the reply to the greeting and one to a request with an IPv4 BND.ADDR
+  const std::size_t REPLY_LENGTH = 2 + 10;
+
+  std::string socksRequest(
+    Socks::RequestType cmd, Socks::AddressType atyp, const std::string &addr,
+    uint16_t port) {
+    auto request = std::string{"\5\0\0", 3};
+    request[1] = static_cast<char>(cmd);
+    request.push_back(static_cast<char>(atyp));
+    if (atyp == Socks::AddressType::DOMAIN_NAME) {
+      request.push_back(static_cast<char>(addr.size()));
+    }
+    request.append(addr);
+    port = htons(port);
+    request.append(reinterpret_cast<const char *>(&port), 2);
+    return request;
+  }
+
+  std::string connectRequest(
+    Socks::AddressType atyp, const std::string &addr, uint16_t port) {
+    return socksRequest(Socks::RequestType::CONNECT, atyp, addr, port);
+  }
+
+  // a SOCKS proxy on the loop, every session is set up by configure
+  uint16_t startProxy(
+    const std::shared_ptr<uvcpp::Loop> &loop, ProxyServer &server,
+    std::function<void(SocksProxySession &sess)> &&configure) {
+    server.setSessionCreator([configure](
+        const std::shared_ptr<uvcpp::Tcp> &conn,
+        const std::shared_ptr<nul::BufferPool> &bufferPool) {
+      auto sess = std::make_shared<SocksProxySession>(conn, bufferPool);
+      configure(*sess);
+      return sess;
+    });
+    auto port = getFreePort();
+    return server.start(loop, "127.0.0.1", port, 50) ? port : 0;
+  }
+
+  // a client of the proxy on the loop, the greeting, the request and the
+  // bytes after it go out in one write, so the bytes are read along with
+  // the request. what comes back is kept until expectedLen bytes arrive
+  // or the proxy closes the connection
+  void startClient(
+    const std::shared_ptr<uvcpp::Loop> &loop,
+    const std::shared_ptr<nul::BufferPool> &bufferPool, uint16_t proxyPort,
+    const std::string &data, std::size_t expectedLen, std::string &received,
+    std::function<void()> onDone) {
+    auto conn = uvcpp::Tcp::create(loop);
+    conn->on<uvcpp::EvBufferRecycled>([bufferPool](const auto &e, auto &conn) {
+      bufferPool->returnBuffer(std::forward<std::unique_ptr<nul::Buffer>>(
+          const_cast<uvcpp::EvBufferRecycled &>(e).buffer));
+    });
+    conn->once<uvcpp::EvClose>(
+      // intentionally cycle-ref the connection to keep it until closed
+      [onDone, _ = conn](const auto &e, auto &conn) {
+        onDone();
+      });
+    conn->once<uvcpp::EvConnect>(
+      [bufferPool, data, expectedLen, &received](const auto &e, auto &conn) {
+        conn.template on<uvcpp::EvRead>(
+          [expectedLen, &received](const auto &e, auto &conn) {
+            received.append(e.buf, e.nread);
+            if (received.size() >= expectedLen) {
+              conn.close();
+            }
+          });
+        conn.readStart();
+        conn.writeAsync(
+          bufferPool->assembleDataBuffer(data.data(), data.size()));
+      });
+    if (!conn->connect("127.0.0.1", proxyPort)) {
+      conn->close();
+    }
+  }
+}
+
+TEST(SocksProxySession, RouteRequests) {
+  // the target of the direct requests
+  TcpServer target{[](int fd) { echo(fd); }};
+
+  // an HTTP upstream that takes the CONNECT request and echoes the rest
+  std::mutex mutex;
+  std::string tunnelRequest;
+  TcpServer upstream{[&](int fd) {
+    auto head = readHead(fd);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tunnelRequest = head;
+    }
+    const std::string response{"HTTP/1.1 200 Connection established\r\n\r\n"};
+    send(fd, response.data(), response.size(), 0);
+    echo(fd);
+  }};
+
+  auto manager = std::make_shared<AutoProxyManager>();
+  ASSERT_TRUE(manager->addRule("||reject.test$action=reject"));
+  ASSERT_TRUE(manager->addRule("127.0.0.0/8$action=direct"));
+  ASSERT_TRUE(manager->addRule("||upstream.test"));
+  manager->waitUntilCompiled();
+
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+
+  auto server = ProxyServer{};
+  auto upstreamPort = upstream.getPort();
+  server.setSessionCreator([&](
+      const std::shared_ptr<uvcpp::Tcp> &conn,
+      const std::shared_ptr<nul::BufferPool> &bufferPool) {
+    auto sess = std::make_shared<SocksProxySession>(conn, bufferPool);
+    sess->setUpstreamServer(UpstreamType::kHTTP, "127.0.0.1", upstreamPort);
+    sess->setAutoProxyManager(manager);
+    return sess;
+  });
+  auto proxyPort = getFreePort();
+  ASSERT_TRUE(server.start(loop, "127.0.0.1", proxyPort, 50));
+
+  const std::string payload{"hello"};
+
+  std::string rejected, direct, proxied;
+  auto pending = 3;
+  auto onDone = [&]() {
+    if (--pending == 0) {
+      server.shutdown();
+    }
+  };
+  auto bufferPool = std::make_shared<nul::BufferPool>(8192, 20);
+  startClient(
+    loop, bufferPool, proxyPort,
+    GREETING + connectRequest(
+      Socks::AddressType::DOMAIN_NAME, "www.reject.test", 80) + payload,
+    std::numeric_limits<std::size_t>::max(), rejected, onDone);
+  startClient(
+    loop, bufferPool, proxyPort,
+    GREETING + connectRequest(
+      Socks::AddressType::IPV4, std::string{"\177\0\0\1", 4},
+      target.getPort()) + payload,
+    REPLY_LENGTH + payload.size(), direct, onDone);
+  startClient(
+    loop, bufferPool, proxyPort,
+    GREETING + connectRequest(
+      Socks::AddressType::DOMAIN_NAME, "www.upstream.test", 80) + payload,
+    REPLY_LENGTH + payload.size(), proxied, onDone);
+
+  loop->run();
+
+  // refused, and the connection is closed
+  ASSERT_EQ(REPLY_LENGTH, rejected.size());
+  ASSERT_EQ(std::string("\5\0", 2), rejected.substr(0, 2));
+  ASSERT_EQ(
+    static_cast<char>(SocksReqParser::ReplyField::CONNECTION_NOT_ALLOWED),
+    rejected[3]);
+
+  // the bytes read along with the request reach the target once connected
+  ASSERT_EQ(REPLY_LENGTH + payload.size(), direct.size());
+  ASSERT_EQ(0, direct[3]);
+  ASSERT_EQ(payload, direct.substr(REPLY_LENGTH));
+
+  // the same through the upstream, which is asked for the name
+  ASSERT_EQ(REPLY_LENGTH + payload.size(), proxied.size());
+  ASSERT_EQ(0, proxied[3]);
+  ASSERT_EQ(payload, proxied.substr(REPLY_LENGTH));
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(
+    0u, tunnelRequest.find("CONNECT www.upstream.test:80 HTTP/1.1\r\n"));
+}
+
+TEST(SocksProxySession, OptimisticConnect) {
+  // more than the buffers of the kernel hold on the two ends of the
+  // connection, so the client only gets it all out if the session reads it
+  const std::size_t payloadSize = 16 * 1024 * 1024;
+  std::string payload(payloadSize, 0);
+  for (std::size_t i = 0; i < payloadSize; ++i) {
+    payload[i] = static_cast<char>('a' + i % 26);
+  }
+
+  // an HTTP upstream that holds the CONNECT until the client lets it go
+  std::atomic<bool> released{false};
+  std::atomic<bool> payloadIntact{false};
+  TcpServer upstream{[&](int fd) {
+    readHead(fd);
+    for (int i = 0; i < 500 && !released; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    const std::string response{"HTTP/1.1 200 Connection established\r\n\r\n"};
+    send(fd, response.data(), response.size(), 0);
+    payloadIntact = readBytes(fd, payloadSize) == payload;
+  }};
+
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  auto upstreamPort = upstream.getPort();
+  auto proxyPort = startProxy(loop, server, [upstreamPort](auto &sess) {
+    sess.setUpstreamServer(UpstreamType::kHTTP, "127.0.0.1", upstreamPort);
+    sess.setOptimisticConnect(true);
+  });
+  ASSERT_NE(0, proxyPort);
+
+  std::string reply;
+  auto repliedBeforeConnected = false;
+  std::size_t sentBeforeConnected = 0;
+  auto closed = false;
+  runClient(loop, server, [&]() {
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, GREETING + connectRequest(
+        Socks::AddressType::DOMAIN_NAME, "www.example.test", 80));
+    reply = readBytes(fd, REPLY_LENGTH);
+    repliedBeforeConnected = !released;
+
+    // the session buffers what comes before the upstream is connected,
+    // up to a limit, sending stalls once it stops reading
+    timeval timeout{0, 300 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    ssize_t n;
+    while (sentBeforeConnected < payloadSize &&
+           (n = send(fd, payload.data() + sentBeforeConnected,
+                     payloadSize - sentBeforeConnected, MSG_NOSIGNAL)) > 0) {
+      sentBeforeConnected += n;
+    }
+
+    released = true;
+    timeout = timeval{0, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    sendAll(fd, payload.substr(sentBeforeConnected));
+    // the upstream closes once it has read the payload
+    char ch;
+    closed = recv(fd, &ch, 1, 0) == 0;
+    close(fd);
+  });
+
+  // succeeded with 0.0.0.0:0 before the upstream answered the CONNECT
+  ASSERT_EQ(std::string("\5\0\5\0\0\1\0\0\0\0\0\0", REPLY_LENGTH), reply);
+  ASSERT_TRUE(repliedBeforeConnected);
+  ASSERT_GE(sentBeforeConnected, 64 * 1024u);
+  ASSERT_LT(sentBeforeConnected, payloadSize);
+  // and nothing was lost across the pause
+  ASSERT_TRUE(payloadIntact);
+  ASSERT_TRUE(closed);
+}
+
+TEST(SocksProxySession, FailedConnect) {
+  auto deadPort = getFreePort();
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  std::atomic<bool> optimistic{false};
+  auto proxyPort = startProxy(loop, server, [&optimistic](auto &sess) {
+    sess.setOptimisticConnect(optimistic);
+  });
+  ASSERT_NE(0, proxyPort);
+
+  const auto request = GREETING + connectRequest(
+    Socks::AddressType::IPV4, std::string{"\177\0\0\1", 4}, deadPort);
+  std::string reply, optimisticReply;
+  auto closed = false;
+  auto reset = false;
+  runClient(loop, server, [&]() {
+    char ch;
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, request);
+    reply = readBytes(fd, REPLY_LENGTH);
+    closed = recv(fd, &ch, 1, 0) == 0;
+    close(fd);
+
+    optimistic = true;
+    fd = connectLocalTcp(proxyPort);
+    sendAll(fd, request + "hello");
+    optimisticReply = readBytes(fd, REPLY_LENGTH);
+    reset = recv(fd, &ch, 1, 0) == -1 && errno == ECONNRESET;
+    close(fd);
+  });
+
+  // the failure is told in the reply, and the connection is closed
+  ASSERT_EQ(REPLY_LENGTH, reply.size());
+  ASSERT_EQ(
+    static_cast<char>(
+      SocksReqParser::ReplyField::GENERAL_SOCKS_SERVER_FAILURE), reply[3]);
+  ASSERT_TRUE(closed);
+
+  // after a success reply only a reset tells the client it failed
+  ASSERT_EQ(REPLY_LENGTH, optimisticReply.size());
+  ASSERT_EQ(0, optimisticReply[3]);
+  ASSERT_TRUE(reset);
+}
+
+TEST(SocksProxySession, Bind) {
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  auto proxyPort = startProxy(loop, server, [](auto &sess) {});
+  ASSERT_NE(0, proxyPort);
+
+  std::string firstReply, secondReply, peerReceived, clientReceived;
+  uint16_t peerPort = 0;
+  auto strangerClosed = false;
+  auto closed = false;
+  runClient(loop, server, [&]() {
+    // what comes before the connection is accepted is kept for it
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, GREETING + socksRequest(
+        Socks::RequestType::BIND, Socks::AddressType::IPV4,
+        std::string{"\177\0\0\1", 4}, 0) + "early");
+    firstReply = readBytes(fd, REPLY_LENGTH);
+    if (firstReply.size() != REPLY_LENGTH) {
+      close(fd);
+      return;
+    }
+    uint16_t bindPort;
+    memcpy(&bindPort, &firstReply[10], 2);
+    bindPort = ntohs(bindPort);
+
+    // only the host named in the request may connect
+    char ch;
+    auto stranger = connectLocalTcp(bindPort, "127.0.0.2");
+    strangerClosed = stranger != -1 && recv(stranger, &ch, 1, 0) == 0;
+    close(stranger);
+
+    auto peer = connectLocalTcp(bindPort);
+    sockaddr_in peerAddr;
+    socklen_t addrLen = sizeof(peerAddr);
+    getsockname(peer, reinterpret_cast<sockaddr *>(&peerAddr), &addrLen);
+    peerPort = ntohs(peerAddr.sin_port);
+    secondReply = readBytes(fd, REPLY_LENGTH - 2);
+
+    sendAll(fd, "hello");
+    peerReceived = readBytes(peer, 10);
+    sendAll(peer, "world");
+    clientReceived = readBytes(fd, 5);
+    close(peer);
+    closed = recv(fd, &ch, 1, 0) == 0;
+    close(fd);
+  });
+
+  // where to connect to, on the IP the client reached the proxy at
+  ASSERT_EQ(REPLY_LENGTH, firstReply.size());
+  ASSERT_EQ(
+    std::string("\5\0\5\0\0\1\177\0\0\1", 10), firstReply.substr(0, 10));
+  ASSERT_TRUE(strangerClosed);
+
+  // who connected
+  ASSERT_EQ(REPLY_LENGTH - 2, secondReply.size());
+  ASSERT_EQ(std::string("\5\0\0\1\177\0\0\1", 8), secondReply.substr(0, 8));
+  uint16_t port;
+  memcpy(&port, &secondReply[8], 2);
+  ASSERT_EQ(peerPort, ntohs(port));
+
+  ASSERT_EQ("earlyhello", peerReceived);
+  ASSERT_EQ("world", clientReceived);
+  ASSERT_TRUE(closed);
+}
+
+TEST(SocksProxySession, BindTimeout) {
+  auto loop = std::make_shared<uvcpp::Loop>();
+  ASSERT_TRUE(loop->init());
+  auto server = ProxyServer{};
+  auto proxyPort = startProxy(loop, server, [](auto &sess) {
+    sess.setBindTimeout(100);
+  });
+  ASSERT_NE(0, proxyPort);
+
+  std::string firstReply, secondReply;
+  auto closed = false;
+  runClient(loop, server, [&]() {
+    auto fd = connectLocalTcp(proxyPort);
+    sendAll(fd, GREETING + socksRequest(
+        Socks::RequestType::BIND, Socks::AddressType::IPV4,
+        std::string{"\0\0\0\0", 4}, 0));
+    firstReply = readBytes(fd, REPLY_LENGTH);
+    secondReply = readBytes(fd, REPLY_LENGTH - 2);
+    char ch;
+    closed = recv(fd, &ch, 1, 0) == 0;
+    close(fd);
+  });
+
+  ASSERT_EQ(REPLY_LENGTH, firstReply.size());
+  ASSERT_EQ(0, firstReply[3]);
+  // nobody connected in time
+  ASSERT_EQ(REPLY_LENGTH - 2, secondReply.size());
+  ASSERT_EQ(
+    static_cast<char>(SocksReqParser::ReplyField::TTL_EXPIRED),
+    secondReply[1]);
+  ASSERT_TRUE(closed);
+}
@@ -0,0 +1,156 @@
+#include <gtest/gtest.h>
+#include "proxypp/socks/socks_req_parser.h"
+#include "proxypp/socks/socks4_req_parser.h"
+
+#include <arpa/inet.h>
+
+using namespace proxypp;
+
+namespace {
+  // greeting + CONNECT example.com:80
+  const std::string kGreeting{"\5\1\0", 3};
+  const std::string kConnect{"\5\1\0\3\13example.com\0\120", 18};
+}
+
+TEST(SocksReqParser, CoalescedMessages) {
+  auto data = kGreeting + kConnect + "GET / HTTP/1.1\r\n\r\n";
+  SocksReqParser parser;
+
+  auto consumed = parser.parse(data.data(), data.size());
+  ASSERT_EQ(kGreeting.size(), consumed);
+  ASSERT_EQ(SocksReqParser::State::PARSING_REQUEST, parser.getState());
+
+  auto rest = data.substr(consumed);
+  consumed = parser.parse(rest.data(), rest.size());
+  ASSERT_EQ(kConnect.size(), consumed);
+  ASSERT_EQ(SocksReqParser::State::NEGOTIATION_COMPLETE, parser.getState());
+  ASSERT_EQ(Socks::RequestType::CONNECT, parser.getCommand());
+  ASSERT_EQ(Socks::AddressType::DOMAIN_NAME, parser.getAddressType());
+  ASSERT_EQ("example.com", parser.getAddress());
+  ASSERT_EQ(80, ntohs(parser.getPort()));
+  ASSERT_EQ("GET / HTTP/1.1\r\n\r\n", rest.substr(consumed));
+}
+
+TEST(SocksReqParser, FragmentedMessages) {
+  auto data = kGreeting + std::string{"\5\1\0\1\177\0\0\1\37\220", 10};
+  SocksReqParser parser;
+
+  // one byte at a time, each message completes on its last byte
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    ASSERT_EQ(1u, parser.parse(data.data() + i, 1));
+    if (i + 1 < kGreeting.size()) {
+      ASSERT_EQ(SocksReqParser::State::METHOD_IDENTIFICATION,
+                parser.getState());
+    } else if (i + 1 < data.size()) {
+      ASSERT_EQ(SocksReqParser::State::PARSING_REQUEST, parser.getState());
+    }
+  }
+  ASSERT_EQ(SocksReqParser::State::NEGOTIATION_COMPLETE, parser.getState());
+  ASSERT_EQ(Socks::AddressType::IPV4, parser.getAddressType());
+  ASSERT_EQ(std::string("\177\0\0\1", 4), parser.getAddress());
+  ASSERT_EQ(8080, ntohs(parser.getPort()));
+}
+
+TEST(SocksReqParser, Commands) {
+  // BIND and UDP ASSOCIATE for 0.0.0.0:0
+  const Socks::RequestType commands[] = {
+    Socks::RequestType::BIND, Socks::RequestType::UDP_ASSOCIATE
+  };
+  for (auto cmd : commands) {
+    auto data = kGreeting + std::string{"\5\0\0\1\0\0\0\0\0\0", 10};
+    data[kGreeting.size() + 1] = static_cast<char>(cmd);
+    SocksReqParser parser;
+    auto consumed = parser.parse(data.data(), data.size());
+    parser.parse(data.data() + consumed, data.size() - consumed);
+    ASSERT_EQ(SocksReqParser::State::NEGOTIATION_COMPLETE, parser.getState());
+    ASSERT_EQ(cmd, parser.getCommand());
+  }
+}
+
+TEST(SocksReqParser, UsernamePassword) {
+  SocksReqParser parser;
+  parser.setRequireAuthMethod(Socks::Method::USERNAME_PASSWORD);
+
+  auto data = std::string{"\5\2\0\2", 4} + "\1\4user\10password";
+  auto consumed = parser.parse(data.data(), data.size());
+  ASSERT_EQ(4u, consumed);
+  ASSERT_EQ(SocksReqParser::State::USERNAME_PASSWORD_AUTH, parser.getState());
+
+  // split in the middle of the username
+  ASSERT_EQ(4u, parser.parse(data.data() + consumed, 4));
+  ASSERT_EQ(SocksReqParser::State::USERNAME_PASSWORD_AUTH, parser.getState());
+  ASSERT_EQ(11u, parser.parse(data.data() + consumed + 4, 11));
+  ASSERT_EQ(SocksReqParser::State::PARSING_REQUEST, parser.getState());
+  ASSERT_EQ("user", parser.getParsedUsername());
+  ASSERT_EQ("password", parser.getParsedPassword());
+}
+
+TEST(SocksReqParser, Errors) {
+  SocksReqParser parser;
+  auto data = kGreeting + std::string{"\5\7\0\1\177\0\0\1\0\120", 10};
+  auto consumed = parser.parse(data.data(), data.size());
+  parser.parse(data.data() + consumed, data.size() - consumed);
+  ASSERT_EQ(SocksReqParser::State::ERROR_OCCURRED, parser.getState());
+  ASSERT_EQ(SocksReqParser::ReplyField::COMMAND_NOT_SUPPORTED,
+            parser.getErrorReply());
+
+  SocksReqParser parser2;
+  auto badAtyp = kGreeting + std::string{"\5\1\0\2", 4};
+  consumed = parser2.parse(badAtyp.data(), badAtyp.size());
+  parser2.parse(badAtyp.data() + consumed, badAtyp.size() - consumed);
+  ASSERT_EQ(SocksReqParser::State::ERROR_OCCURRED, parser2.getState());
+  ASSERT_EQ(SocksReqParser::ReplyField::ADDRESS_TYPE_NOT_SUPPORTED,
+            parser2.getErrorReply());
+
+  SocksReqParser parser3;
+  auto badVersion = std::string{"\4\1\0", 3};
+  parser3.parse(badVersion.data(), badVersion.size());
+  ASSERT_EQ(SocksReqParser::State::ERROR_OCCURRED, parser3.getState());
+}
+
+TEST(Socks4ReqParser, Socks4) {
+  // CONNECT 127.0.0.1:8080 with USERID "bob", then the payload
+  auto data = std::string{"\4\1\37\220\177\0\0\1bob\0GET", 15};
+  Socks4ReqParser parser;
+  auto consumed = parser.parse(data.data(), data.size());
+  ASSERT_EQ(12u, consumed);
+  ASSERT_EQ(Socks4ReqParser::State::REQUEST_COMPLETE, parser.getState());
+  ASSERT_EQ(Socks::RequestType::CONNECT, parser.getRequest().cmd);
+  ASSERT_EQ(Socks::AddressType::IPV4, parser.getRequest().atyp);
+  ASSERT_EQ(std::string("\177\0\0\1", 4), parser.getRequest().addr);
+  ASSERT_EQ(8080, ntohs(parser.getRequest().port));
+  ASSERT_EQ("bob", parser.getUserId());
+  ASSERT_EQ("GET", data.substr(consumed));
+}
+
+TEST(Socks4ReqParser, Socks4a) {
+  // BIND example.com:80 with an empty USERID, one byte at a time
+  auto data = std::string{"\4\2\0\120\0\0\0\1\0example.com\0", 21};
+  Socks4ReqParser parser;
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    ASSERT_EQ(Socks4ReqParser::State::PARSING_REQUEST, parser.getState());
+    ASSERT_EQ(1u, parser.parse(data.data() + i, 1));
+  }
+  ASSERT_EQ(Socks4ReqParser::State::REQUEST_COMPLETE, parser.getState());
+  ASSERT_EQ(Socks::RequestType::BIND, parser.getRequest().cmd);
+  ASSERT_EQ(Socks::AddressType::DOMAIN_NAME, parser.getRequest().atyp);
+  ASSERT_EQ("example.com", parser.getRequest().addr);
+  ASSERT_EQ(80, ntohs(parser.getRequest().port));
+}
+
+TEST(Socks4ReqParser, Errors) {
+  Socks4ReqParser parser;
+  auto udp = std::string{"\4\3\0\120\177\0\0\1\0", 9};
+  parser.parse(udp.data(), udp.size());
+  ASSERT_EQ(Socks4ReqParser::State::ERROR_OCCURRED, parser.getState());
+
+  Socks4ReqParser parser2;
+  auto emptyHost = std::string{"\4\1\0\120\0\0\0\1\0\0", 10};
+  parser2.parse(emptyHost.data(), emptyHost.size());
+  ASSERT_EQ(Socks4ReqParser::State::ERROR_OCCURRED, parser2.getState());
+
+  Socks4ReqParser parser3;
+  auto longUserId = std::string{"\4\1\0\120\177\0\0\1", 8} + std::string(300, 'a');
+  parser3.parse(longUserId.data(), longUserId.size());
+  ASSERT_EQ(Socks4ReqParser::State::ERROR_OCCURRED, parser3.getState());
+}
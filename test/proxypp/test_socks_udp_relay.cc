@@ -0,0 +1,286 @@
+#include <gtest/gtest.h>
+#include "proxypp/socks/socks_udp_relay.h"
+
+#include <atomic>
+#include <cstring>
+#include <set>
+#include <thread>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace proxypp;
+
+namespace {
+  int bindLocalUdp(uint16_t &port) {
+    auto fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    bind(fd, reinterpret_cast<sockaddr *>(&addr), addrLen);
+    getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &addrLen);
+    port = ntohs(addr.sin_port);
+    return fd;
+  }
+
+  // echoes every datagram back to its sender until stopped
+  class EchoServer {
+    public:
+      EchoServer() {
+        fd_ = bindLocalUdp(port_);
+        thread_ = std::thread([this]() {
+          char buf[2048];
+          while (!stopped_) {
+            pollfd pfd{fd_, POLLIN, 0};
+            if (poll(&pfd, 1, 20) <= 0) {
+              continue;
+            }
+            sockaddr_storage from;
+            socklen_t fromLen = sizeof(from);
+            auto n = recvfrom(fd_, buf, sizeof(buf), 0,
+                              reinterpret_cast<sockaddr *>(&from), &fromLen);
+            if (n >= 0) {
+              sendto(fd_, buf, n, 0,
+                     reinterpret_cast<sockaddr *>(&from), fromLen);
+            }
+          }
+        });
+      }
+
+      ~EchoServer() {
+        stopped_ = true;
+        thread_.join();
+        close(fd_);
+      }
+
+      uint16_t getPort() const { return port_; }
+
+    private:
+      int fd_;
+      uint16_t port_;
+      std::atomic<bool> stopped_{false};
+      std::thread thread_;
+  };
+
+  std::string ipv4Header(uint16_t port) {
+    auto header = std::string{"\0\0\0\1\177\0\0\1", 8};
+    port = htons(port);
+    header.append(reinterpret_cast<const char *>(&port), 2);
+    return header;
+  }
+
+  std::string domainHeader(const std::string &host, uint16_t port) {
+    auto header = std::string{"\0\0\0\3", 4};
+    header.push_back(static_cast<char>(host.size()));
+    header.append(host);
+    port = htons(port);
+    header.append(reinterpret_cast<const char *>(&port), 2);
+    return header;
+  }
+
+  void sendTo(int fd, uint16_t port, const std::string &data) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    sendto(fd, data.data(), data.size(), 0,
+           reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+  }
+
+  // keeps track of the sockets of the entries
+  void watchSockets(SocksUdpRelay &relay, std::set<int> &fds) {
+    relay.setSocketCallback([&fds](int fd, bool opened) {
+      if (opened) {
+        fds.insert(fd);
+      } else {
+        fds.erase(fd);
+      }
+    });
+  }
+
+  // runs the relay until count datagrams reach the clients in total or it
+  // times out, returns what each of the clients received
+  std::vector<std::vector<std::string>> relayUntil(
+    SocksUdpRelay &relay, const std::set<int> &fds,
+    const std::vector<int> &clientFds, std::size_t count) {
+    std::vector<std::vector<std::string>> received(clientFds.size());
+    std::size_t total = 0;
+    for (int i = 0; i < 25 && total < count; ++i) {
+      std::vector<pollfd> pfds;
+      for (auto fd : clientFds) {
+        pfds.push_back({fd, POLLIN, 0});
+      }
+      pfds.push_back({relay.getFd(), POLLIN, 0});
+      for (auto fd : fds) {
+        pfds.push_back({fd, POLLIN, 0});
+      }
+      poll(pfds.data(), pfds.size(), 20);
+      for (std::size_t j = 0; j < pfds.size(); ++j) {
+        if (!(pfds[j].revents & POLLIN)) {
+          continue;
+        }
+        if (j >= clientFds.size()) {
+          relay.onReadable(pfds[j].fd);
+          continue;
+        }
+        char buf[2048];
+        auto n = recv(pfds[j].fd, buf, sizeof(buf), 0);
+        if (n >= 0) {
+          received[j].emplace_back(buf, n);
+          ++total;
+        }
+      }
+    }
+    return received;
+  }
+
+  std::vector<std::string> relayUntil(
+    SocksUdpRelay &relay, const std::set<int> &fds, int clientFd,
+    std::size_t count) {
+    return relayUntil(relay, fds, std::vector<int>{clientFd}, count)[0];
+  }
+
+  uint16_t getRelayPort(const SocksUdpRelay &relay) {
+    sockaddr_storage addr;
+    relay.getBoundAddress(addr);
+    return ntohs(reinterpret_cast<sockaddr_in *>(&addr)->sin_port);
+  }
+}
+
+TEST(SocksUdpRelay, EchoThroughRelay) {
+  EchoServer echo;
+  SocksUdpRelay relay;
+  ASSERT_TRUE(relay.open("127.0.0.1"));
+  relay.setClientIp("127.0.0.1");
+  std::set<int> fds;
+  watchSockets(relay, fds);
+
+  uint16_t clientPort;
+  auto clientFd = bindLocalUdp(clientPort);
+  auto header = ipv4Header(echo.getPort());
+
+  // several datagrams, so that they go out in one batch
+  for (int i = 0; i < 5; ++i) {
+    sendTo(clientFd, getRelayPort(relay), header + "ping" + std::to_string(i));
+  }
+  auto received = relayUntil(relay, fds, clientFd, 5);
+  ASSERT_EQ(5u, received.size());
+  for (auto &datagram : received) {
+    ASSERT_EQ(header, datagram.substr(0, header.size()));
+    ASSERT_EQ("ping", datagram.substr(header.size(), 4));
+  }
+  // one (client, target) pair
+  ASSERT_EQ(1u, relay.getEntryCount());
+  ASSERT_EQ(1u, fds.size());
+
+  relay.expireIdleEntries(std::chrono::milliseconds(0));
+  ASSERT_EQ(0u, relay.getEntryCount());
+  ASSERT_TRUE(fds.empty());
+  close(clientFd);
+}
+
+TEST(SocksUdpRelay, SharedTarget) {
+  EchoServer echo;
+  SocksUdpRelay relay;
+  ASSERT_TRUE(relay.open("127.0.0.1"));
+  relay.setClientIp("127.0.0.1");
+  std::set<int> fds;
+  watchSockets(relay, fds);
+  relay.setResolveCallback(
+    [](const std::string &host, SocksUdpRelay::ResolvedCallback &&callback) {
+    callback("127.0.0.1");
+  });
+
+  // two clients sending to the same target, the second also by name
+  uint16_t port1, port2;
+  auto clientFd1 = bindLocalUdp(port1);
+  auto clientFd2 = bindLocalUdp(port2);
+  auto header = ipv4Header(echo.getPort());
+  auto nameHeader = domainHeader("echo.test", echo.getPort());
+  sendTo(clientFd1, getRelayPort(relay), header + "one");
+  sendTo(clientFd2, getRelayPort(relay), header + "two");
+  sendTo(clientFd2, getRelayPort(relay), nameHeader + "three");
+
+  auto received = relayUntil(relay, fds, {clientFd1, clientFd2}, 3);
+  ASSERT_EQ(1u, received[0].size());
+  ASSERT_EQ(header + "one", received[0][0]);
+  ASSERT_EQ(2u, received[1].size());
+  std::set<std::string> replies(received[1].begin(), received[1].end());
+  ASSERT_EQ(1u, replies.count(header + "two"));
+  ASSERT_EQ(1u, replies.count(nameHeader + "three"));
+  ASSERT_EQ(3u, relay.getEntryCount());
+
+  // the entries of the second client expire, the first still gets replies
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  sendTo(clientFd1, getRelayPort(relay), header + "four");
+  ASSERT_EQ(1u, relayUntil(relay, fds, clientFd1, 1).size());
+  relay.expireIdleEntries(std::chrono::milliseconds(50));
+  ASSERT_EQ(1u, relay.getEntryCount());
+  ASSERT_EQ(1u, fds.size());
+  sendTo(clientFd1, getRelayPort(relay), header + "five");
+  received = relayUntil(relay, fds, {clientFd1, clientFd2}, 1);
+  ASSERT_EQ(1u, received[0].size());
+  ASSERT_EQ(header + "five", received[0][0]);
+  ASSERT_TRUE(received[1].empty());
+  close(clientFd1);
+  close(clientFd2);
+}
+
+TEST(SocksUdpRelay, DomainTargets) {
+  EchoServer echo;
+  SocksUdpRelay relay;
+  ASSERT_TRUE(relay.open("127.0.0.1"));
+  relay.setClientIp("127.0.0.1");
+  std::set<int> fds;
+  watchSockets(relay, fds);
+  relay.setResolveCallback(
+    [](const std::string &host, SocksUdpRelay::ResolvedCallback &&callback) {
+    callback(host == "echo.test" ? "127.0.0.1" : "");
+  });
+
+  uint16_t clientPort;
+  auto clientFd = bindLocalUdp(clientPort);
+  auto header = domainHeader("echo.test", echo.getPort());
+  sendTo(clientFd, getRelayPort(relay), header + "hello");
+  // can't be resolved, dropped
+  sendTo(clientFd, getRelayPort(relay),
+         domainHeader("unknown.test", echo.getPort()) + "hello");
+
+  auto received = relayUntil(relay, fds, clientFd, 2);
+  ASSERT_EQ(1u, received.size());
+  // replies carry the address the client sent to
+  ASSERT_EQ(header + "hello", received[0]);
+  close(clientFd);
+}
+
+TEST(SocksUdpRelay, Rules) {
+  EchoServer echo;
+  SocksUdpRelay relay;
+  ASSERT_TRUE(relay.open("127.0.0.1"));
+  relay.setClientIp("127.0.0.1");
+  std::set<int> fds;
+  watchSockets(relay, fds);
+  std::string allowedAddr;
+  relay.setAllowCallback([&](const std::string &addr, uint16_t port) {
+    allowedAddr = addr;
+    return false;
+  });
+
+  uint16_t clientPort;
+  auto clientFd = bindLocalUdp(clientPort);
+  sendTo(clientFd, getRelayPort(relay), ipv4Header(echo.getPort()) + "x");
+  ASSERT_TRUE(relayUntil(relay, fds, clientFd, 1).empty());
+  ASSERT_EQ("127.0.0.1", allowedAddr);
+
+  // not from the client of the association
+  relay.setClientIp("10.0.0.1");
+  relay.setAllowCallback(nullptr);
+  relay.expireIdleEntries(std::chrono::milliseconds(0));
+  sendTo(clientFd, getRelayPort(relay), ipv4Header(echo.getPort()) + "x");
+  ASSERT_TRUE(relayUntil(relay, fds, clientFd, 1).empty());
+  ASSERT_EQ(0u, relay.getEntryCount());
+  close(clientFd);
+}